@@ -100,6 +100,7 @@ static int eval_file(JSContext *ctx, const char *filename, int module)
         eval_flags = JS_EVAL_TYPE_MODULE;
     else
         eval_flags = JS_EVAL_TYPE_GLOBAL;
+    eval_flags |= JS_EVAL_FLAG_RELOAD_SOURCE;
     ret = eval_buf(ctx, buf, buf_len, filename, eval_flags);
     js_free(ctx, buf);
     return ret;
@@ -294,6 +295,11 @@ void help(void)
 #endif
            "-T  --trace        trace memory allocation\n"
            "-d  --dump         dump the memory usage stats\n"
+           "    --alloc-profile file   write a sampled allocation profile to 'file'\n"
+           "    --snapshot file        initialize the context from a snapshot\n"
+           "    --write-snapshot file  write a snapshot of the evaluated code\n"
+           "    --module-cache dir     cache the bytecode of the imported modules in 'dir'\n"
+           "    --drop-source  do not keep the source of the functions in memory\n"
            "    --memory-limit n       limit the memory usage to 'n' bytes\n"
            "    --stack-size n         limit the stack size to 'n' bytes\n"
            "    --unhandled-rejection  dump unhandled promise rejections\n"
@@ -315,7 +321,11 @@ int main(int argc, char **argv)
     int module = -1;
     int load_std = 0;
     int dump_unhandled_promise_rejection = 0;
+    int drop_source = 0;
     size_t memory_limit = 0;
+    const char *alloc_profile_file = NULL;
+    const char *snapshot_file = NULL;
+    const char *write_snapshot_file = NULL;
     char *include_list[32];
     int i, include_count = 0;
 #ifdef CONFIG_BIGNUM
@@ -434,6 +444,42 @@ int main(int argc, char **argv)
                 memory_limit = (size_t)strtod(argv[optind++], NULL);
                 continue;
             }
+            if (!strcmp(longopt, "alloc-profile")) {
+                if (optind >= argc) {
+                    fprintf(stderr, "expecting filename");
+                    exit(1);
+                }
+                alloc_profile_file = argv[optind++];
+                continue;
+            }
+            if (!strcmp(longopt, "snapshot")) {
+                if (optind >= argc) {
+                    fprintf(stderr, "expecting filename");
+                    exit(1);
+                }
+                snapshot_file = argv[optind++];
+                continue;
+            }
+            if (!strcmp(longopt, "write-snapshot")) {
+                if (optind >= argc) {
+                    fprintf(stderr, "expecting filename");
+                    exit(1);
+                }
+                write_snapshot_file = argv[optind++];
+                continue;
+            }
+            if (!strcmp(longopt, "module-cache")) {
+                if (optind >= argc) {
+                    fprintf(stderr, "expecting directory name");
+                    exit(1);
+                }
+                js_std_set_module_cache_dir(argv[optind++]);
+                continue;
+            }
+            if (!strcmp(longopt, "drop-source")) {
+                drop_source = 1;
+                continue;
+            }
             if (!strcmp(longopt, "stack-size")) {
                 if (optind >= argc) {
                     fprintf(stderr, "expecting stack size");
@@ -470,6 +516,8 @@ int main(int argc, char **argv)
         JS_SetMemoryLimit(rt, memory_limit);
     if (stack_size != 0)
         JS_SetMaxStackSize(rt, stack_size);
+    if (alloc_profile_file)
+        JS_SetAllocSampling(rt, 64 * 1024);
     js_std_set_worker_new_context_func(JS_NewCustomContext);
     js_std_init_handlers(rt);
     ctx = JS_NewCustomContext(rt);
@@ -480,6 +528,9 @@ int main(int argc, char **argv)
 
     /* loader for ES6 modules */
     JS_SetModuleLoaderFunc(rt, NULL, js_module_loader, NULL);
+    /* the function sources are read again from the files if needed */
+    if (drop_source)
+        JS_SetSourceLoaderFunc(rt, js_std_source_loader, NULL);
 
     if (dump_unhandled_promise_rejection) {
         JS_SetHostPromiseRejectionTracker(rt, js_std_promise_rejection_tracker,
@@ -489,7 +540,8 @@ int main(int argc, char **argv)
     if (!empty_run) {
 #ifdef CONFIG_BIGNUM
         if (load_jscalc) {
-            js_std_eval_binary(ctx, qjsc_qjscalc, qjsc_qjscalc_size, 0);
+            js_std_eval_binary(ctx, qjsc_qjscalc, qjsc_qjscalc_size,
+                               JS_STD_EVAL_BINARY_ROM_DATA);
         }
 #endif
         js_std_add_helpers(ctx, argc - optind, argv + optind);
@@ -503,6 +555,25 @@ int main(int argc, char **argv)
             eval_buf(ctx, str, strlen(str), "<input>", JS_EVAL_TYPE_MODULE);
         }
 
+        if (snapshot_file) {
+            uint8_t *buf;
+            size_t buf_len;
+            int ret;
+            buf = js_load_file(ctx, &buf_len, snapshot_file);
+            if (!buf) {
+                perror(snapshot_file);
+                exit(1);
+            }
+            ret = JS_EvalSnapshot(ctx, buf, buf_len);
+            js_free(ctx, buf);
+            if (ret < 0) {
+                js_std_dump_error(ctx);
+                goto fail;
+            }
+        }
+        if (write_snapshot_file)
+            JS_RecordSnapshot(ctx, TRUE);
+
         for(i = 0; i < include_count; i++) {
             if (eval_file(ctx, include_list[i], module))
                 goto fail;
@@ -526,6 +597,24 @@ int main(int argc, char **argv)
             eval_file(ctx, "repl.js", 1);
         }
         js_std_loop(ctx);
+
+        if (write_snapshot_file) {
+            uint8_t *buf;
+            size_t buf_len;
+            FILE *f;
+            buf = JS_WriteSnapshot(ctx, &buf_len);
+            if (!buf) {
+                js_std_dump_error(ctx);
+                goto fail;
+            }
+            f = fopen(write_snapshot_file, "wb");
+            if (!f || fwrite(buf, 1, buf_len, f) != buf_len) {
+                perror(write_snapshot_file);
+                exit(1);
+            }
+            fclose(f);
+            js_free(ctx, buf);
+        }
     }
     
     if (dump_memory) {
@@ -533,6 +622,15 @@ int main(int argc, char **argv)
         JS_ComputeMemoryUsage(rt, &stats);
         JS_DumpMemoryUsage(stdout, &stats, rt);
     }
+    if (alloc_profile_file) {
+        FILE *f = fopen(alloc_profile_file, "w");
+        if (f) {
+            JS_DumpAllocProfile(rt, f, FALSE);
+            fclose(f);
+        } else {
+            perror(alloc_profile_file);
+        }
+    }
     js_std_free_handlers(rt);
     JS_FreeContext(ctx);
     JS_FreeRuntime(rt);
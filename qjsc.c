@@ -55,33 +55,51 @@ typedef struct namelist_t {
 typedef struct {
     const char *option_name;
     const char *init_name;
+    /* comma separated names whose use requires the feature (see
+       -ftree-shaking) */
+    const char *used_names;
 } FeatureEntry;
 
+/* compiled script or module waiting to be output */
+typedef struct {
+    JSValue obj;
+    char *c_name;
+    BOOL keep_exports; /* dynamically loaded module */
+} PendingModuleEntry;
+
 static namelist_t cname_list;
 static namelist_t cmodule_list;
 static namelist_t init_module_list;
+static PendingModuleEntry *pending_module_list;
+static int pending_module_count;
+static int pending_module_size;
 static uint64_t feature_bitmap;
 static FILE *outfile;
 static BOOL byte_swap;
 static BOOL dynamic_export;
+static BOOL tree_shaking;
+static BOOL strip_debug;
 static const char *c_ident_prefix = "qjsc_";
 
 #define FE_ALL (-1)
 
 static const FeatureEntry feature_list[] = {
-    { "date", "Date" },
-    { "eval", "Eval" },
-    { "string-normalize", "StringNormalize" },
-    { "regexp", "RegExp" },
-    { "json", "JSON" },
-    { "proxy", "Proxy" },
-    { "map", "MapSet" },
-    { "typedarray", "TypedArrays" },
-    { "promise", "Promise" },
+    { "date", "Date", "Date" },
+    { "eval", "Eval", "eval,Function,evalScript,loadScript" },
+    { "string-normalize", "StringNormalize", "normalize" },
+    { "regexp", "RegExp", "RegExp,match,matchAll,search" },
+    { "json", "JSON", "JSON" },
+    { "proxy", "Proxy", "Proxy" },
+    { "map", "MapSet", "Map,Set,WeakMap,WeakSet" },
+    { "typedarray", "TypedArrays",
+      "ArrayBuffer,SharedArrayBuffer,DataView,Atomics,Int8Array,Uint8Array,"
+      "Uint8ClampedArray,Int16Array,Uint16Array,Int32Array,Uint32Array,"
+      "BigInt64Array,BigUint64Array,Float32Array,Float64Array" },
+    { "promise", "Promise", "Promise" },
 #define FE_MODULE_LOADER 9
-    { "module-loader", NULL },
+    { "module-loader", NULL, NULL },
 #ifdef CONFIG_BIGNUM
-    { "bigint", "BigInt" },
+    { "bigint", "BigInt", "BigInt,BigInt64Array,BigUint64Array" },
 #endif
 };
 
@@ -188,8 +206,7 @@ static void dump_bin(const char *path, const uint8_t *buf, size_t len)
 }
 
 static void output_object_code(JSContext *ctx,
-                               FILE *fo, JSValueConst obj, const char *c_name,
-                               BOOL load_only)
+                               FILE *fo, JSValueConst obj, const char *c_name)
 {
     uint8_t *out_buf;
     size_t out_buf_len;
@@ -203,8 +220,6 @@ static void output_object_code(JSContext *ctx,
         exit(1);
     }
 
-    namelist_add(&cname_list, c_name, NULL, load_only);
-    
     fprintf(fo, "const uint32_t %s_size = %u;\n\n", 
             c_name, (unsigned int)out_buf_len);
     fprintf(fo, "const uint8_t %s[%u] = {\n",
@@ -244,6 +259,29 @@ static void find_unique_cname(char *cname, size_t cname_size)
     pstrcpy(cname, cname_size, cname1);
 }
 
+static void add_pending_module(JSValue obj, const char *c_name)
+{
+    PendingModuleEntry *pe;
+
+    if (pending_module_count == pending_module_size) {
+        PendingModuleEntry *new_list;
+        int new_size;
+        new_size = pending_module_size + (pending_module_size >> 1) + 4;
+        new_list = realloc(pending_module_list,
+                           sizeof(pending_module_list[0]) * new_size);
+        if (!new_list) {
+            fprintf(stderr, "Could not allocate memory\n");
+            exit(1);
+        }
+        pending_module_list = new_list;
+        pending_module_size = new_size;
+    }
+    pe = &pending_module_list[pending_module_count++];
+    pe->obj = obj;
+    pe->c_name = strdup(c_name);
+    pe->keep_exports = FALSE;
+}
+
 JSModuleDef *jsc_module_loader(JSContext *ctx,
                               const char *module_name, void *opaque)
 {
@@ -287,15 +325,130 @@ JSModuleDef *jsc_module_loader(JSContext *ctx,
         if (namelist_find(&cname_list, cname)) {
             find_unique_cname(cname, sizeof(cname));
         }
-        output_object_code(ctx, outfile, func_val, cname, TRUE);
-        
-        /* the module is already referenced, so we must free it */
+        namelist_add(&cname_list, cname, NULL, TRUE);
+        /* the module is output when the module graph is resolved */
+        add_pending_module(func_val, cname);
         m = JS_VALUE_GET_PTR(func_val);
-        JS_FreeValue(ctx, func_val);
     }
     return m;
 }
 
+typedef struct {
+    JSAtom atom;
+    int feature_idx;
+    BOOL used;
+} FeatureNameEntry;
+
+typedef struct {
+    FeatureNameEntry *tab;
+    int count;
+} FeatureNames;
+
+static void feature_atom_func(JSContext *ctx, JSAtom atom, void *opaque)
+{
+    FeatureNames *fn = opaque;
+    int i;
+
+    for(i = 0; i < fn->count; i++) {
+        if (fn->tab[i].atom == atom)
+            fn->tab[i].used = TRUE;
+    }
+}
+
+/* Remove the unused code of the compiled scripts and modules and
+   disable the language features they do not reference. The features
+   only used through computed property names cannot be detected. */
+static void tree_shake(JSContext *ctx)
+{
+    FeatureNameEntry name_tab[64];
+    FeatureNames fn_s, *fn = &fn_s;
+    JSValue *objs;
+    JS_BOOL *keep_exports;
+    char name[64];
+    const char *p, *r;
+    int i;
+    uint64_t used_bitmap;
+
+    objs = malloc(sizeof(objs[0]) * (pending_module_count + 1));
+    keep_exports = malloc(sizeof(keep_exports[0]) *
+                          (pending_module_count + 1));
+    if (!objs || !keep_exports) {
+        fprintf(stderr, "Could not allocate memory\n");
+        exit(1);
+    }
+    for(i = 0; i < pending_module_count; i++) {
+        objs[i] = pending_module_list[i].obj;
+        keep_exports[i] = pending_module_list[i].keep_exports;
+    }
+    if (JS_StripUnusedCode(ctx, objs, pending_module_count, keep_exports)) {
+        js_std_dump_error(ctx);
+        exit(1);
+    }
+    free(objs);
+    free(keep_exports);
+
+    fn->tab = name_tab;
+    fn->count = 0;
+    for(i = 0; i < countof(feature_list); i++) {
+        p = feature_list[i].used_names;
+        while (p) {
+            r = strchr(p, ',');
+            if (r) {
+                pstrcpy(name, min_int(sizeof(name), r - p + 1), p);
+                r++;
+            } else {
+                pstrcpy(name, sizeof(name), p);
+            }
+            assert(fn->count < countof(name_tab));
+            name_tab[fn->count].atom = JS_NewAtom(ctx, name);
+            name_tab[fn->count].feature_idx = i;
+            name_tab[fn->count].used = FALSE;
+            fn->count++;
+            p = r;
+        }
+    }
+    for(i = 0; i < pending_module_count; i++) {
+        if (JS_EnumBytecodeAtoms(ctx, pending_module_list[i].obj,
+                                 feature_atom_func, fn)) {
+            js_std_dump_error(ctx);
+            exit(1);
+        }
+    }
+    used_bitmap = 0;
+    for(i = 0; i < countof(feature_list); i++) {
+        if (!feature_list[i].used_names)
+            used_bitmap |= (uint64_t)1 << i;
+    }
+    for(i = 0; i < fn->count; i++) {
+        if (name_tab[i].used)
+            used_bitmap |= (uint64_t)1 << name_tab[i].feature_idx;
+        JS_FreeAtom(ctx, name_tab[i].atom);
+    }
+    feature_bitmap &= used_bitmap;
+}
+
+/* Output the compiled scripts and modules. It is done once the whole
+   module graph is resolved so that the imports and exports can be
+   prelinked. */
+static void output_pending_modules(JSContext *ctx, FILE *fo)
+{
+    PendingModuleEntry *pe;
+    int i;
+
+    for(i = 0; i < pending_module_count; i++) {
+        pe = &pending_module_list[i];
+        if (JS_PrelinkModule(ctx, pe->obj) < 0) {
+            js_std_dump_error(ctx);
+            exit(1);
+        }
+        output_object_code(ctx, outfile, pe->obj, pe->c_name);
+        /* the module is already referenced, so we must free it */
+        JS_FreeValue(ctx, pe->obj);
+        free(pe->c_name);
+    }
+    pending_module_count = 0;
+}
+
 static void compile_file(JSContext *ctx, FILE *fo,
                          const char *filename,
                          const char *c_name1,
@@ -313,6 +466,8 @@ static void compile_file(JSContext *ctx, FILE *fo,
         exit(1);
     }
     eval_flags = JS_EVAL_FLAG_COMPILE_ONLY;
+    if (strip_debug)
+        eval_flags |= JS_EVAL_FLAG_STRIP;
     if (module < 0) {
         module = (has_suffix(filename, ".mjs") ||
                   JS_DetectModule((const char *)buf, buf_len));
@@ -332,8 +487,8 @@ static void compile_file(JSContext *ctx, FILE *fo,
     } else {
         get_c_name(c_name, sizeof(c_name), filename);
     }
-    output_object_code(ctx, fo, obj, c_name, FALSE);
-    JS_FreeValue(ctx, obj);
+    namelist_add(&cname_list, c_name, NULL, FALSE);
+    add_pending_module(obj, c_name);
 }
 
 static const char main_c_template1[] =
@@ -369,6 +524,7 @@ void help(void)
            "-D module_name         compile a dynamically loaded module or worker\n"
            "-M module_name[,cname] add initialization code for an external C module\n"
            "-x          byte swapped output\n"
+           "-s          strip the debug information (smaller and faster code)\n"
            "-p prefix   set the prefix of the generated C names\n"
            "-S n        set the maximum stack size to 'n' bytes (default=%d)\n",
            JS_DEFAULT_STACK_SIZE);
@@ -377,6 +533,8 @@ void help(void)
         int i;
         printf("-flto       use link time optimization\n");
         printf("-fbignum    enable bignum extensions\n");
+        printf("-ftree-shaking\n"
+               "            remove the unused functions, exports and language features\n");
         printf("-fno-[");
         for(i = 0; i < countof(feature_list); i++) {
             if (i != 0)
@@ -499,7 +657,7 @@ typedef enum {
 
 int main(int argc, char **argv)
 {
-    int c, i, verbose;
+    int c, i, j, verbose;
     const char *out_filename, *cname;
     char cfilename[1024];
     FILE *fo;
@@ -530,7 +688,7 @@ int main(int argc, char **argv)
     namelist_add(&cmodule_list, "os", "os", 0);
 
     for(;;) {
-        c = getopt(argc, argv, "ho:cN:f:mxevM:p:S:D:");
+        c = getopt(argc, argv, "ho:cN:f:mxsevM:p:S:D:");
         if (c == -1)
             break;
         switch(c) {
@@ -554,6 +712,9 @@ int main(int argc, char **argv)
                 p = optarg;
                 if (!strcmp(optarg, "lto")) {
                     use_lto = TRUE;
+                } else if (!strcmp(optarg, "tree-shaking")) {
+                    use_lto = TRUE;
+                    tree_shaking = TRUE;
                 } else if (strstart(p, "no-", &p)) {
                     use_lto = TRUE;
                     for(i = 0; i < countof(feature_list); i++) {
@@ -580,6 +741,9 @@ int main(int argc, char **argv)
         case 'm':
             module = 1;
             break;
+        case 's':
+            strip_debug = TRUE;
+            break;
         case 'M':
             {
                 char *p;
@@ -680,12 +844,31 @@ int main(int argc, char **argv)
     }
 
     for(i = 0; i < dynamic_module_list.count; i++) {
-        if (!jsc_module_loader(ctx, dynamic_module_list.array[i].name, NULL)) {
+        JSModuleDef *m;
+        m = jsc_module_loader(ctx, dynamic_module_list.array[i].name, NULL);
+        if (!m) {
             fprintf(stderr, "Could not load dynamic module '%s'\n",
                     dynamic_module_list.array[i].name);
             exit(1);
         }
+        /* its namespace is visible at run time */
+        for(j = 0; j < pending_module_count; j++) {
+            if (JS_VALUE_GET_PTR(pending_module_list[j].obj) == m)
+                pending_module_list[j].keep_exports = TRUE;
+        }
+    }
+    if (tree_shaking) {
+        uint64_t bitmap = feature_bitmap;
+        tree_shake(ctx);
+        if (verbose) {
+            for(i = 0; i < countof(feature_list); i++) {
+                if ((bitmap & ~feature_bitmap) & ((uint64_t)1 << i))
+                    printf("disabling feature: %s\n",
+                           feature_list[i].option_name);
+            }
+        }
     }
+    output_pending_modules(ctx, fo);
     
     if (output_type != OUTPUT_C) {
         fprintf(fo,
@@ -728,7 +911,8 @@ int main(int argc, char **argv)
         for(i = 0; i < cname_list.count; i++) {
             namelist_entry_t *e = &cname_list.array[i];
             if (e->flags) {
-                fprintf(fo, "  js_std_eval_binary(ctx, %s, %s_size, 1);\n",
+                fprintf(fo, "  js_std_eval_binary(ctx, %s, %s_size, "
+                        "JS_STD_EVAL_BINARY_LOAD_ONLY | JS_STD_EVAL_BINARY_ROM_DATA);\n",
                         e->name, e->name);
             }
         }
@@ -755,7 +939,8 @@ int main(int argc, char **argv)
         for(i = 0; i < cname_list.count; i++) {
             namelist_entry_t *e = &cname_list.array[i];
             if (!e->flags) {
-                fprintf(fo, "  js_std_eval_binary(ctx, %s, %s_size, 0);\n",
+                fprintf(fo, "  js_std_eval_binary(ctx, %s, %s_size, "
+                        "JS_STD_EVAL_BINARY_ROM_DATA);\n",
                         e->name, e->name);
             }
         }
@@ -774,5 +959,6 @@ int main(int argc, char **argv)
     namelist_free(&cname_list);
     namelist_free(&cmodule_list);
     namelist_free(&init_module_list);
+    free(pending_module_list);
     return 0;
 }
@@ -421,6 +421,13 @@ uint8_t *js_load_file(JSContext *ctx, size_t *pbuf_len, const char *filename)
     return buf;
 }
 
+/* source loader for JS_SetSourceLoaderFunc() */
+uint8_t *js_std_source_loader(JSContext *ctx, size_t *pbuf_len,
+                              const char *filename, void *opaque)
+{
+    return js_load_file(ctx, pbuf_len, filename);
+}
+
 /* load and evaluate a file */
 static JSValue js_loadScript(JSContext *ctx, JSValueConst this_val,
                              int argc, JSValueConst *argv)
@@ -440,7 +447,7 @@ static JSValue js_loadScript(JSContext *ctx, JSValueConst this_val,
         return JS_EXCEPTION;
     }
     ret = JS_Eval(ctx, (char *)buf, buf_len, filename,
-                  JS_EVAL_TYPE_GLOBAL);
+                  JS_EVAL_TYPE_GLOBAL | JS_EVAL_FLAG_RELOAD_SOURCE);
     js_free(ctx, buf);
     JS_FreeCString(ctx, filename);
     return ret;
@@ -582,6 +589,263 @@ int js_module_set_import_meta(JSContext *ctx, JSValueConst func_val,
     return 0;
 }
 
+/* Module bytecode cache: when a cache directory is set, the bytecode
+   of the compiled modules is stored in one file per module. A cache
+   entry is used if the version, the module path and name, the mtime,
+   the size and the hash of the source file are the same. */
+
+#define MODULE_CACHE_MAGIC "QJSBC2\n"
+
+#ifdef CONFIG_BIGNUM
+#define MODULE_CACHE_VERSION CONFIG_VERSION "-bignum"
+#else
+#define MODULE_CACHE_VERSION CONFIG_VERSION
+#endif
+
+typedef struct {
+    char magic[8];
+    char version[32];
+    uint64_t mtime;
+    uint64_t size;
+    uint64_t hash; /* hash of the source */
+    uint32_t key_len; /* followed by the key */
+    uint32_t bc_len; /* followed by the bytecode */
+} JSModuleCacheHeader;
+
+/* NULL if the cache is disabled. Shared by all the threads. */
+static char *module_cache_dir;
+
+/* cache file loaded in memory. It is read with JS_READ_OBJ_ROM_DATA
+   so that the bytecode is shared by all the runtimes (e.g. workers)
+   loading the same module, hence it is never freed. */
+typedef struct JSModuleCacheBuf {
+    struct JSModuleCacheBuf *next;
+    char *filename;
+    uint8_t *buf;
+    size_t buf_len;
+} JSModuleCacheBuf;
+
+static JSModuleCacheBuf *module_cache_bufs;
+#ifdef USE_WORKER
+static pthread_mutex_t module_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+void js_std_set_module_cache_dir(const char *dir)
+{
+    free(module_cache_dir);
+    module_cache_dir = NULL;
+    if (dir)
+        module_cache_dir = strdup(dir);
+}
+
+/* FNV-1a */
+static uint64_t module_cache_hash(const uint8_t *buf, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325;
+    size_t i;
+    for(i = 0; i < len; i++) {
+        h ^= buf[i];
+        h *= 0x100000001b3;
+    }
+    return h;
+}
+
+static void module_cache_init_header(JSModuleCacheHeader *hdr,
+                                     const struct stat *st,
+                                     const uint8_t *buf, size_t buf_len,
+                                     size_t key_len)
+{
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, MODULE_CACHE_MAGIC, strlen(MODULE_CACHE_MAGIC));
+    pstrcpy(hdr->version, sizeof(hdr->version), MODULE_CACHE_VERSION);
+    hdr->mtime = st->st_mtime;
+    hdr->size = st->st_size;
+    hdr->hash = module_cache_hash(buf, buf_len);
+    hdr->key_len = key_len;
+}
+
+/* Compute the cache file name from the absolute path of the module.
+   The key is the absolute path followed by the module name because
+   the imports are resolved relatively to the module name. Return the
+   key length or 0 if the module cannot be cached. */
+static size_t module_cache_get_filename(char *cache_filename, size_t size,
+                                        char *key, size_t key_size,
+                                        const char *module_name)
+{
+    size_t path_len, name_len;
+
+#if defined(_WIN32)
+    if (!_fullpath(key, module_name, key_size))
+        return 0;
+#else
+    if (key_size < PATH_MAX || !realpath(module_name, key))
+        return 0;
+#endif
+    path_len = strlen(key);
+    name_len = strlen(module_name);
+    if (path_len + 1 + name_len > key_size)
+        return 0;
+    snprintf(cache_filename, size, "%s/%016" PRIx64 ".jsbc", module_cache_dir,
+             module_cache_hash((const uint8_t *)key, path_len));
+    memcpy(key + path_len + 1, module_name, name_len);
+    return path_len + 1 + name_len;
+}
+
+/* return TRUE if the cache file contents 'buf' match 'hdr' and 'key' */
+static BOOL module_cache_check(const uint8_t *buf, size_t buf_len,
+                               const JSModuleCacheHeader *hdr,
+                               const char *key)
+{
+    JSModuleCacheHeader hdr1;
+
+    if (buf_len < sizeof(hdr1))
+        return FALSE;
+    memcpy(&hdr1, buf, sizeof(hdr1));
+    /* the bytecode length is not known in 'hdr' */
+    return (memcmp(&hdr1, hdr, offsetof(JSModuleCacheHeader, bc_len)) == 0 &&
+            buf_len == sizeof(hdr1) + hdr1.key_len + hdr1.bc_len &&
+            memcmp(buf + sizeof(hdr1), key, hdr1.key_len) == 0);
+}
+
+/* return the valid cache file contents for 'hdr' and 'key', or NULL
+   if none. The file is read once for all the runtimes. */
+static JSModuleCacheBuf *module_cache_get_buf(const char *cache_filename,
+                                              const JSModuleCacheHeader *hdr,
+                                              const char *key)
+{
+    JSModuleCacheBuf *cb;
+    uint8_t *buf;
+    size_t buf_len;
+
+#ifdef USE_WORKER
+    pthread_mutex_lock(&module_cache_mutex);
+#endif
+    /* a previous version of the file is kept because it may still be
+       used by a runtime */
+    for(cb = module_cache_bufs; cb != NULL; cb = cb->next) {
+        if (!strcmp(cb->filename, cache_filename) &&
+            module_cache_check(cb->buf, cb->buf_len, hdr, key))
+            goto done;
+    }
+    buf = js_load_file(NULL, &buf_len, cache_filename);
+    if (!buf)
+        goto done;
+    if (!module_cache_check(buf, buf_len, hdr, key)) {
+        free(buf);
+        goto done;
+    }
+    cb = malloc(sizeof(*cb));
+    if (cb)
+        cb->filename = strdup(cache_filename);
+    if (!cb || !cb->filename) {
+        free(cb);
+        free(buf);
+        cb = NULL;
+        goto done;
+    }
+    cb->buf = buf;
+    cb->buf_len = buf_len;
+    cb->next = module_cache_bufs;
+    module_cache_bufs = cb;
+ done:
+#ifdef USE_WORKER
+    pthread_mutex_unlock(&module_cache_mutex);
+#endif
+    return cb;
+}
+
+/* return the module or NULL if not found in the cache. No exception
+   is raised. */
+static JSModuleDef *module_cache_load(JSContext *ctx,
+                                      const char *cache_filename,
+                                      const JSModuleCacheHeader *hdr,
+                                      const char *key)
+{
+    JSModuleCacheBuf *cb;
+    JSModuleCacheHeader hdr1;
+    JSValue func_val;
+
+    cb = module_cache_get_buf(cache_filename, hdr, key);
+    if (!cb)
+        return NULL;
+    memcpy(&hdr1, cb->buf, sizeof(hdr1));
+    func_val = JS_ReadObject(ctx, cb->buf + sizeof(hdr1) + hdr1.key_len,
+                             hdr1.bc_len,
+                             JS_READ_OBJ_BYTECODE | JS_READ_OBJ_LAZY |
+                             JS_READ_OBJ_ROM_DATA);
+    if (JS_IsException(func_val)) {
+        JS_FreeValue(ctx, JS_GetException(ctx));
+        return NULL;
+    }
+    if (JS_VALUE_GET_TAG(func_val) != JS_TAG_MODULE) {
+        JS_FreeValue(ctx, func_val);
+        return NULL;
+    }
+    js_module_set_import_meta(ctx, func_val, TRUE, FALSE);
+    JS_FreeValue(ctx, func_val);
+    return JS_VALUE_GET_PTR(func_val);
+}
+
+/* write the cache entry in a temporary file and rename it so that
+   concurrent readers never see a partial file. Errors are ignored. */
+static void module_cache_save(JSContext *ctx, const char *cache_filename,
+                              JSModuleCacheHeader *hdr, const char *key,
+                              JSValueConst func_val)
+{
+    char tmp_filename[PATH_MAX + 16];
+    uint8_t *bc_buf;
+    size_t bc_len;
+    FILE *f;
+    BOOL ok;
+
+    /* the sources are saved so that Function.prototype.toString()
+       gives the same result as when the module is compiled */
+    bc_buf = JS_WriteObject(ctx, &bc_len, func_val,
+                            JS_WRITE_OBJ_BYTECODE | JS_WRITE_OBJ_SOURCE);
+    if (!bc_buf) {
+        JS_FreeValue(ctx, JS_GetException(ctx));
+        return;
+    }
+    hdr->bc_len = bc_len;
+
+    snprintf(tmp_filename, sizeof(tmp_filename), "%s.XXXXXX", cache_filename);
+#if defined(_WIN32)
+    if (_mktemp_s(tmp_filename, strlen(tmp_filename) + 1) != 0)
+        goto done;
+    f = fopen(tmp_filename, "wb");
+#else
+    {
+        int fd = mkstemp(tmp_filename);
+        if (fd < 0)
+            goto done;
+        /* mkstemp() creates the file with mode 0600: the cache
+           directory may be shared by several users */
+        fchmod(fd, 0644);
+        f = fdopen(fd, "wb");
+        if (!f)
+            close(fd);
+    }
+#endif
+    if (!f)
+        goto done;
+    ok = (fwrite(hdr, 1, sizeof(*hdr), f) == sizeof(*hdr) &&
+          fwrite(key, 1, hdr->key_len, f) == hdr->key_len &&
+          fwrite(bc_buf, 1, bc_len, f) == bc_len);
+    if (fclose(f) != 0)
+        ok = FALSE;
+#if defined(_WIN32)
+    if (ok)
+        ok = MoveFileExA(tmp_filename, cache_filename, MOVEFILE_REPLACE_EXISTING);
+#else
+    if (ok)
+        ok = (rename(tmp_filename, cache_filename) == 0);
+#endif
+    if (!ok)
+        remove(tmp_filename);
+ done:
+    js_free(ctx, bc_buf);
+}
+
 JSModuleDef *js_module_loader(JSContext *ctx,
                               const char *module_name, void *opaque)
 {
@@ -593,6 +857,11 @@ JSModuleDef *js_module_loader(JSContext *ctx,
         size_t buf_len;
         uint8_t *buf;
         JSValue func_val;
+        size_t key_len;
+        char cache_filename[PATH_MAX + 32];
+        char key[2 * PATH_MAX + 2];
+        JSModuleCacheHeader hdr;
+        struct stat st;
     
         buf = js_load_file(ctx, &buf_len, module_name);
         if (!buf) {
@@ -600,13 +869,30 @@ JSModuleDef *js_module_loader(JSContext *ctx,
                                    module_name);
             return NULL;
         }
+
+        key_len = 0;
+        if (module_cache_dir && stat(module_name, &st) == 0) {
+            key_len = module_cache_get_filename(cache_filename, sizeof(cache_filename),
+                                                key, sizeof(key), module_name);
+        }
+        if (key_len != 0) {
+            module_cache_init_header(&hdr, &st, buf, buf_len, key_len);
+            m = module_cache_load(ctx, cache_filename, &hdr, key);
+            if (m) {
+                js_free(ctx, buf);
+                return m;
+            }
+        }
         
         /* compile the module */
         func_val = JS_Eval(ctx, (char *)buf, buf_len, module_name,
-                           JS_EVAL_TYPE_MODULE | JS_EVAL_FLAG_COMPILE_ONLY);
+                           JS_EVAL_TYPE_MODULE | JS_EVAL_FLAG_COMPILE_ONLY |
+                           JS_EVAL_FLAG_RELOAD_SOURCE);
         js_free(ctx, buf);
         if (JS_IsException(func_val))
             return NULL;
+        if (key_len != 0)
+            module_cache_save(ctx, cache_filename, &hdr, key, func_val);
         /* XXX: could propagate the exception */
         js_module_set_import_meta(ctx, func_val, TRUE, FALSE);
         /* the module is already referenced, so we must free it */
@@ -3955,13 +4241,18 @@ int js_std_loop_nowait(JSContext *ctx)
 }
 
 void js_std_eval_binary(JSContext *ctx, const uint8_t *buf, size_t buf_len,
-                        int load_only)
+                        int flags)
 {
     JSValue obj, val;
-    obj = JS_ReadObject(ctx, buf, buf_len, JS_READ_OBJ_BYTECODE);
+    int read_flags;
+
+    read_flags = JS_READ_OBJ_BYTECODE | JS_READ_OBJ_LAZY;
+    if (flags & JS_STD_EVAL_BINARY_ROM_DATA)
+        read_flags |= JS_READ_OBJ_ROM_DATA;
+    obj = JS_ReadObject(ctx, buf, buf_len, read_flags);
     if (JS_IsException(obj))
         goto exception;
-    if (load_only) {
+    if (flags & JS_STD_EVAL_BINARY_LOAD_ONLY) {
         if (JS_VALUE_GET_TAG(obj) == JS_TAG_MODULE) {
             js_module_set_import_meta(ctx, obj, FALSE, FALSE);
         }
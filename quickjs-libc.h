@@ -42,10 +42,20 @@ void js_std_init_handlers(JSRuntime *rt);
 void js_std_free_handlers(JSRuntime *rt);
 void js_std_dump_error(JSContext *ctx);
 uint8_t *js_load_file(JSContext *ctx, size_t *pbuf_len, const char *filename);
+uint8_t *js_std_source_loader(JSContext *ctx, size_t *pbuf_len,
+                              const char *filename, void *opaque);
 int js_module_set_import_meta(JSContext *ctx, JSValueConst func_val,
                               JS_BOOL use_realpath, JS_BOOL is_main);
 JSModuleDef *js_module_loader(JSContext *ctx,
                               const char *module_name, void *opaque);
+/* store the bytecode of the modules loaded by js_module_loader() in
+   'dir'. NULL disables the cache. */
+void js_std_set_module_cache_dir(const char *dir);
+#define JS_STD_EVAL_BINARY_LOAD_ONLY (1 << 0) /* only load the module */
+/* 'buf' is used in place and must be kept until the runtime is freed.
+   The bytecode is not copied, so it is shared by all the runtimes
+   (e.g. workers) evaluating the same buffer. */
+#define JS_STD_EVAL_BINARY_ROM_DATA  (1 << 1)
 void js_std_eval_binary(JSContext *ctx, const uint8_t *buf, size_t buf_len,
                         int flags);
 void js_std_promise_rejection_tracker(JSContext *ctx, JSValueConst promise,
@@ -78,6 +78,9 @@ DEF(      push_true, 1, 0, 1, none)
 DEF(         object, 1, 0, 1, none)
 DEF( special_object, 2, 0, 1, u8) /* only used at the start of a function */
 DEF(           rest, 3, 0, 1, u16) /* only used at the start of a function */
+DEF(arguments_length, 1, 0, 1, none) /* arguments.length without arguments object */
+DEF(   arguments_el, 2, 1, 1, u8) /* idx -> arguments[idx] without arguments object */
+DEF(apply_arguments, 2, 3, 1, u8) /* func method this_arg -> method.call(func, this_arg, arguments) */
 
 DEF(           drop, 1, 1, 0, none) /* a -> */
 DEF(            nip, 1, 2, 1, none) /* a b -> b */
@@ -110,6 +110,7 @@
 //#define DUMP_MODULE_RESOLVE
 //#define DUMP_PROMISE
 //#define DUMP_READ_OBJECT
+//#define DUMP_INTRINSICS /* dump the instantiation of the lazy intrinsics */
 
 /* test the GC by forcing it before each object allocation */
 //#define FORCE_GC_AT_MALLOC
@@ -208,12 +209,17 @@ typedef enum JSErrorEnum {
 #define JS_MAX_LOCAL_VARS 65536
 #define JS_STACK_SIZE_MAX 65534
 #define JS_STRING_LEN_MAX ((1 << 30) - 1)
+#define JS_EVAL_CACHE_DEFAULT_SIZE 64 /* compiled scripts per context */
+#define JS_EVAL_CACHE_MAX_INPUT_LEN 16384
 
 #define __exception PLATFORM_WARN_UNUSED
 
 typedef struct JSShape JSShape;
 typedef struct JSString JSString;
 typedef struct JSString JSAtomStruct;
+typedef struct JSAllocProfile JSAllocProfile;
+typedef struct JSArena JSArena;
+typedef struct JSSnapshotRecorder JSSnapshotRecorder;
 
 typedef enum {
     JS_GC_PHASE_NONE,
@@ -223,6 +229,30 @@ typedef enum {
 
 typedef enum OPCodeEnum OPCodeEnum;
 
+/* intrinsics whose constructors and prototypes are only created when
+   they are first accessed */
+typedef enum {
+    JS_INTRINSIC_DATE,
+    JS_INTRINSIC_PROXY,
+    JS_INTRINSIC_MAP_SET,
+    JS_INTRINSIC_TYPED_ARRAYS,
+
+    JS_INTRINSIC_COUNT,
+} JSIntrinsicEnum;
+
+/* constructors of the lazy intrinsics (JSContext.intrinsic_ctor[]) */
+enum {
+    JS_INTRINSIC_CTOR_DATE,
+    JS_INTRINSIC_CTOR_PROXY,
+    JS_INTRINSIC_CTOR_MAP, /* Map, Set, WeakMap, WeakSet */
+    JS_INTRINSIC_CTOR_ARRAY_BUFFER = JS_INTRINSIC_CTOR_MAP + 4,
+    JS_INTRINSIC_CTOR_SHARED_ARRAY_BUFFER,
+    JS_INTRINSIC_CTOR_TYPED_ARRAY, /* one per typed array class */
+    JS_INTRINSIC_CTOR_DATAVIEW = JS_INTRINSIC_CTOR_TYPED_ARRAY + JS_TYPED_ARRAY_COUNT,
+
+    JS_INTRINSIC_CTOR_COUNT,
+};
+
 #ifdef CONFIG_BIGNUM
 /* function pointers are used for numeric operations so that it is
    possible to remove some numeric types */
@@ -246,6 +276,10 @@ typedef struct {
 struct JSRuntime {
     JSMallocFunctions mf;
     JSMallocState malloc_state;
+    JSAllocProfile *alloc_profile; /* NULL if no allocation sampling */
+    int arena_count;
+    int arena_size;
+    JSArena **arena_tab; /* sorted by base address */
     const char *rt_info;
 
     int atom_hash_size; /* power of two */
@@ -255,6 +289,8 @@ struct JSRuntime {
     uint32_t *atom_hash;
     JSAtomStruct **atom_array;
     int atom_free_index; /* 0 = none */
+    /* shared one character 8 bit strings, created on demand */
+    JSString *char_strings[256];
 
     int class_count;    /* size of class_array */
     JSClass *class_array;
@@ -293,6 +329,9 @@ struct JSRuntime {
     JSModuleLoaderFunc *module_loader_func;
     void *module_loader_opaque;
 
+    JSSourceLoaderFunc *source_loader_func;
+    void *source_loader_opaque;
+
     BOOL can_block : 8; /* TRUE if Atomics.wait can block */
     /* used to allocate, free and clone SharedArrayBuffers */
     JSSharedArrayBufferFunctions sab_funcs;
@@ -309,6 +348,10 @@ struct JSRuntime {
     JSNumericOperations bigdecimal_ops;
     uint32_t operator_count;
 #endif
+    /* lazy intrinsics statistics: number of contexts where the
+       intrinsic was deferred and number of actual instantiations */
+    uint32_t intrinsic_lazy_count[JS_INTRINSIC_COUNT];
+    uint32_t intrinsic_init_count[JS_INTRINSIC_COUNT];
     void *user_opaque;
 };
 
@@ -382,8 +425,17 @@ typedef struct JSVarRef {
     JSValue *pvalue; /* pointer to the value, either on the stack or
                         to 'value' */
     JSValue value; /* used when the variable is no longer on the stack */
+    struct JSVarRefBlock *block; /* NULL if allocated alone */
 } JSVarRef;
 
+/* The variable references created together by a closure are
+   allocated in a single block. The block is freed with its last
+   variable reference. */
+typedef struct JSVarRefBlock {
+    int ref_count; /* number of variable references in use */
+    JSVarRef var_refs[0];
+} JSVarRefBlock;
+
 #ifdef CONFIG_BIGNUM
 typedef struct JSFloatEnv {
     limb_t prec;
@@ -408,6 +460,7 @@ typedef enum {
     JS_AUTOINIT_ID_PROTOTYPE,
     JS_AUTOINIT_ID_MODULE_NS,
     JS_AUTOINIT_ID_PROP,
+    JS_AUTOINIT_ID_INTRINSIC,
 } JSAutoInitIDEnum;
 
 /* must be large enough to have a negligible runtime cost and small
@@ -423,6 +476,7 @@ struct JSContext {
     int binary_object_size;
 
     JSShape *array_shape;   /* initial shape for Array objects */
+    JSArena *arena; /* NULL if the context uses the runtime allocator */
 
     JSValue *class_proto;
     JSValue function_proto;
@@ -440,6 +494,9 @@ struct JSContext {
     JSValue global_obj; /* global object */
     JSValue global_var_obj; /* contains the global let/const definitions */
 
+    uint32_t intrinsic_pending; /* mask of the lazy intrinsics (1 << JSIntrinsicEnum) not yet instantiated */
+    JSValue intrinsic_ctor[JS_INTRINSIC_CTOR_COUNT];
+
     uint64_t random_state;
 #ifdef CONFIG_BIGNUM
     bf_context_t *bf_ctx;   /* points to rt->bf_ctx, shared by all contexts */
@@ -450,6 +507,10 @@ struct JSContext {
     /* when the counter reaches zero, JSRutime.interrupt_handler is called */
     int interrupt_counter;
     BOOL is_error_property_enabled;
+    /* TRUE if the intrinsics are frozen and shared with the contexts
+       created by JS_NewContextShared(). The C functions of a shared
+       context are run in the realm of their caller. */
+    BOOL shared_intrinsics : 8;
 
     struct list_head loaded_modules; /* list of JSModuleDef.link */
 
@@ -460,6 +521,12 @@ struct JSContext {
     JSValue (*eval_internal)(JSContext *ctx, JSValueConst this_obj,
                              const char *input, size_t input_len,
                              const char *filename, int flags, int scope_idx);
+    /* if not NULL, record the evaluated code for JS_WriteSnapshot() */
+    JSSnapshotRecorder *snapshot;
+    /* compiled code of the last evaluated scripts (see
+       js_eval_cache_find()) */
+    struct JSEvalCache *eval_cache;
+    int eval_cache_max_size; /* 0 if no cache */
     void *user_opaque;
 };
 
@@ -508,6 +575,37 @@ struct JSString {
     } u;
 };
 
+/* A string rope is the concatenation of two strings or string
+   ropes. The rope tree is kept balanced (AVL). Its characters are
+   only copied when they are accessed: the resulting JSString is then
+   kept in 'left' so that the rope is linearized only once.
+
+   A rope of depth 0 is a slice: its characters are those of the
+   JSString 'left' starting at 'start'. Slices are also used for long
+   substrings so that they share the storage of their parent string. */
+typedef struct JSStringRope {
+    JSRefCountHeader header; /* must come first, 32-bit */
+    uint32_t len;
+    uint8_t is_wide_char; /* 0 = 8 bits, 1 = 16 bits characters */
+    uint8_t depth; /* 0 if slice */
+    uint32_t start; /* slice only: start position in 'left' */
+    JSValue left; /* JSString if slice */
+    JSValue right; /* undefined if slice */
+} JSStringRope;
+
+#define JS_VALUE_GET_STRING_ROPE(v) ((JSStringRope *)JS_VALUE_GET_PTR(v))
+
+/* shorter concatenations are done by copying the characters */
+#define JS_STRING_ROPE_SHORT_LEN 512
+/* larger depths only happen with unbalanced trees: the rope is
+   linearized instead */
+#define JS_STRING_ROPE_MAX_DEPTH 64
+/* shorter substrings are copied */
+#define JS_STRING_SLICE_MIN_LEN 256
+/* substrings smaller than 1/JS_STRING_SLICE_MIN_RATIO of their
+   parent string are copied to avoid keeping it alive */
+#define JS_STRING_SLICE_MIN_RATIO 16
+
 typedef struct JSClosureVar {
     uint8_t is_local : 1;
     uint8_t is_arg : 1;
@@ -544,19 +642,15 @@ typedef enum {
     JS_VAR_PRIVATE_GETTER_SETTER, /* must come after JS_VAR_PRIVATE_SETTER */
 } JSVarKindEnum;
 
-/* XXX: could use a different structure in bytecode functions to save
-   memory */
+/* variable definition during compilation (see JSBytecodeVarDef for
+   the bytecode functions) */
 typedef struct JSVarDef {
     JSAtom var_name;
     /* index into fd->scopes of this variable lexical scope */
     int scope_level;
-    /* during compilation: 
-        - if scope_level = 0: scope in which the variable is defined
-        - if scope_level != 0: index into fd->vars of the next
-          variable in the same or enclosing lexical scope
-       in a bytecode function:
-       index into fd->vars of the next
-       variable in the same or enclosing lexical scope
+    /* - if scope_level = 0: scope in which the variable is defined
+       - if scope_level != 0: index into fd->vars of the next
+         variable in the same or enclosing lexical scope
     */
     int scope_next;    
     uint8_t is_const : 1;
@@ -573,6 +667,28 @@ typedef struct JSVarDef {
                                definition */
 } JSVarDef;
 
+/* variable definition in a bytecode function. Only the information
+   needed by direct eval() and the debug functions is kept. */
+typedef struct JSBytecodeVarDef {
+    JSAtom var_name;
+    /* index into b->vardefs of the next variable in the same or
+       enclosing lexical scope. The bit-fields have the same type so
+       that all compilers pack them in 32 bits: the value is signed
+       and must be read with js_var_scope_next(). */
+    uint32_t scope_next : 24;
+    uint32_t is_scoped : 1; /* scope_level != 0 during compilation */
+    uint32_t is_const : 1;
+    uint32_t is_lexical : 1;
+    uint32_t is_captured : 1;
+    uint32_t var_kind : 4; /* see JSVarKindEnum */
+} JSBytecodeVarDef;
+
+static inline int js_var_scope_next(const JSBytecodeVarDef *vd)
+{
+    /* sign extend the 24 bit value */
+    return (int32_t)(vd->scope_next << 8) >> 8;
+}
+
 /* for the encoding of the pc2line table */
 #define PC2LINE_BASE     (-1)
 #define PC2LINE_RANGE    5
@@ -586,6 +702,14 @@ typedef enum JSFunctionKindEnum {
     JS_FUNC_ASYNC_GENERATOR = (JS_FUNC_GENERATOR | JS_FUNC_ASYNC),
 } JSFunctionKindEnum;
 
+/* code of an inlined function call (see inline_function_calls()) */
+typedef struct JSInlineRange {
+    uint32_t pc_start;
+    uint32_t pc_end;
+    int cpool_idx; /* inlined function */
+    int call_line; /* line number of the call */
+} JSInlineRange;
+
 typedef struct JSFunctionBytecode {
     JSGCObjectHeader header; /* must come first */
     uint8_t js_mode;
@@ -606,7 +730,7 @@ typedef struct JSFunctionBytecode {
     uint8_t *byte_code_buf; /* (self pointer) */
     int byte_code_len;
     JSAtom func_name;
-    JSVarDef *vardefs; /* arguments + local variables (arg_count + var_count) (self pointer) */
+    JSBytecodeVarDef *vardefs; /* arguments + local variables (arg_count + var_count) (self pointer) */
     JSClosureVar *closure_var; /* list of variables in the closure (self pointer) */
     uint16_t arg_count;
     uint16_t var_count;
@@ -616,6 +740,12 @@ typedef struct JSFunctionBytecode {
     JSValue *cpool; /* constant pool (self pointer) */
     int cpool_count;
     int closure_var_count;
+    /* non NULL if the function was read or compiled lazily (see
+       js_function_bytecode_load()) */
+    struct JSFunctionBytecodeLazy *lazy;
+    /* non NULL if the atom operands of byte_code_buf are indexes in
+       this table (read-only bytecode shared between runtimes) */
+    struct JSAtomMap *atom_map;
     struct {
         /* debug info, move to separate structure to save memory? */
         JSAtom filename;
@@ -623,10 +753,62 @@ typedef struct JSFunctionBytecode {
         int source_len;
         int pc2line_len;
         uint8_t *pc2line_buf;
+        int inline_range_count;
+        JSInlineRange *inline_ranges; /* sorted by pc */
+        /* if NULL and source_len != 0, the source is reloaded from
+           'filename' (see js_function_get_source()) */
         char *source;
+        int source_pos; /* position of the source in 'filename' */
+        uint32_t source_hash;
     } debug;
 } JSFunctionBytecode;
 
+/* translation of the atom indexes of a bytecode buffer read with
+   JS_READ_OBJ_ROM_DATA to the atoms of the runtime. The buffer is not
+   modified, so it can be shared by several runtimes. */
+typedef struct JSAtomMap {
+    int ref_count;
+    uint32_t count;
+    JSAtom atoms[0];
+} JSAtomMap;
+
+/* bytecode buffer read with JS_READ_OBJ_LAZY. It is shared by all
+   the functions whose body is not loaded yet. */
+typedef struct JSBytecodeImage {
+    int ref_count;
+    BOOL is_rom_data : 8; /* atoms are not relocated */
+    BOOL free_buf : 8; /* 'buf' is a copy owned by the image */
+    const uint8_t *buf;
+    size_t buf_len;
+    uint32_t first_atom;
+    uint32_t idx_to_atom_count;
+    JSAtom *idx_to_atom;
+    JSAtomMap *atom_map;
+} JSBytecodeImage;
+
+/* function whose body is read or compiled when it is first used */
+typedef struct JSFunctionBytecodeLazy {
+    /* bytecode image if the function was read with JS_READ_OBJ_LAZY,
+       NULL if it is compiled from 'debug.source' */
+    JSBytecodeImage *image;
+    union {
+        struct {
+            uint32_t body_pos; /* offset of the function body in image->buf */
+            uint32_t body_len;
+            /* values of the loaded function */
+            int byte_code_len;
+            int cpool_count;
+            int local_count;
+        } read;
+        struct {
+            struct JSFunctionBytecode *b; /* NULL if not compiled yet */
+            BOOL is_func_expr : 8;
+            BOOL is_module : 8;
+            BOOL reload_source : 8;
+        } compile;
+    } u;
+} JSFunctionBytecodeLazy;
+
 typedef struct JSBoundFunction {
     JSValue func_obj;
     JSValue this_val;
@@ -640,6 +822,12 @@ typedef enum JSIteratorKindEnum {
     JS_ITERATOR_KIND_KEY_AND_VALUE,
 } JSIteratorKindEnum;
 
+typedef struct JSArrayIteratorData {
+    JSValue obj;
+    JSIteratorKindEnum kind;
+    uint32_t idx;
+} JSArrayIteratorData;
+
 typedef struct JSForInIterator {
     JSValue obj;
     BOOL is_array;
@@ -772,8 +960,20 @@ typedef struct JSImportEntry {
     int var_idx; /* closure variable index */
     JSAtom import_name;
     int req_module_idx; /* in req_module_entries */
+    /* set by JS_PrelinkModule(): module and index of the resolved
+       export entry. res_export_idx < 0 if the import must be resolved
+       when linking. */
+    JSAtom res_module_name;
+    int res_export_idx;
 } JSImportEntry;
 
+/* prelinked namespace entry */
+typedef struct JSModuleNsEntry {
+    JSAtom export_name;
+    JSAtom module_name; /* module containing the export entry */
+    int export_idx; /* -1 if the name is ambiguous */
+} JSModuleNsEntry;
+
 struct JSModuleDef {
     JSRefCountHeader header; /* must come first, 32-bit */
     JSAtom module_name;
@@ -795,10 +995,17 @@ struct JSModuleDef {
     int import_entries_count;
     int import_entries_size;
 
+    /* sorted namespace exports computed by JS_PrelinkModule(), NULL
+       if not available */
+    JSModuleNsEntry *ns_entries;
+    int ns_entries_count;
+
     JSValue module_ns;
     JSValue func_obj; /* only used for JS modules */
     JSModuleInitFunc *init_func; /* only used for C modules */
     BOOL resolved : 8;
+    BOOL prelinked : 8; /* the requested module names are normalized */
+    BOOL prelinked_exports : 8; /* the indirect exports were checked */
     BOOL func_created : 8;
     BOOL instantiated : 8;
     BOOL evaluated : 8;
@@ -1004,6 +1211,12 @@ static JSAtom __JS_NewAtomInit(JSRuntime *rt, const char *str, int len,
                                int atom_type);
 static void JS_FreeAtomStruct(JSRuntime *rt, JSAtomStruct *p);
 static void free_function_bytecode(JSRuntime *rt, JSFunctionBytecode *b);
+static void js_bytecode_image_free(JSRuntime *rt, JSBytecodeImage *img);
+static void js_atom_map_free(JSRuntime *rt, JSAtomMap *map);
+static __exception int js_function_bytecode_read(JSFunctionBytecode *b);
+static JSFunctionBytecode *js_function_bytecode_load(JSFunctionBytecode *b);
+static JSFunctionBytecode *js_function_load_bytecode(JSRuntime *rt,
+                                                     JSObject *p);
 static JSValue js_call_c_function(JSContext *ctx, JSValueConst func_obj,
                                   JSValueConst this_obj,
                                   int argc, JSValueConst *argv, int flags);
@@ -1193,6 +1406,9 @@ static JSValue JS_EvalInternal(JSContext *ctx, JSValueConst this_obj,
                                const char *input, size_t input_len,
                                const char *filename, int flags, int scope_idx);
 static void js_free_module_def(JSContext *ctx, JSModuleDef *m);
+static void js_eval_cache_free(JSContext *ctx);
+static void js_eval_cache_mark(JSRuntime *rt, struct JSEvalCache *ec,
+                               JS_MarkFunc *mark_func);
 static void js_mark_module_def(JSRuntime *rt, JSModuleDef *m,
                                JS_MarkFunc *mark_func);
 static JSValue js_import_meta(JSContext *ctx);
@@ -1253,7 +1469,20 @@ static JSValue js_module_ns_autoinit(JSContext *ctx, JSObject *p, JSAtom atom,
                                  void *opaque);
 static JSValue JS_InstantiateFunctionListItem2(JSContext *ctx, JSObject *p,
                                                JSAtom atom, void *opaque);
+static JSValue js_intrinsic_autoinit(JSContext *ctx, JSObject *p, JSAtom atom,
+                                     void *opaque);
+static void js_date_init(JSContext *ctx);
+static void js_proxy_init(JSContext *ctx);
+static void js_map_set_init(JSContext *ctx);
+static void js_typed_arrays_init(JSContext *ctx);
 void JS_SetUncatchableError(JSContext *ctx, JSValueConst val, BOOL flag);
+static void js_alloc_profile_on_malloc(JSRuntime *rt, void *ptr, size_t size);
+static void js_alloc_profile_on_free(JSRuntime *rt, void *ptr);
+static void js_alloc_profile_delete(JSRuntime *rt);
+static void js_snapshot_recorder_free(JSContext *ctx, JSSnapshotRecorder *sr);
+static int js_snapshot_find(JSSnapshotRecorder *sr, void *ptr);
+static int js_snapshot_record_compile(JSContext *ctx, JSValueConst obj);
+static void js_snapshot_record_eval(JSContext *ctx, void *ptr);
 
 static const JSClassExoticMethods js_arguments_exotic_methods;
 static const JSClassExoticMethods js_string_exotic_methods;
@@ -1286,23 +1515,240 @@ static size_t js_malloc_usable_size_unknown(const void *ptr)
     return 0;
 }
 
+/* Context arenas: the memory allocated by a context with
+   js_malloc()/js_mallocz() is taken from a single preallocated block
+   with a bump pointer. Freeing an arena block only decrements a
+   counter (and reuses the space if it is the last allocated
+   block). The whole block is released at once when the context is
+   freed and no block of the arena is still in use. Blocks escaping to
+   objects which survive the context (e.g. atoms or objects referenced
+   from another context) are detected by the counter and keep the
+   arena alive until they are freed. When the arena is full, the
+   allocations fall back to the runtime allocator. The arena block is
+   itself allocated with js_malloc_rt() so that it is accounted in the
+   memory limit and in the allocation profile. */
+
+#define JS_ARENA_ALIGN 8
+#define JS_ARENA_HEADER_SIZE 8 /* block size, keeps JS_ARENA_ALIGN alignment */
+
+struct JSArena {
+    uint8_t *base;
+    uint8_t *ptr;
+    uint8_t *end;
+    size_t live_count; /* number of allocated blocks */
+    BOOL active; /* FALSE when the owning context is freed */
+};
+
+static inline size_t js_arena_block_size(const void *ptr)
+{
+    return *(const uint64_t *)((const uint8_t *)ptr - JS_ARENA_HEADER_SIZE);
+}
+
+/* return the index of the first arena whose block ends after 'ptr' */
+static int js_arena_find_index(JSRuntime *rt, const void *ptr)
+{
+    int lo, hi, mid;
+
+    lo = 0;
+    hi = rt->arena_count;
+    while (lo < hi) {
+        mid = (lo + hi) >> 1;
+        if ((const uint8_t *)ptr >= rt->arena_tab[mid]->end)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static JSArena *js_arena_find(JSRuntime *rt, const void *ptr)
+{
+    JSArena *a;
+    int i;
+
+    i = js_arena_find_index(rt, ptr);
+    if (i < rt->arena_count) {
+        a = rt->arena_tab[i];
+        if ((const uint8_t *)ptr >= a->base)
+            return a;
+    }
+    return NULL;
+}
+
+static inline void *js_arena_alloc(JSArena *a, size_t size)
+{
+    uint8_t *p;
+
+    size = (size + JS_ARENA_ALIGN - 1) & ~(size_t)(JS_ARENA_ALIGN - 1);
+    if (unlikely(size + JS_ARENA_HEADER_SIZE > a->end - a->ptr))
+        return NULL;
+    p = a->ptr;
+    *(uint64_t *)p = size;
+    a->ptr = p + JS_ARENA_HEADER_SIZE + size;
+    a->live_count++;
+    return p + JS_ARENA_HEADER_SIZE;
+}
+
+static void js_arena_delete(JSRuntime *rt, JSArena *a)
+{
+    int i;
+
+    i = js_arena_find_index(rt, a->base);
+    assert(i < rt->arena_count && rt->arena_tab[i] == a);
+    memmove(rt->arena_tab + i, rt->arena_tab + i + 1,
+            (rt->arena_count - i - 1) * sizeof(rt->arena_tab[0]));
+    rt->arena_count--;
+    /* must be done after the arena is removed from rt->arena_tab */
+    js_free_rt(rt, a->base);
+    rt->mf.js_free(&rt->malloc_state, a);
+}
+
+static void js_arena_free(JSRuntime *rt, JSArena *a, void *ptr)
+{
+    uint8_t *p = (uint8_t *)ptr - JS_ARENA_HEADER_SIZE;
+
+    /* the space of the last allocated block can be reused */
+    if (p + JS_ARENA_HEADER_SIZE + js_arena_block_size(ptr) == a->ptr)
+        a->ptr = p;
+    if (--a->live_count == 0) {
+        if (a->active)
+            a->ptr = a->base;
+        else
+            js_arena_delete(rt, a);
+    }
+}
+
+static void *js_arena_realloc(JSRuntime *rt, JSArena *a, void *ptr, size_t size)
+{
+    uint8_t *p = (uint8_t *)ptr - JS_ARENA_HEADER_SIZE;
+    size_t old_size, new_size;
+    void *new_ptr;
+
+    if (size == 0) {
+        js_arena_free(rt, a, ptr);
+        return NULL;
+    }
+    old_size = js_arena_block_size(ptr);
+    if (size <= old_size)
+        return ptr;
+    new_size = (size + JS_ARENA_ALIGN - 1) & ~(size_t)(JS_ARENA_ALIGN - 1);
+    if (p + JS_ARENA_HEADER_SIZE + old_size == a->ptr &&
+        new_size - old_size <= a->end - a->ptr) {
+        /* grow the last block in place */
+        *(uint64_t *)p = new_size;
+        a->ptr += new_size - old_size;
+        return ptr;
+    }
+    new_ptr = NULL;
+    if (a->active)
+        new_ptr = js_arena_alloc(a, size);
+    if (!new_ptr) {
+        new_ptr = js_malloc_rt(rt, size);
+        if (!new_ptr)
+            return NULL;
+    }
+    memcpy(new_ptr, ptr, old_size);
+    js_arena_free(rt, a, ptr);
+    return new_ptr;
+}
+
+/* Allocate the memory of the context from an arena of 'size'
+   bytes. It should be called just after JS_NewContextRaw() so that
+   the intrinsic objects are also allocated in the arena. Return -1 if
+   not enough memory. */
+int JS_SetContextArena(JSContext *ctx, size_t size)
+{
+    JSRuntime *rt = ctx->rt;
+    JSArena *a, **new_tab;
+    int i, new_size;
+
+    if (ctx->arena)
+        return -1;
+    if (rt->arena_count >= rt->arena_size) {
+        new_size = max_int(4, rt->arena_size * 3 / 2);
+        new_tab = rt->mf.js_realloc(&rt->malloc_state, rt->arena_tab,
+                                    new_size * sizeof(rt->arena_tab[0]));
+        if (!new_tab)
+            return -1;
+        rt->arena_tab = new_tab;
+        rt->arena_size = new_size;
+    }
+    a = rt->mf.js_malloc(&rt->malloc_state, sizeof(*a));
+    if (!a)
+        return -1;
+    size = (size + JS_ARENA_ALIGN - 1) & ~(size_t)(JS_ARENA_ALIGN - 1);
+    a->base = js_malloc_rt(rt, size);
+    if (!a->base) {
+        rt->mf.js_free(&rt->malloc_state, a);
+        return -1;
+    }
+    a->ptr = a->base;
+    a->end = a->base + size;
+    a->live_count = 0;
+    a->active = TRUE;
+    i = js_arena_find_index(rt, a->base);
+    memmove(rt->arena_tab + i + 1, rt->arena_tab + i,
+            (rt->arena_count - i) * sizeof(rt->arena_tab[0]));
+    rt->arena_tab[i] = a;
+    rt->arena_count++;
+    ctx->arena = a;
+    return 0;
+}
+
+/* called when the owning context is freed */
+static void js_arena_release(JSRuntime *rt, JSArena *a)
+{
+    a->active = FALSE;
+    if (a->live_count == 0)
+        js_arena_delete(rt, a);
+}
+
 void *js_malloc_rt(JSRuntime *rt, size_t size)
 {
-    return rt->mf.js_malloc(&rt->malloc_state, size);
+    void *ptr;
+    ptr = rt->mf.js_malloc(&rt->malloc_state, size);
+    if (unlikely(rt->alloc_profile != NULL) && ptr)
+        js_alloc_profile_on_malloc(rt, ptr, size);
+    return ptr;
 }
 
 void js_free_rt(JSRuntime *rt, void *ptr)
 {
+    if (unlikely(rt->arena_count != 0) && ptr) {
+        JSArena *a = js_arena_find(rt, ptr);
+        if (a) {
+            js_arena_free(rt, a, ptr);
+            return;
+        }
+    }
+    if (unlikely(rt->alloc_profile != NULL) && ptr)
+        js_alloc_profile_on_free(rt, ptr);
     rt->mf.js_free(&rt->malloc_state, ptr);
 }
 
 void *js_realloc_rt(JSRuntime *rt, void *ptr, size_t size)
 {
-    return rt->mf.js_realloc(&rt->malloc_state, ptr, size);
+    void *new_ptr;
+    if (unlikely(rt->arena_count != 0) && ptr) {
+        JSArena *a = js_arena_find(rt, ptr);
+        if (a)
+            return js_arena_realloc(rt, a, ptr, size);
+    }
+    new_ptr = rt->mf.js_realloc(&rt->malloc_state, ptr, size);
+    if (unlikely(rt->alloc_profile != NULL)) {
+        /* a moved or freed block is accounted as a free */
+        if (ptr && (new_ptr != ptr || size == 0))
+            js_alloc_profile_on_free(rt, ptr);
+        if (new_ptr && new_ptr != ptr)
+            js_alloc_profile_on_malloc(rt, new_ptr, size);
+    }
+    return new_ptr;
 }
 
 size_t js_malloc_usable_size_rt(JSRuntime *rt, const void *ptr)
 {
+    if (unlikely(rt->arena_count != 0) && js_arena_find(rt, ptr))
+        return js_arena_block_size(ptr);
     return rt->mf.js_malloc_usable_size(ptr);
 }
 
@@ -1328,6 +1774,11 @@ static void *js_bf_realloc(void *opaque, void *ptr, size_t size)
 void *js_malloc(JSContext *ctx, size_t size)
 {
     void *ptr;
+    if (unlikely(ctx->arena != NULL)) {
+        ptr = js_arena_alloc(ctx->arena, size);
+        if (ptr)
+            return ptr;
+    }
     ptr = js_malloc_rt(ctx->rt, size);
     if (unlikely(!ptr)) {
         JS_ThrowOutOfMemory(ctx);
@@ -1340,6 +1791,11 @@ void *js_malloc(JSContext *ctx, size_t size)
 void *js_mallocz(JSContext *ctx, size_t size)
 {
     void *ptr;
+    if (unlikely(ctx->arena != NULL)) {
+        ptr = js_arena_alloc(ctx->arena, size);
+        if (ptr)
+            return memset(ptr, 0, size);
+    }
     ptr = js_mallocz_rt(ctx->rt, size);
     if (unlikely(!ptr)) {
         JS_ThrowOutOfMemory(ctx);
@@ -1881,12 +2337,9 @@ static inline JSAtomStruct *atom_set_free(uint32_t v)
 }
 
 /* Note: the string contents are uninitialized */
-static JSString *js_alloc_string_rt(JSRuntime *rt, int max_len, int is_wide_char)
+static JSString *js_init_string(JSRuntime *rt, JSString *str, int max_len,
+                                int is_wide_char)
 {
-    JSString *str;
-    str = js_malloc_rt(rt, sizeof(JSString) + (max_len << is_wide_char) + 1 - is_wide_char);
-    if (unlikely(!str))
-        return NULL;
     str->header.ref_count = 1;
     str->is_wide_char = is_wide_char;
     str->len = max_len;
@@ -1899,9 +2352,24 @@ static JSString *js_alloc_string_rt(JSRuntime *rt, int max_len, int is_wide_char
     return str;
 }
 
+static JSString *js_alloc_string_rt(JSRuntime *rt, int max_len, int is_wide_char)
+{
+    JSString *str;
+    str = js_malloc_rt(rt, sizeof(JSString) + (max_len << is_wide_char) + 1 - is_wide_char);
+    if (unlikely(!str))
+        return NULL;
+    return js_init_string(rt, str, max_len, is_wide_char);
+}
+
 static JSString *js_alloc_string(JSContext *ctx, int max_len, int is_wide_char)
 {
     JSString *p;
+    if (unlikely(ctx->arena != NULL)) {
+        p = js_arena_alloc(ctx->arena, sizeof(JSString) +
+                           (max_len << is_wide_char) + 1 - is_wide_char);
+        if (p)
+            return js_init_string(ctx->rt, p, max_len, is_wide_char);
+    }
     p = js_alloc_string_rt(ctx->rt, max_len, is_wide_char);
     if (unlikely(!p)) {
         JS_ThrowOutOfMemory(ctx);
@@ -1936,8 +2404,14 @@ void JS_FreeRuntime(JSRuntime *rt)
     struct list_head *el, *el1;
     int i;
 
+    js_alloc_profile_delete(rt);
     JS_FreeValueRT(rt, rt->current_exception);
 
+    for(i = 0; i < countof(rt->char_strings); i++) {
+        if (rt->char_strings[i])
+            JS_FreeValueRT(rt, JS_MKPTR(JS_TAG_STRING, rt->char_strings[i]));
+    }
+
     list_for_each_safe(el, el1, &rt->job_list) {
         JSJobEntry *e = list_entry(el, JSJobEntry, link);
         for(i = 0; i < e->argc; i++)
@@ -2113,13 +2587,18 @@ void JS_FreeRuntime(JSRuntime *rt)
     }
 #endif
 
+    /* arenas kept alive by leaking blocks */
+    while (rt->arena_count != 0)
+        js_arena_delete(rt, rt->arena_tab[rt->arena_count - 1]);
+    rt->mf.js_free(&rt->malloc_state, rt->arena_tab);
+
     {
         JSMallocState ms = rt->malloc_state;
         rt->mf.js_free(&ms, rt);
     }
 }
 
-JSContext *JS_NewContextRaw(JSRuntime *rt)
+static JSContext *js_new_context(JSRuntime *rt)
 {
     JSContext *ctx;
     int i;
@@ -2148,8 +2627,20 @@ JSContext *JS_NewContextRaw(JSRuntime *rt)
     ctx->array_ctor = JS_NULL;
     ctx->regexp_ctor = JS_NULL;
     ctx->promise_ctor = JS_NULL;
+    for(i = 0; i < JS_INTRINSIC_CTOR_COUNT; i++)
+        ctx->intrinsic_ctor[i] = JS_UNDEFINED;
     init_list_head(&ctx->loaded_modules);
+    ctx->eval_cache_max_size = JS_EVAL_CACHE_DEFAULT_SIZE;
+    return ctx;
+}
 
+JSContext *JS_NewContextRaw(JSRuntime *rt)
+{
+    JSContext *ctx;
+
+    ctx = js_new_context(rt);
+    if (!ctx)
+        return NULL;
     JS_AddIntrinsicBasicObjects(ctx);
     return ctx;
 }
@@ -2205,11 +2696,68 @@ void JS_SetClassProto(JSContext *ctx, JSClassID class_id, JSValue obj)
     set_value(ctx, &ctx->class_proto[class_id], obj);
 }
 
+static const char * const js_intrinsic_name[JS_INTRINSIC_COUNT] = {
+    "Date", "Proxy", "Map/Set", "TypedArrays",
+};
+
+static void (* const js_intrinsic_init_func[JS_INTRINSIC_COUNT])(JSContext *ctx) = {
+    js_date_init,
+    js_proxy_init,
+    js_map_set_init,
+    js_typed_arrays_init,
+};
+
+/* mark the intrinsic 'id' as pending: it is instantiated by
+   js_instantiate_intrinsic() when one of its constructors or
+   prototypes is first needed */
+static void js_defer_intrinsic(JSContext *ctx, JSIntrinsicEnum id)
+{
+    ctx->intrinsic_pending |= 1 << id;
+    ctx->rt->intrinsic_lazy_count[id]++;
+}
+
+static void js_instantiate_intrinsic(JSContext *ctx, JSIntrinsicEnum id)
+{
+    if (!(ctx->intrinsic_pending & (1 << id)))
+        return;
+    ctx->intrinsic_pending &= ~(1 << id);
+    ctx->rt->intrinsic_init_count[id]++;
+#ifdef DUMP_INTRINSICS
+    printf("instantiate intrinsic: %s\n", js_intrinsic_name[id]);
+#endif
+    js_intrinsic_init_func[id](ctx);
+}
+
+static void js_instantiate_class_proto(JSContext *ctx, JSClassID class_id)
+{
+    JSIntrinsicEnum id;
+
+    if (class_id == JS_CLASS_DATE)
+        id = JS_INTRINSIC_DATE;
+    else if (class_id >= JS_CLASS_ARRAY_BUFFER && class_id <= JS_CLASS_DATAVIEW)
+        id = JS_INTRINSIC_TYPED_ARRAYS;
+    else if (class_id >= JS_CLASS_MAP && class_id <= JS_CLASS_SET_ITERATOR)
+        id = JS_INTRINSIC_MAP_SET;
+    else
+        return;
+    js_instantiate_intrinsic(ctx, id);
+}
+
+/* return the prototype of the class 'class_id', instantiating the
+   corresponding lazy intrinsic if needed */
+static inline JSValueConst js_get_class_proto(JSContext *ctx, JSClassID class_id)
+{
+    if (unlikely(ctx->intrinsic_pending != 0) &&
+        JS_IsNull(ctx->class_proto[class_id]))
+        js_instantiate_class_proto(ctx, class_id);
+    return ctx->class_proto[class_id];
+}
+
 JSValue JS_GetClassProto(JSContext *ctx, JSClassID class_id)
 {
     JSRuntime *rt = ctx->rt;
     assert(class_id < rt->class_count);
-    return JS_DupValue(ctx, ctx->class_proto[class_id]);
+    return JS_DupValue(ctx, js_get_class_proto(ctx, class_id));
 }
 
 typedef enum JSFreeModuleEnum {
@@ -2272,9 +2820,15 @@ static void JS_MarkContext(JSRuntime *rt, JSContext *ctx,
     JS_MarkValue(rt, ctx->regexp_ctor, mark_func);
     JS_MarkValue(rt, ctx->function_ctor, mark_func);
     JS_MarkValue(rt, ctx->function_proto, mark_func);
+    for(i = 0; i < JS_INTRINSIC_CTOR_COUNT; i++) {
+        JS_MarkValue(rt, ctx->intrinsic_ctor[i], mark_func);
+    }
 
     if (ctx->array_shape)
         mark_func(rt, &ctx->array_shape->header);
+
+    if (ctx->eval_cache)
+        js_eval_cache_mark(rt, ctx->eval_cache, mark_func);
 }
 
 void JS_FreeContext(JSContext *ctx)
@@ -2336,11 +2890,20 @@ void JS_FreeContext(JSContext *ctx)
     JS_FreeValue(ctx, ctx->regexp_ctor);
     JS_FreeValue(ctx, ctx->function_ctor);
     JS_FreeValue(ctx, ctx->function_proto);
+    for(i = 0; i < JS_INTRINSIC_CTOR_COUNT; i++) {
+        JS_FreeValue(ctx, ctx->intrinsic_ctor[i]);
+    }
 
     js_free_shape_null(ctx->rt, ctx->array_shape);
 
+    if (ctx->snapshot)
+        js_snapshot_recorder_free(ctx, ctx->snapshot);
+    js_eval_cache_free(ctx);
+
     list_del(&ctx->link);
     remove_gc_object(&ctx->header);
+    if (ctx->arena)
+        js_arena_release(rt, ctx->arena);
     js_free_rt(ctx->rt, ctx);
 }
 
@@ -3445,6 +4008,25 @@ int JS_NewClass(JSRuntime *rt, JSClassID class_id, const JSClassDef *class_def)
     return ret;
 }
 
+/* the one character 8 bit strings are kept in a table so that they
+   are allocated only once */
+static JSValue js_new_string_char8(JSContext *ctx, uint8_t c)
+{
+    JSRuntime *rt = ctx->rt;
+    JSString *p;
+
+    p = rt->char_strings[c];
+    if (unlikely(!p)) {
+        p = js_alloc_string(ctx, 1, 0);
+        if (!p)
+            return JS_EXCEPTION;
+        p->u.str8[0] = c;
+        p->u.str8[1] = '\0';
+        rt->char_strings[c] = p;
+    }
+    return JS_DupValue(ctx, JS_MKPTR(JS_TAG_STRING, p));
+}
+
 static JSValue js_new_string8(JSContext *ctx, const uint8_t *buf, int len)
 {
     JSString *str;
@@ -3452,6 +4034,9 @@ static JSValue js_new_string8(JSContext *ctx, const uint8_t *buf, int len)
     if (len <= 0) {
         return JS_AtomToString(ctx, JS_ATOM_empty_string);
     }
+    if (len == 1) {
+        return js_new_string_char8(ctx, buf[0]);
+    }
     str = js_alloc_string(ctx, len, 0);
     if (!str)
         return JS_EXCEPTION;
@@ -3473,20 +4058,46 @@ static JSValue js_new_string16(JSContext *ctx, const uint16_t *buf, int len)
 static JSValue js_new_string_char(JSContext *ctx, uint16_t c)
 {
     if (c < 0x100) {
-        uint8_t ch8 = c;
-        return js_new_string8(ctx, &ch8, 1);
+        return js_new_string_char8(ctx, c);
     } else {
         uint16_t ch16 = c;
         return js_new_string16(ctx, &ch16, 1);
     }
 }
 
+/* return a string rope referencing the characters of 'p' from
+   'start' to 'start + len' */
+static JSValue js_new_string_slice(JSContext *ctx, JSString *p,
+                                   uint32_t start, uint32_t len)
+{
+    JSStringRope *r;
+
+    r = js_malloc(ctx, sizeof(*r));
+    if (!r)
+        return JS_EXCEPTION;
+    r->header.ref_count = 1;
+    r->len = len;
+    r->is_wide_char = p->is_wide_char;
+    r->depth = 0;
+    r->start = start;
+    r->left = JS_DupValue(ctx, JS_MKPTR(JS_TAG_STRING, p));
+    r->right = JS_UNDEFINED;
+    return JS_MKPTR(JS_TAG_STRING_ROPE, r);
+}
+
+/* The result may be a string rope */
 static JSValue js_sub_string(JSContext *ctx, JSString *p, int start, int end)
 {
     int len = end - start;
+    BOOL is_slice;
+
     if (start == 0 && end == p->len) {
         return JS_DupValue(ctx, JS_MKPTR(JS_TAG_STRING, p));
     }
+    /* long substrings share the storage of 'p' unless they are too
+       small compared to it */
+    is_slice = (len >= JS_STRING_SLICE_MIN_LEN &&
+                len >= p->len / JS_STRING_SLICE_MIN_RATIO);
     if (p->is_wide_char && len > 0) {
         JSString *str;
         int i;
@@ -3494,8 +4105,11 @@ static JSValue js_sub_string(JSContext *ctx, JSString *p, int start, int end)
         for (i = start; i < end; i++) {
             c |= p->u.str16[i];
         }
-        if (c > 0xFF)
+        if (c > 0xFF) {
+            if (is_slice)
+                return js_new_string_slice(ctx, p, start, len);
             return js_new_string16(ctx, p->u.str16 + start, len);
+        }
 
         str = js_alloc_string(ctx, len, 0);
         if (!str)
@@ -3506,6 +4120,8 @@ static JSValue js_sub_string(JSContext *ctx, JSString *p, int start, int end)
         str->u.str8[len] = '\0';
         return JS_MKPTR(JS_TAG_STRING, str);
     } else {
+        if (is_slice)
+            return js_new_string_slice(ctx, p, start, len);
         return js_new_string8(ctx, p->u.str8 + start, len);
     }
 }
@@ -3760,6 +4376,8 @@ static int string_buffer_concat(StringBuffer *s, const JSString *p,
         return string_buffer_write8(s, p->u.str8 + from, to - from);
 }
 
+static int string_buffer_concat_rope(StringBuffer *s, JSValueConst v);
+
 static int string_buffer_concat_value(StringBuffer *s, JSValueConst v)
 {
     JSString *p;
@@ -3770,6 +4388,8 @@ static int string_buffer_concat_value(StringBuffer *s, JSValueConst v)
         /* prevent exception overload */
         return -1;
     }
+    if (JS_VALUE_GET_TAG(v) == JS_TAG_STRING_ROPE)
+        return string_buffer_concat_rope(s, v);
     if (unlikely(JS_VALUE_GET_TAG(v) != JS_TAG_STRING)) {
         v1 = JS_ToString(s->ctx, v);
         if (JS_IsException(v1))
@@ -3793,6 +4413,11 @@ static int string_buffer_concat_value_free(StringBuffer *s, JSValue v)
         JS_FreeValue(s->ctx, v);
         return -1;
     }
+    if (JS_VALUE_GET_TAG(v) == JS_TAG_STRING_ROPE) {
+        res = string_buffer_concat_rope(s, v);
+        JS_FreeValue(s->ctx, v);
+        return res;
+    }
     if (unlikely(JS_VALUE_GET_TAG(v) != JS_TAG_STRING)) {
         v = JS_ToStringFree(s->ctx, v);
         if (JS_IsException(v))
@@ -3829,6 +4454,12 @@ static JSValue string_buffer_end(StringBuffer *s)
         s->str = NULL;
         return JS_AtomToString(s->ctx, JS_ATOM_empty_string);
     }
+    if (s->len == 1 && !s->is_wide_char) {
+        uint8_t c = str->u.str8[0];
+        js_free(s->ctx, str);
+        s->str = NULL;
+        return js_new_string_char8(s->ctx, c);
+    }
     if (s->len < s->size) {
         /* smaller size so js_realloc should not fail, but OK if it does */
         /* XXX: should add some slack to avoid unnecessary calls */
@@ -4163,53 +4794,449 @@ static JSValue JS_ConcatString1(JSContext *ctx,
     return JS_MKPTR(JS_TAG_STRING, p);
 }
 
+static inline BOOL tag_is_string(uint32_t tag)
+{
+    return tag == JS_TAG_STRING || tag == JS_TAG_STRING_ROPE;
+}
+
+/* 'val' must be a string or a string rope */
+static uint32_t js_string_value_len(JSValueConst val)
+{
+    if (JS_VALUE_GET_TAG(val) == JS_TAG_STRING)
+        return JS_VALUE_GET_STRING(val)->len;
+    else
+        return JS_VALUE_GET_STRING_ROPE(val)->len;
+}
+
+/* 'val' must be a string or a string rope */
+static int js_string_value_is_wide_char(JSValueConst val)
+{
+    if (JS_VALUE_GET_TAG(val) == JS_TAG_STRING)
+        return JS_VALUE_GET_STRING(val)->is_wide_char;
+    else
+        return JS_VALUE_GET_STRING_ROPE(val)->is_wide_char;
+}
+
+/* 'val' must be a string or a string rope */
+static int js_string_rope_depth(JSValueConst val)
+{
+    if (JS_VALUE_GET_TAG(val) == JS_TAG_STRING)
+        return 0;
+    else
+        return JS_VALUE_GET_STRING_ROPE(val)->depth;
+}
+
+static void js_string_rope_copy(void *buf, int is_wide_char, uint32_t pos,
+                                JSValueConst val)
+{
+    JSStringRope *r;
+    JSString *p;
+
+    for(;;) {
+        if (JS_VALUE_GET_TAG(val) == JS_TAG_STRING) {
+            p = JS_VALUE_GET_STRING(val);
+            if (is_wide_char)
+                copy_str16((uint16_t *)buf + pos, p, 0, p->len);
+            else
+                memcpy((uint8_t *)buf + pos, p->u.str8, p->len);
+            break;
+        }
+        r = JS_VALUE_GET_STRING_ROPE(val);
+        if (r->depth == 0) {
+            p = JS_VALUE_GET_STRING(r->left);
+            if (is_wide_char)
+                copy_str16((uint16_t *)buf + pos, p, r->start, r->len);
+            else
+                memcpy((uint8_t *)buf + pos, p->u.str8 + r->start, r->len);
+            break;
+        }
+        js_string_rope_copy(buf, is_wide_char, pos, r->left);
+        pos += js_string_value_len(r->left);
+        val = r->right;
+    }
+}
+
+/* return the string containing the characters of the rope 'val' */
+static JSValue js_linearize_string_rope(JSContext *ctx, JSValueConst val)
+{
+    JSStringRope *r = JS_VALUE_GET_STRING_ROPE(val);
+    JSString *p;
+
+    if (r->depth == 0 && r->start == 0 &&
+        r->len == JS_VALUE_GET_STRING(r->left)->len)
+        return JS_DupValue(ctx, r->left);
+    p = js_alloc_string(ctx, r->len, r->is_wide_char);
+    if (!p)
+        return JS_EXCEPTION;
+    js_string_rope_copy(p->u.str8, r->is_wide_char, 0, val);
+    if (!r->is_wide_char)
+        p->u.str8[r->len] = '\0';
+    JS_FreeValue(ctx, r->left);
+    JS_FreeValue(ctx, r->right);
+    r->left = JS_DupValue(ctx, JS_MKPTR(JS_TAG_STRING, p));
+    r->right = JS_UNDEFINED;
+    r->depth = 0;
+    r->start = 0;
+    return JS_MKPTR(JS_TAG_STRING, p);
+}
+
+/* convert a string rope to a string. Other values are returned as is. */
+static JSValue js_linearize_string_free(JSContext *ctx, JSValue val)
+{
+    JSValue ret;
+
+    if (JS_VALUE_GET_TAG(val) != JS_TAG_STRING_ROPE)
+        return val;
+    ret = js_linearize_string_rope(ctx, val);
+    JS_FreeValue(ctx, val);
+    return ret;
+}
+
+/* 'left' and 'right' are freed. For convenience, JS_EXCEPTION is
+   accepted for 'left' or 'right'. The resulting length must be <=
+   JS_STRING_LEN_MAX. */
+static JSValue js_new_string_rope(JSContext *ctx, JSValue left, JSValue right)
+{
+    JSStringRope *r;
+
+    if (JS_IsException(left) || JS_IsException(right))
+        goto fail;
+    r = js_malloc(ctx, sizeof(*r));
+    if (!r)
+        goto fail;
+    r->header.ref_count = 1;
+    r->len = js_string_value_len(left) + js_string_value_len(right);
+    r->is_wide_char = js_string_value_is_wide_char(left) |
+        js_string_value_is_wide_char(right);
+    r->depth = max_int(js_string_rope_depth(left),
+                       js_string_rope_depth(right)) + 1;
+    r->start = 0;
+    r->left = left;
+    r->right = right;
+    if (r->depth > JS_STRING_ROPE_MAX_DEPTH)
+        return js_linearize_string_free(ctx, JS_MKPTR(JS_TAG_STRING_ROPE, r));
+    return JS_MKPTR(JS_TAG_STRING_ROPE, r);
+ fail:
+    JS_FreeValue(ctx, left);
+    JS_FreeValue(ctx, right);
+    return JS_EXCEPTION;
+}
+
+/* Concatenate the strings or string ropes 'op1' and 'op2' (AVL
+   join). 'op1' and 'op2' are freed. The resulting length must be <=
+   JS_STRING_LEN_MAX. */
+static JSValue js_concat_string_rope(JSContext *ctx, JSValue op1, JSValue op2)
+{
+    JSStringRope *r;
+    JSValue left, right, a, b, ret;
+    int d1, d2;
+
+    d1 = js_string_rope_depth(op1);
+    d2 = js_string_rope_depth(op2);
+    if (d1 > d2 + 1) {
+        r = JS_VALUE_GET_STRING_ROPE(op1);
+        left = JS_DupValue(ctx, r->left);
+        right = js_concat_string_rope(ctx, JS_DupValue(ctx, r->right), op2);
+        JS_FreeValue(ctx, op1);
+        if (JS_IsException(right)) {
+            JS_FreeValue(ctx, left);
+            return JS_EXCEPTION;
+        }
+        if (js_string_rope_depth(right) > js_string_rope_depth(left) + 1) {
+            r = JS_VALUE_GET_STRING_ROPE(right);
+            a = JS_DupValue(ctx, r->left);
+            b = JS_DupValue(ctx, r->right);
+            JS_FreeValue(ctx, right);
+            if (js_string_rope_depth(a) > js_string_rope_depth(b)) {
+                /* double rotation */
+                r = JS_VALUE_GET_STRING_ROPE(a);
+                left = js_new_string_rope(ctx, left, JS_DupValue(ctx, r->left));
+                right = js_new_string_rope(ctx, JS_DupValue(ctx, r->right), b);
+                JS_FreeValue(ctx, a);
+            } else {
+                left = js_new_string_rope(ctx, left, a);
+                right = b;
+            }
+        }
+        return js_new_string_rope(ctx, left, right);
+    } else if (d2 > d1 + 1) {
+        r = JS_VALUE_GET_STRING_ROPE(op2);
+        left = js_concat_string_rope(ctx, op1, JS_DupValue(ctx, r->left));
+        right = JS_DupValue(ctx, r->right);
+        JS_FreeValue(ctx, op2);
+        if (JS_IsException(left)) {
+            JS_FreeValue(ctx, right);
+            return JS_EXCEPTION;
+        }
+        if (js_string_rope_depth(left) > js_string_rope_depth(right) + 1) {
+            r = JS_VALUE_GET_STRING_ROPE(left);
+            a = JS_DupValue(ctx, r->left);
+            b = JS_DupValue(ctx, r->right);
+            JS_FreeValue(ctx, left);
+            if (js_string_rope_depth(b) > js_string_rope_depth(a)) {
+                /* double rotation */
+                r = JS_VALUE_GET_STRING_ROPE(b);
+                right = js_new_string_rope(ctx, JS_DupValue(ctx, r->right), right);
+                left = js_new_string_rope(ctx, a, JS_DupValue(ctx, r->left));
+                JS_FreeValue(ctx, b);
+            } else {
+                right = js_new_string_rope(ctx, b, right);
+                left = a;
+            }
+        }
+        return js_new_string_rope(ctx, left, right);
+    } else if (JS_VALUE_GET_TAG(op1) == JS_TAG_STRING &&
+               JS_VALUE_GET_TAG(op2) == JS_TAG_STRING &&
+               JS_VALUE_GET_STRING(op1)->len + JS_VALUE_GET_STRING(op2)->len <
+               JS_STRING_ROPE_SHORT_LEN) {
+        /* merge the small leaves */
+        ret = JS_ConcatString1(ctx, JS_VALUE_GET_STRING(op1),
+                               JS_VALUE_GET_STRING(op2));
+        JS_FreeValue(ctx, op1);
+        JS_FreeValue(ctx, op2);
+        return ret;
+    } else {
+        return js_new_string_rope(ctx, op1, op2);
+    }
+}
+
+typedef struct JSStringRopeIter {
+    int stack_len;
+    JSValueConst stack[JS_STRING_ROPE_MAX_DEPTH + 2];
+} JSStringRopeIter;
+
+static void string_rope_iter_init(JSStringRopeIter *s, JSValueConst val)
+{
+    s->stack_len = 0;
+    s->stack[s->stack_len++] = val;
+}
+
+/* return the string containing the next non empty part of the rope
+   or NULL if none. The part starts at '*pstart' and its length is
+   '*plen'. */
+static JSString *string_rope_iter_next(JSStringRopeIter *s,
+                                       uint32_t *pstart, uint32_t *plen)
+{
+    JSValueConst val;
+    JSStringRope *r;
+    JSString *p;
+
+    while (s->stack_len > 0) {
+        val = s->stack[--s->stack_len];
+        if (JS_VALUE_GET_TAG(val) == JS_TAG_STRING) {
+            p = JS_VALUE_GET_STRING(val);
+            if (p->len != 0) {
+                *pstart = 0;
+                *plen = p->len;
+                return p;
+            }
+        } else {
+            r = JS_VALUE_GET_STRING_ROPE(val);
+            if (r->depth == 0) {
+                if (r->len != 0) {
+                    *pstart = r->start;
+                    *plen = r->len;
+                    return JS_VALUE_GET_STRING(r->left);
+                }
+            } else {
+                s->stack[s->stack_len++] = r->right;
+                s->stack[s->stack_len++] = r->left;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* append the characters of the string rope 'v' without linearizing it */
+static int string_buffer_concat_rope(StringBuffer *s, JSValueConst v)
+{
+    JSStringRopeIter it;
+    JSString *p;
+    uint32_t start, len;
+
+    string_rope_iter_init(&it, v);
+    while ((p = string_rope_iter_next(&it, &start, &len)) != NULL) {
+        if (string_buffer_concat(s, p, start, start + len))
+            return -1;
+    }
+    return 0;
+}
+
+static int js_string_memcmp_pos(const JSString *p1, int pos1,
+                                const JSString *p2, int pos2, int len)
+{
+    int res;
+
+    if (likely(!p1->is_wide_char)) {
+        if (likely(!p2->is_wide_char))
+            res = memcmp(p1->u.str8 + pos1, p2->u.str8 + pos2, len);
+        else
+            res = -memcmp16_8(p2->u.str16 + pos2, p1->u.str8 + pos1, len);
+    } else {
+        if (!p2->is_wide_char)
+            res = memcmp16_8(p1->u.str16 + pos1, p2->u.str8 + pos2, len);
+        else
+            res = memcmp16(p1->u.str16 + pos1, p2->u.str16 + pos2, len);
+    }
+    return res;
+}
+
+/* compare two strings or string ropes without linearizing them.
+   Return < 0, 0 or > 0 */
+static int js_string_rope_compare(JSValueConst op1, JSValueConst op2)
+{
+    JSStringRopeIter it1, it2;
+    JSString *p1, *p2;
+    uint32_t pos1, pos2, len1, len2, len;
+    int res;
+
+    string_rope_iter_init(&it1, op1);
+    string_rope_iter_init(&it2, op2);
+    p1 = string_rope_iter_next(&it1, &pos1, &len1);
+    p2 = string_rope_iter_next(&it2, &pos2, &len2);
+    for(;;) {
+        if (!p1 || !p2)
+            return (p1 != NULL) - (p2 != NULL);
+        len = min_uint32(len1, len2);
+        res = js_string_memcmp_pos(p1, pos1, p2, pos2, len);
+        if (res != 0)
+            return res;
+        pos1 += len;
+        len1 -= len;
+        pos2 += len;
+        len2 -= len;
+        if (len1 == 0)
+            p1 = string_rope_iter_next(&it1, &pos1, &len1);
+        if (len2 == 0)
+            p2 = string_rope_iter_next(&it2, &pos2, &len2);
+    }
+}
+
+/* return TRUE if the strings or string ropes are equal */
+static BOOL js_string_rope_eq(JSValueConst op1, JSValueConst op2)
+{
+    if (js_string_value_len(op1) != js_string_value_len(op2))
+        return FALSE;
+    return js_string_rope_compare(op1, op2) == 0;
+}
+
+/* Grow 'p' so that it can hold at least 'new_len' characters. The
+   size grows geometrically so that repeated appends to the same string
+   take amortized linear time. Return NULL if error. */
+static JSString *js_realloc_string(JSContext *ctx, JSString *p,
+                                   uint32_t new_len)
+{
+    JSString *new_p;
+    uint32_t size;
+
+    size = min_uint32(max_uint32(new_len, p->len + p->len / 2),
+                      JS_STRING_LEN_MAX);
+#ifdef DUMP_LEAKS
+    list_del(&p->link);
+#endif
+    new_p = js_realloc(ctx, p, sizeof(JSString) +
+                       (size << p->is_wide_char) + 1 - p->is_wide_char);
+#ifdef DUMP_LEAKS
+    list_add_tail(new_p ? &new_p->link : &p->link, &ctx->rt->string_list);
+#endif
+    return new_p;
+}
+
+/* Append the string 'op2' at the end of the string '*pv' if '*pv' is
+   its only reference. Return 1 if done, 0 if not possible and -1 in
+   case of exception. '*pv' is unchanged if 0 or -1 is returned. */
+static int js_concat_string_in_place(JSContext *ctx, JSValue *pv,
+                                     JSValueConst op2)
+{
+    JSString *p1, *p2;
+    uint32_t len;
+
+    if (JS_VALUE_GET_TAG(*pv) != JS_TAG_STRING ||
+        JS_VALUE_GET_TAG(op2) != JS_TAG_STRING)
+        return 0;
+    p1 = JS_VALUE_GET_STRING(*pv);
+    p2 = JS_VALUE_GET_STRING(op2);
+    if (p1->header.ref_count != 1 || p1->atom_type != 0 ||
+        p1->is_wide_char != p2->is_wide_char)
+        return 0;
+    len = p1->len + p2->len;
+    if (len > JS_STRING_LEN_MAX)
+        return 0;
+    if (js_malloc_usable_size(ctx, p1) < sizeof(*p1) + (len << p1->is_wide_char) + 1 - p1->is_wide_char) {
+        p1 = js_realloc_string(ctx, p1, len);
+        if (!p1)
+            return -1;
+        *pv = JS_MKPTR(JS_TAG_STRING, p1);
+    }
+    if (p1->is_wide_char) {
+        memcpy(p1->u.str16 + p1->len, p2->u.str16, p2->len << 1);
+    } else {
+        memcpy(p1->u.str8 + p1->len, p2->u.str8, p2->len);
+        p1->u.str8[len] = '\0';
+    }
+    p1->len = len;
+    return 1;
+}
+
 /* op1 and op2 are converted to strings. For convience, op1 or op2 =
-   JS_EXCEPTION are accepted and return JS_EXCEPTION.  */
+   JS_EXCEPTION are accepted and return JS_EXCEPTION. The result may
+   be a string rope. */
 static JSValue JS_ConcatString(JSContext *ctx, JSValue op1, JSValue op2)
 {
     JSValue ret;
-    JSString *p1, *p2;
+    uint32_t len1, len2;
+    int res;
 
-    if (unlikely(JS_VALUE_GET_TAG(op1) != JS_TAG_STRING)) {
+    if (unlikely(!tag_is_string(JS_VALUE_GET_TAG(op1)))) {
         op1 = JS_ToStringFree(ctx, op1);
         if (JS_IsException(op1)) {
             JS_FreeValue(ctx, op2);
             return JS_EXCEPTION;
         }
     }
-    if (unlikely(JS_VALUE_GET_TAG(op2) != JS_TAG_STRING)) {
+    if (unlikely(!tag_is_string(JS_VALUE_GET_TAG(op2)))) {
         op2 = JS_ToStringFree(ctx, op2);
         if (JS_IsException(op2)) {
             JS_FreeValue(ctx, op1);
             return JS_EXCEPTION;
         }
     }
-    p1 = JS_VALUE_GET_STRING(op1);
-    p2 = JS_VALUE_GET_STRING(op2);
-
-    /* XXX: could also check if p1 is empty */
-    if (p2->len == 0) {
+    len1 = js_string_value_len(op1);
+    len2 = js_string_value_len(op2);
+    if (len2 == 0) {
         goto ret_op1;
     }
-    if (p1->header.ref_count == 1 && p1->is_wide_char == p2->is_wide_char
-    &&  js_malloc_usable_size(ctx, p1) >= sizeof(*p1) + ((p1->len + p2->len) << p2->is_wide_char) + 1 - p1->is_wide_char) {
-        /* Concatenate in place in available space at the end of p1 */
-        if (p1->is_wide_char) {
-            memcpy(p1->u.str16 + p1->len, p2->u.str16, p2->len << 1);
-            p1->len += p2->len;
-        } else {
-            memcpy(p1->u.str8 + p1->len, p2->u.str8, p2->len);
-            p1->len += p2->len;
-            p1->u.str8[p1->len] = '\0';
-        }
+    if (len1 == 0) {
+        JS_FreeValue(ctx, op1);
+        return op2;
+    }
+    if (len1 + len2 > JS_STRING_LEN_MAX) {
+        JS_FreeValue(ctx, op1);
+        JS_FreeValue(ctx, op2);
+        return JS_ThrowInternalError(ctx, "string too long");
+    }
+    /* op1 is not shared: concatenate in place at the end of op1 */
+    res = js_concat_string_in_place(ctx, &op1, op2);
+    if (res < 0) {
+        JS_FreeValue(ctx, op1);
+        JS_FreeValue(ctx, op2);
+        return JS_EXCEPTION;
+    } else if (res > 0) {
     ret_op1:
         JS_FreeValue(ctx, op2);
         return op1;
     }
-    ret = JS_ConcatString1(ctx, p1, p2);
-    JS_FreeValue(ctx, op1);
-    JS_FreeValue(ctx, op2);
-    return ret;
+    if (JS_VALUE_GET_TAG(op1) == JS_TAG_STRING &&
+        JS_VALUE_GET_TAG(op2) == JS_TAG_STRING) {
+        if (len1 + len2 < JS_STRING_ROPE_SHORT_LEN) {
+            ret = JS_ConcatString1(ctx, JS_VALUE_GET_STRING(op1),
+                                   JS_VALUE_GET_STRING(op2));
+            JS_FreeValue(ctx, op1);
+            JS_FreeValue(ctx, op2);
+            return ret;
+        }
+    }
+    return js_concat_string_rope(ctx, op1, op2);
 }
 
 /* Shape support */
@@ -4896,7 +5923,8 @@ static int JS_SetObjectData(JSContext *ctx, JSValueConst obj, JSValue val)
 
 JSValue JS_NewObjectClass(JSContext *ctx, int class_id)
 {
-    return JS_NewObjectProtoClass(ctx, ctx->class_proto[class_id], class_id);
+    return JS_NewObjectProtoClass(ctx, js_get_class_proto(ctx, class_id),
+                                  class_id);
 }
 
 JSValue JS_NewObjectProto(JSContext *ctx, JSValueConst proto)
@@ -5230,7 +6258,12 @@ static void free_var_ref(JSRuntime *rt, JSVarRef *var_ref)
             } else {
                 list_del(&var_ref->header.link); /* still on the stack */
             }
-            js_free_rt(rt, var_ref);
+            if (var_ref->block) {
+                if (--var_ref->block->ref_count == 0)
+                    js_free_rt(rt, var_ref->block);
+            } else {
+                js_free_rt(rt, var_ref);
+            }
         }
     }
 }
@@ -5490,6 +6523,14 @@ void __JS_FreeValueRT(JSRuntime *rt, JSValue v)
             }
         }
         break;
+    case JS_TAG_STRING_ROPE:
+        {
+            JSStringRope *r = JS_VALUE_GET_STRING_ROPE(v);
+            JS_FreeValueRT(rt, r->left);
+            JS_FreeValueRT(rt, r->right);
+            js_free_rt(rt, r);
+        }
+        break;
     case JS_TAG_OBJECT:
     case JS_TAG_FUNCTION_BYTECODE:
         {
@@ -5626,6 +6667,8 @@ static void mark_children(JSRuntime *rt, JSGCObjectHeader *gp,
             }
             if (b->realm)
                 mark_func(rt, &b->realm->header);
+            if (b->lazy && !b->lazy->image && b->lazy->u.compile.b)
+                mark_func(rt, &b->lazy->u.compile.b->header);
         }
         break;
     case JS_GC_OBJ_TYPE_VAR_REF:
@@ -5865,6 +6908,11 @@ static void compute_bytecode_size(JSFunctionBytecode *b, JSMemoryUsage_helper *h
             hp->js_func_pc2line_count += 1;
             hp->js_func_pc2line_size += b->debug.pc2line_len;
         }
+        if (b->debug.inline_range_count) {
+            memory_used_count++;
+            hp->js_func_pc2line_size += b->debug.inline_range_count *
+                sizeof(b->debug.inline_ranges[0]);
+        }
     }
     hp->js_func_size += js_func_size;
     hp->js_func_count += 1;
@@ -5877,6 +6925,16 @@ static void compute_value_size(JSValueConst val, JSMemoryUsage_helper *hp)
     case JS_TAG_STRING:
         compute_jsstring_size(JS_VALUE_GET_STRING(val), hp);
         break;
+    case JS_TAG_STRING_ROPE:
+        {
+            JSStringRope *r = JS_VALUE_GET_STRING_ROPE(val);
+            double s_ref_count = r->header.ref_count;
+            hp->str_count += 1 / s_ref_count;
+            hp->str_size += sizeof(*r) / s_ref_count;
+            compute_value_size(r->left, hp);
+            compute_value_size(r->right, hp);
+        }
+        break;
 #ifdef CONFIG_BIGNUM
     case JS_TAG_BIG_INT:
     case JS_TAG_BIG_FLOAT:
@@ -6239,6 +7297,14 @@ void JS_DumpMemoryUsage(FILE *fp, const JSMemoryUsage *s, JSRuntime *rt)
             if (obj_classes[JS_CLASS_INIT_COUNT])
                 fprintf(fp, "  %5d  %2.0d %s\n", obj_classes[JS_CLASS_INIT_COUNT], 0, "other");
         }
+        {
+            int id;
+            fprintf(fp, "\n" "Lazy intrinsics (instantiated/deferred)\n");
+            for(id = 0; id < JS_INTRINSIC_COUNT; id++) {
+                fprintf(fp, "  %5u/%-5u %s\n", rt->intrinsic_init_count[id],
+                        rt->intrinsic_lazy_count[id], js_intrinsic_name[id]);
+            }
+        }
         fprintf(fp, "\n");
     }
 #endif
@@ -6430,6 +7496,32 @@ static int find_line_num(JSContext *ctx, JSFunctionBytecode *b,
     return line_num;
 }
 
+/* return the function whose code was inlined at 'pc_value' or NULL
+   if none. '*pcall_line' is set to the line number of the call. */
+static JSFunctionBytecode *find_inline_func_bytecode(JSFunctionBytecode *b,
+                                                     uint32_t pc_value,
+                                                     int *pcall_line)
+{
+    JSInlineRange *r;
+    int i;
+
+    if (!b->has_debug)
+        return NULL;
+    for(i = 0; i < b->debug.inline_range_count; i++) {
+        r = &b->debug.inline_ranges[i];
+        if (pc_value < r->pc_start)
+            break;
+        if (pc_value < r->pc_end) {
+            if (r->cpool_idx >= b->cpool_count ||
+                JS_VALUE_GET_TAG(b->cpool[r->cpool_idx]) != JS_TAG_FUNCTION_BYTECODE)
+                break;
+            *pcall_line = r->call_line;
+            return JS_VALUE_GET_PTR(b->cpool[r->cpool_idx]);
+        }
+    }
+    return NULL;
+}
+
 /* in order to avoid executing arbitrary code during the stack trace
    generation, we only look at simple 'name' properties containing a
    string. */
@@ -6447,11 +7539,24 @@ static const char *get_func_name(JSContext *ctx, JSValueConst func)
     if ((prs->flags & JS_PROP_TMASK) != JS_PROP_NORMAL)
         return NULL;
     val = pr->u.value;
-    if (JS_VALUE_GET_TAG(val) != JS_TAG_STRING)
+    if (!tag_is_string(JS_VALUE_GET_TAG(val)))
         return NULL;
     return JS_ToCString(ctx, val);
 }
 
+static void dbuf_put_backtrace_pos(JSContext *ctx, DynBuf *dbuf,
+                                   JSFunctionBytecode *b, int line_num)
+{
+    const char *atom_str;
+
+    atom_str = JS_AtomToCString(ctx, b->debug.filename);
+    dbuf_printf(dbuf, " (%s", atom_str ? atom_str : "<null>");
+    JS_FreeCString(ctx, atom_str);
+    if (line_num != -1)
+        dbuf_printf(dbuf, ":%d", line_num);
+    dbuf_putc(dbuf, ')');
+}
+
 #define JS_BACKTRACE_FLAG_SKIP_FIRST_LEVEL (1 << 0)
 /* only taken into account if filename is provided */
 #define JS_BACKTRACE_FLAG_SINGLE_LEVEL     (1 << 1)
@@ -6469,6 +7574,7 @@ static void build_backtrace(JSContext *ctx, JSValueConst error_obj,
     const char *str1;
     JSObject *p;
     BOOL backtrace_barrier;
+    int line_num1, call_line;
     
     js_dbuf_init(ctx, &dbuf);
     if (filename) {
@@ -6489,6 +7595,32 @@ static void build_backtrace(JSContext *ctx, JSValueConst error_obj,
             backtrace_flags &= ~JS_BACKTRACE_FLAG_SKIP_FIRST_LEVEL;
             continue;
         }
+        p = JS_VALUE_GET_OBJ(sf->cur_func);
+        line_num1 = -1;
+        if (js_class_has_bytecode(p->class_id)) {
+            JSFunctionBytecode *b, *b1;
+            uint32_t pc;
+
+            b = p->u.func.function_bytecode;
+            if (b->has_debug) {
+                pc = sf->cur_pc - b->byte_code_buf - 1;
+                line_num1 = find_line_num(ctx, b, pc);
+                /* the inlined function calls have their own level */
+                b1 = find_inline_func_bytecode(b, pc, &call_line);
+                if (b1) {
+                    str1 = NULL;
+                    if (b1->func_name != JS_ATOM_NULL)
+                        str1 = JS_AtomToCString(ctx, b1->func_name);
+                    dbuf_printf(&dbuf, "    at %s",
+                                str1 && str1[0] != '\0' ? str1 : "<anonymous>");
+                    JS_FreeCString(ctx, str1);
+                    dbuf_put_backtrace_pos(ctx, &dbuf, b, line_num1);
+                    dbuf_putc(&dbuf, '\n');
+                    line_num1 = call_line;
+                }
+            }
+        }
+
         func_name_str = get_func_name(ctx, sf->cur_func);
         if (!func_name_str || func_name_str[0] == '\0')
             str1 = "<anonymous>";
@@ -6497,26 +7629,14 @@ static void build_backtrace(JSContext *ctx, JSValueConst error_obj,
         dbuf_printf(&dbuf, "    at %s", str1);
         JS_FreeCString(ctx, func_name_str);
 
-        p = JS_VALUE_GET_OBJ(sf->cur_func);
         backtrace_barrier = FALSE;
         if (js_class_has_bytecode(p->class_id)) {
             JSFunctionBytecode *b;
-            const char *atom_str;
-            int line_num1;
 
             b = p->u.func.function_bytecode;
             backtrace_barrier = b->backtrace_barrier;
-            if (b->has_debug) {
-                line_num1 = find_line_num(ctx, b,
-                                          sf->cur_pc - b->byte_code_buf - 1);
-                atom_str = JS_AtomToCString(ctx, b->debug.filename);
-                dbuf_printf(&dbuf, " (%s",
-                            atom_str ? atom_str : "<null>");
-                JS_FreeCString(ctx, atom_str);
-                if (line_num1 != -1)
-                    dbuf_printf(&dbuf, ":%d", line_num1);
-                dbuf_putc(&dbuf, ')');
-            }
+            if (b->has_debug)
+                dbuf_put_backtrace_pos(ctx, &dbuf, b, line_num1);
         } else {
             dbuf_printf(&dbuf, " (native)");
         }
@@ -6550,6 +7670,443 @@ static BOOL is_backtrace_needed(JSContext *ctx, JSValueConst obj)
     return TRUE;
 }
 
+/* Allocation sampling profiler. One allocation is sampled every
+   'sample_interval' bytes (with some jitter to avoid aliasing with
+   periodic allocation patterns). The JS stack of the sampled
+   allocation is recorded together with the number of bytes it stands
+   for, so that the sum of the sample weights is an estimate of the
+   total allocated size. The sampled blocks are remembered until they
+   are freed so that the live memory can also be reported. */
+
+#define JS_ALLOC_PROFILE_MAX_DEPTH 64
+#define JS_ALLOC_PROFILE_STACK_SIZE 1024
+
+typedef struct JSAllocSite {
+    struct JSAllocSite *hash_next;
+    uint32_t hash;
+    int64_t alloc_count; /* number of samples */
+    int64_t alloc_size; /* estimated number of allocated bytes */
+    int64_t live_count;
+    int64_t live_size;
+    char stack[0]; /* folded stack, outermost frame first */
+} JSAllocSite;
+
+typedef struct JSAllocSample {
+    struct JSAllocSample *hash_next;
+    void *ptr;
+    size_t weight;
+    JSAllocSite *site;
+} JSAllocSample;
+
+struct JSAllocProfile {
+    size_t sample_interval;
+    size_t bytes_since_sample;
+    size_t next_sample;
+    uint32_t random_state;
+    BOOL in_sample : 8; /* avoid recursing */
+    int site_hash_bits;
+    int site_count;
+    JSAllocSite **site_hash;
+    int sample_hash_bits;
+    int sample_count;
+    JSAllocSample **sample_hash;
+};
+
+/* the profile data is allocated with the runtime allocator so that
+   it is accounted, but it is not itself sampled */
+static void *js_alloc_profile_malloc(JSRuntime *rt, size_t size)
+{
+    return rt->mf.js_malloc(&rt->malloc_state, size);
+}
+
+static void js_alloc_profile_free(JSRuntime *rt, void *ptr)
+{
+    rt->mf.js_free(&rt->malloc_state, ptr);
+}
+
+static void js_alloc_profile_set_next(JSAllocProfile *ap)
+{
+    uint32_t r;
+    /* xorshift32 */
+    r = ap->random_state;
+    r ^= r << 13;
+    r ^= r >> 17;
+    r ^= r << 5;
+    ap->random_state = r;
+    /* uniform in [interval / 2, 3 * interval / 2) */
+    ap->next_sample = ap->sample_interval / 2 +
+        (size_t)(((uint64_t)r * ap->sample_interval) >> 32);
+    if (ap->next_sample == 0)
+        ap->next_sample = 1;
+}
+
+static inline uint32_t js_alloc_profile_ptr_hash(const void *ptr, int bits)
+{
+    uint64_t h = (uintptr_t)ptr;
+    h *= 0x9E3779B97F4A7C15ULL;
+    return (uint32_t)(h >> (64 - bits));
+}
+
+/* grow the hash tables when their load factor reaches 1. Return
+   FALSE if not enough memory. */
+static BOOL js_alloc_profile_resize_sites(JSRuntime *rt, JSAllocProfile *ap)
+{
+    JSAllocSite **new_hash, *site, *site_next;
+    int new_bits, i;
+    uint32_t h;
+
+    if (ap->site_count < (1 << ap->site_hash_bits))
+        return TRUE;
+    new_bits = ap->site_hash_bits + 1;
+    new_hash = js_alloc_profile_malloc(rt, sizeof(new_hash[0]) << new_bits);
+    if (!new_hash)
+        return FALSE;
+    memset(new_hash, 0, sizeof(new_hash[0]) << new_bits);
+    for(i = 0; i < (1 << ap->site_hash_bits); i++) {
+        for(site = ap->site_hash[i]; site != NULL; site = site_next) {
+            site_next = site->hash_next;
+            h = site->hash & ((1 << new_bits) - 1);
+            site->hash_next = new_hash[h];
+            new_hash[h] = site;
+        }
+    }
+    js_alloc_profile_free(rt, ap->site_hash);
+    ap->site_hash = new_hash;
+    ap->site_hash_bits = new_bits;
+    return TRUE;
+}
+
+static BOOL js_alloc_profile_resize_samples(JSRuntime *rt, JSAllocProfile *ap)
+{
+    JSAllocSample **new_hash, *s, *s_next;
+    int new_bits, i;
+    uint32_t h;
+
+    if (ap->sample_count < (1 << ap->sample_hash_bits))
+        return TRUE;
+    new_bits = ap->sample_hash_bits + 1;
+    new_hash = js_alloc_profile_malloc(rt, sizeof(new_hash[0]) << new_bits);
+    if (!new_hash)
+        return FALSE;
+    memset(new_hash, 0, sizeof(new_hash[0]) << new_bits);
+    for(i = 0; i < (1 << ap->sample_hash_bits); i++) {
+        for(s = ap->sample_hash[i]; s != NULL; s = s_next) {
+            s_next = s->hash_next;
+            h = js_alloc_profile_ptr_hash(s->ptr, new_bits);
+            s->hash_next = new_hash[h];
+            new_hash[h] = s;
+        }
+    }
+    js_alloc_profile_free(rt, ap->sample_hash);
+    ap->sample_hash = new_hash;
+    ap->sample_hash_bits = new_bits;
+    return TRUE;
+}
+
+/* append the name of the function without allocating memory */
+static void js_alloc_profile_get_func_name(JSRuntime *rt, char *buf,
+                                           int buf_size, JSValueConst func)
+{
+    JSObject *p;
+    JSProperty *pr;
+    JSShapeProperty *prs;
+    JSString *str;
+    int i, c;
+
+    buf[0] = '\0';
+    if (JS_VALUE_GET_TAG(func) != JS_TAG_OBJECT)
+        return;
+    p = JS_VALUE_GET_OBJ(func);
+    if (js_class_has_bytecode(p->class_id)) {
+        JSFunctionBytecode *b = p->u.func.function_bytecode;
+        if (b->func_name != JS_ATOM_NULL) {
+            char atom_buf[ATOM_GET_STR_BUF_SIZE];
+            pstrcpy(buf, buf_size,
+                    JS_AtomGetStrRT(rt, atom_buf, sizeof(atom_buf),
+                                    b->func_name));
+        }
+        return;
+    }
+    prs = find_own_property(&pr, p, JS_ATOM_name);
+    if (!prs || (prs->flags & JS_PROP_TMASK) != JS_PROP_NORMAL ||
+        JS_VALUE_GET_TAG(pr->u.value) != JS_TAG_STRING)
+        return;
+    str = JS_VALUE_GET_STRING(pr->u.value);
+    for(i = 0; i < str->len && i < buf_size - 1; i++) {
+        c = string_get(str, i);
+        buf[i] = (c >= 0x20 && c < 0x7f) ? c : '?';
+    }
+    buf[i] = '\0';
+}
+
+/* build the folded stack of the current JS call stack in 'buf'. ';'
+   and ' ' are reserved by the folded format and are replaced. */
+/* the separators of the folded stack format are replaced in the frame
+   names */
+static void js_alloc_profile_escape(char *buf, int start, int len)
+{
+    for(; start < len; start++) {
+        if (buf[start] == ' ' || buf[start] == ';')
+            buf[start] = '_';
+    }
+}
+
+static int js_alloc_profile_get_stack(JSRuntime *rt, char *buf, int buf_size)
+{
+    JSStackFrame *frames[JS_ALLOC_PROFILE_MAX_DEPTH];
+    JSStackFrame *sf;
+    JSFunctionBytecode *b1;
+    JSAtom filename;
+    int n, i, len, start, line_num, call_line;
+    char name[64];
+    char atom_buf[ATOM_GET_STR_BUF_SIZE];
+
+    n = 0;
+    for(sf = rt->current_stack_frame; sf != NULL && n < countof(frames);
+        sf = sf->prev_frame) {
+        frames[n++] = sf;
+    }
+    len = 0;
+    buf[0] = '\0';
+    if (n == 0) {
+        pstrcpy(buf, buf_size, "<runtime>");
+        return strlen(buf);
+    }
+    for(i = n - 1; i >= 0; i--) {
+        JSObject *p;
+        sf = frames[i];
+        js_alloc_profile_get_func_name(rt, name, sizeof(name), sf->cur_func);
+        if (i != n - 1)
+            buf[len++] = ';';
+        start = len;
+        len += snprintf(buf + len, buf_size - len, "%s",
+                        name[0] != '\0' ? name : "<anonymous>");
+        if (len >= buf_size)
+            break;
+        p = JS_VALUE_GET_OBJ(sf->cur_func);
+        b1 = NULL;
+        if (js_class_has_bytecode(p->class_id)) {
+            JSFunctionBytecode *b = p->u.func.function_bytecode;
+            if (b->has_debug) {
+                uint32_t pc = sf->cur_pc - b->byte_code_buf - 1;
+                line_num = find_line_num(b->realm, b, pc);
+                b1 = find_inline_func_bytecode(b, pc, &call_line);
+                filename = b->debug.filename;
+                len += snprintf(buf + len, buf_size - len, "(%s:%d)",
+                                JS_AtomGetStrRT(rt, atom_buf, sizeof(atom_buf),
+                                                b->debug.filename),
+                                b1 ? call_line : line_num);
+            }
+        } else {
+            len += snprintf(buf + len, buf_size - len, "(native)");
+        }
+        if (len >= buf_size - 1)
+            break;
+        js_alloc_profile_escape(buf, start, len);
+        if (b1) {
+            /* the inlined function call has its own frame */
+            buf[len++] = ';';
+            start = len;
+            if (b1->func_name != JS_ATOM_NULL)
+                JS_AtomGetStrRT(rt, name, sizeof(name), b1->func_name);
+            else
+                pstrcpy(name, sizeof(name), "<anonymous>");
+            len += snprintf(buf + len, buf_size - len, "%s(%s:%d)", name,
+                            JS_AtomGetStrRT(rt, atom_buf, sizeof(atom_buf),
+                                            filename),
+                            line_num);
+            if (len >= buf_size - 1)
+                break;
+            js_alloc_profile_escape(buf, start, len);
+        }
+    }
+    if (len >= buf_size)
+        len = buf_size - 1;
+    buf[len] = '\0';
+    return len;
+}
+
+static JSAllocSite *js_alloc_profile_find_site(JSRuntime *rt)
+{
+    JSAllocProfile *ap = rt->alloc_profile;
+    char buf[JS_ALLOC_PROFILE_STACK_SIZE];
+    JSAllocSite *site;
+    uint32_t h;
+    int len;
+
+    len = js_alloc_profile_get_stack(rt, buf, sizeof(buf));
+    h = hash_string8((const uint8_t *)buf, len, 0);
+    for(site = ap->site_hash[h & ((1 << ap->site_hash_bits) - 1)];
+        site != NULL; site = site->hash_next) {
+        if (site->hash == h && !strcmp(site->stack, buf))
+            return site;
+    }
+    if (!js_alloc_profile_resize_sites(rt, ap))
+        return NULL;
+    site = js_alloc_profile_malloc(rt, sizeof(*site) + len + 1);
+    if (!site)
+        return NULL;
+    memset(site, 0, sizeof(*site));
+    site->hash = h;
+    memcpy(site->stack, buf, len + 1);
+    h &= (1 << ap->site_hash_bits) - 1;
+    site->hash_next = ap->site_hash[h];
+    ap->site_hash[h] = site;
+    ap->site_count++;
+    return site;
+}
+
+static no_inline void js_alloc_profile_on_malloc(JSRuntime *rt, void *ptr,
+                                                 size_t size)
+{
+    JSAllocProfile *ap = rt->alloc_profile;
+    JSAllocSample *s;
+    JSAllocSite *site;
+    size_t weight;
+    uint32_t h;
+
+    ap->bytes_since_sample += size;
+    if (likely(ap->bytes_since_sample < ap->next_sample) || ap->in_sample)
+        return;
+    weight = ap->bytes_since_sample;
+    ap->bytes_since_sample = 0;
+    js_alloc_profile_set_next(ap);
+
+    ap->in_sample = TRUE;
+    site = js_alloc_profile_find_site(rt);
+    if (!site)
+        goto done;
+    site->alloc_count++;
+    site->alloc_size += weight;
+    if (!js_alloc_profile_resize_samples(rt, ap))
+        goto done;
+    s = js_alloc_profile_malloc(rt, sizeof(*s));
+    if (!s)
+        goto done;
+    s->ptr = ptr;
+    s->weight = weight;
+    s->site = site;
+    h = js_alloc_profile_ptr_hash(ptr, ap->sample_hash_bits);
+    s->hash_next = ap->sample_hash[h];
+    ap->sample_hash[h] = s;
+    ap->sample_count++;
+    site->live_count++;
+    site->live_size += weight;
+ done:
+    ap->in_sample = FALSE;
+}
+
+static no_inline void js_alloc_profile_on_free(JSRuntime *rt, void *ptr)
+{
+    JSAllocProfile *ap = rt->alloc_profile;
+    JSAllocSample *s, **ps;
+
+    if (ap->sample_count == 0)
+        return;
+    ps = &ap->sample_hash[js_alloc_profile_ptr_hash(ptr, ap->sample_hash_bits)];
+    for(;;) {
+        s = *ps;
+        if (!s)
+            return;
+        if (s->ptr == ptr)
+            break;
+        ps = &s->hash_next;
+    }
+    *ps = s->hash_next;
+    ap->sample_count--;
+    s->site->live_count--;
+    s->site->live_size -= s->weight;
+    js_alloc_profile_free(rt, s);
+}
+
+static void js_alloc_profile_delete(JSRuntime *rt)
+{
+    JSAllocProfile *ap = rt->alloc_profile;
+    JSAllocSite *site, *site_next;
+    JSAllocSample *s, *s_next;
+    int i;
+
+    if (!ap)
+        return;
+    rt->alloc_profile = NULL;
+    for(i = 0; i < (1 << ap->sample_hash_bits); i++) {
+        for(s = ap->sample_hash[i]; s != NULL; s = s_next) {
+            s_next = s->hash_next;
+            js_alloc_profile_free(rt, s);
+        }
+    }
+    for(i = 0; i < (1 << ap->site_hash_bits); i++) {
+        for(site = ap->site_hash[i]; site != NULL; site = site_next) {
+            site_next = site->hash_next;
+            js_alloc_profile_free(rt, site);
+        }
+    }
+    js_alloc_profile_free(rt, ap->sample_hash);
+    js_alloc_profile_free(rt, ap->site_hash);
+    js_alloc_profile_free(rt, ap);
+}
+
+/* 'sample_interval' is the average number of allocated bytes between
+   two samples. 0 disables the profiler and discards the collected
+   samples. Return -1 if not enough memory. */
+int JS_SetAllocSampling(JSRuntime *rt, size_t sample_interval)
+{
+    JSAllocProfile *ap;
+
+    if (sample_interval == 0) {
+        js_alloc_profile_delete(rt);
+        return 0;
+    }
+    ap = rt->alloc_profile;
+    if (!ap) {
+        ap = js_alloc_profile_malloc(rt, sizeof(*ap));
+        if (!ap)
+            return -1;
+        memset(ap, 0, sizeof(*ap));
+        ap->site_hash_bits = 8;
+        ap->sample_hash_bits = 8;
+        ap->site_hash = js_alloc_profile_malloc(rt, sizeof(ap->site_hash[0]) <<
+                                                ap->site_hash_bits);
+        ap->sample_hash = js_alloc_profile_malloc(rt, sizeof(ap->sample_hash[0]) <<
+                                                  ap->sample_hash_bits);
+        if (!ap->site_hash || !ap->sample_hash) {
+            js_alloc_profile_free(rt, ap->site_hash);
+            js_alloc_profile_free(rt, ap->sample_hash);
+            js_alloc_profile_free(rt, ap);
+            return -1;
+        }
+        memset(ap->site_hash, 0, sizeof(ap->site_hash[0]) << ap->site_hash_bits);
+        memset(ap->sample_hash, 0, sizeof(ap->sample_hash[0]) << ap->sample_hash_bits);
+        ap->random_state = 0x2545f491;
+        rt->alloc_profile = ap;
+    }
+    ap->sample_interval = sample_interval;
+    js_alloc_profile_set_next(ap);
+    return 0;
+}
+
+/* Output the profile in the folded stack format ("frame1;frame2 value"
+   per line) which can be converted to a flame graph or to the pprof
+   format. If 'live_only' is TRUE, only the sampled allocations which
+   are not freed yet are reported. */
+void JS_DumpAllocProfile(JSRuntime *rt, FILE *fp, BOOL live_only)
+{
+    JSAllocProfile *ap = rt->alloc_profile;
+    JSAllocSite *site;
+    int64_t size;
+    int i;
+
+    if (!ap)
+        return;
+    for(i = 0; i < (1 << ap->site_hash_bits); i++) {
+        for(site = ap->site_hash[i]; site != NULL; site = site->hash_next) {
+            size = live_only ? site->live_size : site->alloc_size;
+            if (size > 0)
+                fprintf(fp, "%s %" PRId64 "\n", site->stack, size);
+        }
+    }
+}
+
 JSValue JS_NewError(JSContext *ctx)
 {
     return JS_NewObjectClass(ctx, JS_CLASS_ERROR);
@@ -6883,6 +8440,7 @@ static JSValueConst JS_GetPrototypePrimitive(JSContext *ctx, JSValueConst val)
         val = ctx->class_proto[JS_CLASS_BOOLEAN];
         break;
     case JS_TAG_STRING:
+    case JS_TAG_STRING_ROPE:
         val = ctx->class_proto[JS_CLASS_STRING];
         break;
     case JS_TAG_SYMBOL:
@@ -7034,6 +8592,7 @@ static JSAutoInitFunc *js_autoinit_func_table[] = {
     js_instantiate_prototype, /* JS_AUTOINIT_ID_PROTOTYPE */
     js_module_ns_autoinit, /* JS_AUTOINIT_ID_MODULE_NS */
     JS_InstantiateFunctionListItem2, /* JS_AUTOINIT_ID_PROP */
+    js_intrinsic_autoinit, /* JS_AUTOINIT_ID_INTRINSIC */
 };
 
 /* warning: 'prs' is reallocated after it */
@@ -7096,6 +8655,35 @@ JSValue JS_GetPropertyInternal(JSContext *ctx, JSValueConst obj,
                 }
             }
             break;
+        case JS_TAG_STRING_ROPE:
+            if (__JS_AtomIsTaggedInt(prop)) {
+                JSStringRope *r = JS_VALUE_GET_STRING_ROPE(obj);
+                JSValue str, ret;
+                if (r->depth == 0) {
+                    JSString *p1 = JS_VALUE_GET_STRING(r->left);
+                    uint32_t idx, ch;
+                    idx = __JS_AtomToUInt32(prop);
+                    if (idx < r->len) {
+                        idx += r->start;
+                        if (p1->is_wide_char)
+                            ch = p1->u.str16[idx];
+                        else
+                            ch = p1->u.str8[idx];
+                        return js_new_string_char(ctx, ch);
+                    }
+                    break;
+                }
+                str = js_linearize_string_rope(ctx, obj);
+                if (JS_IsException(str))
+                    return JS_EXCEPTION;
+                ret = JS_GetPropertyInternal(ctx, str, prop, this_obj,
+                                             throw_ref_error);
+                JS_FreeValue(ctx, str);
+                return ret;
+            } else if (prop == JS_ATOM_length) {
+                return JS_NewInt32(ctx, JS_VALUE_GET_STRING_ROPE(obj)->len);
+            }
+            break;
         default:
             break;
         }
@@ -9279,6 +10867,26 @@ static int JS_DefineAutoInitProperty(JSContext *ctx, JSValueConst this_obj,
     return TRUE;
 }
 
+/* define the global constructor 'name' of the lazy intrinsic 'id'. It
+   is stored in ctx->intrinsic_ctor[ctor_idx] when the intrinsic is
+   instantiated. */
+static void js_define_intrinsic_ctor(JSContext *ctx, JSAtom name,
+                                     JSIntrinsicEnum id, int ctor_idx)
+{
+    JS_DefineAutoInitProperty(ctx, ctx->global_obj, name,
+                              JS_AUTOINIT_ID_INTRINSIC,
+                              (void *)(uintptr_t)((id << 8) | ctor_idx),
+                              JS_PROP_WRITABLE | JS_PROP_CONFIGURABLE);
+}
+
+static JSValue js_intrinsic_autoinit(JSContext *ctx, JSObject *p, JSAtom atom,
+                                     void *opaque)
+{
+    uintptr_t v = (uintptr_t)opaque;
+    js_instantiate_intrinsic(ctx, v >> 8);
+    return JS_DupValue(ctx, ctx->intrinsic_ctor[v & 0xff]);
+}
+
 /* shortcut to add or redefine a new property value */
 int JS_DefinePropertyValue(JSContext *ctx, JSValueConst this_obj,
                            JSAtom prop, JSValue val, int flags)
@@ -9900,6 +11508,12 @@ static int JS_ToBoolFree(JSContext *ctx, JSValue val)
             JS_FreeValue(ctx, val);
             return ret;
         }
+    case JS_TAG_STRING_ROPE:
+        {
+            BOOL ret = JS_VALUE_GET_STRING_ROPE(val)->len != 0;
+            JS_FreeValue(ctx, val);
+            return ret;
+        }
 #ifdef CONFIG_BIGNUM
     case JS_TAG_BIG_INT:
     case JS_TAG_BIG_FLOAT:
@@ -10421,6 +12035,7 @@ static JSValue JS_ToNumberHintFree(JSContext *ctx, JSValue val,
             return JS_EXCEPTION;
         goto redo;
     case JS_TAG_STRING:
+    case JS_TAG_STRING_ROPE:
         {
             const char *str;
             const char *p;
@@ -11514,6 +13129,8 @@ JSValue JS_ToStringInternal(JSContext *ctx, JSValueConst val, BOOL is_ToProperty
     switch(tag) {
     case JS_TAG_STRING:
         return JS_DupValue(ctx, val);
+    case JS_TAG_STRING_ROPE:
+        return js_linearize_string_rope(ctx, val);
     case JS_TAG_INT:
         snprintf(buf, sizeof(buf), "%d", JS_VALUE_GET_INT(val));
         str = buf;
@@ -11882,6 +13499,15 @@ static __maybe_unused void JS_DumpValueShort(JSRuntime *rt,
             JS_DumpString(rt, p);
         }
         break;
+    case JS_TAG_STRING_ROPE:
+        {
+            JSStringRope *r = JS_VALUE_GET_STRING_ROPE(val);
+            if (r->depth == 0)
+                printf("[slice len=%u start=%u]", r->len, r->start);
+            else
+                printf("[rope len=%u depth=%d]", r->len, r->depth);
+        }
+        break;
     case JS_TAG_FUNCTION_BYTECODE:
         {
             JSFunctionBytecode *b = JS_VALUE_GET_PTR(val);
@@ -12157,6 +13783,7 @@ static bf_t *JS_ToBigIntFree(JSContext *ctx, bf_t *buf, JSValue val)
         JS_FreeValue(ctx, val);
         break;
     case JS_TAG_STRING:
+    case JS_TAG_STRING_ROPE:
         val = JS_StringToBigIntErr(ctx, val);
         if (JS_IsException(val))
             return NULL;
@@ -13441,10 +15068,10 @@ static no_inline __exception int js_add_slow(JSContext *ctx, JSValue *sp)
         /* try to call an overloaded operator */
         if ((tag1 == JS_TAG_OBJECT &&
              (tag2 != JS_TAG_NULL && tag2 != JS_TAG_UNDEFINED &&
-              tag2 != JS_TAG_STRING)) ||
+              !tag_is_string(tag2))) ||
             (tag2 == JS_TAG_OBJECT &&
              (tag1 != JS_TAG_NULL && tag1 != JS_TAG_UNDEFINED &&
-              tag1 != JS_TAG_STRING))) {
+              !tag_is_string(tag1)))) {
             ret = js_call_binary_op_fallback(ctx, &res, op1, op2, OP_add,
                                              FALSE, HINT_NONE);
             if (ret != 0) {
@@ -13474,7 +15101,7 @@ static no_inline __exception int js_add_slow(JSContext *ctx, JSValue *sp)
         tag2 = JS_VALUE_GET_NORM_TAG(op2);
     }
 
-    if (tag1 == JS_TAG_STRING || tag2 == JS_TAG_STRING) {
+    if (tag_is_string(tag1) || tag_is_string(tag2)) {
         sp[-2] = JS_ConcatString(ctx, op1, op2);
         if (JS_IsException(sp[-2]))
             goto exception;
@@ -13760,11 +15387,13 @@ static no_inline int js_relational_slow(JSContext *ctx, JSValue *sp,
     tag1 = JS_VALUE_GET_NORM_TAG(op1);
     tag2 = JS_VALUE_GET_NORM_TAG(op2);
 
-    if (tag1 == JS_TAG_STRING && tag2 == JS_TAG_STRING) {
-        JSString *p1, *p2;
-        p1 = JS_VALUE_GET_STRING(op1);
-        p2 = JS_VALUE_GET_STRING(op2);
-        res = js_string_compare(ctx, p1, p2);
+    if (tag_is_string(tag1) && tag_is_string(tag2)) {
+        if (tag1 == JS_TAG_STRING && tag2 == JS_TAG_STRING) {
+            res = js_string_compare(ctx, JS_VALUE_GET_STRING(op1),
+                                    JS_VALUE_GET_STRING(op2));
+        } else {
+            res = js_string_rope_compare(op1, op2);
+        }
         switch(op) {
         case OP_lt:
             res = (res < 0);
@@ -13787,15 +15416,15 @@ static no_inline int js_relational_slow(JSContext *ctx, JSValue *sp,
         /* fast path for float64/int */
         goto float64_compare;
     } else {
-        if (((tag1 == JS_TAG_BIG_INT && tag2 == JS_TAG_STRING) ||
-             (tag2 == JS_TAG_BIG_INT && tag1 == JS_TAG_STRING)) &&
+        if (((tag1 == JS_TAG_BIG_INT && tag_is_string(tag2)) ||
+             (tag2 == JS_TAG_BIG_INT && tag_is_string(tag1))) &&
             !is_math_mode(ctx)) {
-            if (tag1 == JS_TAG_STRING) {
+            if (tag_is_string(tag1)) {
                 op1 = JS_StringToBigInt(ctx, op1);
                 if (JS_VALUE_GET_TAG(op1) != JS_TAG_BIG_INT)
                     goto invalid_bigint_string;
             }
-            if (tag2 == JS_TAG_STRING) {
+            if (tag_is_string(tag2)) {
                 op2 = JS_StringToBigInt(ctx, op2);
                 if (JS_VALUE_GET_TAG(op2) != JS_TAG_BIG_INT) {
                 invalid_bigint_string:
@@ -13925,7 +15554,7 @@ static no_inline __exception int js_eq_slow(JSContext *ctx, JSValue *sp,
             if (res < 0)
                 goto exception;
         }
-    } else if (tag1 == tag2) {
+    } else if (tag1 == tag2 || (tag_is_string(tag1) && tag_is_string(tag2))) {
         if (tag1 == JS_TAG_OBJECT) {
             /* try the fallback operator */
             res = js_call_binary_op_fallback(ctx, &ret, op1, op2,
@@ -13946,17 +15575,17 @@ static no_inline __exception int js_eq_slow(JSContext *ctx, JSValue *sp,
     } else if ((tag1 == JS_TAG_NULL && tag2 == JS_TAG_UNDEFINED) ||
                (tag2 == JS_TAG_NULL && tag1 == JS_TAG_UNDEFINED)) {
         res = TRUE;
-    } else if ((tag1 == JS_TAG_STRING && tag_is_number(tag2)) ||
-               (tag2 == JS_TAG_STRING && tag_is_number(tag1))) {
+    } else if ((tag_is_string(tag1) && tag_is_number(tag2)) ||
+               (tag_is_string(tag2) && tag_is_number(tag1))) {
 
         if ((tag1 == JS_TAG_BIG_INT || tag2 == JS_TAG_BIG_INT) &&
             !is_math_mode(ctx)) {
-            if (tag1 == JS_TAG_STRING) {
+            if (tag_is_string(tag1)) {
                 op1 = JS_StringToBigInt(ctx, op1);
                 if (JS_VALUE_GET_TAG(op1) != JS_TAG_BIG_INT)
                     goto invalid_bigint_string;
             }
-            if (tag2 == JS_TAG_STRING) {
+            if (tag_is_string(tag2)) {
                 op2 = JS_StringToBigInt(ctx, op2);
                 if (JS_VALUE_GET_TAG(op2) != JS_TAG_BIG_INT) {
                 invalid_bigint_string:
@@ -13986,9 +15615,9 @@ static no_inline __exception int js_eq_slow(JSContext *ctx, JSValue *sp,
         op2 = JS_NewInt32(ctx, JS_VALUE_GET_INT(op2));
         goto redo;
     } else if ((tag1 == JS_TAG_OBJECT &&
-                (tag_is_number(tag2) || tag2 == JS_TAG_STRING || tag2 == JS_TAG_SYMBOL)) ||
+                (tag_is_number(tag2) || tag_is_string(tag2) || tag2 == JS_TAG_SYMBOL)) ||
                (tag2 == JS_TAG_OBJECT &&
-                (tag_is_number(tag1) || tag1 == JS_TAG_STRING || tag1 == JS_TAG_SYMBOL))) {
+                (tag_is_number(tag1) || tag_is_string(tag1) || tag1 == JS_TAG_SYMBOL))) {
 
         /* try the fallback operator */
         res = js_call_binary_op_fallback(ctx, &ret, op1, op2,
@@ -14273,7 +15902,7 @@ static no_inline __exception int js_add_slow(JSContext *ctx, JSValue *sp)
         }
         tag1 = JS_VALUE_GET_TAG(op1);
         tag2 = JS_VALUE_GET_TAG(op2);
-        if (tag1 == JS_TAG_STRING || tag2 == JS_TAG_STRING) {
+        if (tag_is_string(tag1) || tag_is_string(tag2)) {
             sp[-2] = JS_ConcatString(ctx, op1, op2);
             if (JS_IsException(sp[-2]))
                 goto exception;
@@ -14368,12 +15997,15 @@ static no_inline int js_relational_slow(JSContext *ctx, JSValue *sp,
         JS_FreeValue(ctx, op1);
         goto exception;
     }
-    if (JS_VALUE_GET_TAG(op1) == JS_TAG_STRING &&
-        JS_VALUE_GET_TAG(op2) == JS_TAG_STRING) {
-        JSString *p1, *p2;
-        p1 = JS_VALUE_GET_STRING(op1);
-        p2 = JS_VALUE_GET_STRING(op2);
-        res = js_string_compare(ctx, p1, p2);
+    if (tag_is_string(JS_VALUE_GET_TAG(op1)) &&
+        tag_is_string(JS_VALUE_GET_TAG(op2))) {
+        if (JS_VALUE_GET_TAG(op1) == JS_TAG_STRING &&
+            JS_VALUE_GET_TAG(op2) == JS_TAG_STRING) {
+            res = js_string_compare(ctx, JS_VALUE_GET_STRING(op1),
+                                    JS_VALUE_GET_STRING(op2));
+        } else {
+            res = js_string_rope_compare(op1, op2);
+        }
         JS_FreeValue(ctx, op1);
         JS_FreeValue(ctx, op2);
         switch(op) {
@@ -14437,15 +16069,16 @@ static no_inline __exception int js_eq_slow(JSContext *ctx, JSValue *sp,
     tag2 = JS_VALUE_GET_NORM_TAG(op2);
     if (tag1 == tag2 ||
         (tag1 == JS_TAG_INT && tag2 == JS_TAG_FLOAT64) ||
-        (tag2 == JS_TAG_INT && tag1 == JS_TAG_FLOAT64)) {
+        (tag2 == JS_TAG_INT && tag1 == JS_TAG_FLOAT64) ||
+        (tag_is_string(tag1) && tag_is_string(tag2))) {
         res = js_strict_eq(ctx, op1, op2);
     } else if ((tag1 == JS_TAG_NULL && tag2 == JS_TAG_UNDEFINED) ||
                (tag2 == JS_TAG_NULL && tag1 == JS_TAG_UNDEFINED)) {
         res = TRUE;
-    } else if ((tag1 == JS_TAG_STRING && (tag2 == JS_TAG_INT ||
-                                   tag2 == JS_TAG_FLOAT64)) ||
-        (tag2 == JS_TAG_STRING && (tag1 == JS_TAG_INT ||
-                                   tag1 == JS_TAG_FLOAT64))) {
+    } else if ((tag_is_string(tag1) && (tag2 == JS_TAG_INT ||
+                                        tag2 == JS_TAG_FLOAT64)) ||
+        (tag_is_string(tag2) && (tag1 == JS_TAG_INT ||
+                                 tag1 == JS_TAG_FLOAT64))) {
         double d1;
         double d2;
         if (JS_ToFloat64Free(ctx, &d1, op1)) {
@@ -14462,7 +16095,7 @@ static no_inline __exception int js_eq_slow(JSContext *ctx, JSValue *sp,
         op2 = JS_NewInt32(ctx, JS_VALUE_GET_INT(op2));
         goto redo;
     } else if (tag1 == JS_TAG_OBJECT &&
-               (tag2 == JS_TAG_INT || tag2 == JS_TAG_FLOAT64 || tag2 == JS_TAG_STRING || tag2 == JS_TAG_SYMBOL)) {
+               (tag2 == JS_TAG_INT || tag2 == JS_TAG_FLOAT64 || tag_is_string(tag2) || tag2 == JS_TAG_SYMBOL)) {
         op1 = JS_ToPrimitiveFree(ctx, op1, HINT_NONE);
         if (JS_IsException(op1)) {
             JS_FreeValue(ctx, op2);
@@ -14470,7 +16103,7 @@ static no_inline __exception int js_eq_slow(JSContext *ctx, JSValue *sp,
         }
         goto redo;
     } else if (tag2 == JS_TAG_OBJECT &&
-               (tag1 == JS_TAG_INT || tag1 == JS_TAG_FLOAT64 || tag1 == JS_TAG_STRING || tag1 == JS_TAG_SYMBOL)) {
+               (tag1 == JS_TAG_INT || tag1 == JS_TAG_FLOAT64 || tag_is_string(tag1) || tag1 == JS_TAG_SYMBOL)) {
         op2 = JS_ToPrimitiveFree(ctx, op2, HINT_NONE);
         if (JS_IsException(op2)) {
             JS_FreeValue(ctx, op1);
@@ -14546,14 +16179,17 @@ static BOOL js_strict_eq2(JSContext *ctx, JSValue op1, JSValue op2,
         res = (tag1 == tag2);
         break;
     case JS_TAG_STRING:
+    case JS_TAG_STRING_ROPE:
         {
             JSString *p1, *p2;
-            if (tag1 != tag2) {
+            if (!tag_is_string(tag2)) {
                 res = FALSE;
-            } else {
+            } else if (tag1 == JS_TAG_STRING && tag2 == JS_TAG_STRING) {
                 p1 = JS_VALUE_GET_STRING(op1);
                 p2 = JS_VALUE_GET_STRING(op2);
                 res = (js_string_compare(ctx, p1, p2) == 0);
+            } else {
+                res = js_string_rope_eq(op1, op2);
             }
         }
         break;
@@ -14798,6 +16434,7 @@ static __exception int js_operator_typeof(JSContext *ctx, JSValueConst op1)
         atom = JS_ATOM_boolean;
         break;
     case JS_TAG_STRING:
+    case JS_TAG_STRING_ROPE:
         atom = JS_ATOM_string;
         break;
     case JS_TAG_OBJECT:
@@ -14871,6 +16508,8 @@ static JSValue js_function_proto_fileName(JSContext *ctx,
 {
     JSFunctionBytecode *b = JS_GetFunctionBytecode(this_val);
     if (b && b->has_debug) {
+        if (b->lazy && b->lazy->image && js_function_bytecode_read(b))
+            return JS_EXCEPTION;
         return JS_AtomToString(ctx, b->debug.filename);
     }
     return JS_UNDEFINED;
@@ -14881,6 +16520,8 @@ static JSValue js_function_proto_lineNumber(JSContext *ctx,
 {
     JSFunctionBytecode *b = JS_GetFunctionBytecode(this_val);
     if (b && b->has_debug) {
+        if (b->lazy && b->lazy->image && js_function_bytecode_read(b))
+            return JS_EXCEPTION;
         return JS_NewInt32(ctx, b->debug.line_num);
     }
     return JS_UNDEFINED;
@@ -15348,13 +16989,75 @@ static int JS_IteratorClose(JSContext *ctx, JSValueConst enum_obj,
     return res;
 }
 
-/* obj -> enum_rec (3 slots) */
+static JSValue js_array_iterator_next(JSContext *ctx, JSValueConst this_val,
+                                      int argc, JSValueConst *argv,
+                                      BOOL *pdone, int magic);
+
+static JSValue js_create_array_iterator(JSContext *ctx, JSValueConst this_val,
+                                        int argc, JSValueConst *argv, int magic);
+
+/* return TRUE if the 'next' method of the array iterators is the
+   built-in one */
+static BOOL js_array_iterator_next_is_builtin(JSContext *ctx)
+{
+    JSShapeProperty *prs;
+    JSProperty *pr;
+    JSObject *p;
+
+    p = JS_VALUE_GET_OBJ(ctx->class_proto[JS_CLASS_ARRAY_ITERATOR]);
+    prs = find_own_property(&pr, p, JS_ATOM_next);
+    return prs && (prs->flags & JS_PROP_TMASK) == JS_PROP_NORMAL &&
+        JS_IsCFunction(ctx, pr->u.value,
+                       (JSCFunction *)js_array_iterator_next, 0);
+}
+
+/* return TRUE if closing an array iterator may call a 'return' method */
+static BOOL js_array_iterator_has_return(JSContext *ctx)
+{
+    JSProperty *pr;
+    JSObject *p;
+
+    p = JS_VALUE_GET_OBJ(ctx->class_proto[JS_CLASS_ARRAY_ITERATOR]);
+    while (p != NULL) {
+        if (p->is_exotic || find_own_property(&pr, p, JS_ATOM_return))
+            return TRUE;
+        p = p->shape->proto;
+    }
+    return FALSE;
+}
+
+/* obj -> enum_rec (3 slots). If 'allow_array' is TRUE and 'obj' is
+   an array using the default iterator, no iterator object is
+   created: the enum_rec contains the array and the current index
+   stored as JS_TAG_UNINITIALIZED instead of the 'next' method. Only
+   js_for_of_next() and js_for_of_close() accept such enum_rec. */
 static __exception int js_for_of_start(JSContext *ctx, JSValue *sp,
-                                       BOOL is_async)
+                                       BOOL is_async, BOOL allow_array)
 {
     JSValue op1, obj, method;
     op1 = sp[-1];
-    obj = JS_GetIterator(ctx, op1, is_async);
+    if (allow_array && JS_VALUE_GET_TAG(op1) == JS_TAG_OBJECT &&
+        JS_VALUE_GET_OBJ(op1)->class_id == JS_CLASS_ARRAY) {
+        method = JS_GetProperty(ctx, op1, JS_ATOM_Symbol_iterator);
+        if (JS_IsException(method))
+            return -1;
+        if (JS_IsCFunction(ctx, method, (JSCFunction *)js_create_array_iterator,
+                           JS_ITERATOR_KIND_VALUE) &&
+            js_array_iterator_next_is_builtin(ctx)) {
+            JS_FreeValue(ctx, method);
+            sp[0] = JS_MKVAL(JS_TAG_UNINITIALIZED, 0);
+            return 0;
+        }
+        if (!JS_IsFunction(ctx, method)) {
+            JS_FreeValue(ctx, method);
+            JS_ThrowTypeError(ctx, "value is not iterable");
+            return -1;
+        }
+        obj = JS_GetIterator2(ctx, op1, method);
+        JS_FreeValue(ctx, method);
+    } else {
+        obj = JS_GetIterator(ctx, op1, is_async);
+    }
     if (JS_IsException(obj))
         return -1;
     JS_FreeValue(ctx, op1);
@@ -15376,6 +17079,32 @@ static __exception int js_for_of_next(JSContext *ctx, JSValue *sp, int offset)
     int done = 1;
 
     if (likely(!JS_IsUndefined(sp[offset]))) {
+        if (JS_VALUE_GET_TAG(sp[offset + 1]) == JS_TAG_UNINITIALIZED) {
+            /* array iterated without iterator object */
+            JSObject *p = JS_VALUE_GET_OBJ(sp[offset]);
+            uint32_t idx, len;
+            idx = JS_VALUE_GET_INT(sp[offset + 1]);
+            if (p->fast_array && idx < p->u.array.count) {
+                value = JS_DupValue(ctx, p->u.array.u.values[idx]);
+                done = 0;
+            } else {
+                if (js_get_length32(ctx, &len, sp[offset]))
+                    goto exception;
+                if (idx < len) {
+                    value = JS_GetPropertyUint32(ctx, sp[offset], idx);
+                    if (JS_IsException(value))
+                        goto exception;
+                    done = 0;
+                }
+            }
+            if (done) {
+                JS_FreeValue(ctx, sp[offset]);
+                sp[offset] = JS_UNDEFINED;
+            } else {
+                sp[offset + 1] = JS_MKVAL(JS_TAG_UNINITIALIZED, idx + 1);
+            }
+            goto done;
+        }
         value = JS_IteratorNext(ctx, sp[offset], sp[offset + 1], 0, NULL, &done);
         if (JS_IsException(value))
             done = -1;
@@ -15392,9 +17121,39 @@ static __exception int js_for_of_next(JSContext *ctx, JSValue *sp, int offset)
             }
         }
     }
+ done:
     sp[0] = value;
     sp[1] = JS_NewBool(ctx, done);
     return 0;
+ exception:
+    JS_FreeValue(ctx, sp[offset]);
+    sp[offset] = JS_UNDEFINED;
+    return -1;
+}
+
+/* close the enum_rec 'enum_obj method' created by js_for_of_start() */
+static int js_for_of_close(JSContext *ctx, JSValueConst enum_obj,
+                           JSValueConst method, BOOL is_exception_pending)
+{
+    JSArrayIteratorData *it;
+    JSValue iter;
+    int ret;
+
+    if (JS_VALUE_GET_TAG(method) != JS_TAG_UNINITIALIZED)
+        return JS_IteratorClose(ctx, enum_obj, is_exception_pending);
+    /* array iterated without iterator object: the iterator is only
+       created if its 'return' method may be observed */
+    if (!js_array_iterator_has_return(ctx))
+        return is_exception_pending ? -1 : 0;
+    iter = js_create_array_iterator(ctx, enum_obj, 0, NULL,
+                                    JS_ITERATOR_KIND_VALUE);
+    if (JS_IsException(iter))
+        return -1;
+    it = JS_GetOpaque(iter, JS_CLASS_ARRAY_ITERATOR);
+    it->idx = JS_VALUE_GET_INT(method);
+    ret = JS_IteratorClose(ctx, iter, is_exception_pending);
+    JS_FreeValue(ctx, iter);
+    return ret;
 }
 
 static JSValue JS_IteratorGetCompleteValue(JSContext *ctx, JSValueConst obj,
@@ -15457,13 +17216,6 @@ static JSValue js_create_iterator_result(JSContext *ctx,
     return obj;
 }
 
-static JSValue js_array_iterator_next(JSContext *ctx, JSValueConst this_val,
-                                      int argc, JSValueConst *argv,
-                                      BOOL *pdone, int magic);
-
-static JSValue js_create_array_iterator(JSContext *ctx, JSValueConst this_val,
-                                        int argc, JSValueConst *argv, int magic);
-
 static BOOL js_is_fast_array(JSContext *ctx, JSValueConst obj)
 {
     /* Try and handle fast arrays explicitly */
@@ -15631,33 +17383,51 @@ static JSValueConst JS_GetActiveFunction(JSContext *ctx)
     return ctx->rt->current_stack_frame->cur_func;
 }
 
-static JSVarRef *get_var_ref(JSContext *ctx, JSStackFrame *sf,
-                             int var_idx, BOOL is_arg)
+/* return the existing reference to a variable of the stack frame or NULL */
+static JSVarRef *find_var_ref(JSStackFrame *sf, int var_idx, BOOL is_arg)
 {
     JSVarRef *var_ref;
     struct list_head *el;
 
     list_for_each(el, &sf->var_ref_list) {
         var_ref = list_entry(el, JSVarRef, header.link);
-        if (var_ref->var_idx == var_idx && var_ref->is_arg == is_arg) {
-            var_ref->header.ref_count++;
+        if (var_ref->var_idx == var_idx && var_ref->is_arg == is_arg)
             return var_ref;
-        }
     }
-    /* create a new one */
-    var_ref = js_malloc(ctx, sizeof(JSVarRef));
-    if (!var_ref)
-        return NULL;
+    return NULL;
+}
+
+static void init_var_ref(JSStackFrame *sf, JSVarRef *var_ref,
+                         int var_idx, BOOL is_arg, JSVarRefBlock *block)
+{
     var_ref->header.ref_count = 1;
     var_ref->is_detached = FALSE;
     var_ref->is_arg = is_arg;
     var_ref->var_idx = var_idx;
+    var_ref->block = block;
     list_add_tail(&var_ref->header.link, &sf->var_ref_list);
     if (is_arg)
         var_ref->pvalue = &sf->arg_buf[var_idx];
     else
         var_ref->pvalue = &sf->var_buf[var_idx];
     var_ref->value = JS_UNDEFINED;
+}
+
+static JSVarRef *get_var_ref(JSContext *ctx, JSStackFrame *sf,
+                             int var_idx, BOOL is_arg)
+{
+    JSVarRef *var_ref;
+
+    var_ref = find_var_ref(sf, var_idx, is_arg);
+    if (var_ref) {
+        var_ref->header.ref_count++;
+        return var_ref;
+    }
+    /* create a new one */
+    var_ref = js_malloc(ctx, sizeof(JSVarRef));
+    if (!var_ref)
+        return NULL;
+    init_var_ref(sf, var_ref, var_idx, is_arg, NULL);
     return var_ref;
 }
 
@@ -15668,7 +17438,8 @@ static JSValue js_closure2(JSContext *ctx, JSValue func_obj,
 {
     JSObject *p;
     JSVarRef **var_refs;
-    int i;
+    JSVarRefBlock *block;
+    int i, new_count;
 
     p = JS_VALUE_GET_OBJ(func_obj);
     p->u.func.function_bytecode = b;
@@ -15679,20 +17450,46 @@ static JSValue js_closure2(JSContext *ctx, JSValue func_obj,
         if (!var_refs)
             goto fail;
         p->u.func.var_refs = var_refs;
+        new_count = 0;
         for(i = 0; i < b->closure_var_count; i++) {
             JSClosureVar *cv = &b->closure_var[i];
             JSVarRef *var_ref;
             if (cv->is_local) {
                 /* reuse the existing variable reference if it already exists */
-                var_ref = get_var_ref(ctx, sf, cv->var_idx, cv->is_arg);
-                if (!var_ref)
-                    goto fail;
+                var_ref = find_var_ref(sf, cv->var_idx, cv->is_arg);
+                if (!var_ref) {
+                    new_count++;
+                    continue;
+                }
             } else {
                 var_ref = cur_var_refs[cv->var_idx];
-                var_ref->header.ref_count++;
             }
+            var_ref->header.ref_count++;
             var_refs[i] = var_ref;
         }
+        if (new_count != 0) {
+            /* allocate the new variable references at once */
+            block = js_malloc(ctx, sizeof(JSVarRefBlock) +
+                              sizeof(JSVarRef) * new_count);
+            if (!block)
+                goto fail;
+            block->ref_count = 0;
+            for(i = 0; i < b->closure_var_count; i++) {
+                JSClosureVar *cv = &b->closure_var[i];
+                JSVarRef *var_ref;
+                if (var_refs[i])
+                    continue;
+                /* the same variable may be referenced twice */
+                var_ref = find_var_ref(sf, cv->var_idx, cv->is_arg);
+                if (var_ref) {
+                    var_ref->header.ref_count++;
+                } else {
+                    var_ref = &block->var_refs[block->ref_count++];
+                    init_var_ref(sf, var_ref, cv->var_idx, cv->is_arg, block);
+                }
+                var_refs[i] = var_ref;
+            }
+        }
     }
     return func_obj;
  fail:
@@ -15947,7 +17744,10 @@ static JSValue js_call_c_function(JSContext *ctx, JSValueConst func_obj,
     prev_sf = rt->current_stack_frame;
     sf->prev_frame = prev_sf;
     rt->current_stack_frame = sf;
-    ctx = p->u.cfunc.realm; /* change the current realm */
+    /* change the current realm, except for the functions of a shared
+       context which run in the realm of their caller */
+    if (likely(!p->u.cfunc.realm->shared_intrinsics))
+        ctx = p->u.cfunc.realm;
     
 #ifdef CONFIG_BIGNUM
     /* we only propagate the bignum mode as some runtime functions
@@ -16110,6 +17910,107 @@ typedef enum {
 #define FUNC_RET_YIELD      1
 #define FUNC_RET_YIELD_STAR 2
 
+/* return the atom operand at 'pc' in the bytecode of 'b' */
+static inline JSAtom get_bc_atom(const JSFunctionBytecode *b,
+                                 const uint8_t *pc)
+{
+    JSAtom atom = get_u32(pc);
+    if (unlikely(b->atom_map != NULL) && !__JS_AtomIsTaggedInt(atom))
+        atom = b->atom_map->atoms[atom];
+    return atom;
+}
+
+/* create the arguments object of type 'type' (OP_SPECIAL_OBJECT_x)
+   after the start of the function (see optimize_arguments()). The
+   'arg_count' first arguments are in 'arg_buf', the next ones in
+   'argv'. */
+static JSValue js_build_lazy_arguments(JSContext *ctx, int type,
+                                       int argc, JSValueConst *argv,
+                                       JSStackFrame *sf, int arg_count)
+{
+    if (type == OP_SPECIAL_OBJECT_MAPPED_ARGUMENTS) {
+        return js_build_mapped_arguments(ctx, argc, argv, sf,
+                                         min_int(argc, arg_count));
+    } else {
+        return js_build_arguments(ctx, argc, argv);
+    }
+}
+
+/* call 'func' with the arguments of the current function as
+   'apply_func.call(func, this_obj, arguments)' does. A stack frame
+   is added for 'apply_func' so that the backtraces are the same. */
+static JSValue js_call_with_arguments(JSContext *ctx, JSValueConst apply_func,
+                                      JSValueConst func, JSValueConst this_obj,
+                                      int argc, JSValueConst *argv,
+                                      JSValueConst *arg_buf, int arg_count)
+{
+    JSRuntime *rt = ctx->rt;
+    JSStackFrame sf_s, *sf = &sf_s;
+    JSValueConst *tab;
+    JSValue ret;
+    int i;
+
+    tab = arg_buf;
+    if (argc > arg_count && arg_buf != argv) {
+        /* the arguments were partially copied to 'arg_buf' */
+        tab = js_malloc(ctx, sizeof(tab[0]) * argc);
+        if (!tab)
+            return JS_EXCEPTION;
+        for(i = 0; i < arg_count; i++)
+            tab[i] = arg_buf[i];
+        for(; i < argc; i++)
+            tab[i] = argv[i];
+    }
+
+    sf->prev_frame = rt->current_stack_frame;
+#ifdef CONFIG_BIGNUM
+    sf->js_mode = sf->prev_frame->js_mode & JS_MODE_MATH;
+#else
+    sf->js_mode = 0;
+#endif
+    sf->cur_func = apply_func;
+    sf->arg_count = 0;
+    sf->arg_buf = NULL;
+    rt->current_stack_frame = sf;
+    ret = JS_Call(ctx, func, this_obj, argc, tab);
+    rt->current_stack_frame = sf->prev_frame;
+
+    if (tab != arg_buf)
+        js_free(ctx, tab);
+    return ret;
+}
+
+/* return the index of the local variable assigned by the instruction
+   at 'pc' or -1 if it does not assign a local variable */
+static int js_get_put_loc_idx(const uint8_t *pc)
+{
+    if (*pc == OP_dup)
+        pc++;
+    switch(*pc) {
+    case OP_put_loc:
+    case OP_set_loc:
+    case OP_put_loc_check:
+        return get_u16(pc + 1);
+#if SHORT_OPCODES
+    case OP_put_loc8:
+    case OP_set_loc8:
+        return pc[1];
+    case OP_put_loc0:
+    case OP_put_loc1:
+    case OP_put_loc2:
+    case OP_put_loc3:
+        return *pc - OP_put_loc0;
+    case OP_set_loc0:
+    case OP_set_loc1:
+    case OP_set_loc2:
+    case OP_set_loc3:
+        return *pc - OP_set_loc0;
+#endif
+    default:
+        return -1;
+    }
+}
+
 /* argv[] is modified if (flags & JS_CALL_FLAG_COPY_ARGV) = 0. */
 static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
                                JSValueConst this_obj, JSValueConst new_target,
@@ -16188,6 +18089,11 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
                          (JSValueConst *)argv, flags);
     }
     b = p->u.func.function_bytecode;
+    if (unlikely(b->lazy)) {
+        b = js_function_load_bytecode(rt, p);
+        if (!b)
+            return JS_EXCEPTION;
+    }
 
     if (unlikely(argc < b->arg_count || (flags & JS_CALL_FLAG_COPY_ARGV))) {
         arg_allocated_size = b->arg_count;
@@ -16289,7 +18195,7 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
             BREAK;
 #endif
         CASE(OP_push_atom_value):
-            *sp++ = JS_AtomToValue(ctx, get_u32(pc));
+            *sp++ = JS_AtomToValue(ctx, get_bc_atom(b, pc));
             pc += 4;
             BREAK;
         CASE(OP_undefined):
@@ -16386,6 +18292,69 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
                     goto exception;
             }
             BREAK;
+        CASE(OP_arguments_length):
+            *sp++ = JS_NewInt32(ctx, argc);
+            BREAK;
+        CASE(OP_arguments_el):
+            {
+                int type = *pc++;
+                uint32_t idx;
+                JSValue args, val;
+
+                if (likely(JS_VALUE_GET_TAG(sp[-1]) == JS_TAG_INT &&
+                           (idx = JS_VALUE_GET_INT(sp[-1])) < (uint32_t)argc)) {
+                    if (idx < b->arg_count)
+                        sp[-1] = JS_DupValue(ctx, arg_buf[idx]);
+                    else
+                        sp[-1] = JS_DupValue(ctx, argv[idx]);
+                } else {
+                    args = js_build_lazy_arguments(ctx, type, argc,
+                                                   (JSValueConst *)argv,
+                                                   sf, b->arg_count);
+                    if (unlikely(JS_IsException(args)))
+                        goto exception;
+                    val = JS_GetPropertyValue(ctx, args, sp[-1]);
+                    JS_FreeValue(ctx, args);
+                    sp[-1] = JS_UNDEFINED;
+                    if (unlikely(JS_IsException(val)))
+                        goto exception;
+                    sp[-1] = val;
+                }
+            }
+            BREAK;
+        CASE(OP_apply_arguments):
+            {
+                /* func method this_arg -> ret */
+                int type = *pc++;
+                JSValue args[2];
+
+                sf->cur_pc = pc;
+                if (JS_IsCFunction(ctx, sp[-2], (JSCFunction *)js_function_apply, 0)) {
+                    ret_val = js_call_with_arguments(ctx, sp[-2], sp[-3],
+                                                     sp[-1], argc,
+                                                     (JSValueConst *)argv,
+                                                     (JSValueConst *)arg_buf,
+                                                     b->arg_count);
+                } else {
+                    args[0] = sp[-1];
+                    args[1] = js_build_lazy_arguments(ctx, type, argc,
+                                                      (JSValueConst *)argv,
+                                                      sf, b->arg_count);
+                    if (unlikely(JS_IsException(args[1])))
+                        goto exception;
+                    ret_val = JS_Call(ctx, sp[-2], sp[-3], 2,
+                                      (JSValueConst *)args);
+                    JS_FreeValue(ctx, args[1]);
+                }
+                if (unlikely(JS_IsException(ret_val)))
+                    goto exception;
+                JS_FreeValue(ctx, sp[-3]);
+                JS_FreeValue(ctx, sp[-2]);
+                JS_FreeValue(ctx, sp[-1]);
+                sp -= 3;
+                *sp++ = ret_val;
+            }
+            BREAK;
 
         CASE(OP_drop):
             JS_FreeValue(ctx, sp[-1]);
@@ -16694,7 +18663,7 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
             {
                 JSAtom atom;
                 int type;
-                atom = get_u32(pc);
+                atom = get_bc_atom(b, pc);
                 type = pc[4];
                 pc += 5;
                 if (type == JS_THROW_VAR_RO)
@@ -16812,7 +18781,7 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
             {
                 int ret;
                 JSAtom atom;
-                atom = get_u32(pc);
+                atom = get_bc_atom(b, pc);
                 pc += 4;
 
                 ret = JS_CheckGlobalVar(ctx, atom);
@@ -16827,7 +18796,7 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
             {
                 JSValue val;
                 JSAtom atom;
-                atom = get_u32(pc);
+                atom = get_bc_atom(b, pc);
                 pc += 4;
 
                 val = JS_GetGlobalVar(ctx, atom, opcode - OP_get_var_undef);
@@ -16842,7 +18811,7 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
             {
                 int ret;
                 JSAtom atom;
-                atom = get_u32(pc);
+                atom = get_bc_atom(b, pc);
                 pc += 4;
 
                 ret = JS_SetGlobalVar(ctx, atom, sp[-1], opcode - OP_put_var);
@@ -16856,7 +18825,7 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
             {
                 int ret;
                 JSAtom atom;
-                atom = get_u32(pc);
+                atom = get_bc_atom(b, pc);
                 pc += 4;
 
                 /* sp[-2] is JS_TRUE or JS_FALSE */
@@ -16875,7 +18844,7 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
             {
                 JSAtom atom;
                 int flags;
-                atom = get_u32(pc);
+                atom = get_bc_atom(b, pc);
                 flags = pc[4];
                 pc += 5;
                 if (JS_CheckDefineGlobalVar(ctx, atom, flags))
@@ -16886,7 +18855,7 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
             {
                 JSAtom atom;
                 int flags;
-                atom = get_u32(pc);
+                atom = get_bc_atom(b, pc);
                 flags = pc[4];
                 pc += 5;
                 if (JS_DefineGlobalVar(ctx, atom, flags))
@@ -16897,7 +18866,7 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
             {
                 JSAtom atom;
                 int flags;
-                atom = get_u32(pc);
+                atom = get_bc_atom(b, pc);
                 flags = pc[4];
                 pc += 5;
                 if (JS_DefineGlobalFunction(ctx, atom, sp[-1], flags))
@@ -17136,7 +19105,7 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
                 JSProperty *pr;
                 JSAtom atom;
                 int idx;
-                atom = get_u32(pc);
+                atom = get_bc_atom(b, pc);
                 idx = get_u16(pc + 4);
                 pc += 6;
                 *sp++ = JS_NewObjectProto(ctx, JS_NULL);
@@ -17163,7 +19132,7 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
         CASE(OP_make_var_ref):
             {
                 JSAtom atom;
-                atom = get_u32(pc);
+                atom = get_bc_atom(b, pc);
                 pc += 4;
 
                 if (JS_GetGlobalVarRef(ctx, atom, sp))
@@ -17318,7 +19287,9 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
             sp += 2;
             BREAK;
         CASE(OP_for_of_start):
-            if (js_for_of_start(ctx, sp, FALSE))
+            /* generators may expose the enum_rec to 'yield*' */
+            if (js_for_of_start(ctx, sp, FALSE,
+                                !(b->func_kind & JS_FUNC_GENERATOR)))
                 goto exception;
             sp += 1;
             *sp++ = JS_NewCatchOffset(ctx, 0);
@@ -17333,7 +19304,7 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
             }
             BREAK;
         CASE(OP_for_await_of_start):
-            if (js_for_of_start(ctx, sp, TRUE))
+            if (js_for_of_start(ctx, sp, TRUE, FALSE))
                 goto exception;
             sp += 1;
             *sp++ = JS_NewCatchOffset(ctx, 0);
@@ -17356,7 +19327,7 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
             JS_FreeValue(ctx, sp[-1]); /* drop the next method */
             sp--;
             if (!JS_IsUndefined(sp[-1])) {
-                if (JS_IteratorClose(ctx, sp[-1], FALSE))
+                if (js_for_of_close(ctx, sp[-1], sp[0], FALSE))
                     goto exception;
                 JS_FreeValue(ctx, sp[-1]);
             }
@@ -17450,7 +19421,7 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
             {
                 JSValue val;
                 JSAtom atom;
-                atom = get_u32(pc);
+                atom = get_bc_atom(b, pc);
                 pc += 4;
 
                 val = JS_GetProperty(ctx, sp[-1], atom);
@@ -17465,7 +19436,7 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
             {
                 JSValue val;
                 JSAtom atom;
-                atom = get_u32(pc);
+                atom = get_bc_atom(b, pc);
                 pc += 4;
 
                 val = JS_GetProperty(ctx, sp[-1], atom);
@@ -17479,7 +19450,7 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
             {
                 int ret;
                 JSAtom atom;
-                atom = get_u32(pc);
+                atom = get_bc_atom(b, pc);
                 pc += 4;
 
                 ret = JS_SetPropertyInternal(ctx, sp[-2], atom, sp[-1],
@@ -17496,7 +19467,7 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
                 JSAtom atom;
                 JSValue val;
                 
-                atom = get_u32(pc);
+                atom = get_bc_atom(b, pc);
                 pc += 4;
                 val = JS_NewSymbolFromAtom(ctx, atom, JS_ATOM_TYPE_PRIVATE);
                 if (JS_IsException(val))
@@ -17546,7 +19517,7 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
             {
                 int ret;
                 JSAtom atom;
-                atom = get_u32(pc);
+                atom = get_bc_atom(b, pc);
                 pc += 4;
 
                 ret = JS_DefinePropertyValue(ctx, sp[-2], atom, sp[-1],
@@ -17561,7 +19532,7 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
             {
                 int ret;
                 JSAtom atom;
-                atom = get_u32(pc);
+                atom = get_bc_atom(b, pc);
                 pc += 4;
 
                 ret = JS_DefineObjectName(ctx, sp[-1], atom, JS_PROP_CONFIGURABLE);
@@ -17612,7 +19583,7 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
                         goto exception;
                     opcode += OP_define_method - OP_define_method_computed;
                 } else {
-                    atom = get_u32(pc);
+                    atom = get_bc_atom(b, pc);
                     pc += 4;
                 }
                 op_flags = *pc++;
@@ -17658,7 +19629,7 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
                 int class_flags;
                 JSAtom atom;
                 
-                atom = get_u32(pc);
+                atom = get_bc_atom(b, pc);
                 class_flags = pc[4];
                 pc += 5;
                 if (js_op_define_class(ctx, sp, atom, class_flags,
@@ -17845,6 +19816,37 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
                     sp[-2] = __JS_NewFloat64(ctx, JS_VALUE_GET_FLOAT64(op1) +
                                              JS_VALUE_GET_FLOAT64(op2));
                     sp--;
+                } else if (JS_VALUE_GET_TAG(op1) == JS_TAG_STRING &&
+                           tag_is_string(JS_VALUE_GET_TAG(op2))) {
+                    /* 's = s + str': if the string is only referenced
+                       by the stack and by the local variable receiving
+                       the result, it is appended in place in the
+                       variable. The variable is unchanged in case of
+                       exception. */
+                    if (JS_VALUE_GET_STRING(op1)->header.ref_count == 2) {
+                        int idx = js_get_put_loc_idx(pc);
+                        if (idx >= 0 &&
+                            JS_VALUE_GET_TAG(var_buf[idx]) == JS_TAG_STRING &&
+                            JS_VALUE_GET_PTR(var_buf[idx]) == JS_VALUE_GET_PTR(op1)) {
+                            int res;
+                            /* the variable keeps the only reference */
+                            JS_FreeValue(ctx, op1);
+                            res = js_concat_string_in_place(ctx, &var_buf[idx], op2);
+                            op1 = JS_DupValue(ctx, var_buf[idx]);
+                            sp[-2] = op1;
+                            if (res != 0) {
+                                JS_FreeValue(ctx, op2);
+                                sp--;
+                                if (res < 0)
+                                    goto exception;
+                                BREAK;
+                            }
+                        }
+                    }
+                    sp[-2] = JS_ConcatString(ctx, op1, op2);
+                    sp--;
+                    if (JS_IsException(sp[-1]))
+                        goto exception;
                 } else {
                 add_slow:
                     if (js_add_slow(ctx, sp))
@@ -17869,17 +19871,33 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
                         goto add_loc_slow;
                     *pv = JS_NewInt32(ctx, r);
                     sp--;
-                } else if (JS_VALUE_GET_TAG(*pv) == JS_TAG_STRING) {
+                } else if (tag_is_string(JS_VALUE_GET_TAG(*pv))) {
                     JSValue op1;
+                    int res;
                     op1 = sp[-1];
                     sp--;
                     op1 = JS_ToPrimitiveFree(ctx, op1, HINT_NONE);
                     if (JS_IsException(op1))
                         goto exception;
-                    op1 = JS_ConcatString(ctx, JS_DupValue(ctx, *pv), op1);
-                    if (JS_IsException(op1))
-                        goto exception;
-                    set_value(ctx, pv, op1);
+                    if (!tag_is_string(JS_VALUE_GET_TAG(op1))) {
+                        op1 = JS_ToStringFree(ctx, op1);
+                        if (JS_IsException(op1))
+                            goto exception;
+                    }
+                    /* a string only referenced by the local variable
+                       is appended in place. The variable is unchanged
+                       in case of exception. */
+                    res = js_concat_string_in_place(ctx, pv, op1);
+                    if (res != 0) {
+                        JS_FreeValue(ctx, op1);
+                        if (res < 0)
+                            goto exception;
+                    } else {
+                        op1 = JS_ConcatString(ctx, JS_DupValue(ctx, *pv), op1);
+                        if (JS_IsException(op1))
+                            goto exception;
+                        set_value(ctx, pv, op1);
+                    }
                 } else {
                     JSValue ops[2];
                 add_loc_slow:
@@ -18358,7 +20376,7 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
                 JSAtom atom;
                 int ret;
 
-                atom = get_u32(pc);
+                atom = get_bc_atom(b, pc);
                 pc += 4;
 
                 ret = JS_DeleteProperty(ctx, ctx->global_obj, atom, 0);
@@ -18436,7 +20454,7 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
                 int32_t diff;
                 JSValue obj, val;
                 int ret, is_with;
-                atom = get_u32(pc);
+                atom = get_bc_atom(b, pc);
                 diff = get_u32(pc + 4);
                 is_with = pc[8];
                 pc += 9;
@@ -18593,7 +20611,7 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
                     /* enumerator: close it with a throw */
                     JS_FreeValue(ctx, sp[-1]); /* drop the next method */
                     sp--;
-                    JS_IteratorClose(ctx, sp[-1], TRUE);
+                    js_for_of_close(ctx, sp[-1], sp[0], TRUE);
                 } else {
                     *sp++ = rt->current_exception;
                     rt->current_exception = JS_NULL;
@@ -18655,6 +20673,8 @@ static JSContext *JS_GetFunctionRealm(JSContext *ctx, JSValueConst func_obj)
     switch(p->class_id) {
     case JS_CLASS_C_FUNCTION:
         realm = p->u.cfunc.realm;
+        if (realm->shared_intrinsics)
+            realm = ctx;
         break;
     case JS_CLASS_BYTECODE_FUNCTION:
     case JS_CLASS_GENERATOR_FUNCTION:
@@ -18699,7 +20719,7 @@ static JSValue js_create_from_ctor(JSContext *ctx, JSValueConst ctor,
     JSContext *realm;
     
     if (JS_IsUndefined(ctor)) {
-        proto = JS_DupValue(ctx, ctx->class_proto[class_id]);
+        proto = JS_DupValue(ctx, js_get_class_proto(ctx, class_id));
     } else {
         proto = JS_GetProperty(ctx, ctor, JS_ATOM_prototype);
         if (JS_IsException(proto))
@@ -18709,7 +20729,7 @@ static JSValue js_create_from_ctor(JSContext *ctx, JSValueConst ctor,
             realm = JS_GetFunctionRealm(ctx, ctor);
             if (!realm)
                 return JS_EXCEPTION;
-            proto = JS_DupValue(ctx, realm->class_proto[class_id]);
+            proto = JS_DupValue(ctx, js_get_class_proto(realm, class_id));
         }
     }
     obj = JS_NewObjectProtoClass(ctx, proto, class_id);
@@ -18815,6 +20835,11 @@ static __exception int async_func_init(JSContext *ctx, JSAsyncFunctionState *s,
     init_list_head(&sf->var_ref_list);
     p = JS_VALUE_GET_OBJ(func_obj);
     b = p->u.func.function_bytecode;
+    if (unlikely(b->lazy)) {
+        b = js_function_load_bytecode(ctx->rt, p);
+        if (!b)
+            return -1;
+    }
     sf->js_mode = b->js_mode;
     sf->cur_pc = b->byte_code_buf;
     arg_buf_len = max_int(b->arg_count, argc);
@@ -19845,6 +21870,28 @@ typedef struct LineNumberSlot {
     int line_num;
 } LineNumberSlot;
 
+/* pass 2 code of an inner function which can be inlined in its parent
+   (see inline_function_calls()) */
+typedef struct JSInlineFunc {
+    int cpool_idx; /* index of the function in the parent constant pool */
+    int line_num;
+    int arg_count;
+    int var_count;
+    int label_count;
+    uint8_t *var_undef; /* TRUE if the variable is initially undefined */
+    uint8_t *byte_code;
+    int byte_code_len;
+} JSInlineFunc;
+
+/* in the pass 2 and 3 code, the line numbers of the inlined code also
+   contain the constant pool index of the inlined function so that the
+   inlined calls can be shown in the backtraces (see
+   compute_pc2line_info()) */
+#define INLINE_LINE_FLAG     (1 << 30)
+#define INLINE_LINE_BITS     20
+#define INLINE_LINE_MAX      ((1 << INLINE_LINE_BITS) - 1)
+#define INLINE_CPOOL_IDX_MAX ((1 << (30 - INLINE_LINE_BITS)) - 1)
+
 typedef enum JSParseFunctionEnum {
     JS_PARSE_FUNC_STATEMENT,
     JS_PARSE_FUNC_VAR,
@@ -19895,6 +21942,11 @@ typedef struct JSFunctionDef {
     BOOL is_derived_class_constructor;
     BOOL in_function_body;
     BOOL backtrace_barrier;
+    BOOL lazy_compile; /* top level only: the inner functions can be
+                          compiled when they are first called */
+    BOOL reload_source; /* top level only: the function sources are
+                           not kept in memory */
+    BOOL is_resolved; /* true if js_resolve_function() was called */
     JSFunctionKindEnum func_kind : 8;
     JSParseFunctionEnum func_type : 8;
     uint8_t js_mode; /* bitmap of JS_MODE_x */
@@ -19912,6 +21964,8 @@ typedef struct JSFunctionDef {
     int arguments_var_idx; /* -1 if none */
     int arguments_arg_idx; /* argument variable definition in argument scope, 
                               -1 if none */
+    BOOL lazy_arguments; /* TRUE if the arguments object is not created
+                            at the start (see optimize_arguments()) */
     int func_var_idx; /* variable containing the current function (-1
                          if none, only used if is_func_expr is true) */
     int eval_ret_idx; /* variable containing the return value of the eval, -1 if none */
@@ -19948,6 +22002,11 @@ typedef struct JSFunctionDef {
     int cpool_count;
     int cpool_size;
 
+    /* inner functions which can be inlined */
+    JSInlineFunc *inline_funcs;
+    int inline_func_count;
+    int inline_func_size;
+
     /* list of variables in the closure */
     int closure_var_count;
     int closure_var_size;
@@ -19967,9 +22026,11 @@ typedef struct JSFunctionDef {
     JSAtom filename;
     int line_num;
     DynBuf pc2line;
+    DynBuf inline_ranges; /* JSInlineRange table */
 
     char *source;  /* raw source, utf-8 encoded */
     int source_len;
+    int source_pos; /* position of the source in the input file */
 
     JSModuleDef *module; /* != NULL when parsing a module */
 } JSFunctionDef;
@@ -20011,6 +22072,8 @@ typedef struct JSParseState {
     const uint8_t *last_ptr;
     const uint8_t *buf_ptr;
     const uint8_t *buf_end;
+    const uint8_t *buf_start;
+    int buf_start_pos; /* position of buf_start in the input file */
 
     /* current function code */
     JSFunctionDef *cur_func;
@@ -21586,6 +23649,255 @@ static __exception int emit_push_const(JSParseState *s, JSValueConst val,
     return 0;
 }
 
+/* Constant folding: the operands of the arithmetic operators which
+   are primitive constants are evaluated at compile time with the
+   runtime functions, so that the semantics are exactly the same. */
+
+/* return TRUE if the code in [pos, end) is a single push of a
+   primitive constant. Its value is stored in '*pval'. */
+static BOOL js_get_const_code(JSParseState *s, int pos, int end, JSValue *pval)
+{
+    JSFunctionDef *fd = s->cur_func;
+    const uint8_t *bc_buf = fd->byte_code.buf;
+    JSValue val;
+    int op;
+
+    if (pos < end && bc_buf[pos] == OP_line_num)
+        pos += 5;
+    if (pos >= end)
+        return FALSE;
+    op = bc_buf[pos];
+    if (pos + opcode_info[op].size != end)
+        return FALSE;
+    switch(op) {
+    case OP_push_i32:
+        val = JS_NewInt32(s->ctx, get_u32(bc_buf + pos + 1));
+        break;
+    case OP_push_const:
+        val = fd->cpool[get_u32(bc_buf + pos + 1)];
+        switch(JS_VALUE_GET_NORM_TAG(val)) {
+        case JS_TAG_INT:
+        case JS_TAG_FLOAT64:
+        case JS_TAG_STRING:
+            break;
+        default:
+            return FALSE;
+        }
+        val = JS_DupValue(s->ctx, val);
+        break;
+    case OP_push_atom_value:
+        val = JS_AtomToString(s->ctx, get_u32(bc_buf + pos + 1));
+        if (JS_IsException(val)) {
+            JS_FreeValue(s->ctx, JS_GetException(s->ctx));
+            return FALSE;
+        }
+        break;
+    case OP_undefined:
+        val = JS_UNDEFINED;
+        break;
+    case OP_null:
+        val = JS_NULL;
+        break;
+    case OP_push_false:
+    case OP_push_true:
+        val = JS_NewBool(s->ctx, op == OP_push_true);
+        break;
+    default:
+        return FALSE;
+    }
+    *pval = val;
+    return TRUE;
+}
+
+/* remove the code after 'pos'. It may only contain constant pushes,
+   line numbers and field accesses. */
+static void js_remove_const_code(JSParseState *s, int pos)
+{
+    JSFunctionDef *fd = s->cur_func;
+    const uint8_t *bc_buf = fd->byte_code.buf;
+    int op, end, idx, cpool_min, cpool_n;
+
+    end = fd->byte_code.size;
+    fd->byte_code.size = pos;
+    fd->last_opcode_pos = -1;
+    cpool_min = fd->cpool_count;
+    cpool_n = 0;
+    for(; pos < end; pos += opcode_info[op].size) {
+        op = bc_buf[pos];
+        switch(op) {
+        case OP_line_num:
+            /* the line number must be emitted again */
+            fd->last_opcode_line_num = -1;
+            break;
+        case OP_push_const:
+            idx = get_u32(bc_buf + pos + 1);
+            cpool_min = min_int(cpool_min, idx);
+            cpool_n++;
+            break;
+        case OP_push_atom_value:
+        case OP_get_field2:
+            JS_FreeAtom(s->ctx, get_u32(bc_buf + pos + 1));
+            break;
+        default:
+            break;
+        }
+    }
+    /* the constants are removed from the pool if they are the last ones */
+    if (cpool_n != 0 && cpool_min == fd->cpool_count - cpool_n) {
+        for(idx = cpool_min; idx < fd->cpool_count; idx++)
+            JS_FreeValue(s->ctx, fd->cpool[idx]);
+        fd->cpool_count = cpool_min;
+    }
+}
+
+/* evaluate 'op' on the 'argc' values of 'stack'. The values are
+   freed. Return -1 if the operation cannot be done at compile time. */
+static int js_fold_op(JSContext *ctx, OPCodeEnum op, JSValue *stack,
+                      int argc, JSValue *pres)
+{
+    JSValue *sp = stack + argc;
+    int ret;
+
+#ifdef CONFIG_BIGNUM
+    if (is_math_mode(ctx))
+        goto fail;
+#endif
+    switch(op) {
+    case OP_add:
+        ret = js_add_slow(ctx, sp);
+        break;
+    case OP_sub:
+    case OP_mul:
+    case OP_div:
+    case OP_mod:
+    case OP_pow:
+        ret = js_binary_arith_slow(ctx, sp, op);
+        break;
+    case OP_shl:
+    case OP_sar:
+    case OP_and:
+    case OP_or:
+    case OP_xor:
+        ret = js_binary_logic_slow(ctx, sp, op);
+        break;
+    case OP_shr:
+        ret = js_shr_slow(ctx, sp);
+        break;
+    case OP_lt:
+    case OP_lte:
+    case OP_gt:
+    case OP_gte:
+        ret = js_relational_slow(ctx, sp, op);
+        break;
+    case OP_eq:
+    case OP_neq:
+        ret = js_eq_slow(ctx, sp, op == OP_neq);
+        break;
+    case OP_strict_eq:
+    case OP_strict_neq:
+        ret = js_strict_eq_slow(ctx, sp, op == OP_strict_neq);
+        break;
+    case OP_neg:
+    case OP_plus:
+        ret = js_unary_arith_slow(ctx, sp, op);
+        break;
+    case OP_not:
+        ret = js_not_slow(ctx, sp);
+        break;
+    case OP_lnot:
+        stack[0] = JS_NewBool(ctx, !JS_ToBoolFree(ctx, stack[0]));
+        ret = 0;
+        break;
+    default:
+        goto fail;
+    }
+    if (ret < 0) {
+        JS_FreeValue(ctx, JS_GetException(ctx));
+        return -1;
+    }
+    /* the constants must not be string ropes */
+    *pres = js_linearize_string_free(ctx, stack[0]);
+    if (JS_IsException(*pres)) {
+        JS_FreeValue(ctx, JS_GetException(ctx));
+        return -1;
+    }
+    return 0;
+ fail:
+    while (argc-- > 0)
+        JS_FreeValue(ctx, stack[argc]);
+    return -1;
+}
+
+/* replace the code after 'pos' with a push of 'val'. 'val' is freed. */
+static __exception int emit_const_code(JSParseState *s, int pos, JSValue val)
+{
+    double d;
+    int ret;
+
+    js_remove_const_code(s, pos);
+    switch(JS_VALUE_GET_NORM_TAG(val)) {
+    case JS_TAG_BOOL:
+        emit_op(s, JS_VALUE_GET_BOOL(val) ? OP_push_true : OP_push_false);
+        return 0;
+    case JS_TAG_FLOAT64:
+        d = JS_VALUE_GET_FLOAT64(val);
+        if (d != (int32_t)d || (d == 0 && 1 / d < 0))
+            break;
+        val = JS_NewInt32(s->ctx, (int32_t)d);
+        /* fall thru */
+    case JS_TAG_INT:
+        emit_op(s, OP_push_i32);
+        emit_u32(s, JS_VALUE_GET_INT(val));
+        return 0;
+    default:
+        break;
+    }
+    ret = emit_push_const(s, val, 1);
+    JS_FreeValue(s->ctx, val);
+    return ret;
+}
+
+/* emit the unary (pos2 < 0) or binary operator 'op' whose operands
+   start at 'pos1' and 'pos2' */
+static __exception int emit_op_fold(JSParseState *s, OPCodeEnum op,
+                                    int pos1, int pos2)
+{
+    JSFunctionDef *fd = s->cur_func;
+    int end = fd->byte_code.size;
+    JSValue stack[2], res;
+
+    if (fd->js_mode & JS_MODE_MATH)
+        goto no_fold;
+    if (pos2 < 0) {
+        if (!js_get_const_code(s, pos1, end, &stack[0]))
+            goto no_fold;
+        if (js_fold_op(s->ctx, op, stack, 1, &res))
+            goto no_fold;
+    } else {
+        if (!js_get_const_code(s, pos1, pos2, &stack[0]))
+            goto no_fold;
+        if (!js_get_const_code(s, pos2, end, &stack[1])) {
+            JS_FreeValue(s->ctx, stack[0]);
+            goto no_fold;
+        }
+        if (js_fold_op(s->ctx, op, stack, 2, &res))
+            goto no_fold;
+    }
+    switch(JS_VALUE_GET_NORM_TAG(res)) {
+    case JS_TAG_INT:
+    case JS_TAG_FLOAT64:
+    case JS_TAG_STRING:
+    case JS_TAG_BOOL:
+        return emit_const_code(s, pos1, res);
+    default:
+        JS_FreeValue(s->ctx, res);
+        break;
+    }
+ no_fold:
+    emit_op(s, op);
+    return 0;
+}
+
 /* return the variable index or -1 if not found,
    add ARGUMENT_VAR_OFFSET for argument variables */
 static int find_arg(JSContext *ctx, JSFunctionDef *fd, JSAtom name)
@@ -22082,12 +24394,16 @@ static int seal_template_obj(JSContext *ctx, JSValueConst obj)
 static __exception int js_parse_template(JSParseState *s, int call, int *argc)
 {
     JSContext *ctx = s->ctx;
-    JSValue raw_array, template_object;
+    JSValue raw_array, template_object, fold_val, stack[2];
     JSToken cooked;
-    int depth, ret;
+    int depth, ret, pos1, pos2;
 
     raw_array = JS_UNDEFINED; /* avoid warning */
     template_object = JS_UNDEFINED; /* avoid warning */
+    /* 'fold_val' is the value of the template if all the expressions
+       are constants so far */
+    fold_val = JS_UNDEFINED;
+    pos1 = s->cur_func->byte_code.size;
     if (call) {
         /* Create a template object: an array of cooked strings */
         /* Create an array of raw strings and store it to the raw property */
@@ -22140,10 +24456,19 @@ static __exception int js_parse_template(JSParseState *s, int call, int *argc)
                 return -1;
             str = JS_VALUE_GET_STRING(cooked.u.str.str);
             if (str->len != 0 || depth == 0) {
+                if (depth == 0) {
+                    if (!(s->cur_func->js_mode & JS_MODE_MATH))
+                        fold_val = JS_DupValue(ctx, cooked.u.str.str);
+                } else if (!JS_IsUndefined(fold_val)) {
+                    stack[0] = fold_val;
+                    stack[1] = JS_DupValue(ctx, cooked.u.str.str);
+                    if (js_fold_op(ctx, OP_add, stack, 2, &fold_val))
+                        fold_val = JS_UNDEFINED;
+                }
                 ret = emit_push_const(s, cooked.u.str.str, 1);
                 JS_FreeValue(s->ctx, cooked.u.str.str);
                 if (ret)
-                    return -1;
+                    goto fail;
                 if (depth == 0) {
                     if (s->token.u.str.sep == '`')
                         goto done1;
@@ -22158,12 +24483,24 @@ static __exception int js_parse_template(JSParseState *s, int call, int *argc)
         if (s->token.u.str.sep == '`')
             goto done;
         if (next_token(s))
-            return -1;
+            goto fail;
+        pos2 = s->cur_func->byte_code.size;
         if (js_parse_expr(s))
-            return -1;
+            goto fail;
         depth++;
+        if (!JS_IsUndefined(fold_val)) {
+            stack[0] = fold_val;
+            if (!js_get_const_code(s, pos2, s->cur_func->byte_code.size,
+                                   &stack[1])) {
+                JS_FreeValue(ctx, fold_val);
+                fold_val = JS_UNDEFINED;
+            } else if (js_fold_op(ctx, OP_add, stack, 2, &fold_val)) {
+                fold_val = JS_UNDEFINED;
+            }
+        }
         if (s->token.val != '}') {
-            return js_parse_error(s, "expected '}' after template expression");
+            js_parse_error(s, "expected '}' after template expression");
+            goto fail;
         }
         /* XXX: should convert to string at this stage? */
         free_token(s, &s->token);
@@ -22172,8 +24509,9 @@ static __exception int js_parse_template(JSParseState *s, int call, int *argc)
         s->got_lf = FALSE;
         s->last_line_num = s->token.line_num;
         if (js_parse_template_part(s, s->buf_ptr))
-            return -1;
+            goto fail;
     }
+    JS_FreeValue(ctx, fold_val);
     return js_parse_expect(s, TOK_TEMPLATE);
 
  done:
@@ -22182,12 +24520,22 @@ static __exception int js_parse_template(JSParseState *s, int call, int *argc)
         seal_template_obj(ctx, raw_array);
         seal_template_obj(ctx, template_object);
         *argc = depth + 1;
+    } else if (JS_VALUE_GET_TAG(fold_val) == JS_TAG_STRING) {
+        /* only constant expressions: the result is a constant string */
+        ret = emit_const_code(s, pos1, fold_val);
+        fold_val = JS_UNDEFINED;
+        if (ret)
+            return -1;
     } else {
         emit_op(s, OP_call_method);
         emit_u16(s, depth - 1);
     }
  done1:
+    JS_FreeValue(ctx, fold_val);
     return next_token(s);
+ fail:
+    JS_FreeValue(ctx, fold_val);
+    return -1;
 }
 
 
@@ -23198,6 +25546,8 @@ static __exception int js_parse_class(JSParseState *s, BOOL is_class_expr,
     if (!(fd->js_mode & JS_MODE_STRIP)) {
         js_free(ctx, ctor_fd->source);
         ctor_fd->source_len = s->buf_ptr - class_start_ptr;
+        ctor_fd->source_pos = s->buf_start_pos +
+            (class_start_ptr - s->buf_start);
         ctor_fd->source = js_strndup(ctx, (const char *)class_start_ptr,
                                      ctor_fd->source_len);
         if (!ctor_fd->source)
@@ -23562,8 +25912,8 @@ static __exception int get_lvalue(JSParseState *s, int *popcode, int *pscope,
 
 typedef enum {
     PUT_LVALUE_NOKEEP, /* [depth] v -> */
-    PUT_LVALUE_NOKEEP_DEPTH, /* [depth] v -> , keep depth (currently
-                                just disable optimizations) */
+    PUT_LVALUE_NOKEEP_DEPTH, /* [depth] v -> , keep depth (see
+                                optimize_scope_make_ref_depth()) */
     PUT_LVALUE_KEEP_TOP,  /* [depth] v -> v */
     PUT_LVALUE_KEEP_SECOND, /* [depth] v0 v -> v0 */
     PUT_LVALUE_NOKEEP_BOTTOM, /* v [depth] -> */
@@ -23667,6 +26017,10 @@ static void put_lvalue(JSParseState *s, int opcode, int scope,
         break;
     case OP_get_ref_value:
         emit_op(s, OP_put_ref_value);
+        if (special == PUT_LVALUE_NOKEEP_DEPTH) {
+            /* room for optimize_scope_make_global_ref_depth() */
+            emit_op(s, OP_nop);
+        }
         break;
     case OP_get_super_value:
         emit_op(s, OP_put_super_value);
@@ -24942,8 +27296,9 @@ static __exception int js_parse_delete(JSParseState *s)
 /* allowed parse_flags: PF_ARROW_FUNC, PF_POW_ALLOWED, PF_POW_FORBIDDEN */
 static __exception int js_parse_unary(JSParseState *s, int parse_flags)
 {
-    int op;
+    int op, pos1, pos2;
 
+    pos1 = s->cur_func->byte_code.size;
     switch(s->token.val) {
     case '+':
     case '-':
@@ -24957,16 +27312,20 @@ static __exception int js_parse_unary(JSParseState *s, int parse_flags)
             return -1;
         switch(op) {
         case '-':
-            emit_op(s, OP_neg);
+            if (emit_op_fold(s, OP_neg, pos1, -1))
+                return -1;
             break;
         case '+':
-            emit_op(s, OP_plus);
+            if (emit_op_fold(s, OP_plus, pos1, -1))
+                return -1;
             break;
         case '!':
-            emit_op(s, OP_lnot);
+            if (emit_op_fold(s, OP_lnot, pos1, -1))
+                return -1;
             break;
         case '~':
-            emit_op(s, OP_not);
+            if (emit_op_fold(s, OP_not, pos1, -1))
+                return -1;
             break;
         case TOK_VOID:
             emit_op(s, OP_drop);
@@ -25061,9 +27420,11 @@ static __exception int js_parse_unary(JSParseState *s, int parse_flags)
             }
             if (next_token(s))
                 return -1;
+            pos2 = s->cur_func->byte_code.size;
             if (js_parse_unary(s, PF_POW_ALLOWED))
                 return -1;
-            emit_op(s, OP_pow);
+            if (emit_op_fold(s, OP_pow, pos1, pos2))
+                return -1;
         }
 #else
         if (s->token.val == TOK_POW) {
@@ -25078,9 +27439,11 @@ static __exception int js_parse_unary(JSParseState *s, int parse_flags)
             }
             if (next_token(s))
                 return -1;
+            pos2 = s->cur_func->byte_code.size;
             if (js_parse_unary(s, PF_POW_ALLOWED))
                 return -1;
-            emit_op(s, OP_pow);
+            if (emit_op_fold(s, OP_pow, pos1, pos2))
+                return -1;
         }
 #endif
     }
@@ -25091,12 +27454,13 @@ static __exception int js_parse_unary(JSParseState *s, int parse_flags)
 static __exception int js_parse_expr_binary(JSParseState *s, int level,
                                             int parse_flags)
 {
-    int op, opcode;
+    int op, opcode, pos1, pos2;
 
     if (level == 0) {
         return js_parse_unary(s, (parse_flags & PF_ARROW_FUNC) |
                               PF_POW_ALLOWED);
     }
+    pos1 = s->cur_func->byte_code.size;
     if (js_parse_expr_binary(s, level - 1, parse_flags))
         return -1;
     for(;;) {
@@ -25227,9 +27591,11 @@ static __exception int js_parse_expr_binary(JSParseState *s, int level,
         }
         if (next_token(s))
             return -1;
+        pos2 = s->cur_func->byte_code.size;
         if (js_parse_expr_binary(s, level - 1, parse_flags & ~PF_ARROW_FUNC))
             return -1;
-        emit_op(s, opcode);
+        if (emit_op_fold(s, opcode, pos1, pos2))
+            return -1;
     }
     return 0;
 }
@@ -27006,9 +29372,17 @@ static void js_free_module_def(JSContext *ctx, JSModuleDef *m)
     for(i = 0; i < m->import_entries_count; i++) {
         JSImportEntry *mi = &m->import_entries[i];
         JS_FreeAtom(ctx, mi->import_name);
+        JS_FreeAtom(ctx, mi->res_module_name);
     }
     js_free(ctx, m->import_entries);
 
+    for(i = 0; i < m->ns_entries_count; i++) {
+        JSModuleNsEntry *ne = &m->ns_entries[i];
+        JS_FreeAtom(ctx, ne->export_name);
+        JS_FreeAtom(ctx, ne->module_name);
+    }
+    js_free(ctx, m->ns_entries);
+
     JS_FreeValue(ctx, m->module_ns);
     JS_FreeValue(ctx, m->func_obj);
     JS_FreeValue(ctx, m->eval_exception);
@@ -27173,6 +29547,13 @@ JSValue JS_GetModuleExport(JSContext *ctx, JSModuleDef *m, const char *export_na
     return JS_UNDEFINED;
 }
 
+void JS_SetSourceLoaderFunc(JSRuntime *rt, JSSourceLoaderFunc *source_loader,
+                            void *opaque)
+{
+    rt->source_loader_func = source_loader;
+    rt->source_loader_opaque = opaque;
+}
+
 void JS_SetModuleLoaderFunc(JSRuntime *rt,
                             JSModuleNormalizeFunc *module_normalize,
                             JSModuleLoaderFunc *module_loader, void *opaque)
@@ -27447,11 +29828,12 @@ static JSResolveResultEnum js_resolve_export1(JSContext *ctx,
 /* If the return value is JS_RESOLVE_RES_FOUND, return the module
   (*pmodule) and the corresponding local export entry
   (*pme). Otherwise return (NULL, NULL) */
-static JSResolveResultEnum js_resolve_export(JSContext *ctx,
-                                             JSModuleDef **pmodule,
-                                             JSExportEntry **pme,
-                                             JSModuleDef *m,
-                                             JSAtom export_name)
+static JSResolveResultEnum js_resolve_export2(JSContext *ctx,
+                                              JSModuleDef **pmodule,
+                                              JSExportEntry **pme,
+                                              JSModuleDef *m,
+                                              JSAtom export_name,
+                                              BOOL *pis_static)
 {
     JSResolveState ss, *s = &ss;
     int i;
@@ -27463,6 +29845,15 @@ static JSResolveResultEnum js_resolve_export(JSContext *ctx,
 
     ret = js_resolve_export1(ctx, pmodule, pme, m, export_name, s);
 
+    /* the result only depends on JS modules if no C module was
+       visited (the exports of C modules are only known at run time) */
+    if (pis_static) {
+        *pis_static = TRUE;
+        for(i = 0; i < s->count; i++) {
+            if (s->array[i].module->init_func)
+                *pis_static = FALSE;
+        }
+    }
     for(i = 0; i < s->count; i++)
         JS_FreeAtom(ctx, s->array[i].name);
     js_free(ctx, s->array);
@@ -27470,6 +29861,15 @@ static JSResolveResultEnum js_resolve_export(JSContext *ctx,
     return ret;
 }
 
+static JSResolveResultEnum js_resolve_export(JSContext *ctx,
+                                             JSModuleDef **pmodule,
+                                             JSExportEntry **pme,
+                                             JSModuleDef *m,
+                                             JSAtom export_name)
+{
+    return js_resolve_export2(ctx, pmodule, pme, m, export_name, NULL);
+}
+
 static void js_resolve_export_throw_error(JSContext *ctx,
                                           JSResolveResultEnum res,
                                           JSModuleDef *m, JSAtom export_name)
@@ -27594,17 +29994,14 @@ static const JSClassExoticMethods js_module_ns_exotic_methods = {
     .has_property = js_module_ns_has,
 };
 
-static int exported_names_cmp(const void *p1, const void *p2, void *opaque)
+static int js_export_name_cmp(JSContext *ctx, JSAtom name1, JSAtom name2)
 {
-    JSContext *ctx = opaque;
-    const ExportedNameEntry *me1 = p1;
-    const ExportedNameEntry *me2 = p2;
     JSValue str1, str2;
     int ret;
 
     /* XXX: should avoid allocation memory in atom comparison */
-    str1 = JS_AtomToString(ctx, me1->export_name);
-    str2 = JS_AtomToString(ctx, me2->export_name);
+    str1 = JS_AtomToString(ctx, name1);
+    str2 = JS_AtomToString(ctx, name2);
     if (JS_IsException(str1) || JS_IsException(str2)) {
         /* XXX: raise an error ? */
         ret = 0;
@@ -27617,6 +30014,20 @@ static int exported_names_cmp(const void *p1, const void *p2, void *opaque)
     return ret;
 }
 
+static int exported_names_cmp(const void *p1, const void *p2, void *opaque)
+{
+    const ExportedNameEntry *me1 = p1;
+    const ExportedNameEntry *me2 = p2;
+    return js_export_name_cmp(opaque, me1->export_name, me2->export_name);
+}
+
+static int module_ns_entries_cmp(const void *p1, const void *p2, void *opaque)
+{
+    const JSModuleNsEntry *ne1 = p1;
+    const JSModuleNsEntry *ne2 = p2;
+    return js_export_name_cmp(opaque, ne1->export_name, ne2->export_name);
+}
+
 static JSValue js_get_module_ns(JSContext *ctx, JSModuleDef *m);
 
 static JSValue js_module_ns_autoinit(JSContext *ctx, JSObject *p, JSAtom atom,
@@ -27626,6 +30037,86 @@ static JSValue js_module_ns_autoinit(JSContext *ctx, JSObject *p, JSAtom atom,
     return js_get_module_ns(ctx, m);
 }
 
+static void js_set_exported_name(ExportedNameEntry *en, JSModuleDef *res_m,
+                                 JSExportEntry *res_me)
+{
+    if (res_me->local_name == JS_ATOM__star_) {
+        en->export_type = EXPORTED_NAME_NS;
+        en->u.module = res_m->req_module_entries[res_me->u.req_module_idx].module;
+    } else {
+        en->export_type = EXPORTED_NAME_NORMAL;
+        if (res_me->u.local.var_ref) {
+            en->u.var_ref = res_me->u.local.var_ref;
+        } else {
+            JSObject *p1 = JS_VALUE_GET_OBJ(res_m->func_obj);
+            en->u.var_ref = p1->u.func.var_refs[res_me->u.local.var_idx];
+        }
+    }
+}
+
+/* Return the export entry computed by JS_PrelinkModule() or NULL if
+   it does not match the loaded modules. 'm' is tried first to avoid a
+   lookup. */
+static JSExportEntry *js_get_prelinked_export(JSContext *ctx,
+                                              JSModuleDef **pmodule,
+                                              JSModuleDef *m,
+                                              JSAtom module_name,
+                                              int export_idx)
+{
+    JSExportEntry *me;
+
+    if (m->module_name != module_name) {
+        m = js_find_loaded_module(ctx, module_name);
+        if (!m)
+            return NULL;
+    }
+    if (m->init_func || !m->func_created ||
+        export_idx < 0 || export_idx >= m->export_entries_count)
+        return NULL;
+    me = &m->export_entries[export_idx];
+    if (me->export_type != JS_EXPORT_TYPE_LOCAL &&
+        me->local_name != JS_ATOM__star_)
+        return NULL;
+    *pmodule = m;
+    return me;
+}
+
+/* Get the resolved and sorted exported names from the table computed
+   by JS_PrelinkModule(). Return 1 if OK, 0 if the table is not
+   available or does not match the loaded modules, -1 if exception. */
+static int get_prelinked_exported_names(JSContext *ctx,
+                                        GetExportNamesState *s,
+                                        JSModuleDef *m)
+{
+    JSModuleNsEntry *ne;
+    JSExportEntry *res_me;
+    JSModuleDef *res_m;
+    int i;
+
+    if (!m->ns_entries)
+        return 0;
+    s->exported_names = js_malloc(ctx, sizeof(s->exported_names[0]) *
+                                  max_int(m->ns_entries_count, 1));
+    if (!s->exported_names)
+        return -1;
+    s->exported_names_size = m->ns_entries_count;
+    for(i = 0; i < m->ns_entries_count; i++) {
+        ne = &m->ns_entries[i];
+        res_me = js_get_prelinked_export(ctx, &res_m, m, ne->module_name,
+                                         ne->export_idx);
+        if (!res_me) {
+            js_free(ctx, s->exported_names);
+            s->exported_names = NULL;
+            s->exported_names_size = 0;
+            return 0;
+        }
+        s->exported_names[i].export_name = ne->export_name;
+        js_set_exported_name(&s->exported_names[i], res_m, res_me);
+    }
+    s->exported_names_count = m->ns_entries_count;
+    return 1;
+}
+
 static JSValue js_build_module_ns(JSContext *ctx, JSModuleDef *m)
 {
     JSValue obj;
@@ -27640,6 +30131,12 @@ static JSValue js_build_module_ns(JSContext *ctx, JSModuleDef *m)
     p = JS_VALUE_GET_OBJ(obj);
 
     memset(s, 0, sizeof(*s));
+    ret = get_prelinked_exported_names(ctx, s, m);
+    if (ret < 0)
+        goto fail;
+    if (ret > 0)
+        goto add_names;
+    
     ret = get_exported_names(ctx, s, m, FALSE);
     js_free(ctx, s->modules);
     if (ret)
@@ -27667,19 +30164,7 @@ static JSValue js_build_module_ns(JSContext *ctx, JSModuleDef *m)
             }
             en->export_type = EXPORTED_NAME_AMBIGUOUS;
         } else {
-            if (res_me->local_name == JS_ATOM__star_) {
-                en->export_type = EXPORTED_NAME_NS;
-                en->u.module = res_m->req_module_entries[res_me->u.req_module_idx].module;
-            } else {
-                en->export_type = EXPORTED_NAME_NORMAL;
-                if (res_me->u.local.var_ref) {
-                    en->u.var_ref = res_me->u.local.var_ref;
-                } else {
-                    JSObject *p1 = JS_VALUE_GET_OBJ(res_m->func_obj);
-                    p1 = JS_VALUE_GET_OBJ(res_m->func_obj);
-                    en->u.var_ref = p1->u.func.var_refs[res_me->u.local.var_idx];
-                }
-            }
+            js_set_exported_name(en, res_m, res_me);
         }
     }
 
@@ -27687,6 +30172,7 @@ static JSValue js_build_module_ns(JSContext *ctx, JSModuleDef *m)
     rqsort(s->exported_names, s->exported_names_count,
            sizeof(s->exported_names[0]), exported_names_cmp, ctx);
 
+ add_names:
     for(i = 0; i < s->exported_names_count; i++) {
         ExportedNameEntry *en = &s->exported_names[i];
         switch(en->export_type) {
@@ -27759,10 +30245,17 @@ static int js_resolve_module(JSContext *ctx, JSModuleDef *m)
     /* resolve each requested module */
     for(i = 0; i < m->req_module_entries_count; i++) {
         JSReqModuleEntry *rme = &m->req_module_entries[i];
-        m1 = js_host_resolve_imported_module_atom(ctx, m->module_name,
-                                                  rme->module_name);
-        if (!m1)
-            return -1;
+        m1 = NULL;
+        /* the module names are already normalized if prelinked */
+        if (m->prelinked)
+            m1 = js_find_loaded_module(ctx, rme->module_name);
+        if (!m1) {
+            m->prelinked_exports = FALSE;
+            m1 = js_host_resolve_imported_module_atom(ctx, m->module_name,
+                                                      rme->module_name);
+            if (!m1)
+                return -1;
+        }
         rme->module = m1;
         /* already done in js_host_resolve_imported_module() except if
            the module was loaded with JS_EvalBinary() */
@@ -27785,6 +30278,7 @@ static JSVarRef *js_create_module_var(JSContext *ctx, BOOL is_lexical)
         var_ref->value = JS_UNDEFINED;
     var_ref->pvalue = &var_ref->value;
     var_ref->is_detached = TRUE;
+    var_ref->block = NULL;
     add_gc_object(ctx->rt, &var_ref->header, JS_GC_OBJ_TYPE_VAR_REF);
     return var_ref;
 }
@@ -27917,8 +30411,8 @@ static int js_link_module(JSContext *ctx, JSModuleDef *m)
         printf("instantiating module '%s':\n", JS_AtomGetStr(ctx, buf1, sizeof(buf1), m->module_name));
     }
 #endif
-    /* check the indirect exports */
-    for(i = 0; i < m->export_entries_count; i++) {
+    /* check the indirect exports (already done if prelinked) */
+    for(i = 0; i < m->export_entries_count && !m->prelinked_exports; i++) {
         JSExportEntry *me = &m->export_entries[i];
         if (me->export_type == JS_EXPORT_TYPE_INDIRECT &&
             me->local_name != JS_ATOM__star_) {
@@ -27976,8 +30470,17 @@ static int js_link_module(JSContext *ctx, JSModuleDef *m)
                 JSModuleDef *res_m;
                 JSObject *p1;
 
-                ret = js_resolve_export(ctx, &res_m,
-                                        &res_me, m1, mi->import_name);
+                res_me = NULL;
+                if (mi->res_export_idx >= 0) {
+                    res_me = js_get_prelinked_export(ctx, &res_m, m1,
+                                                     mi->res_module_name,
+                                                     mi->res_export_idx);
+                }
+                if (res_me)
+                    ret = JS_RESOLVE_RES_FOUND;
+                else
+                    ret = js_resolve_export(ctx, &res_m,
+                                            &res_me, m1, mi->import_name);
                 if (ret != JS_RESOLVE_RES_FOUND) {
                     js_resolve_export_throw_error(ctx, ret, m1, mi->import_name);
                     goto fail;
@@ -28498,6 +31001,8 @@ static int add_import(JSParseState *s, JSModuleDef *m,
     mi = &m->import_entries[m->import_entries_count++];
     mi->import_name = JS_DupAtom(ctx, import_name);
     mi->var_idx = var_idx;
+    mi->res_module_name = JS_ATOM_NULL;
+    mi->res_export_idx = -1;
     return 0;
 }
 
@@ -28698,6 +31203,7 @@ static JSFunctionDef *js_new_function_def(JSContext *ctx,
     fd->line_num = line_num;
 
     js_dbuf_init(ctx, &fd->pc2line);
+    js_dbuf_init(ctx, &fd->inline_ranges);
     //fd->pc2line_last_line_num = line_num;
     //fd->pc2line_last_pc = 0;
     fd->last_opcode_line_num = line_num;
@@ -28738,6 +31244,21 @@ static void free_bytecode_atoms(JSRuntime *rt,
     }
 }
 
+static void free_inline_funcs(JSContext *ctx, JSFunctionDef *fd)
+{
+    int i;
+
+    for(i = 0; i < fd->inline_func_count; i++) {
+        JSInlineFunc *f = &fd->inline_funcs[i];
+        js_free(ctx, f->var_undef);
+        js_free(ctx, f->byte_code);
+    }
+    js_free(ctx, fd->inline_funcs);
+    fd->inline_funcs = NULL;
+    fd->inline_func_count = 0;
+    fd->inline_func_size = 0;
+}
+
 static void js_free_function_def(JSContext *ctx, JSFunctionDef *fd)
 {
     int i;
@@ -28762,6 +31283,8 @@ static void js_free_function_def(JSContext *ctx, JSFunctionDef *fd)
     }
     js_free(ctx, fd->cpool);
 
+    free_inline_funcs(ctx, fd);
+
     JS_FreeAtom(ctx, fd->func_name);
 
     for(i = 0; i < fd->var_count; i++) {
@@ -28789,6 +31312,7 @@ static void js_free_function_def(JSContext *ctx, JSFunctionDef *fd)
 
     JS_FreeAtom(ctx, fd->filename);
     dbuf_free(&fd->pc2line);
+    dbuf_free(&fd->inline_ranges);
 
     js_free(ctx, fd->source);
 
@@ -29055,7 +31579,10 @@ static void dump_byte_code(JSContext *ctx, int pass,
         has_loc:
             printf(" %d: ", idx);
             if (idx < var_count) {
-                print_atom(ctx, vars[idx].var_name);
+                if (b)
+                    print_atom(ctx, b->vardefs[b->arg_count + idx].var_name);
+                else
+                    print_atom(ctx, vars[idx].var_name);
             }
             break;
         case OP_FMT_none_arg:
@@ -29066,7 +31593,10 @@ static void dump_byte_code(JSContext *ctx, int pass,
         has_arg:
             printf(" %d: ", idx);
             if (idx < arg_count) {
-                print_atom(ctx, args[idx].var_name);
+                if (b)
+                    print_atom(ctx, b->vardefs[idx].var_name);
+                else
+                    print_atom(ctx, args[idx].var_name);
             }
             break;
         case OP_FMT_none_var_ref:
@@ -29173,7 +31703,7 @@ static __maybe_unused void js_dump_function_bytecode(JSContext *ctx, JSFunctionB
     if (b->var_count && b->vardefs) {
         printf("  locals:\n");
         for(i = 0; i < b->var_count; i++) {
-            JSVarDef *vd = &b->vardefs[b->arg_count + i];
+            JSBytecodeVarDef *vd = &b->vardefs[b->arg_count + i];
             printf("%5d: %s %s", i,
                    vd->var_kind == JS_VAR_CATCH ? "catch" :
                    (vd->var_kind == JS_VAR_FUNCTION_DECL ||
@@ -29181,8 +31711,8 @@ static __maybe_unused void js_dump_function_bytecode(JSContext *ctx, JSFunctionB
                    vd->is_const ? "const" :
                    vd->is_lexical ? "let" : "var",
                    JS_AtomGetStr(ctx, atom_buf, sizeof(atom_buf), vd->var_name));
-            if (vd->scope_level)
-                printf(" [level:%d next:%d]", vd->scope_level, vd->scope_next);
+            if (vd->is_scoped)
+                printf(" [next:%d]", js_var_scope_next(vd));
             printf("\n");
         }
     }
@@ -29201,8 +31731,8 @@ static __maybe_unused void js_dump_function_bytecode(JSContext *ctx, JSFunctionB
     printf("  stack_size: %d\n", b->stack_size);
     printf("  opcodes:\n");
     dump_byte_code(ctx, 3, b->byte_code_buf, b->byte_code_len,
-                   b->vardefs, b->arg_count,
-                   b->vardefs ? b->vardefs + b->arg_count : NULL, b->var_count,
+                   NULL, b->vardefs ? b->arg_count : 0,
+                   NULL, b->vardefs ? b->var_count : 0,
                    b->closure_var, b->closure_var_count,
                    b->cpool, b->cpool_count,
                    b->has_debug ? b->debug.source : NULL,
@@ -29437,6 +31967,114 @@ static int optimize_scope_make_global_ref(JSContext *ctx, JSFunctionDef *s,
     return pos_next;
 }
 
+/* Same as optimize_scope_make_ref() for the references whose stack
+   depth must be kept (destructuring and logical assignments): the
+   label points directly to OP_put_ref_value. The reference is
+   removed when the following opcode only depends on its depth,
+   otherwise it is replaced by two placeholder values. */
+static int optimize_scope_make_ref_depth(JSContext *ctx, JSFunctionDef *s,
+                                         DynBuf *bc, uint8_t *bc_buf,
+                                         LabelSlot *ls, int pos_next,
+                                         int get_op, int var_idx)
+{
+    int label_pos, end_pos, pos;
+    BOOL has_ref;
+
+    has_ref = FALSE;
+    switch(bc_buf[pos_next]) {
+    case OP_rot3l: /* source ref -> ref source */
+    case OP_swap2: /* source prop ref -> ref source prop */
+        pos_next++;
+        break;
+    case OP_for_of_next:
+        /* the iterator is below the reference */
+        if (bc_buf[pos_next + 1] >= 2) {
+            dbuf_putc(bc, OP_for_of_next);
+            dbuf_putc(bc, bc_buf[pos_next + 1] - 2);
+            pos_next += 2;
+            break;
+        }
+        /* fall thru */
+    default:
+        dbuf_putc(bc, OP_undefined);
+        dbuf_putc(bc, OP_undefined);
+        if (bc_buf[pos_next] == OP_get_ref_value) {
+            dbuf_putc(bc, get_op);
+            dbuf_put_u16(bc, var_idx);
+            pos_next++;
+        }
+        has_ref = TRUE;
+        break;
+    }
+    /* replace the OP_label / OP_put_ref_value pair */
+    label_pos = ls->pos;
+    pos = label_pos - 5;
+    assert(bc_buf[pos] == OP_label && bc_buf[label_pos] == OP_put_ref_value);
+    end_pos = label_pos + 1;
+    bc_buf[pos] = get_op + 1;
+    put_u16(bc_buf + pos + 1, var_idx);
+    pos += 3;
+    if (has_ref) {
+        bc_buf[pos++] = OP_drop;
+        bc_buf[pos++] = OP_drop;
+    }
+    /* pad with OP_nop */
+    while (pos < end_pos)
+        bc_buf[pos++] = OP_nop;
+    return pos_next;
+}
+
+/* Same as optimize_scope_make_global_ref() for the references whose
+   stack depth must be kept. put_lvalue() emits an OP_nop after
+   OP_put_ref_value to make room for the replacement. */
+static int optimize_scope_make_global_ref_depth(JSContext *ctx,
+                                                JSFunctionDef *s,
+                                                DynBuf *bc, uint8_t *bc_buf,
+                                                LabelSlot *ls, int pos_next,
+                                                JSAtom var_name)
+{
+    int label_pos, end_pos, pos;
+    BOOL is_strict;
+    is_strict = ((s->js_mode & JS_MODE_STRICT) != 0);
+
+    if (is_strict) {
+        /* need to check if the variable exists before evaluating the right
+           expression */
+        dbuf_putc(bc, OP_check_var);
+        dbuf_put_u32(bc, JS_DupAtom(ctx, var_name));
+    } else {
+        dbuf_putc(bc, OP_undefined);
+    }
+    dbuf_putc(bc, OP_undefined);
+    if (bc_buf[pos_next] == OP_get_ref_value) {
+        dbuf_putc(bc, OP_get_var);
+        dbuf_put_u32(bc, JS_DupAtom(ctx, var_name));
+        pos_next++;
+    }
+    label_pos = ls->pos;
+    pos = label_pos - 5;
+    assert(bc_buf[pos] == OP_label && bc_buf[label_pos] == OP_put_ref_value &&
+           bc_buf[label_pos + 1] == OP_nop);
+    end_pos = label_pos + 2;
+    if (is_strict) {
+        /* exists undefined v -> exists v */
+        bc_buf[pos++] = OP_nip;
+        bc_buf[pos] = OP_put_var_strict;
+    } else {
+        bc_buf[pos] = OP_put_var;
+    }
+    put_u32(bc_buf + pos + 1, JS_DupAtom(ctx, var_name));
+    pos += 5;
+    if (!is_strict) {
+        bc_buf[pos++] = OP_drop;
+        bc_buf[pos++] = OP_drop;
+    }
+    /* pad with OP_nop */
+    while (pos < end_pos)
+        bc_buf[pos++] = OP_nop;
+    return pos_next;
+}
+
 static int add_var_this(JSContext *ctx, JSFunctionDef *fd)
 {
     int idx;
@@ -29596,7 +32234,9 @@ static int resolve_scope_var(JSContext *ctx, JSFunctionDef *s,
                 dbuf_putc(bc, OP_push_atom_value);
                 dbuf_put_u32(bc, JS_DupAtom(ctx, var_name));
             } else
-            if (label_done == -1 && can_opt_put_ref_value(bc_buf, ls->pos)) {
+            if (label_done == -1 &&
+                (can_opt_put_ref_value(bc_buf, ls->pos) ||
+                 bc_buf[ls->pos] == OP_put_ref_value)) {
                 int get_op;
                 if (var_idx & ARGUMENT_VAR_OFFSET) {
                     get_op = OP_get_arg;
@@ -29607,8 +32247,14 @@ static int resolve_scope_var(JSContext *ctx, JSFunctionDef *s,
                     else
                         get_op = OP_get_loc;
                 }
-                pos_next = optimize_scope_make_ref(ctx, s, bc, bc_buf, ls,
-                                                   pos_next, get_op, var_idx);
+                if (bc_buf[ls->pos] == OP_put_ref_value) {
+                    pos_next = optimize_scope_make_ref_depth(ctx, s, bc, bc_buf,
+                                                             ls, pos_next,
+                                                             get_op, var_idx);
+                } else {
+                    pos_next = optimize_scope_make_ref(ctx, s, bc, bc_buf, ls,
+                                                       pos_next, get_op, var_idx);
+                }
             } else {
                 /* Create a dummy object with a named slot that is
                    a reference to the local variable */
@@ -29835,15 +32481,23 @@ static int resolve_scope_var(JSContext *ctx, JSFunctionDef *s,
                     dbuf_put_u32(bc, JS_DupAtom(ctx, var_name));
                 } else
                 if (label_done == -1 &&
-                    can_opt_put_ref_value(bc_buf, ls->pos)) {
+                    (can_opt_put_ref_value(bc_buf, ls->pos) ||
+                     bc_buf[ls->pos] == OP_put_ref_value)) {
                     int get_op;
                     if (s->closure_var[idx].is_lexical)
                         get_op = OP_get_var_ref_check;
                     else
                         get_op = OP_get_var_ref;
-                    pos_next = optimize_scope_make_ref(ctx, s, bc, bc_buf, ls,
-                                                       pos_next,
-                                                       get_op, idx);
+                    if (bc_buf[ls->pos] == OP_put_ref_value) {
+                        pos_next = optimize_scope_make_ref_depth(ctx, s, bc,
+                                                                 bc_buf, ls,
+                                                                 pos_next,
+                                                                 get_op, idx);
+                    } else {
+                        pos_next = optimize_scope_make_ref(ctx, s, bc, bc_buf, ls,
+                                                           pos_next,
+                                                           get_op, idx);
+                    }
                 } else {
                     /* Create a dummy object with a named slot that is
                        a reference to the closure variable */
@@ -29901,6 +32555,12 @@ static int resolve_scope_var(JSContext *ctx, JSFunctionDef *s,
         if (label_done == -1 && can_opt_put_global_ref_value(bc_buf, ls->pos)) {
             pos_next = optimize_scope_make_global_ref(ctx, s, bc, bc_buf, ls,
                                                       pos_next, var_name);
+        } else if (label_done == -1 &&
+                   bc_buf[ls->pos] == OP_put_ref_value &&
+                   bc_buf[ls->pos + 1] == OP_nop) {
+            pos_next = optimize_scope_make_global_ref_depth(ctx, s, bc, bc_buf,
+                                                            ls, pos_next,
+                                                            var_name);
         } else {
             dbuf_putc(bc, OP_make_var_ref);
             dbuf_put_u32(bc, JS_DupAtom(ctx, var_name));
@@ -30134,14 +32794,14 @@ static void mark_eval_captured_variables(JSContext *ctx, JSFunctionDef *s,
 }
 
 /* XXX: should handle the argument scope generically */
-static BOOL is_var_in_arg_scope(const JSVarDef *vd)
+static BOOL is_var_in_arg_scope(JSAtom var_name, int var_kind)
 {
-    return (vd->var_name == JS_ATOM_home_object ||
-            vd->var_name == JS_ATOM_this_active_func ||
-            vd->var_name == JS_ATOM_new_target ||
-            vd->var_name == JS_ATOM_this ||
-            vd->var_name == JS_ATOM__arg_var_ ||
-            vd->var_kind == JS_VAR_FUNCTION_NAME);
+    return (var_name == JS_ATOM_home_object ||
+            var_name == JS_ATOM_this_active_func ||
+            var_name == JS_ATOM_new_target ||
+            var_name == JS_ATOM_this ||
+            var_name == JS_ATOM__arg_var_ ||
+            var_kind == JS_VAR_FUNCTION_NAME);
 }
 
 static void add_eval_variables(JSContext *ctx, JSFunctionDef *s)
@@ -30255,7 +32915,8 @@ static void add_eval_variables(JSContext *ctx, JSFunctionDef *s)
             for(i = 0; i < fd->var_count; i++) {
                 vd = &fd->vars[i];
                 /* do not close top level last result */
-                if (vd->scope_level == 0 && is_var_in_arg_scope(vd)) {
+                if (vd->scope_level == 0 &&
+                    is_var_in_arg_scope(vd->var_name, vd->var_kind)) {
                     get_closure_var(ctx, s, fd,
                                     FALSE, i, vd->var_name, FALSE, FALSE,
                                     JS_VAR_NORMAL);
@@ -30278,7 +32939,7 @@ static void add_eval_variables(JSContext *ctx, JSFunctionDef *s)
 }
 
 static void set_closure_from_var(JSContext *ctx, JSClosureVar *cv,
-                                 JSVarDef *vd, int var_idx)
+                                 JSBytecodeVarDef *vd, int var_idx)
 {
     cv->is_local = TRUE;
     cv->is_arg = FALSE;
@@ -30295,7 +32956,7 @@ static __exception int add_closure_variables(JSContext *ctx, JSFunctionDef *s,
                                              JSFunctionBytecode *b, int scope_idx)
 {
     int i, count;
-    JSVarDef *vd;
+    JSBytecodeVarDef *vd;
     BOOL is_arg_scope;
     
     count = b->arg_count + b->var_count + b->closure_var_count;
@@ -30310,11 +32971,11 @@ static __exception int add_closure_variables(JSContext *ctx, JSFunctionDef *s,
     /* Add lexical variables in scope at the point of evaluation */
     for (i = scope_idx; i >= 0;) {
         vd = &b->vardefs[b->arg_count + i];
-        if (vd->scope_level > 0) {
+        if (vd->is_scoped) {
             JSClosureVar *cv = &s->closure_var[s->closure_var_count++];
             set_closure_from_var(ctx, cv, vd, i);
         }
-        i = vd->scope_next;
+        i = js_var_scope_next(vd);
     }
     is_arg_scope = (i == ARG_SCOPE_END);
     if (!is_arg_scope) {
@@ -30333,7 +32994,7 @@ static __exception int add_closure_variables(JSContext *ctx, JSFunctionDef *s,
         /* Add local non lexical variables */
         for(i = 0; i < b->var_count; i++) {
             vd = &b->vardefs[b->arg_count + i];
-            if (vd->scope_level == 0 && vd->var_name != JS_ATOM__ret_) {
+            if (!vd->is_scoped && vd->var_name != JS_ATOM__ret_) {
                 JSClosureVar *cv = &s->closure_var[s->closure_var_count++];
                 set_closure_from_var(ctx, cv, vd, i);
             }
@@ -30342,7 +33003,8 @@ static __exception int add_closure_variables(JSContext *ctx, JSFunctionDef *s,
         /* only add pseudo variables */
         for(i = 0; i < b->var_count; i++) {
             vd = &b->vardefs[b->arg_count + i];
-            if (vd->scope_level == 0 && is_var_in_arg_scope(vd)) {
+            if (!vd->is_scoped &&
+                is_var_in_arg_scope(vd->var_name, vd->var_kind)) {
                 JSClosureVar *cv = &s->closure_var[s->closure_var_count++];
                 set_closure_from_var(ctx, cv, vd, i);
             }
@@ -30407,6 +33069,8 @@ static BOOL code_match(CodeContext *s, int pos, ...)
             if (op == OP_line_num) {
                 line_num = get_u32(tab + pos + 1);
                 pos = pos_next;
+            } else if (op == OP_nop) {
+                pos = pos_next;
             } else {
                 break;
             }
@@ -31075,14 +33739,25 @@ static void add_pc2line_info(JSFunctionDef *s, uint32_t pc, int line_num)
     }
 }
 
-static void compute_pc2line_info(JSFunctionDef *s)
+static void add_inline_range(JSFunctionDef *s, JSInlineRange *r,
+                             uint32_t pc_end)
+{
+    r->pc_end = pc_end;
+    if (r->pc_end > r->pc_start)
+        dbuf_put(&s->inline_ranges, (const uint8_t *)r, sizeof(*r));
+}
+
+static void compute_pc2line_info(JSFunctionDef *s, int code_len)
 {
     if (!(s->js_mode & JS_MODE_STRIP) && s->line_number_slots) {
         int last_line_num = s->line_num;
         uint32_t last_pc = 0;
-        int i;
+        int i, call_line, cpool_idx;
+        JSInlineRange range;
 
         js_dbuf_init(s->ctx, &s->pc2line);
+        range.cpool_idx = -1;
+        call_line = s->line_num;
         for (i = 0; i < s->line_number_count; i++) {
             uint32_t pc = s->line_number_slots[i].pc;
             int line_num = s->line_number_slots[i].line_num;
@@ -31091,6 +33766,22 @@ static void compute_pc2line_info(JSFunctionDef *s)
             if (line_num < 0)
                 continue;
 
+            /* the ranges of inlined code are stored separately */
+            cpool_idx = -1;
+            if (line_num & INLINE_LINE_FLAG) {
+                cpool_idx = (line_num & ~INLINE_LINE_FLAG) >> INLINE_LINE_BITS;
+                line_num &= INLINE_LINE_MAX;
+            }
+            if (cpool_idx != range.cpool_idx) {
+                if (range.cpool_idx >= 0)
+                    add_inline_range(s, &range, pc);
+                range.pc_start = pc;
+                range.cpool_idx = cpool_idx;
+                range.call_line = call_line;
+            }
+            if (cpool_idx < 0)
+                call_line = line_num;
+
             diff_pc = pc - last_pc;
             diff_line = line_num - last_line_num;
             if (diff_line == 0 || diff_pc < 0)
@@ -31110,6 +33801,8 @@ static void compute_pc2line_info(JSFunctionDef *s)
             last_pc = pc;
             last_line_num = line_num;
         }
+        if (range.cpool_idx >= 0)
+            add_inline_range(s, &range, code_len);
     }
 }
 
@@ -31169,6 +33862,7 @@ static int find_jump_target(JSFunctionDef *s, int label, int *pop, int *pline)
                     *pline = get_u32(s->byte_code.buf + pos + 1);
                 /* fall thru */
             case OP_label:
+            case OP_nop:
                 pos += opcode_info[op].size;
                 continue;
             case OP_goto:
@@ -31342,7 +34036,7 @@ static __exception int resolve_labels(JSContext *ctx, JSFunctionDef *s)
         }
     }
     /* initialize the 'arguments' variable if needed */
-    if (s->arguments_var_idx >= 0) {
+    if (s->arguments_var_idx >= 0 && !s->lazy_arguments) {
         if ((s->js_mode & JS_MODE_STRICT) || !s->has_simple_parameter_list) {
             dbuf_putc(&bc_out, OP_special_object);
             dbuf_putc(&bc_out, OP_SPECIAL_OBJECT_ARGUMENTS);
@@ -31385,6 +34079,10 @@ static __exception int resolve_labels(JSContext *ctx, JSFunctionDef *s)
             line_num = get_u32(bc_buf + pos + 1);
             break;
 
+        case OP_nop:
+            /* remove erased code */
+            break;
+
         case OP_label:
             {
                 label = get_u32(bc_buf + pos + 1);
@@ -31741,6 +34439,11 @@ static __exception int resolve_labels(JSContext *ctx, JSFunctionDef *s)
                     pos_next = cc.pos;
                     break;
                 }
+                /* transform push_atom_value(x) to_propkey -> push_atom_value(x) */
+                if (code_match(&cc, pos_next, OP_to_propkey, -1)) {
+                    if (cc.line_num >= 0) line_num = cc.line_num;
+                    pos_next = cc.pos;
+                }
 #if SHORT_OPCODES
                 if (atom == JS_ATOM_empty_string) {
                     JS_FreeAtom(ctx, atom);
@@ -31862,6 +34565,12 @@ static __exception int resolve_labels(JSContext *ctx, JSFunctionDef *s)
                  */
                 int idx;
                 idx = get_u16(bc_buf + pos + 1);
+                /* remove get_loc/drop pairs left by remove_dead_stores() */
+                if (code_match(&cc, pos_next, OP_drop, -1)) {
+                    if (cc.line_num >= 0) line_num = cc.line_num;
+                    pos_next = cc.pos;
+                    break;
+                }
                 if (idx >= 256)
                     goto no_change;
                 if (code_match(&cc, pos_next, M2(OP_post_dec, OP_post_inc), OP_put_loc, idx, OP_drop, -1) ||
@@ -32138,7 +34847,7 @@ static __exception int resolve_labels(JSContext *ctx, JSFunctionDef *s)
     js_free(ctx, s->label_slots);
     s->label_slots = NULL;
     /* XXX: should delay until copying to runtime bytecode function */
-    compute_pc2line_info(s);
+    compute_pc2line_info(s, bc_out.size);
     js_free(ctx, s->line_number_slots);
     s->line_number_slots = NULL;
     /* set the new byte code */
@@ -32348,1334 +35057,4200 @@ static __exception int compute_stack_size(JSContext *ctx,
     return -1;
 }
 
-static int add_module_variables(JSContext *ctx, JSFunctionDef *fd)
-{
-    int i, idx;
-    JSModuleDef *m = fd->module;
-    JSExportEntry *me;
-    JSGlobalVar *hf;
-
-    /* The imported global variables were added as closure variables
-       in js_parse_import(). We add here the module global
-       variables. */
+/* Removal of the TDZ checks: a forward dataflow analysis of the code
+   generated by resolve_variables() computes the lexical variables
+   which are initialized on all the paths reaching each
+   instruction. Their get_loc_check and put_loc_check opcodes are
+   replaced by get_loc and put_loc so that resolve_labels() can
+   optimize them. Only the function itself can set a local variable to
+   the uninitialized state (set_loc_uninitialized), so closures and
+   direct eval() can be ignored. At most 64 variables are tracked. */
 
-    for(i = 0; i < fd->global_var_count; i++) {
-        hf = &fd->global_vars[i];
-        if (add_closure_var(ctx, fd, TRUE, FALSE, i, hf->var_name, hf->is_const,
-                            hf->is_lexical, FALSE) < 0)
-            return -1;
-    }
+typedef struct TDZCheckState {
+    uint64_t *init_tab; /* initialized variables at each position */
+    uint8_t *visited_tab;
+    int *pc_stack;
+    int pc_stack_len;
+    int pc_stack_size;
+} TDZCheckState;
 
-    /* resolve the variable names of the local exports */
-    for(i = 0; i < m->export_entries_count; i++) {
-        me = &m->export_entries[i];
-        if (me->export_type == JS_EXPORT_TYPE_LOCAL) {
-            idx = find_closure_var(ctx, fd, me->local_name);
-            if (idx < 0) {
-                JS_ThrowSyntaxErrorAtom(ctx, "exported variable '%s' does not exist",
-                                        me->local_name);
-                return -1;
-            }
-            me->u.local.var_idx = idx;
-        }
+static __exception int tdz_check_add_pc(JSContext *ctx, TDZCheckState *s,
+                                        int pos, uint64_t init_mask)
+{
+    if (s->visited_tab[pos]) {
+        init_mask &= s->init_tab[pos];
+        if (init_mask == s->init_tab[pos])
+            return 0;
     }
+    s->visited_tab[pos] = 1;
+    s->init_tab[pos] = init_mask;
+    if (js_resize_array(ctx, (void **)&s->pc_stack, sizeof(s->pc_stack[0]),
+                        &s->pc_stack_size, s->pc_stack_len + 1))
+        return -1;
+    s->pc_stack[s->pc_stack_len++] = pos;
     return 0;
 }
 
-/* create a function object from a function definition. The function
-   definition is freed. All the child functions are also created. It
-   must be done this way to resolve all the variables. */
-static JSValue js_create_function(JSContext *ctx, JSFunctionDef *fd)
+static __exception int tdz_check_add_label(JSContext *ctx, TDZCheckState *s,
+                                           JSFunctionDef *fd, int label,
+                                           uint64_t init_mask)
 {
-    JSValue func_obj;
-    JSFunctionBytecode *b;
-    struct list_head *el, *el1;
-    int stack_size, scope, idx;
-    int function_size, byte_code_offset, cpool_offset;
-    int closure_var_offset, vardefs_offset;
+    int pos;
+    assert(label >= 0 && label < fd->label_count);
+    pos = fd->label_slots[label].pos2;
+    assert(pos >= 0 && pos <= fd->byte_code.size);
+    if (pos == fd->byte_code.size)
+        return 0; /* label at the end of the function: no code */
+    return tdz_check_add_pc(ctx, s, pos, init_mask);
+}
 
-    /* recompute scope linkage */
-    for (scope = 0; scope < fd->scope_count; scope++) {
-        fd->scopes[scope].first = -1;
-    }
-    if (fd->has_parameter_expressions) {
-        /* special end of variable list marker for the argument scope */
-        fd->scopes[ARG_SCOPE_INDEX].first = ARG_SCOPE_END;
-    }
-    for (idx = 0; idx < fd->var_count; idx++) {
-        JSVarDef *vd = &fd->vars[idx];
-        vd->scope_next = fd->scopes[vd->scope_level].first;
-        fd->scopes[vd->scope_level].first = idx;
-    }
-    for (scope = 2; scope < fd->scope_count; scope++) {
-        JSVarScope *sd = &fd->scopes[scope];
-        if (sd->first < 0)
-            sd->first = fd->scopes[sd->parent].first;
-    }
-    for (idx = 0; idx < fd->var_count; idx++) {
-        JSVarDef *vd = &fd->vars[idx];
-        if (vd->scope_next < 0 && vd->scope_level > 1) {
-            scope = fd->scopes[vd->scope_level].parent;
-            vd->scope_next = fd->scopes[scope].first;
+static __exception int remove_tdz_checks(JSContext *ctx, JSFunctionDef *fd)
+{
+    TDZCheckState s_s, *s = &s_s;
+    uint8_t *bc_buf = fd->byte_code.buf;
+    int bc_len = fd->byte_code.size;
+    int pos, pos_next, pos1, op, idx, label, var_count, i;
+    int8_t *var_bit; /* bit of the tracked variables or -1 */
+    uint64_t init_mask, mask;
+
+    if (bc_len == 0 || fd->var_count == 0)
+        return 0;
+    var_bit = js_malloc(ctx, sizeof(var_bit[0]) * fd->var_count);
+    if (!var_bit)
+        return -1;
+    memset(var_bit, -1, sizeof(var_bit[0]) * fd->var_count);
+    /* track the variables having checks */
+    var_count = 0;
+    for(pos = 0; pos < bc_len; pos = pos_next) {
+        op = bc_buf[pos];
+        pos_next = pos + opcode_info[op].size;
+        if (op == OP_get_loc_check || op == OP_put_loc_check) {
+            idx = get_u16(bc_buf + pos + 1);
+            if (var_bit[idx] < 0 && var_count < 64)
+                var_bit[idx] = var_count++;
         }
     }
-
-    /* if the function contains an eval call, the closure variables
-       are used to compile the eval and they must be ordered by scope,
-       so it is necessary to create the closure variables before any
-       other variable lookup is done. */
-    if (fd->has_eval_call)
-        add_eval_variables(ctx, fd);
-
-    /* add the module global variables in the closure */
-    if (fd->module) {
-        if (add_module_variables(ctx, fd))
-            goto fail;
+    if (var_count == 0) {
+        js_free(ctx, var_bit);
+        return 0;
     }
 
-    /* first create all the child functions */
-    list_for_each_safe(el, el1, &fd->child_list) {
-        JSFunctionDef *fd1;
-        int cpool_idx;
+    s->init_tab = js_malloc(ctx, sizeof(s->init_tab[0]) * bc_len);
+    s->visited_tab = js_mallocz(ctx, sizeof(s->visited_tab[0]) * bc_len);
+    s->pc_stack = NULL;
+    s->pc_stack_len = 0;
+    s->pc_stack_size = 0;
+    if (!s->init_tab || !s->visited_tab)
+        goto fail;
 
-        fd1 = list_entry(el, JSFunctionDef, link);
-        cpool_idx = fd1->parent_cpool_idx;
-        func_obj = js_create_function(ctx, fd1);
-        if (JS_IsException(func_obj))
-            goto fail;
-        /* save it in the constant pool */
-        assert(cpool_idx >= 0);
-        fd->cpool[cpool_idx] = func_obj;
+    /* the tracked variables are lexical, hence uninitialized when
+       entering the function */
+    if (tdz_check_add_pc(ctx, s, 0, 0))
+        goto fail;
+    while (s->pc_stack_len > 0) {
+        pos = s->pc_stack[--s->pc_stack_len];
+        init_mask = s->init_tab[pos];
+        op = bc_buf[pos];
+        pos_next = pos + opcode_info[op].size;
+        switch(op) {
+        case OP_set_loc_uninitialized:
+        case OP_put_loc:
+        case OP_set_loc:
+        case OP_put_loc_check_init:
+        case OP_get_loc_check:
+        case OP_put_loc_check:
+            idx = get_u16(bc_buf + pos + 1);
+            if (var_bit[idx] >= 0) {
+                mask = (uint64_t)1 << var_bit[idx];
+                if (op == OP_set_loc_uninitialized) {
+                    init_mask &= ~mask;
+                } else {
+                    /* the variable is initialized if the opcode did
+                       not throw */
+                    init_mask |= mask;
+                }
+            }
+            break;
+        case OP_return:
+        case OP_return_undef:
+        case OP_return_async:
+        case OP_throw:
+        case OP_throw_error:
+        case OP_ret:
+            goto done_insn;
+        case OP_goto:
+            label = get_u32(bc_buf + pos + 1);
+            if (tdz_check_add_label(ctx, s, fd, label, init_mask))
+                goto fail;
+            goto done_insn;
+        case OP_if_true:
+        case OP_if_false:
+        case OP_gosub:
+            label = get_u32(bc_buf + pos + 1);
+            if (tdz_check_add_label(ctx, s, fd, label, init_mask))
+                goto fail;
+            break;
+        case OP_catch:
+            /* the exception may be raised anywhere in the protected
+               code, so the variables it sets to uninitialized are
+               removed */
+            label = get_u32(bc_buf + pos + 1);
+            mask = init_mask;
+            for(pos1 = pos_next; pos1 < fd->label_slots[label].pos2;
+                pos1 += opcode_info[bc_buf[pos1]].size) {
+                if (bc_buf[pos1] == OP_set_loc_uninitialized) {
+                    idx = get_u16(bc_buf + pos1 + 1);
+                    if (var_bit[idx] >= 0)
+                        mask &= ~((uint64_t)1 << var_bit[idx]);
+                }
+            }
+            if (tdz_check_add_label(ctx, s, fd, label, mask))
+                goto fail;
+            break;
+        case OP_with_get_var:
+        case OP_with_put_var:
+        case OP_with_delete_var:
+        case OP_with_make_ref:
+        case OP_with_get_ref:
+        case OP_with_get_ref_undef:
+            label = get_u32(bc_buf + pos + 5);
+            if (tdz_check_add_label(ctx, s, fd, label, init_mask))
+                goto fail;
+            break;
+        default:
+            break;
+        }
+        if (pos_next < bc_len) {
+            if (tdz_check_add_pc(ctx, s, pos_next, init_mask))
+                goto fail;
+        }
+    done_insn: ;
     }
 
-#if defined(DUMP_BYTECODE) && (DUMP_BYTECODE & 4)
-    if (!(fd->js_mode & JS_MODE_STRIP)) {
-        printf("pass 1\n");
-        dump_byte_code(ctx, 1, fd->byte_code.buf, fd->byte_code.size,
-                       fd->args, fd->arg_count, fd->vars, fd->var_count,
-                       fd->closure_var, fd->closure_var_count,
-                       fd->cpool, fd->cpool_count, fd->source, fd->line_num,
-                       fd->label_slots, NULL);
-        printf("\n");
+    /* remove the checks of the initialized variables */
+    for(pos = 0; pos < bc_len; pos = pos_next) {
+        op = bc_buf[pos];
+        pos_next = pos + opcode_info[op].size;
+        if ((op == OP_get_loc_check || op == OP_put_loc_check) &&
+            s->visited_tab[pos]) {
+            idx = get_u16(bc_buf + pos + 1);
+            i = var_bit[idx];
+            if (i >= 0 && ((s->init_tab[pos] >> i) & 1)) {
+                bc_buf[pos] = (op == OP_get_loc_check) ? OP_get_loc : OP_put_loc;
+            }
+        }
     }
-#endif
-
-    if (resolve_variables(ctx, fd))
-        goto fail;
+    js_free(ctx, var_bit);
+    js_free(ctx, s->init_tab);
+    js_free(ctx, s->visited_tab);
+    js_free(ctx, s->pc_stack);
+    return 0;
+ fail:
+    js_free(ctx, var_bit);
+    js_free(ctx, s->init_tab);
+    js_free(ctx, s->visited_tab);
+    js_free(ctx, s->pc_stack);
+    return -1;
+}
 
-#if defined(DUMP_BYTECODE) && (DUMP_BYTECODE & 2)
-    if (!(fd->js_mode & JS_MODE_STRIP)) {
-        printf("pass 2\n");
-        dump_byte_code(ctx, 2, fd->byte_code.buf, fd->byte_code.size,
-                       fd->args, fd->arg_count, fd->vars, fd->var_count,
-                       fd->closure_var, fd->closure_var_count,
-                       fd->cpool, fd->cpool_count, fd->source, fd->line_num,
-                       fd->label_slots, NULL);
-        printf("\n");
-    }
-#endif
+/* Lazy arguments object: if 'arguments' is only used as
+   'arguments.length', 'arguments[i]' or as the last argument of a
+   method call with two arguments such as 'f.apply(this, arguments)',
+   the object is not created at the start of the function. These uses
+   read the arguments from the stack frame and the object is only
+   created at run time for the other property names and for the
+   methods other than Function.prototype.apply. Only the normal
+   functions without direct eval() are handled. The initialization
+   of the arguments variable is then not emitted by resolve_labels(). */
 
-    if (resolve_labels(ctx, fd))
-        goto fail;
+enum {
+    ARGS_COPY,
+    ARGS_REMOVE,
+    ARGS_LENGTH,
+    ARGS_EL,
+    ARGS_APPLY,
+};
 
-    if (compute_stack_size(ctx, fd, &stack_size) < 0)
-        goto fail;
+/* return the position of the instruction using the value pushed by
+   the instruction at 'pos' and set '*pdepth' to the number of values
+   above it. Return -1 if the value is not used in the same basic
+   block. */
+static int find_value_use(JSFunctionDef *fd, int pos, int *pdepth)
+{
+    const uint8_t *bc_buf = fd->byte_code.buf;
+    int bc_len = fd->byte_code.size;
+    const JSOpCode *oi;
+    int op, depth, n_pop;
 
-    if (fd->js_mode & JS_MODE_STRIP) {
-        function_size = offsetof(JSFunctionBytecode, debug);
-    } else {
-        function_size = sizeof(*b);
-    }
-    cpool_offset = function_size;
-    function_size += fd->cpool_count * sizeof(*fd->cpool);
-    vardefs_offset = function_size;
-    if (!(fd->js_mode & JS_MODE_STRIP) || fd->has_eval_call) {
-        function_size += (fd->arg_count + fd->var_count) * sizeof(*b->vardefs);
+    depth = 0;
+    for(pos += opcode_info[bc_buf[pos]].size; pos < bc_len; pos += oi->size) {
+        op = bc_buf[pos];
+        oi = &opcode_info[op];
+        switch(oi->fmt) {
+        case OP_FMT_label:
+        case OP_FMT_label_u16:
+        case OP_FMT_atom_label_u8:
+        case OP_FMT_atom_label_u16:
+            return -1;
+        default:
+            break;
+        }
+        if (op == OP_return_undef || op == OP_throw_error)
+            return -1;
+        n_pop = oi->n_pop;
+        if (oi->fmt == OP_FMT_npop || oi->fmt == OP_FMT_npop_u16)
+            n_pop += get_u16(bc_buf + pos + 1);
+        if (n_pop > depth) {
+            *pdepth = depth;
+            return pos;
+        }
+        depth += oi->n_push - n_pop;
     }
-    closure_var_offset = function_size;
-    function_size += fd->closure_var_count * sizeof(*fd->closure_var);
-    byte_code_offset = function_size;
-    function_size += fd->byte_code.size;
-
-    b = js_mallocz(ctx, function_size);
-    if (!b)
-        goto fail;
-    b->header.ref_count = 1;
+    return -1;
+}
 
-    b->byte_code_buf = (void *)((uint8_t*)b + byte_code_offset);
-    b->byte_code_len = fd->byte_code.size;
-    memcpy(b->byte_code_buf, fd->byte_code.buf, fd->byte_code.size);
-    js_free(ctx, fd->byte_code.buf);
-    fd->byte_code.buf = NULL;
+static __exception int optimize_arguments(JSContext *ctx, JSFunctionDef *fd)
+{
+    uint8_t *bc_buf = fd->byte_code.buf;
+    int bc_len = fd->byte_code.size;
+    int pos, pos_next, pos1, op, i, depth, var_idx, type;
+    BOOL args_written, needs_values;
+    uint8_t *action;
+    DynBuf bc_out;
 
-    b->func_name = fd->func_name;
-    if (fd->arg_count + fd->var_count > 0) {
-        if ((fd->js_mode & JS_MODE_STRIP) && !fd->has_eval_call) {
-            /* Strip variable definitions not needed at runtime */
-            int i;
-            for(i = 0; i < fd->var_count; i++) {
-                JS_FreeAtom(ctx, fd->vars[i].var_name);
-            }
-            for(i = 0; i < fd->arg_count; i++) {
-                JS_FreeAtom(ctx, fd->args[i].var_name);
-            }
-            for(i = 0; i < fd->closure_var_count; i++) {
-                JS_FreeAtom(ctx, fd->closure_var[i].var_name);
-                fd->closure_var[i].var_name = JS_ATOM_NULL;
+    var_idx = fd->arguments_var_idx;
+    if (var_idx < 0 || fd->arguments_arg_idx >= 0 || fd->has_eval_call ||
+        fd->func_kind != JS_FUNC_NORMAL || fd->vars[var_idx].is_captured)
+        return 0;
+    /* the values of the captured arguments could be modified during
+       the call of OP_apply_arguments */
+    for(i = 0; i < fd->arg_count; i++) {
+        if (fd->args[i].is_captured)
+            return 0;
+    }
+    action = js_mallocz(ctx, bc_len);
+    if (!action)
+        return -1;
+    if ((fd->js_mode & JS_MODE_STRICT) || !fd->has_simple_parameter_list)
+        type = OP_SPECIAL_OBJECT_ARGUMENTS;
+    else
+        type = OP_SPECIAL_OBJECT_MAPPED_ARGUMENTS;
+    args_written = FALSE;
+    needs_values = FALSE;
+    for(pos = 0; pos < bc_len; pos = pos_next) {
+        op = bc_buf[pos];
+        pos_next = pos + opcode_info[op].size;
+        switch(op) {
+        case OP_put_arg:
+        case OP_set_arg:
+        case OP_make_arg_ref:
+            args_written = TRUE;
+            break;
+        case OP_get_loc:
+            if (get_u16(bc_buf + pos + 1) != var_idx)
+                break;
+            pos1 = find_value_use(fd, pos, &depth);
+            if (pos1 < 0)
+                goto done;
+            if (depth == 0 && bc_buf[pos1] == OP_get_field &&
+                get_u32(bc_buf + pos1 + 1) == JS_ATOM_length) {
+                action[pos] = ARGS_LENGTH;
+                action[pos1] = ARGS_REMOVE;
+            } else if (depth == 1 && bc_buf[pos1] == OP_get_array_el) {
+                action[pos] = ARGS_REMOVE;
+                action[pos1] = ARGS_EL;
+                needs_values = TRUE;
+            } else if (depth == 0 && bc_buf[pos1] == OP_call_method &&
+                       get_u16(bc_buf + pos1 + 1) == 2) {
+                action[pos] = ARGS_REMOVE;
+                action[pos1] = ARGS_APPLY;
+                needs_values = TRUE;
+            } else {
+                goto done;
             }
-        } else {
-            b->vardefs = (void *)((uint8_t*)b + vardefs_offset);
-            memcpy(b->vardefs, fd->args, fd->arg_count * sizeof(fd->args[0]));
-            memcpy(b->vardefs + fd->arg_count, fd->vars, fd->var_count * sizeof(fd->vars[0]));
+            break;
+        case OP_put_loc:
+        case OP_set_loc:
+        case OP_set_loc_uninitialized:
+        case OP_get_loc_check:
+        case OP_put_loc_check:
+        case OP_put_loc_check_init:
+        case OP_close_loc:
+            if (get_u16(bc_buf + pos + 1) == var_idx)
+                goto done;
+            break;
+        case OP_make_loc_ref:
+            if (get_u16(bc_buf + pos + 5) == var_idx)
+                goto done;
+            break;
+        default:
+            break;
         }
-        b->var_count = fd->var_count;
-        b->arg_count = fd->arg_count;
-        b->defined_arg_count = fd->defined_arg_count;
-        js_free(ctx, fd->args);
-        js_free(ctx, fd->vars);
-    }
-    b->cpool_count = fd->cpool_count;
-    if (b->cpool_count) {
-        b->cpool = (void *)((uint8_t*)b + cpool_offset);
-        memcpy(b->cpool, fd->cpool, b->cpool_count * sizeof(*b->cpool));
     }
-    js_free(ctx, fd->cpool);
-    fd->cpool = NULL;
+    /* the unmapped arguments object contains the initial values */
+    if (type == OP_SPECIAL_OBJECT_ARGUMENTS && args_written && needs_values)
+        goto done;
 
-    b->stack_size = stack_size;
+    js_dbuf_init(ctx, &bc_out);
+    for(pos = 0; pos < bc_len; pos = pos_next) {
+        op = bc_buf[pos];
+        pos_next = pos + opcode_info[op].size;
+        switch(action[pos]) {
+        case ARGS_REMOVE:
+            if (op == OP_get_field)
+                JS_FreeAtom(ctx, get_u32(bc_buf + pos + 1));
+            continue;
+        case ARGS_LENGTH:
+            dbuf_putc(&bc_out, OP_arguments_length);
+            continue;
+        case ARGS_EL:
+            dbuf_putc(&bc_out, OP_arguments_el);
+            dbuf_putc(&bc_out, type);
+            continue;
+        case ARGS_APPLY:
+            dbuf_putc(&bc_out, OP_apply_arguments);
+            dbuf_putc(&bc_out, type);
+            continue;
+        default:
+            break;
+        }
+        if (op == OP_label) {
+            fd->label_slots[get_u32(bc_buf + pos + 1)].pos2 =
+                bc_out.size + opcode_info[op].size;
+        }
+        dbuf_put(&bc_out, bc_buf + pos, pos_next - pos);
+    }
+    if (dbuf_error(&bc_out)) {
+        dbuf_free(&bc_out);
+        js_free(ctx, action);
+        return -1;
+    }
+    dbuf_free(&fd->byte_code);
+    fd->byte_code = bc_out;
+    fd->lazy_arguments = TRUE;
+ done:
+    js_free(ctx, action);
+    return 0;
+}
 
-    if (fd->js_mode & JS_MODE_STRIP) {
-        JS_FreeAtom(ctx, fd->filename);
-        dbuf_free(&fd->pc2line);    // probably useless
-    } else {
-        /* XXX: source and pc2line info should be packed at the end of the
-           JSFunctionBytecode structure, avoiding allocation overhead
-         */
-        b->has_debug = 1;
-        b->debug.filename = fd->filename;
-        b->debug.line_num = fd->line_num;
-
-        //DynBuf pc2line;
-        //compute_pc2line_info(fd, &pc2line);
-        //js_free(ctx, fd->line_number_slots)
-        b->debug.pc2line_buf = js_realloc(ctx, fd->pc2line.buf, fd->pc2line.size);
-        if (!b->debug.pc2line_buf)
-            b->debug.pc2line_buf = fd->pc2line.buf;
-        b->debug.pc2line_len = fd->pc2line.size;
-        b->debug.source = fd->source;
-        b->debug.source_len = fd->source_len;
+/* Inlining of the calls to small inner functions. The pass 2 code of
+   an inner function is saved in its parent if it only depends on its
+   arguments (no closure variables, 'this', 'arguments' or inner
+   functions) and if it has no exception handler. A call 'f(a, b)'
+   where 'f' is a lexical variable only initialized with this function
+   is replaced by the function code in which the arguments and the
+   local variables are new local variables of the parent. */
+
+#define JS_INLINE_MAX_CODE_SIZE 64 /* maximum size of an inlined function */
+#define JS_INLINE_MAX_GROWTH  4096 /* maximum size added to a function */
+
+/* return TRUE if the pass 2 code of 'fd' can be inlined in its parent */
+static BOOL js_function_can_be_inlined(JSFunctionDef *fd)
+{
+    const uint8_t *bc_buf = fd->byte_code.buf;
+    int pos, op, len, i, tag;
+
+    if (!fd->parent || fd->parent_cpool_idx < 0 ||
+        fd->func_kind != JS_FUNC_NORMAL ||
+        fd->func_type > JS_PARSE_FUNC_ARROW ||
+        fd->has_eval_call || !fd->has_simple_parameter_list ||
+        fd->closure_var_count != 0 || !list_empty(&fd->child_list) ||
+        fd->this_var_idx >= 0 || fd->arguments_var_idx >= 0 ||
+        fd->new_target_var_idx >= 0 || fd->this_active_func_var_idx >= 0 ||
+        fd->home_object_var_idx >= 0 || fd->func_var_idx >= 0 ||
+        fd->var_object_idx >= 0 || fd->arg_var_object_idx >= 0 ||
+        ((fd->js_mode ^ fd->parent->js_mode) &
+         (JS_MODE_STRICT | JS_MODE_MATH)) ||
+        fd->parent_cpool_idx > INLINE_CPOOL_IDX_MAX ||
+        fd->line_num > INLINE_LINE_MAX)
+        return FALSE;
+    for(i = 0; i < fd->cpool_count; i++) {
+        tag = JS_VALUE_GET_TAG(fd->cpool[i]);
+        if (tag == JS_TAG_OBJECT || tag == JS_TAG_FUNCTION_BYTECODE)
+            return FALSE;
     }
-    if (fd->scopes != fd->def_scope_array)
-        js_free(ctx, fd->scopes);
-
-    b->closure_var_count = fd->closure_var_count;
-    if (b->closure_var_count) {
-        b->closure_var = (void *)((uint8_t*)b + closure_var_offset);
-        memcpy(b->closure_var, fd->closure_var, b->closure_var_count * sizeof(*b->closure_var));
+    len = 0;
+    for(pos = 0; pos < fd->byte_code.size; pos += opcode_info[op].size) {
+        op = bc_buf[pos];
+        switch(op) {
+        case OP_line_num:
+            if (get_u32(bc_buf + pos + 1) > INLINE_LINE_MAX)
+                return FALSE;
+            continue;
+        case OP_push_i32:
+        case OP_push_const:
+        case OP_push_atom_value:
+        case OP_undefined:
+        case OP_null:
+        case OP_push_false:
+        case OP_push_true:
+        case OP_object:
+        case OP_drop:
+        case OP_nip:
+        case OP_nip1:
+        case OP_dup:
+        case OP_dup1:
+        case OP_dup2:
+        case OP_dup3:
+        case OP_insert2:
+        case OP_insert3:
+        case OP_insert4:
+        case OP_perm3:
+        case OP_perm4:
+        case OP_perm5:
+        case OP_swap:
+        case OP_swap2:
+        case OP_rot3l:
+        case OP_rot3r:
+        case OP_rot4l:
+        case OP_rot5l:
+        case OP_call:
+        case OP_call_method:
+        case OP_call_constructor:
+        case OP_array_from:
+        case OP_return:
+        case OP_return_undef:
+        case OP_throw:
+        case OP_throw_error:
+        case OP_get_var_undef:
+        case OP_get_var:
+        case OP_put_var:
+        case OP_put_var_strict:
+        case OP_get_field:
+        case OP_get_field2:
+        case OP_put_field:
+        case OP_get_array_el:
+        case OP_get_array_el2:
+        case OP_put_array_el:
+        case OP_define_field:
+        case OP_define_array_el:
+        case OP_get_loc:
+        case OP_put_loc:
+        case OP_set_loc:
+        case OP_get_arg:
+        case OP_put_arg:
+        case OP_set_arg:
+        case OP_set_loc_uninitialized:
+        case OP_if_false:
+        case OP_if_true:
+        case OP_goto:
+        case OP_label:
+        case OP_to_propkey:
+        case OP_to_propkey2:
+        case OP_neg:
+        case OP_plus:
+        case OP_dec:
+        case OP_inc:
+        case OP_post_dec:
+        case OP_post_inc:
+        case OP_not:
+        case OP_lnot:
+        case OP_typeof:
+        case OP_mul:
+        case OP_div:
+        case OP_mod:
+        case OP_add:
+        case OP_sub:
+        case OP_pow:
+        case OP_shl:
+        case OP_sar:
+        case OP_shr:
+        case OP_lt:
+        case OP_lte:
+        case OP_gt:
+        case OP_gte:
+        case OP_instanceof:
+        case OP_in:
+        case OP_eq:
+        case OP_neq:
+        case OP_strict_eq:
+        case OP_strict_neq:
+        case OP_and:
+        case OP_xor:
+        case OP_or:
+        case OP_is_undefined_or_null:
+            break;
+        default:
+            return FALSE;
+        }
+        len += opcode_info[op].size;
     }
-    js_free(ctx, fd->closure_var);
-    fd->closure_var = NULL;
+    return len <= JS_INLINE_MAX_CODE_SIZE;
+}
 
-    b->has_prototype = fd->has_prototype;
-    b->has_simple_parameter_list = fd->has_simple_parameter_list;
-    b->js_mode = fd->js_mode;
-    b->is_derived_class_constructor = fd->is_derived_class_constructor;
-    b->func_kind = fd->func_kind;
-    b->need_home_object = (fd->home_object_var_idx >= 0 ||
-                           fd->need_home_object);
-    b->new_target_allowed = fd->new_target_allowed;
-    b->super_call_allowed = fd->super_call_allowed;
-    b->super_allowed = fd->super_allowed;
-    b->arguments_allowed = fd->arguments_allowed;
-    b->backtrace_barrier = fd->backtrace_barrier;
-    b->realm = JS_DupContext(ctx);
+/* save the pass 2 code of 'fd' in its parent */
+static __exception int js_save_inline_func(JSContext *ctx, JSFunctionDef *fd)
+{
+    JSFunctionDef *parent = fd->parent;
+    JSInlineFunc *f;
+    int i;
 
-    add_gc_object(ctx->rt, &b->header, JS_GC_OBJ_TYPE_FUNCTION_BYTECODE);
-    
-#if defined(DUMP_BYTECODE) && (DUMP_BYTECODE & 1)
-    if (!(fd->js_mode & JS_MODE_STRIP)) {
-        js_dump_function_bytecode(ctx, b);
+    if (js_resize_array(ctx, (void **)&parent->inline_funcs,
+                        sizeof(parent->inline_funcs[0]),
+                        &parent->inline_func_size,
+                        parent->inline_func_count + 1))
+        return -1;
+    f = &parent->inline_funcs[parent->inline_func_count];
+    f->cpool_idx = fd->parent_cpool_idx;
+    f->line_num = fd->line_num;
+    f->arg_count = fd->arg_count;
+    f->var_count = fd->var_count;
+    f->label_count = fd->label_count;
+    f->byte_code_len = fd->byte_code.size;
+    f->byte_code = js_malloc(ctx, max_int(fd->byte_code.size, 1));
+    f->var_undef = js_malloc(ctx, max_int(fd->var_count, 1));
+    if (!f->byte_code || !f->var_undef) {
+        js_free(ctx, f->byte_code);
+        js_free(ctx, f->var_undef);
+        return -1;
     }
-#endif
+    memcpy(f->byte_code, fd->byte_code.buf, fd->byte_code.size);
+    /* the lexical variables are set by the function code */
+    for(i = 0; i < fd->var_count; i++)
+        f->var_undef[i] = !fd->vars[i].is_lexical;
+    parent->inline_func_count++;
+    return 0;
+}
 
-    if (fd->parent) {
-        /* remove from parent list */
-        list_del(&fd->link);
+static JSInlineFunc *find_inline_func(JSFunctionDef *fd, int cpool_idx)
+{
+    int i;
+    for(i = 0; i < fd->inline_func_count; i++) {
+        if (fd->inline_funcs[i].cpool_idx == cpool_idx)
+            return &fd->inline_funcs[i];
     }
+    return NULL;
+}
 
-    js_free(ctx, fd);
-    return JS_MKPTR(JS_TAG_FUNCTION_BYTECODE, b);
- fail:
-    js_free_function_def(ctx, fd);
-    return JS_EXCEPTION;
+static void emit_inline_line_num(JSFunctionDef *fd, DynBuf *bc, int line_num)
+{
+    dbuf_putc(bc, OP_line_num);
+    dbuf_put_u32(bc, line_num);
+    fd->line_number_size++;
 }
 
-static void free_function_bytecode(JSRuntime *rt, JSFunctionBytecode *b)
+/* emit the code of 'f' for a call with 'argc' arguments at the line
+   'call_line'. The arguments and the variables of 'f' start at the
+   local variable 'var_base'. */
+static __exception int emit_inline_call(JSContext *ctx, JSFunctionDef *fd,
+                                        DynBuf *bc, JSInlineFunc *f,
+                                        int argc, int var_base, int call_line)
 {
-    int i;
+    JSFunctionBytecode *b = JS_VALUE_GET_PTR(fd->cpool[f->cpool_idx]);
+    const uint8_t *bc_buf = f->byte_code;
+    int pos, pos_next, op, i, idx, label_end, line_flags;
+    int *label_map;
 
-#if 0
-    {
-        char buf[ATOM_GET_STR_BUF_SIZE];
-        printf("freeing %s\n",
-               JS_AtomGetStrRT(rt, buf, sizeof(buf), b->func_name));
-    }
-#endif
-    free_bytecode_atoms(rt, b->byte_code_buf, b->byte_code_len, TRUE);
+    label_map = js_malloc(ctx, sizeof(label_map[0]) * (f->label_count + 1));
+    if (!label_map)
+        return -1;
+    for(i = 0; i < f->label_count; i++)
+        label_map[i] = -1;
+    label_end = -1;
 
-    if (b->vardefs) {
-        for(i = 0; i < b->arg_count + b->var_count; i++) {
-            JS_FreeAtomRT(rt, b->vardefs[i].var_name);
+    /* store the arguments */
+    for(i = argc; i-- > 0;) {
+        if (i < f->arg_count) {
+            dbuf_putc(bc, OP_put_loc);
+            dbuf_put_u16(bc, var_base + i);
+        } else {
+            dbuf_putc(bc, OP_drop);
         }
     }
-    for(i = 0; i < b->cpool_count; i++)
-        JS_FreeValueRT(rt, b->cpool[i]);
-
-    for(i = 0; i < b->closure_var_count; i++) {
-        JSClosureVar *cv = &b->closure_var[i];
-        JS_FreeAtomRT(rt, cv->var_name);
+    for(i = argc; i < f->arg_count; i++) {
+        dbuf_putc(bc, OP_undefined);
+        dbuf_putc(bc, OP_put_loc);
+        dbuf_put_u16(bc, var_base + i);
     }
-    if (b->realm)
-        JS_FreeContext(b->realm);
-
-    JS_FreeAtomRT(rt, b->func_name);
-    if (b->has_debug) {
-        JS_FreeAtomRT(rt, b->debug.filename);
-        js_free_rt(rt, b->debug.pc2line_buf);
-        js_free_rt(rt, b->debug.source);
+    /* the 'var' variables are undefined when entering the function */
+    for(i = 0; i < f->var_count; i++) {
+        if (f->var_undef[i]) {
+            dbuf_putc(bc, OP_undefined);
+            dbuf_putc(bc, OP_put_loc);
+            dbuf_put_u16(bc, var_base + f->arg_count + i);
+        }
     }
 
-    remove_gc_object(&b->header);
-    if (rt->gc_phase == JS_GC_PHASE_REMOVE_CYCLES && b->header.ref_count != 0) {
-        list_add_tail(&b->header.link, &rt->gc_zero_ref_count_list);
-    } else {
-        js_free_rt(rt, b);
+    line_flags = INLINE_LINE_FLAG | (f->cpool_idx << INLINE_LINE_BITS);
+    emit_inline_line_num(fd, bc, line_flags | f->line_num);
+    for(pos = 0; pos < f->byte_code_len; pos = pos_next) {
+        op = bc_buf[pos];
+        pos_next = pos + opcode_info[op].size;
+        switch(opcode_info[op].fmt) {
+        case OP_FMT_arg:
+            /* the arguments are local variables */
+            dbuf_putc(bc, op - OP_get_arg + OP_get_loc);
+            dbuf_put_u16(bc, var_base + get_u16(bc_buf + pos + 1));
+            break;
+        case OP_FMT_loc:
+            dbuf_putc(bc, op);
+            dbuf_put_u16(bc, var_base + f->arg_count +
+                         get_u16(bc_buf + pos + 1));
+            break;
+        case OP_FMT_const:
+            idx = get_u32(bc_buf + pos + 1);
+            if (js_resize_array(ctx, (void **)&fd->cpool, sizeof(fd->cpool[0]),
+                                &fd->cpool_size, fd->cpool_count + 1))
+                goto fail;
+            fd->cpool[fd->cpool_count] = JS_DupValue(ctx, b->cpool[idx]);
+            dbuf_putc(bc, op);
+            dbuf_put_u32(bc, fd->cpool_count++);
+            break;
+        case OP_FMT_atom:
+        case OP_FMT_atom_u8:
+            JS_DupAtom(ctx, get_u32(bc_buf + pos + 1));
+            dbuf_put(bc, bc_buf + pos, pos_next - pos);
+            break;
+        case OP_FMT_label:
+            idx = get_u32(bc_buf + pos + 1);
+            if (label_map[idx] < 0) {
+                label_map[idx] = new_label_fd(fd, -1);
+                if (label_map[idx] < 0)
+                    goto fail;
+            }
+            idx = label_map[idx];
+            dbuf_putc(bc, op);
+            dbuf_put_u32(bc, idx);
+            if (op == OP_label) {
+                fd->label_slots[idx].pos2 = bc->size;
+            } else {
+                fd->label_slots[idx].ref_count++;
+                fd->jump_size++;
+            }
+            break;
+        default:
+            switch(op) {
+            case OP_line_num:
+                emit_inline_line_num(fd, bc,
+                                     line_flags | get_u32(bc_buf + pos + 1));
+                break;
+            case OP_return_undef:
+                dbuf_putc(bc, OP_undefined);
+                /* fall thru */
+            case OP_return:
+                if (pos_next == f->byte_code_len)
+                    break;
+                /* the return value is on the stack */
+                if (label_end < 0) {
+                    label_end = new_label_fd(fd, -1);
+                    if (label_end < 0)
+                        goto fail;
+                }
+                dbuf_putc(bc, OP_goto);
+                dbuf_put_u32(bc, label_end);
+                fd->label_slots[label_end].ref_count++;
+                fd->jump_size++;
+                break;
+            default:
+                dbuf_put(bc, bc_buf + pos, pos_next - pos);
+                break;
+            }
+            break;
+        }
+    }
+    if (label_end >= 0) {
+        dbuf_putc(bc, OP_label);
+        dbuf_put_u32(bc, label_end);
+        fd->label_slots[label_end].pos2 = bc->size;
     }
+    emit_inline_line_num(fd, bc, call_line);
+    js_free(ctx, label_map);
+    return 0;
+ fail:
+    js_free(ctx, label_map);
+    return -1;
 }
 
-static __exception int js_parse_directives(JSParseState *s)
-{
-    char str[20];
-    JSParsePos pos;
-    BOOL has_semi;
-
-    if (s->token.val != TOK_STRING)
-        return 0;
-
-    js_parse_get_pos(s, &pos);
+typedef struct InlineCallSite {
+    int call_pos; /* position of OP_call */
+    JSInlineFunc *func;
+} InlineCallSite;
 
-    while(s->token.val == TOK_STRING) {
-        /* Copy actual source string representation */
-        snprintf(str, sizeof str, "%.*s",
-                 (int)(s->buf_ptr - s->token.ptr - 2), s->token.ptr + 1);
+/* replace the calls to the functions of fd->inline_funcs by their
+   code. 'fd' must contain the pass 2 code. */
+static __exception int inline_function_calls(JSContext *ctx, JSFunctionDef *fd)
+{
+    uint8_t *bc_buf = fd->byte_code.buf;
+    int bc_len = fd->byte_code.size;
+    int pos, pos_next, pos_prev, pos_prev2, pos1, op, idx, i, n_pop, n_push;
+    int argc;
+    int sp, stack_size, site_count, site_size, growth, var_base, var_count;
+    int line_num;
+    int *stack, *var_func;
+    InlineCallSite *sites, *site;
+    JSInlineFunc *f;
+    JSVarDef *vd;
+    DynBuf bc_out;
 
-        if (next_token(s))
-            return -1;
+    stack = NULL;
+    var_func = NULL;
+    sites = NULL;
+    if (fd->inline_func_count == 0 || fd->has_eval_call ||
+        fd->var_count == 0)
+        goto done;
 
-        has_semi = FALSE;
-        switch (s->token.val) {
-        case ';':
-            if (next_token(s))
-                return -1;
-            has_semi = TRUE;
+    /* find the variables which are only initialized with an inlinable
+       function: var_func[idx] is the function pool index, -1 if none
+       and -2 if the variable is modified elsewhere */
+    var_func = js_malloc(ctx, sizeof(var_func[0]) * fd->var_count);
+    if (!var_func)
+        goto fail;
+    for(i = 0; i < fd->var_count; i++)
+        var_func[i] = -1;
+    pos_prev = -1;
+    pos_prev2 = -1;
+    for(pos = 0; pos < bc_len; pos_prev2 = pos_prev, pos_prev = pos,
+            pos = pos_next) {
+        op = bc_buf[pos];
+        pos_next = pos + opcode_info[op].size;
+        switch(op) {
+        case OP_put_loc:
+        case OP_put_loc_check_init:
+            idx = get_u16(bc_buf + pos + 1);
+            vd = &fd->vars[idx];
+            /* 'fclosure [set_name] put_loc' */
+            pos1 = pos_prev;
+            if (pos1 >= 0 && bc_buf[pos1] == OP_set_name)
+                pos1 = pos_prev2;
+            if (var_func[idx] == -1 && pos1 >= 0 &&
+                bc_buf[pos1] == OP_fclosure &&
+                (!vd->is_captured || vd->is_const) &&
+                find_inline_func(fd, get_u32(bc_buf + pos1 + 1))) {
+                /* the lexical variables are always initialized
+                   before use if they have no TDZ check. The 'var'
+                   function definitions are initialized when entering
+                   the function. */
+                if (vd->is_lexical ||
+                    (vd->scope_level == 0 &&
+                     vd->func_pool_idx == get_u32(bc_buf + pos1 + 1))) {
+                    var_func[idx] = get_u32(bc_buf + pos1 + 1);
+                    if (pos1 != pos_prev) {
+                        /* the name of an anonymous function is
+                           otherwise only set in its closure, but it
+                           is needed in the backtraces of the inlined
+                           calls */
+                        JSFunctionBytecode *b = JS_VALUE_GET_PTR(fd->cpool[var_func[idx]]);
+                        if (b->func_name == JS_ATOM_NULL) {
+                            b->func_name = JS_DupAtom(ctx, get_u32(bc_buf + pos_prev + 1));
+                        }
+                    }
+                    break;
+                }
+            }
+            var_func[idx] = -2;
             break;
-        case '}':
-        case TOK_EOF:
-            has_semi = TRUE;
+        case OP_set_loc:
+        case OP_put_loc_check:
+            var_func[get_u16(bc_buf + pos + 1)] = -2;
             break;
-        case TOK_NUMBER:
-        case TOK_STRING:
-        case TOK_TEMPLATE:
-        case TOK_IDENT:
-        case TOK_REGEXP:
-        case TOK_DEC:
-        case TOK_INC:
-        case TOK_NULL:
-        case TOK_FALSE:
-        case TOK_TRUE:
-        case TOK_IF:
-        case TOK_RETURN:
-        case TOK_VAR:
-        case TOK_THIS:
-        case TOK_DELETE:
-        case TOK_TYPEOF:
-        case TOK_NEW:
-        case TOK_DO:
-        case TOK_WHILE:
-        case TOK_FOR:
-        case TOK_SWITCH:
-        case TOK_THROW:
-        case TOK_TRY:
-        case TOK_FUNCTION:
-        case TOK_DEBUGGER:
-        case TOK_WITH:
-        case TOK_CLASS:
-        case TOK_CONST:
-        case TOK_ENUM:
-        case TOK_EXPORT:
-        case TOK_IMPORT:
-        case TOK_SUPER:
-        case TOK_INTERFACE:
-        case TOK_LET:
-        case TOK_PACKAGE:
-        case TOK_PRIVATE:
-        case TOK_PROTECTED:
-        case TOK_PUBLIC:
-        case TOK_STATIC:
-            /* automatic insertion of ';' */
-            if (s->got_lf)
-                has_semi = TRUE;
+        case OP_make_loc_ref:
+            var_func[get_u16(bc_buf + pos + 5)] = -2;
             break;
         default:
             break;
         }
-        if (!has_semi)
-            break;
-        if (!strcmp(str, "use strict")) {
-            s->cur_func->has_use_strict = TRUE;
-            s->cur_func->js_mode |= JS_MODE_STRICT;
+    }
+
+    /* find the call sites by following the producer of each stack
+       slot in the straight line code */
+    stack_size = 0;
+    site_count = 0;
+    site_size = 0;
+    growth = 0;
+    var_count = 0;
+    sp = 0;
+    for(pos = 0; pos < bc_len; pos = pos_next) {
+        op = bc_buf[pos];
+        pos_next = pos + opcode_info[op].size;
+        n_pop = opcode_info[op].n_pop;
+        n_push = opcode_info[op].n_push;
+        if (opcode_info[op].fmt == OP_FMT_npop ||
+            opcode_info[op].fmt == OP_FMT_npop_u16)
+            n_pop += get_u16(bc_buf + pos + 1);
+        if (op == OP_call) {
+            argc = get_u16(bc_buf + pos + 1);
+            if (sp > argc) {
+                pos1 = stack[sp - argc - 1];
+                if (bc_buf[pos1] == OP_get_loc &&
+                    var_func[get_u16(bc_buf + pos1 + 1)] >= 0) {
+                    f = find_inline_func(fd, var_func[get_u16(bc_buf + pos1 + 1)]);
+                    if (growth + f->byte_code_len <= JS_INLINE_MAX_GROWTH &&
+                        fd->var_count + f->arg_count + f->var_count <= JS_MAX_LOCAL_VARS) {
+                        var_count = max_int(var_count,
+                                            f->arg_count + f->var_count);
+                        if (js_resize_array(ctx, (void **)&sites,
+                                            sizeof(sites[0]), &site_size,
+                                            site_count + 1))
+                            goto fail;
+                        site = &sites[site_count++];
+                        site->call_pos = pos;
+                        site->func = f;
+                        growth += f->byte_code_len;
+                        /* the function value is no longer needed */
+                        memset(bc_buf + pos1, OP_nop, opcode_info[OP_get_loc].size);
+                    }
+                }
+            }
         }
-#if !defined(DUMP_BYTECODE) || !(DUMP_BYTECODE & 8)
-        else if (!strcmp(str, "use strip")) {
-            s->cur_func->js_mode |= JS_MODE_STRIP;
+        if (opcode_info[op].fmt == OP_FMT_label ||
+            opcode_info[op].fmt == OP_FMT_atom_label_u8 ||
+            opcode_info[op].fmt == OP_FMT_atom_label_u16) {
+            /* control flow: the stack content is no longer known */
+            sp = 0;
+            continue;
         }
-#endif
-#ifdef CONFIG_BIGNUM
-        else if (s->ctx->bignum_ext && !strcmp(str, "use math")) {
-            s->cur_func->js_mode |= JS_MODE_MATH;
+        sp = max_int(sp - n_pop, 0);
+        if (js_resize_array(ctx, (void **)&stack, sizeof(stack[0]),
+                            &stack_size, sp + n_push))
+            goto fail;
+        for(i = 0; i < n_push; i++)
+            stack[sp++] = pos;
+    }
+    if (site_count == 0)
+        goto done;
+
+    /* The inlined code is never interrupted by another inlined code,
+       so all the call sites use the same new variables. They have no
+       name because the inlined code has no TDZ check. */
+    var_base = fd->var_count;
+    for(i = 0; i < var_count; i++) {
+        if (add_var(ctx, fd, JS_ATOM_NULL) < 0)
+            goto fail;
+    }
+
+    /* rewrite the code */
+    js_dbuf_init(ctx, &bc_out);
+    site = sites;
+    line_num = fd->line_num;
+    for(pos = 0; pos < bc_len; pos = pos_next) {
+        op = bc_buf[pos];
+        pos_next = pos + opcode_info[op].size;
+        if (site < sites + site_count && pos == site->call_pos) {
+            f = site->func;
+            if (emit_inline_call(ctx, fd, &bc_out, f,
+                                 get_u16(bc_buf + pos + 1), var_base,
+                                 line_num))
+                goto fail1;
+            site++;
+            continue;
         }
-#endif
+        if (op == OP_line_num) {
+            line_num = get_u32(bc_buf + pos + 1);
+        } else if (op == OP_label) {
+            fd->label_slots[get_u32(bc_buf + pos + 1)].pos2 =
+                bc_out.size + opcode_info[op].size;
+        } else if (op == OP_nop) {
+            continue;
+        }
+        dbuf_put(&bc_out, bc_buf + pos, pos_next - pos);
     }
-    return js_parse_seek_token(s, &pos);
+    if (dbuf_error(&bc_out))
+        goto fail1;
+    dbuf_free(&fd->byte_code);
+    fd->byte_code = bc_out;
+ done:
+    free_inline_funcs(ctx, fd);
+    js_free(ctx, stack);
+    js_free(ctx, var_func);
+    js_free(ctx, sites);
+    return 0;
+ fail1:
+    dbuf_free(&bc_out);
+ fail:
+    free_inline_funcs(ctx, fd);
+    js_free(ctx, stack);
+    js_free(ctx, var_func);
+    js_free(ctx, sites);
+    return -1;
 }
 
-static int js_parse_function_check_names(JSParseState *s, JSFunctionDef *fd,
-                                         JSAtom func_name)
+/* Dead store elimination: a backward liveness analysis of the local
+   variables is done on the code generated by resolve_variables(). A
+   store to a variable which is not read on any path after it is
+   removed, together with the push of the stored value if it has no
+   side effect. Only the variables which are not captured by a closure
+   nor referenced by make_loc_ref are tracked (at most 64) and the
+   functions using the direct eval() are skipped. The exception
+   handlers are assumed to be reachable from any instruction. */
+
+/* live variables before the instruction following 'label' */
+static uint64_t dse_live_at_label(JSFunctionDef *fd, const uint64_t *live_tab,
+                                  int label)
 {
-    JSAtom name;
-    int i, idx;
+    int pos;
+    assert(label >= 0 && label < fd->label_count);
+    pos = fd->label_slots[label].pos2;
+    if (pos >= fd->byte_code.size)
+        return 0;
+    return live_tab[pos];
+}
 
-    if (fd->js_mode & JS_MODE_STRICT) {
-        if (!fd->has_simple_parameter_list && fd->has_use_strict) {
-            return js_parse_error(s, "\"use strict\" not allowed in function with default or destructuring parameter");
-        }
-        if (func_name == JS_ATOM_eval || func_name == JS_ATOM_arguments) {
-            return js_parse_error(s, "invalid function name in strict code");
+/* live variables after the instruction at 'pos' */
+static uint64_t dse_live_out(JSFunctionDef *fd, const uint64_t *live_tab,
+                             int pos, uint64_t exc_mask)
+{
+    const uint8_t *bc_buf = fd->byte_code.buf;
+    int op, pos_next;
+    uint64_t mask;
+
+    op = bc_buf[pos];
+    pos_next = pos + opcode_info[op].size;
+    mask = exc_mask;
+    switch(op) {
+    case OP_return:
+    case OP_return_undef:
+    case OP_return_async:
+    case OP_throw:
+    case OP_throw_error:
+        return mask;
+    case OP_ret:
+        /* the return address is not known */
+        return ~(uint64_t)0;
+    case OP_goto:
+        return mask | dse_live_at_label(fd, live_tab, get_u32(bc_buf + pos + 1));
+    case OP_if_true:
+    case OP_if_false:
+    case OP_catch:
+    case OP_gosub:
+        mask |= dse_live_at_label(fd, live_tab, get_u32(bc_buf + pos + 1));
+        break;
+    case OP_with_get_var:
+    case OP_with_put_var:
+    case OP_with_delete_var:
+    case OP_with_make_ref:
+    case OP_with_get_ref:
+    case OP_with_get_ref_undef:
+        mask |= dse_live_at_label(fd, live_tab, get_u32(bc_buf + pos + 5));
+        break;
+    default:
+        break;
+    }
+    if (pos_next < fd->byte_code.size)
+        mask |= live_tab[pos_next];
+    return mask;
+}
+
+/* return TRUE if 'op' pushes a value without side effect */
+static BOOL dse_is_pure_push(int op)
+{
+    switch(op) {
+    case OP_push_i32:
+    case OP_push_const:
+    case OP_push_atom_value:
+    case OP_undefined:
+    case OP_null:
+    case OP_push_false:
+    case OP_push_true:
+    case OP_fclosure:
+    case OP_get_loc:
+    case OP_get_arg:
+    case OP_get_var_ref:
+    case OP_dup:
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+static void dse_erase_code(JSContext *ctx, uint8_t *bc_buf, int pos)
+{
+    int op = bc_buf[pos];
+    if (op == OP_push_atom_value)
+        JS_FreeAtom(ctx, get_u32(bc_buf + pos + 1));
+    memset(bc_buf + pos, OP_nop, opcode_info[op].size);
+}
+
+static __exception int remove_dead_stores(JSContext *ctx, JSFunctionDef *fd)
+{
+    uint8_t *bc_buf = fd->byte_code.buf;
+    int bc_len = fd->byte_code.size;
+    int pos, pos_next, pos1, prev_pos, op, idx, var_count, i, n;
+    int8_t *var_bit; /* bit of the tracked variables or -1 */
+    int *pos_tab;
+    uint64_t *live_tab, live, exc_mask, mask, def;
+    BOOL changed;
+
+    if (bc_len == 0 || fd->var_count == 0 || fd->has_eval_call)
+        return 0;
+    var_bit = js_malloc(ctx, sizeof(var_bit[0]) * fd->var_count);
+    if (!var_bit)
+        return -1;
+    /* the captured variables and the ones referenced by make_loc_ref
+       are not tracked */
+    for(i = 0; i < fd->var_count; i++)
+        var_bit[i] = fd->vars[i].is_captured ? -2 : -1;
+    n = 0;
+    for(pos = 0; pos < bc_len; pos = pos_next) {
+        op = bc_buf[pos];
+        pos_next = pos + opcode_info[op].size;
+        if (op == OP_make_loc_ref)
+            var_bit[get_u16(bc_buf + pos + 5)] = -2;
+        n++;
+    }
+    var_count = 0;
+    for(pos = 0; pos < bc_len; pos = pos_next) {
+        op = bc_buf[pos];
+        pos_next = pos + opcode_info[op].size;
+        switch(op) {
+        case OP_put_loc:
+        case OP_set_loc:
+        case OP_set_loc_uninitialized:
+            idx = get_u16(bc_buf + pos + 1);
+            if (var_bit[idx] == -1 && var_count < 64)
+                var_bit[idx] = var_count++;
+            break;
+        default:
+            break;
         }
-        for (idx = 0; idx < fd->arg_count; idx++) {
-            name = fd->args[idx].var_name;
+    }
+    if (var_count == 0) {
+        js_free(ctx, var_bit);
+        return 0;
+    }
 
-            if (name == JS_ATOM_eval || name == JS_ATOM_arguments) {
-                return js_parse_error(s, "invalid argument name in strict code");
+    pos_tab = js_malloc(ctx, sizeof(pos_tab[0]) * n);
+    live_tab = js_mallocz(ctx, sizeof(live_tab[0]) * bc_len);
+    if (!pos_tab || !live_tab) {
+        js_free(ctx, var_bit);
+        js_free(ctx, pos_tab);
+        js_free(ctx, live_tab);
+        return -1;
+    }
+    n = 0;
+    for(pos = 0; pos < bc_len; pos += opcode_info[bc_buf[pos]].size)
+        pos_tab[n++] = pos;
+
+    /* iterate until the live variables are stable. The sets only grow,
+       so the loop terminates. */
+    exc_mask = 0;
+    do {
+        changed = FALSE;
+        mask = 0;
+        for(i = n - 1; i >= 0; i--) {
+            pos = pos_tab[i];
+            op = bc_buf[pos];
+            live = dse_live_out(fd, live_tab, pos, exc_mask);
+            switch(op) {
+            case OP_get_loc:
+            case OP_get_loc_check:
+            case OP_put_loc_check: /* these two read the TDZ state */
+            case OP_put_loc_check_init:
+                idx = get_u16(bc_buf + pos + 1);
+                if (var_bit[idx] >= 0)
+                    live |= (uint64_t)1 << var_bit[idx];
+                break;
+            case OP_put_loc:
+            case OP_set_loc:
+            case OP_set_loc_uninitialized:
+                idx = get_u16(bc_buf + pos + 1);
+                if (var_bit[idx] >= 0)
+                    live &= ~((uint64_t)1 << var_bit[idx]);
+                break;
+            case OP_catch:
+                mask |= dse_live_at_label(fd, live_tab, get_u32(bc_buf + pos + 1));
+                break;
+            default:
+                break;
+            }
+            if (live != live_tab[pos]) {
+                live_tab[pos] = live;
+                changed = TRUE;
             }
         }
-    }
-    /* check async_generator case */
-    if ((fd->js_mode & JS_MODE_STRICT)
-    ||  !fd->has_simple_parameter_list
-    ||  (fd->func_type == JS_PARSE_FUNC_METHOD && fd->func_kind == JS_FUNC_ASYNC)
-    ||  fd->func_type == JS_PARSE_FUNC_ARROW
-    ||  fd->func_type == JS_PARSE_FUNC_METHOD) {
-        for (idx = 0; idx < fd->arg_count; idx++) {
-            name = fd->args[idx].var_name;
-            if (name != JS_ATOM_NULL) {
-                for (i = 0; i < idx; i++) {
-                    if (fd->args[i].var_name == name)
-                        goto duplicate;
-                }
-                /* Check if argument name duplicates a destructuring parameter */
-                /* XXX: should have a flag for such variables */
-                for (i = 0; i < fd->var_count; i++) {
-                    if (fd->vars[i].var_name == name &&
-                        fd->vars[i].scope_level == 0)
-                        goto duplicate;
+        if (mask != exc_mask) {
+            exc_mask = mask;
+            changed = TRUE;
+        }
+    } while (changed);
+
+    /* remove the dead stores */
+    prev_pos = -1;
+    for(i = 0; i < n; i++) {
+        pos = pos_tab[i];
+        op = bc_buf[pos];
+        if (op == OP_line_num || op == OP_nop)
+            continue;
+        switch(op) {
+        case OP_put_loc:
+        case OP_set_loc:
+        case OP_set_loc_uninitialized:
+            idx = get_u16(bc_buf + pos + 1);
+            if (var_bit[idx] < 0)
+                break;
+            def = (uint64_t)1 << var_bit[idx];
+            live = dse_live_out(fd, live_tab, pos, exc_mask);
+            if (op == OP_put_loc && i + 1 < n) {
+                /* put_loc(x) get_loc(x) -> nothing if 'x' is dead
+                   after get_loc */
+                pos1 = pos_tab[i + 1];
+                if (bc_buf[pos1] == OP_line_num && i + 2 < n)
+                    pos1 = pos_tab[i + 2];
+                if (bc_buf[pos1] == OP_get_loc &&
+                    get_u16(bc_buf + pos1 + 1) == idx &&
+                    !(dse_live_out(fd, live_tab, pos1, exc_mask) & def)) {
+                    dse_erase_code(ctx, bc_buf, pos);
+                    dse_erase_code(ctx, bc_buf, pos1);
+                    prev_pos = -1;
+                    continue;
                 }
             }
+            if (live & def)
+                break;
+            if (op == OP_set_loc || op == OP_set_loc_uninitialized) {
+                dse_erase_code(ctx, bc_buf, pos);
+            } else if (prev_pos >= 0 && dse_is_pure_push(bc_buf[prev_pos])) {
+                dse_erase_code(ctx, bc_buf, prev_pos);
+                dse_erase_code(ctx, bc_buf, pos);
+            } else {
+                dse_erase_code(ctx, bc_buf, pos);
+                bc_buf[pos] = OP_drop;
+                prev_pos = pos;
+                continue;
+            }
+            prev_pos = -1;
+            continue;
+        default:
+            break;
         }
+        prev_pos = pos;
     }
+    js_free(ctx, var_bit);
+    js_free(ctx, pos_tab);
+    js_free(ctx, live_tab);
     return 0;
-
-duplicate:
-    return js_parse_error(s, "duplicate argument names not allowed in this context");
 }
 
-/* create a function to initialize class fields */
-static JSFunctionDef *js_parse_function_class_fields_init(JSParseState *s)
+/* return TRUE if the scope 'scope' is 'ancestor' or is enclosed in it */
+static BOOL scope_is_enclosed(JSFunctionDef *fd, int scope, int ancestor)
 {
-    JSFunctionDef *fd;
-    
-    fd = js_new_function_def(s->ctx, s->cur_func, FALSE, FALSE,
-                             s->filename, 0);
-    if (!fd)
-        return NULL;
-    fd->func_name = JS_ATOM_NULL;
-    fd->has_prototype = FALSE;
-    fd->has_home_object = TRUE;
-    
-    fd->has_arguments_binding = FALSE;
-    fd->has_this_binding = TRUE;
-    fd->is_derived_class_constructor = FALSE;
-    fd->new_target_allowed = TRUE;
-    fd->super_call_allowed = FALSE;
-    fd->super_allowed = fd->has_home_object;
-    fd->arguments_allowed = FALSE;
-    
-    fd->func_kind = JS_FUNC_NORMAL;
-    fd->func_type = JS_PARSE_FUNC_METHOD;
-    return fd;
+    while (scope >= 0) {
+        if (scope == ancestor)
+            return TRUE;
+        scope = fd->scopes[scope].parent;
+    }
+    return FALSE;
 }
 
-/* func_name must be JS_ATOM_NULL for JS_PARSE_FUNC_STATEMENT and
-   JS_PARSE_FUNC_EXPR, JS_PARSE_FUNC_ARROW and JS_PARSE_FUNC_VAR */
-static __exception int js_parse_function_decl2(JSParseState *s,
-                                               JSParseFunctionEnum func_type,
-                                               JSFunctionKindEnum func_kind,
-                                               JSAtom func_name,
-                                               const uint8_t *ptr,
-                                               int function_line_num,
-                                               JSParseExportEnum export_flag,
-                                               JSFunctionDef **pfd)
-{
-    JSContext *ctx = s->ctx;
-    JSFunctionDef *fd = s->cur_func;
-    BOOL is_expr;
-    int func_idx, lexical_func_idx = -1;
-    BOOL has_opt_arg;
-    BOOL create_func_var = FALSE;
+/* Local variables of disjoint block scopes share the same slot in
+   the stack frame. A variable can share its slot if it is not
+   captured by a closure and if its TDZ checks were all removed
+   (remove_tdz_checks()), so that its value is always set after
+   entering its scope and its name is not needed for error
+   messages. The other variables are renumbered, including the
+   references of the child functions. 'fd' must contain the final
+   bytecode. */
+static __exception int share_var_slots(JSContext *ctx, JSFunctionDef *fd)
+{
+    uint8_t *bc_buf = fd->byte_code.buf;
+    int bc_len = fd->byte_code.size;
+    int pos, pos_next, op, idx, i, j, k, slot_count, scope, next;
+    int *new_idx, *slot_first, *var_next;
+    uint8_t *can_share;
+    JSVarDef *vars, *vd;
+    const JSOpCode *oi;
 
-    is_expr = (func_type != JS_PARSE_FUNC_STATEMENT &&
-               func_type != JS_PARSE_FUNC_VAR);
+    if (fd->has_eval_call || fd->var_count < 2)
+        return 0;
+    new_idx = js_malloc(ctx, sizeof(new_idx[0]) * fd->var_count * 3);
+    can_share = js_malloc(ctx, sizeof(can_share[0]) * fd->var_count);
+    if (!new_idx || !can_share) {
+        js_free(ctx, new_idx);
+        js_free(ctx, can_share);
+        return -1;
+    }
+    slot_first = new_idx + fd->var_count;
+    var_next = slot_first + fd->var_count;
 
-    if (func_type == JS_PARSE_FUNC_STATEMENT ||
-        func_type == JS_PARSE_FUNC_VAR ||
-        func_type == JS_PARSE_FUNC_EXPR) {
-        if (func_kind == JS_FUNC_NORMAL &&
-            token_is_pseudo_keyword(s, JS_ATOM_async) &&
-            peek_token(s, TRUE) != '\n') {
-            if (next_token(s))
-                return -1;
-            func_kind = JS_FUNC_ASYNC;
-        }
-        if (next_token(s))
-            return -1;
-        if (s->token.val == '*') {
-            if (next_token(s))
-                return -1;
-            func_kind |= JS_FUNC_GENERATOR;
+    for(i = 0; i < fd->var_count; i++) {
+        vd = &fd->vars[i];
+        can_share[i] = (vd->scope_level > ARG_SCOPE_INDEX && !vd->is_captured);
+    }
+    for(pos = 0; pos < bc_len; pos = pos_next) {
+        op = bc_buf[pos];
+        pos_next = pos + short_opcode_info(op).size;
+        switch(op) {
+        case OP_get_loc_check:
+        case OP_put_loc_check:
+        case OP_put_loc_check_init:
+            can_share[get_u16(bc_buf + pos + 1)] = FALSE;
+            break;
+        case OP_make_loc_ref:
+            can_share[get_u16(bc_buf + pos + 5)] = FALSE;
+            break;
+        default:
+            break;
         }
+    }
 
-        if (s->token.val == TOK_IDENT) {
-            if (s->token.u.ident.is_reserved ||
-                (s->token.u.ident.atom == JS_ATOM_yield &&
-                 func_type == JS_PARSE_FUNC_EXPR &&
-                 (func_kind & JS_FUNC_GENERATOR)) ||
-                (s->token.u.ident.atom == JS_ATOM_await &&
-                 func_type == JS_PARSE_FUNC_EXPR &&
-                 (func_kind & JS_FUNC_ASYNC))) {
-                return js_parse_error_reserved_identifier(s);
+    /* first fit slot allocation: a slot index is never larger than
+       the variable index */
+    slot_count = 0;
+    for(i = 0; i < fd->var_count; i++) {
+        scope = fd->vars[i].scope_level;
+        var_next[i] = -1;
+        if (can_share[i]) {
+            for(k = 0; k < slot_count; k++) {
+                if (!can_share[slot_first[k]])
+                    continue;
+                for(j = slot_first[k]; j >= 0; j = var_next[j]) {
+                    if (scope_is_enclosed(fd, scope, fd->vars[j].scope_level) ||
+                        scope_is_enclosed(fd, fd->vars[j].scope_level, scope))
+                        break;
+                }
+                if (j < 0)
+                    goto found;
             }
         }
-        if (s->token.val == TOK_IDENT ||
-            (((s->token.val == TOK_YIELD && !(fd->js_mode & JS_MODE_STRICT)) ||
-             (s->token.val == TOK_AWAIT && !s->is_module)) &&
-             func_type == JS_PARSE_FUNC_EXPR)) {
-            func_name = JS_DupAtom(ctx, s->token.u.ident.atom);
-            if (next_token(s)) {
-                JS_FreeAtom(ctx, func_name);
-                return -1;
+        k = slot_count++;
+        slot_first[k] = i;
+        new_idx[i] = k;
+        continue;
+    found:
+        /* add the variable at the end of the slot list */
+        for(j = slot_first[k]; var_next[j] >= 0; j = var_next[j])
+            continue;
+        var_next[j] = i;
+        new_idx[i] = k;
+    }
+    if (slot_count == fd->var_count)
+        goto done;
+
+    /* renumber the local variables in the bytecode */
+    for(pos = 0; pos < bc_len; pos = pos_next) {
+        op = bc_buf[pos];
+        oi = &short_opcode_info(op);
+        pos_next = pos + oi->size;
+        switch(oi->fmt) {
+        case OP_FMT_loc:
+            put_u16(bc_buf + pos + 1, new_idx[get_u16(bc_buf + pos + 1)]);
+            break;
+        case OP_FMT_loc8:
+            /* inc_loc, dec_loc and add_loc are emitted in all cases */
+            bc_buf[pos + 1] = new_idx[bc_buf[pos + 1]];
+            break;
+#if SHORT_OPCODES
+        case OP_FMT_none_loc:
+            idx = (op - OP_get_loc0) % 4;
+            bc_buf[pos] = op - idx + new_idx[idx];
+            break;
+#endif
+        default:
+            if (op == OP_make_loc_ref)
+                put_u16(bc_buf + pos + 5, new_idx[get_u16(bc_buf + pos + 5)]);
+            break;
+        }
+    }
+
+    /* update the references of the child functions */
+    for(i = 0; i < fd->cpool_count; i++) {
+        if (JS_VALUE_GET_TAG(fd->cpool[i]) == JS_TAG_FUNCTION_BYTECODE) {
+            JSFunctionBytecode *b = JS_VALUE_GET_PTR(fd->cpool[i]);
+            for(j = 0; j < b->closure_var_count; j++) {
+                JSClosureVar *cv = &b->closure_var[j];
+                if (cv->is_local && !cv->is_arg)
+                    cv->var_idx = new_idx[cv->var_idx];
             }
+        }
+    }
+
+    /* the first variable of each slot gives its name */
+    vars = js_malloc(ctx, sizeof(vars[0]) * slot_count);
+    if (!vars)
+        goto fail;
+    for(i = 0; i < fd->var_count; i++) {
+        vd = &fd->vars[i];
+        if (slot_first[new_idx[i]] == i) {
+            /* skip the merged variables in the scope chain */
+            next = vd->scope_next;
+            while (next >= 0 && slot_first[new_idx[next]] != next)
+                next = fd->vars[next].scope_next;
+            vars[new_idx[i]] = *vd;
+            vars[new_idx[i]].scope_next = next >= 0 ? new_idx[next] : next;
         } else {
-            if (func_type != JS_PARSE_FUNC_EXPR &&
-                export_flag != JS_PARSE_EXPORT_DEFAULT) {
-                return js_parse_error(s, "function name expected");
-            }
+            JS_FreeAtom(ctx, vd->var_name);
         }
-    } else if (func_type != JS_PARSE_FUNC_ARROW) {
-        func_name = JS_DupAtom(ctx, func_name);
     }
+    js_free(ctx, fd->vars);
+    fd->vars = vars;
+    fd->var_count = slot_count;
+    fd->var_size = slot_count;
+ done:
+    js_free(ctx, new_idx);
+    js_free(ctx, can_share);
+    return 0;
+ fail:
+    js_free(ctx, new_idx);
+    js_free(ctx, can_share);
+    return -1;
+}
 
-    if (fd->is_eval && fd->eval_type == JS_EVAL_TYPE_MODULE &&
-        (func_type == JS_PARSE_FUNC_STATEMENT || func_type == JS_PARSE_FUNC_VAR)) {
-        JSGlobalVar *hf;
-        hf = find_global_var(fd, func_name);
-        /* XXX: should check scope chain */
-        if (hf && hf->scope_level == fd->scope_level) {
-            js_parse_error(s, "invalid redefinition of global identifier in module code");
-            JS_FreeAtom(ctx, func_name);
+static int add_module_variables(JSContext *ctx, JSFunctionDef *fd)
+{
+    int i, idx;
+    JSModuleDef *m = fd->module;
+    JSExportEntry *me;
+    JSGlobalVar *hf;
+
+    /* The imported global variables were added as closure variables
+       in js_parse_import(). We add here the module global
+       variables. */
+
+    for(i = 0; i < fd->global_var_count; i++) {
+        hf = &fd->global_vars[i];
+        if (add_closure_var(ctx, fd, TRUE, FALSE, i, hf->var_name, hf->is_const,
+                            hf->is_lexical, FALSE) < 0)
             return -1;
-        }
     }
 
-    if (func_type == JS_PARSE_FUNC_VAR) {
-        if (!(fd->js_mode & JS_MODE_STRICT)
-        && func_kind == JS_FUNC_NORMAL
-        &&  find_lexical_decl(ctx, fd, func_name, fd->scope_first, FALSE) < 0
-        &&  !((func_idx = find_var(ctx, fd, func_name)) >= 0 && (func_idx & ARGUMENT_VAR_OFFSET))
-        &&  !(func_name == JS_ATOM_arguments && fd->has_arguments_binding)) {
-            create_func_var = TRUE;
-        }
-        /* Create the lexical name here so that the function closure
-           contains it */
-        if (fd->is_eval &&
-            (fd->eval_type == JS_EVAL_TYPE_GLOBAL ||
-             fd->eval_type == JS_EVAL_TYPE_MODULE) &&
-            fd->scope_level == fd->body_scope) {
-            /* avoid creating a lexical variable in the global
-               scope. XXX: check annex B */
-            JSGlobalVar *hf;
-            hf = find_global_var(fd, func_name);
-            /* XXX: should check scope chain */
-            if (hf && hf->scope_level == fd->scope_level) {
-                js_parse_error(s, "invalid redefinition of global identifier");
-                JS_FreeAtom(ctx, func_name);
-                return -1;
-            }
-        } else {
-            /* Always create a lexical name, fail if at the same scope as
-               existing name */
-            /* Lexical variable will be initialized upon entering scope */
-            lexical_func_idx = define_var(s, fd, func_name,
-                                          func_kind != JS_FUNC_NORMAL ?
-                                          JS_VAR_DEF_NEW_FUNCTION_DECL :
-                                          JS_VAR_DEF_FUNCTION_DECL);
-            if (lexical_func_idx < 0) {
-                JS_FreeAtom(ctx, func_name);
+    /* resolve the variable names of the local exports */
+    for(i = 0; i < m->export_entries_count; i++) {
+        me = &m->export_entries[i];
+        if (me->export_type == JS_EXPORT_TYPE_LOCAL) {
+            idx = find_closure_var(ctx, fd, me->local_name);
+            if (idx < 0) {
+                JS_ThrowSyntaxErrorAtom(ctx, "exported variable '%s' does not exist",
+                                        me->local_name);
                 return -1;
             }
+            me->u.local.var_idx = idx;
         }
     }
+    return 0;
+}
 
-    fd = js_new_function_def(ctx, fd, FALSE, is_expr,
-                             s->filename, function_line_num);
-    if (!fd) {
-        JS_FreeAtom(ctx, func_name);
-        return -1;
+/* create a function object from a function definition. The function
+   definition is freed. All the child functions are also created. It
+   must be done this way to resolve all the variables. */
+/* compute the scope linkage and add the implicit closure variables */
+static __exception int js_init_function_scopes(JSContext *ctx,
+                                               JSFunctionDef *fd)
+{
+    int scope, idx;
+
+    /* recompute scope linkage */
+    for (scope = 0; scope < fd->scope_count; scope++) {
+        fd->scopes[scope].first = -1;
     }
-    if (pfd)
-        *pfd = fd;
-    s->cur_func = fd;
-    fd->func_name = func_name;
-    /* XXX: test !fd->is_generator is always false */
-    fd->has_prototype = (func_type == JS_PARSE_FUNC_STATEMENT ||
-                         func_type == JS_PARSE_FUNC_VAR ||
-                         func_type == JS_PARSE_FUNC_EXPR) &&
-                        func_kind == JS_FUNC_NORMAL;
-    fd->has_home_object = (func_type == JS_PARSE_FUNC_METHOD ||
-                           func_type == JS_PARSE_FUNC_GETTER ||
-                           func_type == JS_PARSE_FUNC_SETTER ||
-                           func_type == JS_PARSE_FUNC_CLASS_CONSTRUCTOR ||
-                           func_type == JS_PARSE_FUNC_DERIVED_CLASS_CONSTRUCTOR);
-    fd->has_arguments_binding = (func_type != JS_PARSE_FUNC_ARROW);
-    fd->has_this_binding = fd->has_arguments_binding;
-    fd->is_derived_class_constructor = (func_type == JS_PARSE_FUNC_DERIVED_CLASS_CONSTRUCTOR);
-    if (func_type == JS_PARSE_FUNC_ARROW) {
-        fd->new_target_allowed = fd->parent->new_target_allowed;
-        fd->super_call_allowed = fd->parent->super_call_allowed;
-        fd->super_allowed = fd->parent->super_allowed;
-        fd->arguments_allowed = fd->parent->arguments_allowed;
-    } else {
-        fd->new_target_allowed = TRUE;
-        fd->super_call_allowed = fd->is_derived_class_constructor;
-        fd->super_allowed = fd->has_home_object;
-        fd->arguments_allowed = TRUE;
+    if (fd->has_parameter_expressions) {
+        /* special end of variable list marker for the argument scope */
+        fd->scopes[ARG_SCOPE_INDEX].first = ARG_SCOPE_END;
+    }
+    for (idx = 0; idx < fd->var_count; idx++) {
+        JSVarDef *vd = &fd->vars[idx];
+        vd->scope_next = fd->scopes[vd->scope_level].first;
+        fd->scopes[vd->scope_level].first = idx;
+    }
+    for (scope = 2; scope < fd->scope_count; scope++) {
+        JSVarScope *sd = &fd->scopes[scope];
+        if (sd->first < 0)
+            sd->first = fd->scopes[sd->parent].first;
+    }
+    for (idx = 0; idx < fd->var_count; idx++) {
+        JSVarDef *vd = &fd->vars[idx];
+        if (vd->scope_next < 0 && vd->scope_level > 1) {
+            scope = fd->scopes[vd->scope_level].parent;
+            vd->scope_next = fd->scopes[scope].first;
+        }
     }
 
-    /* fd->in_function_body == FALSE prevents yield/await during the parsing
-       of the arguments in generator/async functions. They are parsed as
-       regular identifiers for other function kinds. */
-    fd->func_kind = func_kind;
-    fd->func_type = func_type;
+    /* if the function contains an eval call, the closure variables
+       are used to compile the eval and they must be ordered by scope,
+       so it is necessary to create the closure variables before any
+       other variable lookup is done. */
+    if (fd->has_eval_call)
+        add_eval_variables(ctx, fd);
 
-    if (func_type == JS_PARSE_FUNC_CLASS_CONSTRUCTOR ||
-        func_type == JS_PARSE_FUNC_DERIVED_CLASS_CONSTRUCTOR) {
-        /* error if not invoked as a constructor */
-        emit_op(s, OP_check_ctor);
+    /* add the module global variables in the closure */
+    if (fd->module) {
+        if (add_module_variables(ctx, fd))
+            return -1;
     }
+    return 0;
+}
 
-    if (func_type == JS_PARSE_FUNC_CLASS_CONSTRUCTOR) {
-        emit_class_field_init(s);
+/* resolve the variables of 'fd' and of its child functions without
+   generating their final bytecode. The closure variables of 'fd' are
+   known after it. */
+static __exception int js_resolve_function(JSContext *ctx, JSFunctionDef *fd)
+{
+    struct list_head *el;
+
+    if (js_init_function_scopes(ctx, fd))
+        return -1;
+    list_for_each(el, &fd->child_list) {
+        JSFunctionDef *fd1 = list_entry(el, JSFunctionDef, link);
+        if (js_resolve_function(ctx, fd1))
+            return -1;
     }
-    
-    /* parse arguments */
-    fd->has_simple_parameter_list = TRUE;
-    fd->has_parameter_expressions = FALSE;
-    has_opt_arg = FALSE;
-    if (func_type == JS_PARSE_FUNC_ARROW && s->token.val == TOK_IDENT) {
-        JSAtom name;
-        if (s->token.u.ident.is_reserved) {
-            js_parse_error_reserved_identifier(s);
+    if (resolve_variables(ctx, fd))
+        return -1;
+    fd->is_resolved = TRUE;
+    return 0;
+}
+
+static JSValue js_create_child_function(JSContext *ctx, JSFunctionDef *fd);
+
+static void set_bytecode_vardefs(JSBytecodeVarDef *tab, const JSVarDef *vars,
+                                 int count)
+{
+    int i;
+    for(i = 0; i < count; i++) {
+        const JSVarDef *vd = &vars[i];
+        JSBytecodeVarDef *bvd = &tab[i];
+        bvd->var_name = vd->var_name;
+        bvd->scope_next = vd->scope_next;
+        bvd->is_scoped = (vd->scope_level != 0);
+        bvd->is_const = vd->is_const;
+        bvd->is_lexical = vd->is_lexical;
+        bvd->is_captured = vd->is_captured;
+        bvd->var_kind = vd->var_kind;
+    }
+}
+
+/* return TRUE if the source of 'fd' can be reloaded from its file
+   instead of being kept in memory */
+static BOOL js_function_reload_source(JSFunctionDef *fd)
+{
+    JSFunctionDef *fd1;
+    for(fd1 = fd; fd1->parent != NULL; fd1 = fd1->parent)
+        continue;
+    return fd1->reload_source;
+}
+
+static void js_function_set_source_pos(JSFunctionBytecode *b,
+                                       JSFunctionDef *fd)
+{
+    b->debug.source_pos = fd->source_pos;
+    b->debug.source_hash = hash_string8((const uint8_t *)fd->source,
+                                        fd->source_len, 0);
+}
+
+static JSValue js_create_function(JSContext *ctx, JSFunctionDef *fd)
+{
+    JSValue func_obj;
+    JSFunctionBytecode *b;
+    struct list_head *el, *el1;
+    int stack_size;
+    int function_size, byte_code_offset, cpool_offset;
+    int closure_var_offset, vardefs_offset;
+
+    if (!fd->is_resolved) {
+        if (js_init_function_scopes(ctx, fd))
             goto fail;
-        }
-        name = s->token.u.ident.atom;
-        if (add_arg(ctx, fd, name) < 0)
+    }
+
+    /* first create all the child functions */
+    list_for_each_safe(el, el1, &fd->child_list) {
+        JSFunctionDef *fd1;
+        int cpool_idx;
+
+        fd1 = list_entry(el, JSFunctionDef, link);
+        cpool_idx = fd1->parent_cpool_idx;
+        if (fd1->is_resolved)
+            func_obj = js_create_function(ctx, fd1);
+        else
+            func_obj = js_create_child_function(ctx, fd1);
+        if (JS_IsException(func_obj))
             goto fail;
-        fd->defined_arg_count = 1;
-    } else {
-        if (s->token.val == '(') {
-            int skip_bits;
-            /* if there is an '=' inside the parameter list, we
-               consider there is a parameter expression inside */
-            js_parse_skip_parens_token(s, &skip_bits, FALSE);
-            if (skip_bits & SKIP_HAS_ASSIGNMENT)
-                fd->has_parameter_expressions = TRUE;
-            if (next_token(s))
-                goto fail;
-        } else {
-            if (js_parse_expect(s, '('))
-                goto fail;
-        }
+        /* save it in the constant pool */
+        assert(cpool_idx >= 0);
+        fd->cpool[cpool_idx] = func_obj;
+    }
 
-        if (fd->has_parameter_expressions) {
-            fd->scope_level = -1; /* force no parent scope */
-            if (push_scope(s) < 0)
-                return -1;
+    if (!fd->is_resolved) {
+#if defined(DUMP_BYTECODE) && (DUMP_BYTECODE & 4)
+        if (!(fd->js_mode & JS_MODE_STRIP)) {
+            printf("pass 1\n");
+            dump_byte_code(ctx, 1, fd->byte_code.buf, fd->byte_code.size,
+                           fd->args, fd->arg_count, fd->vars, fd->var_count,
+                           fd->closure_var, fd->closure_var_count,
+                           fd->cpool, fd->cpool_count, fd->source, fd->line_num,
+                           fd->label_slots, NULL);
+            printf("\n");
         }
-        
-        while (s->token.val != ')') {
-            JSAtom name;
-            BOOL rest = FALSE;
-            int idx, has_initializer;
+#endif
 
-            if (s->token.val == TOK_ELLIPSIS) {
-                fd->has_simple_parameter_list = FALSE;
-                rest = TRUE;
-                if (next_token(s))
-                    goto fail;
-            }
-            if (s->token.val == '[' || s->token.val == '{') {
-                fd->has_simple_parameter_list = FALSE;
-                if (rest) {
-                    emit_op(s, OP_rest);
-                    emit_u16(s, fd->arg_count);
-                } else {
-                    /* unnamed arg for destructuring */
-                    idx = add_arg(ctx, fd, JS_ATOM_NULL);
-                    emit_op(s, OP_get_arg);
-                    emit_u16(s, idx);
-                }
-                has_initializer = js_parse_destructuring_element(s, fd->has_parameter_expressions ? TOK_LET : TOK_VAR, 1, TRUE, -1, TRUE);
-                if (has_initializer < 0)
-                    goto fail;
-                if (has_initializer)
-                    has_opt_arg = TRUE;
-                if (!has_opt_arg)
-                    fd->defined_arg_count++;
-            } else if (s->token.val == TOK_IDENT) {
-                if (s->token.u.ident.is_reserved) {
-                    js_parse_error_reserved_identifier(s);
-                    goto fail;
-                }
-                name = s->token.u.ident.atom;
-                if (name == JS_ATOM_yield && fd->func_kind == JS_FUNC_GENERATOR) {
-                    js_parse_error_reserved_identifier(s);
-                    goto fail;
-                }
-                if (fd->has_parameter_expressions) {
-                    if (define_var(s, fd, name, JS_VAR_DEF_LET) < 0)
-                        goto fail;
-                }
-                /* XXX: could avoid allocating an argument if rest is true */
-                idx = add_arg(ctx, fd, name);
-                if (idx < 0)
-                    goto fail;
-                if (next_token(s))
-                    goto fail;
-                if (rest) {
-                    emit_op(s, OP_rest);
-                    emit_u16(s, idx);
-                    if (fd->has_parameter_expressions) {
-                        emit_op(s, OP_dup);
-                        emit_op(s, OP_scope_put_var_init);
-                        emit_atom(s, name);
-                        emit_u16(s, fd->scope_level);
-                    }
-                    emit_op(s, OP_put_arg);
-                    emit_u16(s, idx);
-                    fd->has_simple_parameter_list = FALSE;
-                    has_opt_arg = TRUE;
-                } else if (s->token.val == '=') {
-                    int label;
-                    
-                    fd->has_simple_parameter_list = FALSE;
-                    has_opt_arg = TRUE;
+        if (resolve_variables(ctx, fd))
+            goto fail;
+    }
 
-                    if (next_token(s))
-                        goto fail;
+#if defined(DUMP_BYTECODE) && (DUMP_BYTECODE & 2)
+    if (!(fd->js_mode & JS_MODE_STRIP)) {
+        printf("pass 2\n");
+        dump_byte_code(ctx, 2, fd->byte_code.buf, fd->byte_code.size,
+                       fd->args, fd->arg_count, fd->vars, fd->var_count,
+                       fd->closure_var, fd->closure_var_count,
+                       fd->cpool, fd->cpool_count, fd->source, fd->line_num,
+                       fd->label_slots, NULL);
+        printf("\n");
+    }
+#endif
 
-                    label = new_label(s);
-                    emit_op(s, OP_get_arg);
-                    emit_u16(s, idx);
-                    emit_op(s, OP_dup);
-                    emit_op(s, OP_undefined);
-                    emit_op(s, OP_strict_eq);
-                    emit_goto(s, OP_if_false, label);
-                    emit_op(s, OP_drop);
-                    if (js_parse_assign_expr(s))
-                        goto fail;
-                    set_object_name(s, name);
-                    emit_op(s, OP_dup);
-                    emit_op(s, OP_put_arg);
-                    emit_u16(s, idx);
-                    emit_label(s, label);
-                    emit_op(s, OP_scope_put_var_init);
-                    emit_atom(s, name);
-                    emit_u16(s, fd->scope_level);
-                } else {
-                    if (!has_opt_arg) {
-                        fd->defined_arg_count++;
-                    }
-                    if (fd->has_parameter_expressions) {
-                        /* copy the argument to the argument scope */
-                        emit_op(s, OP_get_arg);
-                        emit_u16(s, idx);
-                        emit_op(s, OP_scope_put_var_init);
-                        emit_atom(s, name);
-                        emit_u16(s, fd->scope_level);
-                    }
-                }
-            } else {
-                js_parse_error(s, "missing formal parameter");
-                goto fail;
+    if (remove_tdz_checks(ctx, fd))
+        goto fail;
+
+    if (optimize_arguments(ctx, fd))
+        goto fail;
+
+    if (inline_function_calls(ctx, fd))
+        goto fail;
+
+    if (js_function_can_be_inlined(fd)) {
+        if (js_save_inline_func(ctx, fd))
+            goto fail;
+    }
+
+    /* the analysis slows down the compilation, so it is only done
+       when the debug information is stripped */
+    if (fd->js_mode & JS_MODE_STRIP) {
+        if (remove_dead_stores(ctx, fd))
+            goto fail;
+    }
+
+    if (resolve_labels(ctx, fd))
+        goto fail;
+
+    if (compute_stack_size(ctx, fd, &stack_size) < 0)
+        goto fail;
+
+    if (share_var_slots(ctx, fd))
+        goto fail;
+
+    if (fd->js_mode & JS_MODE_STRIP) {
+        function_size = offsetof(JSFunctionBytecode, debug);
+    } else {
+        function_size = sizeof(*b);
+    }
+    cpool_offset = function_size;
+    function_size += fd->cpool_count * sizeof(*fd->cpool);
+    vardefs_offset = function_size;
+    if (!(fd->js_mode & JS_MODE_STRIP) || fd->has_eval_call) {
+        function_size += (fd->arg_count + fd->var_count) * sizeof(*b->vardefs);
+    }
+    closure_var_offset = function_size;
+    function_size += fd->closure_var_count * sizeof(*fd->closure_var);
+    byte_code_offset = function_size;
+    function_size += fd->byte_code.size;
+
+    b = js_mallocz(ctx, function_size);
+    if (!b)
+        goto fail;
+    b->header.ref_count = 1;
+
+    b->byte_code_buf = (void *)((uint8_t*)b + byte_code_offset);
+    b->byte_code_len = fd->byte_code.size;
+    memcpy(b->byte_code_buf, fd->byte_code.buf, fd->byte_code.size);
+    js_free(ctx, fd->byte_code.buf);
+    fd->byte_code.buf = NULL;
+
+    b->func_name = fd->func_name;
+    if (fd->arg_count + fd->var_count > 0) {
+        if ((fd->js_mode & JS_MODE_STRIP) && !fd->has_eval_call) {
+            /* Strip variable definitions not needed at runtime */
+            int i;
+            for(i = 0; i < fd->var_count; i++) {
+                JS_FreeAtom(ctx, fd->vars[i].var_name);
             }
-            if (rest && s->token.val != ')') {
-                js_parse_expect(s, ')');
-                goto fail;
+            for(i = 0; i < fd->arg_count; i++) {
+                JS_FreeAtom(ctx, fd->args[i].var_name);
             }
-            if (s->token.val == ')')
-                break;
-            if (js_parse_expect(s, ','))
-                goto fail;
+            for(i = 0; i < fd->closure_var_count; i++) {
+                JS_FreeAtom(ctx, fd->closure_var[i].var_name);
+                fd->closure_var[i].var_name = JS_ATOM_NULL;
+            }
+        } else {
+            b->vardefs = (void *)((uint8_t*)b + vardefs_offset);
+            set_bytecode_vardefs(b->vardefs, fd->args, fd->arg_count);
+            set_bytecode_vardefs(b->vardefs + fd->arg_count, fd->vars,
+                                 fd->var_count);
         }
-        if ((func_type == JS_PARSE_FUNC_GETTER && fd->arg_count != 0) ||
-            (func_type == JS_PARSE_FUNC_SETTER && fd->arg_count != 1)) {
-            js_parse_error(s, "invalid number of arguments for getter or setter");
+        b->var_count = fd->var_count;
+        b->arg_count = fd->arg_count;
+        b->defined_arg_count = fd->defined_arg_count;
+        js_free(ctx, fd->args);
+        js_free(ctx, fd->vars);
+    }
+    b->cpool_count = fd->cpool_count;
+    if (b->cpool_count) {
+        b->cpool = (void *)((uint8_t*)b + cpool_offset);
+        memcpy(b->cpool, fd->cpool, b->cpool_count * sizeof(*b->cpool));
+    }
+    js_free(ctx, fd->cpool);
+    fd->cpool = NULL;
+
+    b->stack_size = stack_size;
+
+    if (fd->js_mode & JS_MODE_STRIP) {
+        JS_FreeAtom(ctx, fd->filename);
+        dbuf_free(&fd->pc2line);    // probably useless
+        dbuf_free(&fd->inline_ranges);
+    } else {
+        /* XXX: source and pc2line info should be packed at the end of the
+           JSFunctionBytecode structure, avoiding allocation overhead
+         */
+        b->has_debug = 1;
+        b->debug.filename = fd->filename;
+        b->debug.line_num = fd->line_num;
+
+        //DynBuf pc2line;
+        //compute_pc2line_info(fd, &pc2line);
+        //js_free(ctx, fd->line_number_slots)
+        b->debug.pc2line_buf = js_realloc(ctx, fd->pc2line.buf, fd->pc2line.size);
+        if (!b->debug.pc2line_buf)
+            b->debug.pc2line_buf = fd->pc2line.buf;
+        b->debug.pc2line_len = fd->pc2line.size;
+        if (dbuf_error(&fd->inline_ranges)) {
+            dbuf_free(&fd->inline_ranges);
+        } else {
+            b->debug.inline_ranges = (JSInlineRange *)fd->inline_ranges.buf;
+            b->debug.inline_range_count =
+                fd->inline_ranges.size / sizeof(JSInlineRange);
+        }
+        b->debug.source = fd->source;
+        b->debug.source_len = fd->source_len;
+        if (fd->source && js_function_reload_source(fd)) {
+            js_function_set_source_pos(b, fd);
+            js_free(ctx, fd->source);
+            b->debug.source = NULL;
+        }
+    }
+    if (fd->scopes != fd->def_scope_array)
+        js_free(ctx, fd->scopes);
+
+    b->closure_var_count = fd->closure_var_count;
+    if (b->closure_var_count) {
+        b->closure_var = (void *)((uint8_t*)b + closure_var_offset);
+        memcpy(b->closure_var, fd->closure_var, b->closure_var_count * sizeof(*b->closure_var));
+    }
+    js_free(ctx, fd->closure_var);
+    fd->closure_var = NULL;
+
+    b->has_prototype = fd->has_prototype;
+    b->has_simple_parameter_list = fd->has_simple_parameter_list;
+    b->js_mode = fd->js_mode;
+    b->is_derived_class_constructor = fd->is_derived_class_constructor;
+    b->func_kind = fd->func_kind;
+    b->need_home_object = (fd->home_object_var_idx >= 0 ||
+                           fd->need_home_object);
+    b->new_target_allowed = fd->new_target_allowed;
+    b->super_call_allowed = fd->super_call_allowed;
+    b->super_allowed = fd->super_allowed;
+    b->arguments_allowed = fd->arguments_allowed;
+    b->backtrace_barrier = fd->backtrace_barrier;
+    b->realm = JS_DupContext(ctx);
+
+    add_gc_object(ctx->rt, &b->header, JS_GC_OBJ_TYPE_FUNCTION_BYTECODE);
+    
+#if defined(DUMP_BYTECODE) && (DUMP_BYTECODE & 1)
+    if (!(fd->js_mode & JS_MODE_STRIP)) {
+        js_dump_function_bytecode(ctx, b);
+    }
+#endif
+
+    if (fd->parent) {
+        /* remove from parent list */
+        list_del(&fd->link);
+    }
+
+    js_free(ctx, fd);
+    return JS_MKPTR(JS_TAG_FUNCTION_BYTECODE, b);
+ fail:
+    js_free_function_def(ctx, fd);
+    return JS_EXCEPTION;
+}
+
+/* return TRUE if the bytecode of 'fd' may be generated when the
+   function is first called. 'fd' is compiled again from its source
+   code, so it must not depend on the parse state of its parent. */
+static BOOL js_function_can_be_lazy(JSFunctionDef *fd)
+{
+    JSFunctionDef *fd1;
+
+    if (fd->func_type != JS_PARSE_FUNC_STATEMENT &&
+        fd->func_type != JS_PARSE_FUNC_VAR &&
+        fd->func_type != JS_PARSE_FUNC_EXPR)
+        return FALSE;
+    if (!fd->source ||
+        fd->func_name == JS_ATOM_yield || fd->func_name == JS_ATOM_await)
+        return FALSE;
+    for(fd1 = fd; fd1->parent != NULL; fd1 = fd1->parent)
+        continue;
+    return fd1->lazy_compile;
+}
+
+/* return TRUE if the closure variables of the resolved function 'fd'
+   can be rebuilt by js_compile_lazy_function() */
+static BOOL js_function_closure_is_simple(JSFunctionDef *fd)
+{
+    struct list_head *el;
+    int i, j;
+
+    if (fd->has_eval_call)
+        return FALSE;
+    for(i = 0; i < fd->closure_var_count; i++) {
+        JSClosureVar *cv = &fd->closure_var[i];
+        if (cv->var_kind >= JS_VAR_PRIVATE_FIELD ||
+            cv->var_name == JS_ATOM__with_ ||
+            cv->var_name == JS_ATOM__var_ ||
+            cv->var_name == JS_ATOM__arg_var_)
+            return FALSE;
+        for(j = 0; j < i; j++) {
+            if (fd->closure_var[j].var_name == cv->var_name)
+                return FALSE;
+        }
+    }
+    list_for_each(el, &fd->child_list) {
+        JSFunctionDef *fd1 = list_entry(el, JSFunctionDef, link);
+        if (!js_function_closure_is_simple(fd1))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/* create a function bytecode without code for the resolved function
+   'fd'. It only contains what is needed to create the closure. */
+static JSValue js_create_lazy_function(JSContext *ctx, JSFunctionDef *fd)
+{
+    JSFunctionBytecode *b;
+    JSFunctionBytecodeLazy *lazy;
+    JSFunctionDef *fd1;
+    int i, function_size, closure_var_offset, lazy_offset;
+
+    function_size = sizeof(*b);
+    closure_var_offset = function_size;
+    function_size += fd->closure_var_count * sizeof(*fd->closure_var);
+    lazy_offset = (function_size + 7) & ~7;
+    function_size = lazy_offset + sizeof(*lazy);
+
+    b = js_mallocz(ctx, function_size);
+    if (!b) {
+        js_free_function_def(ctx, fd);
+        return JS_EXCEPTION;
+    }
+    b->header.ref_count = 1;
+
+    b->func_name = JS_DupAtom(ctx, fd->func_name);
+    b->arg_count = fd->arg_count;
+    b->defined_arg_count = fd->defined_arg_count;
+    b->closure_var_count = fd->closure_var_count;
+    if (b->closure_var_count) {
+        b->closure_var = (void *)((uint8_t*)b + closure_var_offset);
+        memcpy(b->closure_var, fd->closure_var, b->closure_var_count * sizeof(*b->closure_var));
+        for(i = 0; i < b->closure_var_count; i++)
+            JS_DupAtom(ctx, b->closure_var[i].var_name);
+    }
+
+    b->has_debug = 1;
+    b->debug.filename = JS_DupAtom(ctx, fd->filename);
+    b->debug.line_num = fd->line_num;
+    b->debug.source = fd->source;
+    b->debug.source_len = fd->source_len;
+    if (js_function_reload_source(fd))
+        js_function_set_source_pos(b, fd);
+    fd->source = NULL;
+
+    b->has_prototype = fd->has_prototype;
+    b->has_simple_parameter_list = fd->has_simple_parameter_list;
+    b->js_mode = fd->js_mode;
+    b->is_derived_class_constructor = fd->is_derived_class_constructor;
+    b->func_kind = fd->func_kind;
+    b->need_home_object = (fd->home_object_var_idx >= 0 ||
+                           fd->need_home_object);
+    b->new_target_allowed = fd->new_target_allowed;
+    b->super_call_allowed = fd->super_call_allowed;
+    b->super_allowed = fd->super_allowed;
+    b->arguments_allowed = fd->arguments_allowed;
+    b->backtrace_barrier = fd->backtrace_barrier;
+    b->realm = JS_DupContext(ctx);
+
+    lazy = (void *)((uint8_t*)b + lazy_offset);
+    lazy->u.compile.is_func_expr = fd->is_func_expr;
+    for(fd1 = fd; fd1->parent != NULL; fd1 = fd1->parent)
+        continue;
+    lazy->u.compile.reload_source = fd1->reload_source;
+    lazy->u.compile.is_module = (fd1->module != NULL);
+    b->lazy = lazy;
+
+    add_gc_object(ctx->rt, &b->header, JS_GC_OBJ_TYPE_FUNCTION_BYTECODE);
+
+    /* the inner functions are compiled again with 'fd' */
+    js_free_function_def(ctx, fd);
+    return JS_MKPTR(JS_TAG_FUNCTION_BYTECODE, b);
+}
+
+/* create the inner function 'fd'. Its bytecode is generated when it
+   is first called if possible. */
+static JSValue js_create_child_function(JSContext *ctx, JSFunctionDef *fd)
+{
+    /* the small functions are not lazy so that they can be inlined
+       in their parent */
+    if (!js_function_can_be_lazy(fd) ||
+        (fd->byte_code.size <= JS_INLINE_MAX_CODE_SIZE * 2 &&
+         list_empty(&fd->child_list)))
+        return js_create_function(ctx, fd);
+    /* the closure variables are needed to create the function
+       object */
+    if (js_resolve_function(ctx, fd)) {
+        js_free_function_def(ctx, fd);
+        return JS_EXCEPTION;
+    }
+    if (!js_function_closure_is_simple(fd))
+        return js_create_function(ctx, fd);
+    return js_create_lazy_function(ctx, fd);
+}
+
+/* free the part of the function which is not present in the lazy
+   stubs (see JS_ReadFunctionTag()) */
+static void free_function_bytecode_body(JSRuntime *rt, JSFunctionBytecode *b)
+{
+    int i;
+
+    if (!b->atom_map)
+        free_bytecode_atoms(rt, b->byte_code_buf, b->byte_code_len, TRUE);
+
+    if (b->vardefs) {
+        for(i = 0; i < b->arg_count + b->var_count; i++) {
+            JS_FreeAtomRT(rt, b->vardefs[i].var_name);
+        }
+    }
+    for(i = 0; i < b->cpool_count; i++)
+        JS_FreeValueRT(rt, b->cpool[i]);
+
+    if (b->has_debug) {
+        JS_FreeAtomRT(rt, b->debug.filename);
+        js_free_rt(rt, b->debug.pc2line_buf);
+        js_free_rt(rt, b->debug.inline_ranges);
+        js_free_rt(rt, b->debug.source);
+    }
+}
+
+static void free_function_bytecode(JSRuntime *rt, JSFunctionBytecode *b)
+{
+    int i;
+
+#if 0
+    {
+        char buf[ATOM_GET_STR_BUF_SIZE];
+        printf("freeing %s\n",
+               JS_AtomGetStrRT(rt, buf, sizeof(buf), b->func_name));
+    }
+#endif
+    free_function_bytecode_body(rt, b);
+
+    for(i = 0; i < b->closure_var_count; i++) {
+        JSClosureVar *cv = &b->closure_var[i];
+        JS_FreeAtomRT(rt, cv->var_name);
+    }
+    if (b->realm)
+        JS_FreeContext(b->realm);
+
+    JS_FreeAtomRT(rt, b->func_name);
+    if (b->atom_map)
+        js_atom_map_free(rt, b->atom_map);
+    if (b->lazy) {
+        if (b->lazy->image) {
+            js_bytecode_image_free(rt, b->lazy->image);
+        } else if (b->lazy->u.compile.b) {
+            JS_FreeValueRT(rt, JS_MKPTR(JS_TAG_FUNCTION_BYTECODE,
+                                        b->lazy->u.compile.b));
+        }
+    }
+
+    remove_gc_object(&b->header);
+    if (rt->gc_phase == JS_GC_PHASE_REMOVE_CYCLES && b->header.ref_count != 0) {
+        list_add_tail(&b->header.link, &rt->gc_zero_ref_count_list);
+    } else {
+        js_free_rt(rt, b);
+    }
+}
+
+static __exception int js_parse_directives(JSParseState *s)
+{
+    char str[20];
+    JSParsePos pos;
+    BOOL has_semi;
+
+    if (s->token.val != TOK_STRING)
+        return 0;
+
+    js_parse_get_pos(s, &pos);
+
+    while(s->token.val == TOK_STRING) {
+        /* Copy actual source string representation */
+        snprintf(str, sizeof str, "%.*s",
+                 (int)(s->buf_ptr - s->token.ptr - 2), s->token.ptr + 1);
+
+        if (next_token(s))
+            return -1;
+
+        has_semi = FALSE;
+        switch (s->token.val) {
+        case ';':
+            if (next_token(s))
+                return -1;
+            has_semi = TRUE;
+            break;
+        case '}':
+        case TOK_EOF:
+            has_semi = TRUE;
+            break;
+        case TOK_NUMBER:
+        case TOK_STRING:
+        case TOK_TEMPLATE:
+        case TOK_IDENT:
+        case TOK_REGEXP:
+        case TOK_DEC:
+        case TOK_INC:
+        case TOK_NULL:
+        case TOK_FALSE:
+        case TOK_TRUE:
+        case TOK_IF:
+        case TOK_RETURN:
+        case TOK_VAR:
+        case TOK_THIS:
+        case TOK_DELETE:
+        case TOK_TYPEOF:
+        case TOK_NEW:
+        case TOK_DO:
+        case TOK_WHILE:
+        case TOK_FOR:
+        case TOK_SWITCH:
+        case TOK_THROW:
+        case TOK_TRY:
+        case TOK_FUNCTION:
+        case TOK_DEBUGGER:
+        case TOK_WITH:
+        case TOK_CLASS:
+        case TOK_CONST:
+        case TOK_ENUM:
+        case TOK_EXPORT:
+        case TOK_IMPORT:
+        case TOK_SUPER:
+        case TOK_INTERFACE:
+        case TOK_LET:
+        case TOK_PACKAGE:
+        case TOK_PRIVATE:
+        case TOK_PROTECTED:
+        case TOK_PUBLIC:
+        case TOK_STATIC:
+            /* automatic insertion of ';' */
+            if (s->got_lf)
+                has_semi = TRUE;
+            break;
+        default:
+            break;
+        }
+        if (!has_semi)
+            break;
+        if (!strcmp(str, "use strict")) {
+            s->cur_func->has_use_strict = TRUE;
+            s->cur_func->js_mode |= JS_MODE_STRICT;
+        }
+#if !defined(DUMP_BYTECODE) || !(DUMP_BYTECODE & 8)
+        else if (!strcmp(str, "use strip")) {
+            s->cur_func->js_mode |= JS_MODE_STRIP;
+        }
+#endif
+#ifdef CONFIG_BIGNUM
+        else if (s->ctx->bignum_ext && !strcmp(str, "use math")) {
+            s->cur_func->js_mode |= JS_MODE_MATH;
+        }
+#endif
+    }
+    return js_parse_seek_token(s, &pos);
+}
+
+static int js_parse_function_check_names(JSParseState *s, JSFunctionDef *fd,
+                                         JSAtom func_name)
+{
+    JSAtom name;
+    int i, idx;
+
+    if (fd->js_mode & JS_MODE_STRICT) {
+        if (!fd->has_simple_parameter_list && fd->has_use_strict) {
+            return js_parse_error(s, "\"use strict\" not allowed in function with default or destructuring parameter");
+        }
+        if (func_name == JS_ATOM_eval || func_name == JS_ATOM_arguments) {
+            return js_parse_error(s, "invalid function name in strict code");
+        }
+        for (idx = 0; idx < fd->arg_count; idx++) {
+            name = fd->args[idx].var_name;
+
+            if (name == JS_ATOM_eval || name == JS_ATOM_arguments) {
+                return js_parse_error(s, "invalid argument name in strict code");
+            }
+        }
+    }
+    /* check async_generator case */
+    if ((fd->js_mode & JS_MODE_STRICT)
+    ||  !fd->has_simple_parameter_list
+    ||  (fd->func_type == JS_PARSE_FUNC_METHOD && fd->func_kind == JS_FUNC_ASYNC)
+    ||  fd->func_type == JS_PARSE_FUNC_ARROW
+    ||  fd->func_type == JS_PARSE_FUNC_METHOD) {
+        for (idx = 0; idx < fd->arg_count; idx++) {
+            name = fd->args[idx].var_name;
+            if (name != JS_ATOM_NULL) {
+                for (i = 0; i < idx; i++) {
+                    if (fd->args[i].var_name == name)
+                        goto duplicate;
+                }
+                /* Check if argument name duplicates a destructuring parameter */
+                /* XXX: should have a flag for such variables */
+                for (i = 0; i < fd->var_count; i++) {
+                    if (fd->vars[i].var_name == name &&
+                        fd->vars[i].scope_level == 0)
+                        goto duplicate;
+                }
+            }
+        }
+    }
+    return 0;
+
+duplicate:
+    return js_parse_error(s, "duplicate argument names not allowed in this context");
+}
+
+/* create a function to initialize class fields */
+static JSFunctionDef *js_parse_function_class_fields_init(JSParseState *s)
+{
+    JSFunctionDef *fd;
+    
+    fd = js_new_function_def(s->ctx, s->cur_func, FALSE, FALSE,
+                             s->filename, 0);
+    if (!fd)
+        return NULL;
+    fd->func_name = JS_ATOM_NULL;
+    fd->has_prototype = FALSE;
+    fd->has_home_object = TRUE;
+    
+    fd->has_arguments_binding = FALSE;
+    fd->has_this_binding = TRUE;
+    fd->is_derived_class_constructor = FALSE;
+    fd->new_target_allowed = TRUE;
+    fd->super_call_allowed = FALSE;
+    fd->super_allowed = fd->has_home_object;
+    fd->arguments_allowed = FALSE;
+    
+    fd->func_kind = JS_FUNC_NORMAL;
+    fd->func_type = JS_PARSE_FUNC_METHOD;
+    return fd;
+}
+
+/* func_name must be JS_ATOM_NULL for JS_PARSE_FUNC_STATEMENT and
+   JS_PARSE_FUNC_EXPR, JS_PARSE_FUNC_ARROW and JS_PARSE_FUNC_VAR */
+static __exception int js_parse_function_decl2(JSParseState *s,
+                                               JSParseFunctionEnum func_type,
+                                               JSFunctionKindEnum func_kind,
+                                               JSAtom func_name,
+                                               const uint8_t *ptr,
+                                               int function_line_num,
+                                               JSParseExportEnum export_flag,
+                                               JSFunctionDef **pfd)
+{
+    JSContext *ctx = s->ctx;
+    JSFunctionDef *fd = s->cur_func;
+    BOOL is_expr;
+    int func_idx, lexical_func_idx = -1;
+    BOOL has_opt_arg;
+    BOOL create_func_var = FALSE;
+
+    is_expr = (func_type != JS_PARSE_FUNC_STATEMENT &&
+               func_type != JS_PARSE_FUNC_VAR);
+
+    if (func_type == JS_PARSE_FUNC_STATEMENT ||
+        func_type == JS_PARSE_FUNC_VAR ||
+        func_type == JS_PARSE_FUNC_EXPR) {
+        if (func_kind == JS_FUNC_NORMAL &&
+            token_is_pseudo_keyword(s, JS_ATOM_async) &&
+            peek_token(s, TRUE) != '\n') {
+            if (next_token(s))
+                return -1;
+            func_kind = JS_FUNC_ASYNC;
+        }
+        if (next_token(s))
+            return -1;
+        if (s->token.val == '*') {
+            if (next_token(s))
+                return -1;
+            func_kind |= JS_FUNC_GENERATOR;
+        }
+
+        if (s->token.val == TOK_IDENT) {
+            if (s->token.u.ident.is_reserved ||
+                (s->token.u.ident.atom == JS_ATOM_yield &&
+                 func_type == JS_PARSE_FUNC_EXPR &&
+                 (func_kind & JS_FUNC_GENERATOR)) ||
+                (s->token.u.ident.atom == JS_ATOM_await &&
+                 func_type == JS_PARSE_FUNC_EXPR &&
+                 (func_kind & JS_FUNC_ASYNC))) {
+                return js_parse_error_reserved_identifier(s);
+            }
+        }
+        if (s->token.val == TOK_IDENT ||
+            (((s->token.val == TOK_YIELD && !(fd->js_mode & JS_MODE_STRICT)) ||
+             (s->token.val == TOK_AWAIT && !s->is_module)) &&
+             func_type == JS_PARSE_FUNC_EXPR)) {
+            func_name = JS_DupAtom(ctx, s->token.u.ident.atom);
+            if (next_token(s)) {
+                JS_FreeAtom(ctx, func_name);
+                return -1;
+            }
+        } else {
+            if (func_type != JS_PARSE_FUNC_EXPR &&
+                export_flag != JS_PARSE_EXPORT_DEFAULT) {
+                return js_parse_error(s, "function name expected");
+            }
+        }
+    } else if (func_type != JS_PARSE_FUNC_ARROW) {
+        func_name = JS_DupAtom(ctx, func_name);
+    }
+
+    if (fd->is_eval && fd->eval_type == JS_EVAL_TYPE_MODULE &&
+        (func_type == JS_PARSE_FUNC_STATEMENT || func_type == JS_PARSE_FUNC_VAR)) {
+        JSGlobalVar *hf;
+        hf = find_global_var(fd, func_name);
+        /* XXX: should check scope chain */
+        if (hf && hf->scope_level == fd->scope_level) {
+            js_parse_error(s, "invalid redefinition of global identifier in module code");
+            JS_FreeAtom(ctx, func_name);
+            return -1;
+        }
+    }
+
+    if (func_type == JS_PARSE_FUNC_VAR) {
+        if (!(fd->js_mode & JS_MODE_STRICT)
+        && func_kind == JS_FUNC_NORMAL
+        &&  find_lexical_decl(ctx, fd, func_name, fd->scope_first, FALSE) < 0
+        &&  !((func_idx = find_var(ctx, fd, func_name)) >= 0 && (func_idx & ARGUMENT_VAR_OFFSET))
+        &&  !(func_name == JS_ATOM_arguments && fd->has_arguments_binding)) {
+            create_func_var = TRUE;
+        }
+        /* Create the lexical name here so that the function closure
+           contains it */
+        if (fd->is_eval &&
+            (fd->eval_type == JS_EVAL_TYPE_GLOBAL ||
+             fd->eval_type == JS_EVAL_TYPE_MODULE) &&
+            fd->scope_level == fd->body_scope) {
+            /* avoid creating a lexical variable in the global
+               scope. XXX: check annex B */
+            JSGlobalVar *hf;
+            hf = find_global_var(fd, func_name);
+            /* XXX: should check scope chain */
+            if (hf && hf->scope_level == fd->scope_level) {
+                js_parse_error(s, "invalid redefinition of global identifier");
+                JS_FreeAtom(ctx, func_name);
+                return -1;
+            }
+        } else {
+            /* Always create a lexical name, fail if at the same scope as
+               existing name */
+            /* Lexical variable will be initialized upon entering scope */
+            lexical_func_idx = define_var(s, fd, func_name,
+                                          func_kind != JS_FUNC_NORMAL ?
+                                          JS_VAR_DEF_NEW_FUNCTION_DECL :
+                                          JS_VAR_DEF_FUNCTION_DECL);
+            if (lexical_func_idx < 0) {
+                JS_FreeAtom(ctx, func_name);
+                return -1;
+            }
+        }
+    }
+
+    fd = js_new_function_def(ctx, fd, FALSE, is_expr,
+                             s->filename, function_line_num);
+    if (!fd) {
+        JS_FreeAtom(ctx, func_name);
+        return -1;
+    }
+    if (pfd)
+        *pfd = fd;
+    s->cur_func = fd;
+    fd->func_name = func_name;
+    /* XXX: test !fd->is_generator is always false */
+    fd->has_prototype = (func_type == JS_PARSE_FUNC_STATEMENT ||
+                         func_type == JS_PARSE_FUNC_VAR ||
+                         func_type == JS_PARSE_FUNC_EXPR) &&
+                        func_kind == JS_FUNC_NORMAL;
+    fd->has_home_object = (func_type == JS_PARSE_FUNC_METHOD ||
+                           func_type == JS_PARSE_FUNC_GETTER ||
+                           func_type == JS_PARSE_FUNC_SETTER ||
+                           func_type == JS_PARSE_FUNC_CLASS_CONSTRUCTOR ||
+                           func_type == JS_PARSE_FUNC_DERIVED_CLASS_CONSTRUCTOR);
+    fd->has_arguments_binding = (func_type != JS_PARSE_FUNC_ARROW);
+    fd->has_this_binding = fd->has_arguments_binding;
+    fd->is_derived_class_constructor = (func_type == JS_PARSE_FUNC_DERIVED_CLASS_CONSTRUCTOR);
+    if (func_type == JS_PARSE_FUNC_ARROW) {
+        fd->new_target_allowed = fd->parent->new_target_allowed;
+        fd->super_call_allowed = fd->parent->super_call_allowed;
+        fd->super_allowed = fd->parent->super_allowed;
+        fd->arguments_allowed = fd->parent->arguments_allowed;
+    } else {
+        fd->new_target_allowed = TRUE;
+        fd->super_call_allowed = fd->is_derived_class_constructor;
+        fd->super_allowed = fd->has_home_object;
+        fd->arguments_allowed = TRUE;
+    }
+
+    /* fd->in_function_body == FALSE prevents yield/await during the parsing
+       of the arguments in generator/async functions. They are parsed as
+       regular identifiers for other function kinds. */
+    fd->func_kind = func_kind;
+    fd->func_type = func_type;
+
+    if (func_type == JS_PARSE_FUNC_CLASS_CONSTRUCTOR ||
+        func_type == JS_PARSE_FUNC_DERIVED_CLASS_CONSTRUCTOR) {
+        /* error if not invoked as a constructor */
+        emit_op(s, OP_check_ctor);
+    }
+
+    if (func_type == JS_PARSE_FUNC_CLASS_CONSTRUCTOR) {
+        emit_class_field_init(s);
+    }
+    
+    /* parse arguments */
+    fd->has_simple_parameter_list = TRUE;
+    fd->has_parameter_expressions = FALSE;
+    has_opt_arg = FALSE;
+    if (func_type == JS_PARSE_FUNC_ARROW && s->token.val == TOK_IDENT) {
+        JSAtom name;
+        if (s->token.u.ident.is_reserved) {
+            js_parse_error_reserved_identifier(s);
+            goto fail;
+        }
+        name = s->token.u.ident.atom;
+        if (add_arg(ctx, fd, name) < 0)
+            goto fail;
+        fd->defined_arg_count = 1;
+    } else {
+        if (s->token.val == '(') {
+            int skip_bits;
+            /* if there is an '=' inside the parameter list, we
+               consider there is a parameter expression inside */
+            js_parse_skip_parens_token(s, &skip_bits, FALSE);
+            if (skip_bits & SKIP_HAS_ASSIGNMENT)
+                fd->has_parameter_expressions = TRUE;
+            if (next_token(s))
+                goto fail;
+        } else {
+            if (js_parse_expect(s, '('))
+                goto fail;
+        }
+
+        if (fd->has_parameter_expressions) {
+            fd->scope_level = -1; /* force no parent scope */
+            if (push_scope(s) < 0)
+                return -1;
+        }
+        
+        while (s->token.val != ')') {
+            JSAtom name;
+            BOOL rest = FALSE;
+            int idx, has_initializer;
+
+            if (s->token.val == TOK_ELLIPSIS) {
+                fd->has_simple_parameter_list = FALSE;
+                rest = TRUE;
+                if (next_token(s))
+                    goto fail;
+            }
+            if (s->token.val == '[' || s->token.val == '{') {
+                fd->has_simple_parameter_list = FALSE;
+                if (rest) {
+                    emit_op(s, OP_rest);
+                    emit_u16(s, fd->arg_count);
+                } else {
+                    /* unnamed arg for destructuring */
+                    idx = add_arg(ctx, fd, JS_ATOM_NULL);
+                    emit_op(s, OP_get_arg);
+                    emit_u16(s, idx);
+                }
+                has_initializer = js_parse_destructuring_element(s, fd->has_parameter_expressions ? TOK_LET : TOK_VAR, 1, TRUE, -1, TRUE);
+                if (has_initializer < 0)
+                    goto fail;
+                if (has_initializer)
+                    has_opt_arg = TRUE;
+                if (!has_opt_arg)
+                    fd->defined_arg_count++;
+            } else if (s->token.val == TOK_IDENT) {
+                if (s->token.u.ident.is_reserved) {
+                    js_parse_error_reserved_identifier(s);
+                    goto fail;
+                }
+                name = s->token.u.ident.atom;
+                if (name == JS_ATOM_yield && fd->func_kind == JS_FUNC_GENERATOR) {
+                    js_parse_error_reserved_identifier(s);
+                    goto fail;
+                }
+                if (fd->has_parameter_expressions) {
+                    if (define_var(s, fd, name, JS_VAR_DEF_LET) < 0)
+                        goto fail;
+                }
+                /* XXX: could avoid allocating an argument if rest is true */
+                idx = add_arg(ctx, fd, name);
+                if (idx < 0)
+                    goto fail;
+                if (next_token(s))
+                    goto fail;
+                if (rest) {
+                    emit_op(s, OP_rest);
+                    emit_u16(s, idx);
+                    if (fd->has_parameter_expressions) {
+                        emit_op(s, OP_dup);
+                        emit_op(s, OP_scope_put_var_init);
+                        emit_atom(s, name);
+                        emit_u16(s, fd->scope_level);
+                    }
+                    emit_op(s, OP_put_arg);
+                    emit_u16(s, idx);
+                    fd->has_simple_parameter_list = FALSE;
+                    has_opt_arg = TRUE;
+                } else if (s->token.val == '=') {
+                    int label;
+                    
+                    fd->has_simple_parameter_list = FALSE;
+                    has_opt_arg = TRUE;
+
+                    if (next_token(s))
+                        goto fail;
+
+                    label = new_label(s);
+                    emit_op(s, OP_get_arg);
+                    emit_u16(s, idx);
+                    emit_op(s, OP_dup);
+                    emit_op(s, OP_undefined);
+                    emit_op(s, OP_strict_eq);
+                    emit_goto(s, OP_if_false, label);
+                    emit_op(s, OP_drop);
+                    if (js_parse_assign_expr(s))
+                        goto fail;
+                    set_object_name(s, name);
+                    emit_op(s, OP_dup);
+                    emit_op(s, OP_put_arg);
+                    emit_u16(s, idx);
+                    emit_label(s, label);
+                    emit_op(s, OP_scope_put_var_init);
+                    emit_atom(s, name);
+                    emit_u16(s, fd->scope_level);
+                } else {
+                    if (!has_opt_arg) {
+                        fd->defined_arg_count++;
+                    }
+                    if (fd->has_parameter_expressions) {
+                        /* copy the argument to the argument scope */
+                        emit_op(s, OP_get_arg);
+                        emit_u16(s, idx);
+                        emit_op(s, OP_scope_put_var_init);
+                        emit_atom(s, name);
+                        emit_u16(s, fd->scope_level);
+                    }
+                }
+            } else {
+                js_parse_error(s, "missing formal parameter");
+                goto fail;
+            }
+            if (rest && s->token.val != ')') {
+                js_parse_expect(s, ')');
+                goto fail;
+            }
+            if (s->token.val == ')')
+                break;
+            if (js_parse_expect(s, ','))
+                goto fail;
+        }
+        if ((func_type == JS_PARSE_FUNC_GETTER && fd->arg_count != 0) ||
+            (func_type == JS_PARSE_FUNC_SETTER && fd->arg_count != 1)) {
+            js_parse_error(s, "invalid number of arguments for getter or setter");
+            goto fail;
+        }
+    }
+
+    if (fd->has_parameter_expressions) {
+        int idx;
+
+        /* Copy the variables in the argument scope to the variable
+           scope (see FunctionDeclarationInstantiation() in spec). The
+           normal arguments are already present, so no need to copy
+           them. */
+        idx = fd->scopes[fd->scope_level].first;
+        while (idx >= 0) {
+            JSVarDef *vd = &fd->vars[idx];
+            if (vd->scope_level != fd->scope_level)
+                break;
+            if (find_var(ctx, fd, vd->var_name) < 0) {
+                if (add_var(ctx, fd, vd->var_name) < 0)
+                    goto fail;
+                vd = &fd->vars[idx]; /* fd->vars may have been reallocated */
+                emit_op(s, OP_scope_get_var);
+                emit_atom(s, vd->var_name);
+                emit_u16(s, fd->scope_level);
+                emit_op(s, OP_scope_put_var);
+                emit_atom(s, vd->var_name);
+                emit_u16(s, 0);
+            }
+            idx = vd->scope_next;
+        }
+        
+        /* the argument scope has no parent, hence we don't use pop_scope(s) */
+        emit_op(s, OP_leave_scope);
+        emit_u16(s, fd->scope_level);
+
+        /* set the variable scope as the current scope */
+        fd->scope_level = 0;
+        fd->scope_first = fd->scopes[fd->scope_level].first;
+    }
+    
+    if (next_token(s))
+        goto fail;
+
+    /* generator function: yield after the parameters are evaluated */
+    if (func_kind == JS_FUNC_GENERATOR ||
+        func_kind == JS_FUNC_ASYNC_GENERATOR)
+        emit_op(s, OP_initial_yield);
+
+    /* in generators, yield expression is forbidden during the parsing
+       of the arguments */
+    fd->in_function_body = TRUE;
+    push_scope(s);  /* enter body scope */
+    fd->body_scope = fd->scope_level;
+
+    if (s->token.val == TOK_ARROW) {
+        if (next_token(s))
+            goto fail;
+
+        if (s->token.val != '{') {
+            if (js_parse_function_check_names(s, fd, func_name))
+                goto fail;
+
+            if (js_parse_assign_expr(s))
+                goto fail;
+
+            if (func_kind != JS_FUNC_NORMAL)
+                emit_op(s, OP_return_async);
+            else
+                emit_op(s, OP_return);
+
+            if (!(fd->js_mode & JS_MODE_STRIP)) {
+                /* save the function source code */
+                /* the end of the function source code is after the last
+                   token of the function source stored into s->last_ptr */
+                fd->source_len = s->last_ptr - ptr;
+                fd->source_pos = s->buf_start_pos + (ptr - s->buf_start);
+                fd->source = js_strndup(ctx, (const char *)ptr, fd->source_len);
+                if (!fd->source)
+                    goto fail;
+            }
+            goto done;
+        }
+    }
+
+    if (js_parse_expect(s, '{'))
+        goto fail;
+
+    if (js_parse_directives(s))
+        goto fail;
+
+    /* in strict_mode, check function and argument names */
+    if (js_parse_function_check_names(s, fd, func_name))
+        goto fail;
+
+    while (s->token.val != '}') {
+        if (js_parse_source_element(s))
+            goto fail;
+    }
+    if (!(fd->js_mode & JS_MODE_STRIP)) {
+        /* save the function source code */
+        fd->source_len = s->buf_ptr - ptr;
+        fd->source_pos = s->buf_start_pos + (ptr - s->buf_start);
+        fd->source = js_strndup(ctx, (const char *)ptr, fd->source_len);
+        if (!fd->source)
+            goto fail;
+    }
+
+    if (next_token(s)) {
+        /* consume the '}' */
+        goto fail;
+    }
+
+    /* in case there is no return, add one */
+    if (js_is_live_code(s)) {
+        emit_return(s, FALSE);
+    }
+done:
+    s->cur_func = fd->parent;
+
+    /* create the function object */
+    {
+        int idx;
+        JSAtom func_name = fd->func_name;
+
+        /* the real object will be set at the end of the compilation */
+        idx = cpool_add(s, JS_NULL);
+        fd->parent_cpool_idx = idx;
+
+        if (is_expr) {
+            /* for constructors, no code needs to be generated here */
+            if (func_type != JS_PARSE_FUNC_CLASS_CONSTRUCTOR &&
+                func_type != JS_PARSE_FUNC_DERIVED_CLASS_CONSTRUCTOR) {
+                /* OP_fclosure creates the function object from the bytecode
+                   and adds the scope information */
+                emit_op(s, OP_fclosure);
+                emit_u32(s, idx);
+                if (func_name == JS_ATOM_NULL) {
+                    emit_op(s, OP_set_name);
+                    emit_u32(s, JS_ATOM_NULL);
+                }
+            }
+        } else if (func_type == JS_PARSE_FUNC_VAR) {
+            emit_op(s, OP_fclosure);
+            emit_u32(s, idx);
+            if (create_func_var) {
+                if (s->cur_func->is_global_var) {
+                    JSGlobalVar *hf;
+                    /* the global variable must be defined at the start of the
+                       function */
+                    hf = add_global_var(ctx, s->cur_func, func_name);
+                    if (!hf)
+                        goto fail;
+                    /* it is considered as defined at the top level
+                       (needed for annex B.3.3.4 and B.3.3.5
+                       checks) */
+                    hf->scope_level = 0; 
+                    hf->force_init = ((s->cur_func->js_mode & JS_MODE_STRICT) != 0);
+                    /* store directly into global var, bypass lexical scope */
+                    emit_op(s, OP_dup);
+                    emit_op(s, OP_scope_put_var);
+                    emit_atom(s, func_name);
+                    emit_u16(s, 0);
+                } else {
+                    /* do not call define_var to bypass lexical scope check */
+                    func_idx = find_var(ctx, s->cur_func, func_name);
+                    if (func_idx < 0) {
+                        func_idx = add_var(ctx, s->cur_func, func_name);
+                        if (func_idx < 0)
+                            goto fail;
+                    }
+                    /* store directly into local var, bypass lexical catch scope */
+                    emit_op(s, OP_dup);
+                    emit_op(s, OP_scope_put_var);
+                    emit_atom(s, func_name);
+                    emit_u16(s, 0);
+                }
+            }
+            if (lexical_func_idx >= 0) {
+                /* lexical variable will be initialized upon entering scope */
+                s->cur_func->vars[lexical_func_idx].func_pool_idx = idx;
+                emit_op(s, OP_drop);
+            } else {
+                /* store function object into its lexical name */
+                /* XXX: could use OP_put_loc directly */
+                emit_op(s, OP_scope_put_var_init);
+                emit_atom(s, func_name);
+                emit_u16(s, s->cur_func->scope_level);
+            }
+        } else {
+            if (!s->cur_func->is_global_var) {
+                int var_idx = define_var(s, s->cur_func, func_name, JS_VAR_DEF_VAR);
+
+                if (var_idx < 0)
+                    goto fail;
+                /* the variable will be assigned at the top of the function */
+                if (var_idx & ARGUMENT_VAR_OFFSET) {
+                    s->cur_func->args[var_idx - ARGUMENT_VAR_OFFSET].func_pool_idx = idx;
+                } else {
+                    s->cur_func->vars[var_idx].func_pool_idx = idx;
+                }
+            } else {
+                JSAtom func_var_name;
+                JSGlobalVar *hf;
+                if (func_name == JS_ATOM_NULL)
+                    func_var_name = JS_ATOM__default_; /* export default */
+                else
+                    func_var_name = func_name;
+                /* the variable will be assigned at the top of the function */
+                hf = add_global_var(ctx, s->cur_func, func_var_name);
+                if (!hf)
+                    goto fail;
+                hf->cpool_idx = idx;
+                if (export_flag != JS_PARSE_EXPORT_NONE) {
+                    if (!add_export_entry(s, s->cur_func->module, func_var_name,
+                                          export_flag == JS_PARSE_EXPORT_NAMED ? func_var_name : JS_ATOM_default, JS_EXPORT_TYPE_LOCAL))
+                        goto fail;
+                }
+            }
+        }
+    }
+    return 0;
+ fail:
+    s->cur_func = fd->parent;
+    js_free_function_def(ctx, fd);
+    if (pfd)
+        *pfd = NULL;
+    return -1;
+}
+
+static __exception int js_parse_function_decl(JSParseState *s,
+                                              JSParseFunctionEnum func_type,
+                                              JSFunctionKindEnum func_kind,
+                                              JSAtom func_name,
+                                              const uint8_t *ptr,
+                                              int function_line_num)
+{
+    return js_parse_function_decl2(s, func_type, func_kind, func_name, ptr,
+                                   function_line_num, JS_PARSE_EXPORT_NONE,
+                                   NULL);
+}
+
+static __exception int js_parse_program(JSParseState *s)
+{
+    JSFunctionDef *fd = s->cur_func;
+    int idx;
+
+    if (next_token(s))
+        return -1;
+
+    if (js_parse_directives(s))
+        return -1;
+
+    fd->is_global_var = (fd->eval_type == JS_EVAL_TYPE_GLOBAL) ||
+        (fd->eval_type == JS_EVAL_TYPE_MODULE) ||
+        !(fd->js_mode & JS_MODE_STRICT);
+
+    if (!s->is_module) {
+        /* hidden variable for the return value */
+        fd->eval_ret_idx = idx = add_var(s->ctx, fd, JS_ATOM__ret_);
+        if (idx < 0)
+            return -1;
+    }
+
+    while (s->token.val != TOK_EOF) {
+        if (js_parse_source_element(s))
+            return -1;
+    }
+
+    if (!s->is_module) {
+        /* return the value of the hidden variable eval_ret_idx  */
+        emit_op(s, OP_get_loc);
+        emit_u16(s, fd->eval_ret_idx);
+
+        emit_op(s, OP_return);
+    } else {
+        emit_op(s, OP_return_undef);
+    }
+
+    return 0;
+}
+
+static void js_parse_init(JSContext *ctx, JSParseState *s,
+                          const char *input, size_t input_len,
+                          const char *filename)
+{
+    memset(s, 0, sizeof(*s));
+    s->ctx = ctx;
+    s->filename = filename;
+    s->line_num = 1;
+    s->buf_ptr = (const uint8_t *)input;
+    s->buf_end = s->buf_ptr + input_len;
+    s->buf_start = s->buf_ptr;
+    s->token.val = ' ';
+    s->token.line_num = 1;
+}
+
+static JSValue JS_EvalFunctionInternal(JSContext *ctx, JSValue fun_obj,
+                                       JSValueConst this_obj,
+                                       JSVarRef **var_refs, JSStackFrame *sf)
+{
+    JSValue ret_val;
+    uint32_t tag;
+
+    tag = JS_VALUE_GET_TAG(fun_obj);
+    if (tag == JS_TAG_FUNCTION_BYTECODE) {
+        fun_obj = js_closure(ctx, fun_obj, var_refs, sf);
+        ret_val = JS_CallFree(ctx, fun_obj, this_obj, 0, NULL);
+    } else if (tag == JS_TAG_MODULE) {
+        JSModuleDef *m;
+        m = JS_VALUE_GET_PTR(fun_obj);
+        /* the module refcount should be >= 2 */
+        JS_FreeValue(ctx, fun_obj);
+        if (js_create_module_function(ctx, m) < 0)
+            goto fail;
+        if (js_link_module(ctx, m) < 0)
+            goto fail;
+        ret_val = js_evaluate_module(ctx, m);
+        if (JS_IsException(ret_val)) {
+        fail:
+            js_free_modules(ctx, JS_FREE_MODULE_NOT_EVALUATED);
+            return JS_EXCEPTION;
+        }
+    } else {
+        JS_FreeValue(ctx, fun_obj);
+        ret_val = JS_ThrowTypeError(ctx, "bytecode function expected");
+    }
+    return ret_val;
+}
+
+JSValue JS_EvalFunction(JSContext *ctx, JSValue fun_obj)
+{
+    JSValue ret_val;
+    void *ptr;
+
+    if (unlikely(ctx->snapshot != NULL) &&
+        (JS_VALUE_GET_TAG(fun_obj) == JS_TAG_FUNCTION_BYTECODE ||
+         JS_VALUE_GET_TAG(fun_obj) == JS_TAG_MODULE)) {
+        /* code which was not compiled in this context (e.g. read
+           with JS_ReadObject()) */
+        ptr = JS_VALUE_GET_PTR(fun_obj);
+        if (js_snapshot_find(ctx->snapshot, ptr) < 0)
+            js_snapshot_record_compile(ctx, fun_obj);
+        ret_val = JS_EvalFunctionInternal(ctx, fun_obj, ctx->global_obj,
+                                          NULL, NULL);
+        if (!JS_IsException(ret_val) && ctx->snapshot)
+            js_snapshot_record_eval(ctx, ptr);
+        return ret_val;
+    }
+    return JS_EvalFunctionInternal(ctx, fun_obj, ctx->global_obj, NULL, NULL);
+}
+
+static void skip_shebang(JSParseState *s)
+{
+    const uint8_t *p = s->buf_ptr;
+    int c;
+
+    if (p[0] == '#' && p[1] == '!') {
+        p += 2;
+        while (p < s->buf_end) {
+            if (*p == '\n' || *p == '\r') {
+                break;
+            } else if (*p >= 0x80) {
+                c = unicode_from_utf8(p, UTF8_CHAR_LEN_MAX, &p);
+                if (c == CP_LS || c == CP_PS) {
+                    break;
+                } else if (c == -1) {
+                    p++; /* skip invalid UTF-8 */
+                }
+            } else {
+                p++;
+            }
+        }
+        s->buf_ptr = p;
+    }
+}
+
+/* Cache of the compiled code of the evaluated scripts, eval() and
+   Function() sources. The bytecode of global and eval code only
+   depends on its source, on the evaluation flags and, for direct
+   eval, on the enclosing function and scope. The closure is created
+   for each evaluation. */
+
+typedef struct JSEvalCacheEntry {
+    struct list_head link; /* LRU order, most recently used first */
+    struct JSEvalCacheEntry *hash_next;
+    uint32_t hash;
+    int flags;
+    int scope_idx;
+    JSFunctionBytecode *parent_b; /* enclosing function of direct eval */
+    JSValue func_obj; /* compiled code */
+    size_t input_len;
+    char input[0]; /* input_len bytes followed by the file name */
+} JSEvalCacheEntry;
+
+typedef struct JSEvalCache {
+    struct list_head entry_list;
+    int count;
+    int hash_size; /* power of two */
+    JSEvalCacheEntry **hash;
+} JSEvalCache;
+
+static void js_eval_cache_free_entry(JSRuntime *rt, JSEvalCacheEntry *e)
+{
+    list_del(&e->link);
+    JS_FreeValueRT(rt, e->func_obj);
+    if (e->parent_b)
+        JS_FreeValueRT(rt, JS_MKPTR(JS_TAG_FUNCTION_BYTECODE, e->parent_b));
+    js_free_rt(rt, e);
+}
+
+static void js_eval_cache_free(JSContext *ctx)
+{
+    JSEvalCache *ec = ctx->eval_cache;
+    struct list_head *el, *el1;
+
+    if (!ec)
+        return;
+    list_for_each_safe(el, el1, &ec->entry_list) {
+        JSEvalCacheEntry *e = list_entry(el, JSEvalCacheEntry, link);
+        js_eval_cache_free_entry(ctx->rt, e);
+    }
+    js_free(ctx, ec->hash);
+    js_free(ctx, ec);
+    ctx->eval_cache = NULL;
+}
+
+static void js_eval_cache_mark(JSRuntime *rt, JSEvalCache *ec,
+                               JS_MarkFunc *mark_func)
+{
+    struct list_head *el;
+
+    list_for_each(el, &ec->entry_list) {
+        JSEvalCacheEntry *e = list_entry(el, JSEvalCacheEntry, link);
+        JS_MarkValue(rt, e->func_obj, mark_func);
+        if (e->parent_b)
+            mark_func(rt, &e->parent_b->header);
+    }
+}
+
+/* Set the maximum number of compiled scripts kept by the context. 0
+   disables the cache. */
+void JS_SetEvalCacheSize(JSContext *ctx, int max_size)
+{
+    js_eval_cache_free(ctx);
+    ctx->eval_cache_max_size = max_int(max_size, 0);
+}
+
+static BOOL js_eval_cache_is_enabled(JSContext *ctx, size_t input_len,
+                                     const char *input, int flags)
+{
+    int eval_type = flags & JS_EVAL_TYPE_MASK;
+    return (ctx->eval_cache_max_size > 0 &&
+            eval_type != JS_EVAL_TYPE_MODULE &&
+            !(flags & JS_EVAL_FLAG_COMPILE_ONLY) &&
+            !ctx->snapshot &&
+            input_len <= JS_EVAL_CACHE_MAX_INPUT_LEN &&
+            /* each evaluation must create new template objects */
+            !memchr(input, '`', input_len));
+}
+
+static uint32_t js_eval_cache_hash(const char *input, size_t input_len,
+                                   const char *filename, int flags,
+                                   int scope_idx,
+                                   JSFunctionBytecode *parent_b)
+{
+    uint32_t h;
+    h = hash_string8((const uint8_t *)input, input_len, 1);
+    h = hash_string8((const uint8_t *)filename, strlen(filename), h);
+    h = h * 263 + flags;
+    h = h * 263 + scope_idx;
+    h = h * 263 + (uint32_t)(uintptr_t)parent_b;
+    return h;
+}
+
+/* return the compiled code of the source or JS_UNDEFINED if not in
+   the cache */
+static JSValue js_eval_cache_find(JSContext *ctx, uint32_t hash,
+                                  const char *input, size_t input_len,
+                                  const char *filename, int flags,
+                                  int scope_idx,
+                                  JSFunctionBytecode *parent_b)
+{
+    JSEvalCache *ec = ctx->eval_cache;
+    JSEvalCacheEntry *e;
+
+    if (!ec)
+        return JS_UNDEFINED;
+    for(e = ec->hash[hash & (ec->hash_size - 1)]; e != NULL;
+        e = e->hash_next) {
+        if (e->hash == hash && e->flags == flags &&
+            e->scope_idx == scope_idx && e->parent_b == parent_b &&
+            e->input_len == input_len &&
+            !memcmp(e->input, input, input_len) &&
+            !strcmp(e->input + input_len, filename)) {
+            /* move to the head of the LRU list */
+            list_del(&e->link);
+            list_add(&e->link, &ec->entry_list);
+            return JS_DupValue(ctx, e->func_obj);
+        }
+    }
+    return JS_UNDEFINED;
+}
+
+static void js_eval_cache_remove(JSEvalCache *ec, JSEvalCacheEntry *e)
+{
+    JSEvalCacheEntry **pe;
+
+    for(pe = &ec->hash[e->hash & (ec->hash_size - 1)]; *pe != e;
+        pe = &(*pe)->hash_next)
+        continue;
+    *pe = e->hash_next;
+    ec->count--;
+}
+
+/* add the compiled code 'func_obj' to the cache. Errors are
+   ignored. */
+static void js_eval_cache_add(JSContext *ctx, uint32_t hash,
+                              const char *input, size_t input_len,
+                              const char *filename, int flags,
+                              int scope_idx, JSFunctionBytecode *parent_b,
+                              JSValueConst func_obj)
+{
+    JSEvalCache *ec = ctx->eval_cache;
+    JSEvalCacheEntry *e;
+    size_t filename_len;
+
+    if (!ec) {
+        ec = js_mallocz(ctx, sizeof(*ec));
+        if (!ec)
+            goto fail;
+        init_list_head(&ec->entry_list);
+        ec->hash_size = 1;
+        while (ec->hash_size < ctx->eval_cache_max_size)
+            ec->hash_size *= 2;
+        ec->hash = js_mallocz(ctx, sizeof(ec->hash[0]) * ec->hash_size);
+        if (!ec->hash) {
+            js_free(ctx, ec);
+            goto fail;
+        }
+        ctx->eval_cache = ec;
+    }
+    if (ec->count >= ctx->eval_cache_max_size) {
+        /* remove the least recently used entry */
+        e = list_entry(ec->entry_list.prev, JSEvalCacheEntry, link);
+        js_eval_cache_remove(ec, e);
+        js_eval_cache_free_entry(ctx->rt, e);
+    }
+    filename_len = strlen(filename);
+    e = js_malloc(ctx, sizeof(*e) + input_len + filename_len + 1);
+    if (!e)
+        goto fail;
+    e->hash = hash;
+    e->flags = flags;
+    e->scope_idx = scope_idx;
+    e->parent_b = parent_b;
+    if (parent_b)
+        parent_b->header.ref_count++;
+    e->func_obj = JS_DupValue(ctx, func_obj);
+    e->input_len = input_len;
+    memcpy(e->input, input, input_len);
+    memcpy(e->input + input_len, filename, filename_len + 1);
+    list_add(&e->link, &ec->entry_list);
+    e->hash_next = ec->hash[hash & (ec->hash_size - 1)];
+    ec->hash[hash & (ec->hash_size - 1)] = e;
+    ec->count++;
+    return;
+ fail:
+    JS_FreeValue(ctx, JS_GetException(ctx));
+}
+
+/* 'input' must be zero terminated i.e. input[input_len] = '\0'. */
+static JSValue __JS_EvalInternal(JSContext *ctx, JSValueConst this_obj,
+                                 const char *input, size_t input_len,
+                                 const char *filename, int flags, int scope_idx)
+{
+    JSParseState s1, *s = &s1;
+    int err, js_mode, eval_type;
+    JSValue fun_obj, ret_val;
+    JSStackFrame *sf;
+    JSVarRef **var_refs;
+    JSFunctionBytecode *b;
+    JSFunctionDef *fd;
+    JSModuleDef *m;
+    BOOL use_cache;
+    uint32_t cache_hash;
+
+    js_parse_init(ctx, s, input, input_len, filename);
+    skip_shebang(s);
+
+    eval_type = flags & JS_EVAL_TYPE_MASK;
+    m = NULL;
+    if (eval_type == JS_EVAL_TYPE_DIRECT) {
+        JSObject *p;
+        sf = ctx->rt->current_stack_frame;
+        assert(sf != NULL);
+        assert(JS_VALUE_GET_TAG(sf->cur_func) == JS_TAG_OBJECT);
+        p = JS_VALUE_GET_OBJ(sf->cur_func);
+        assert(js_class_has_bytecode(p->class_id));
+        b = p->u.func.function_bytecode;
+        var_refs = p->u.func.var_refs;
+        js_mode = b->js_mode;
+    } else {
+        sf = NULL;
+        b = NULL;
+        var_refs = NULL;
+        js_mode = 0;
+        if (flags & JS_EVAL_FLAG_STRICT)
+            js_mode |= JS_MODE_STRICT;
+        if (flags & JS_EVAL_FLAG_STRIP)
+            js_mode |= JS_MODE_STRIP;
+        if (eval_type == JS_EVAL_TYPE_MODULE) {
+            JSAtom module_name = JS_NewAtom(ctx, filename);
+            if (module_name == JS_ATOM_NULL)
+                return JS_EXCEPTION;
+            m = js_new_module_def(ctx, module_name);
+            if (!m)
+                return JS_EXCEPTION;
+            js_mode |= JS_MODE_STRICT;
+        }
+    }
+    use_cache = js_eval_cache_is_enabled(ctx, input_len, input, flags);
+    cache_hash = 0;
+    if (use_cache) {
+        cache_hash = js_eval_cache_hash(input, input_len, filename, flags,
+                                        scope_idx, b);
+        fun_obj = js_eval_cache_find(ctx, cache_hash, input, input_len,
+                                     filename, flags, scope_idx, b);
+        if (!JS_IsUndefined(fun_obj))
+            return JS_EvalFunctionInternal(ctx, fun_obj, this_obj,
+                                           var_refs, sf);
+    }
+    fd = js_new_function_def(ctx, NULL, TRUE, FALSE, filename, 1);
+    if (!fd)
+        goto fail1;
+    s->cur_func = fd;
+    fd->eval_type = eval_type;
+    fd->has_this_binding = (eval_type != JS_EVAL_TYPE_DIRECT);
+    fd->backtrace_barrier = ((flags & JS_EVAL_FLAG_BACKTRACE_BARRIER) != 0);
+    if (eval_type == JS_EVAL_TYPE_DIRECT) {
+        fd->new_target_allowed = b->new_target_allowed;
+        fd->super_call_allowed = b->super_call_allowed;
+        fd->super_allowed = b->super_allowed;
+        fd->arguments_allowed = b->arguments_allowed;
+    } else {
+        fd->new_target_allowed = FALSE;
+        fd->super_call_allowed = FALSE;
+        fd->super_allowed = FALSE;
+        fd->arguments_allowed = TRUE;
+    }
+    fd->js_mode = js_mode;
+    fd->func_name = JS_DupAtom(ctx, JS_ATOM__eval_);
+    /* the inner functions of the global and module code are compiled
+       when they are first called */
+    fd->lazy_compile = ((eval_type == JS_EVAL_TYPE_GLOBAL ||
+                         eval_type == JS_EVAL_TYPE_MODULE) &&
+                        !ctx->snapshot);
+    fd->reload_source = ((flags & JS_EVAL_FLAG_RELOAD_SOURCE) &&
+                         ctx->rt->source_loader_func &&
+                         (eval_type == JS_EVAL_TYPE_GLOBAL ||
+                          eval_type == JS_EVAL_TYPE_MODULE));
+    if (b) {
+        if (add_closure_variables(ctx, fd, b, scope_idx))
+            goto fail;
+    }
+    fd->module = m;
+    s->is_module = (m != NULL);
+    s->allow_html_comments = !s->is_module;
+
+    push_scope(s); /* body scope */
+    fd->body_scope = fd->scope_level;
+    
+    err = js_parse_program(s);
+    if (err) {
+    fail:
+        free_token(s, &s->token);
+        js_free_function_def(ctx, fd);
+        goto fail1;
+    }
+
+    /* create the function object and all the enclosed functions */
+    fun_obj = js_create_function(ctx, fd);
+    if (JS_IsException(fun_obj))
+        goto fail1;
+    /* Could add a flag to avoid resolution if necessary */
+    if (m) {
+        m->func_obj = fun_obj;
+        if (js_resolve_module(ctx, m) < 0)
+            goto fail1;
+        fun_obj = JS_DupValue(ctx, JS_MKPTR(JS_TAG_MODULE, m));
+    }
+    if (unlikely(ctx->snapshot != NULL) && eval_type != JS_EVAL_TYPE_DIRECT &&
+        eval_type != JS_EVAL_TYPE_INDIRECT) {
+        js_snapshot_record_compile(ctx, fun_obj);
+    }
+    if (use_cache) {
+        js_eval_cache_add(ctx, cache_hash, input, input_len, filename, flags,
+                          scope_idx, b, fun_obj);
+    }
+    if (flags & JS_EVAL_FLAG_COMPILE_ONLY) {
+        ret_val = fun_obj;
+    } else {
+        void *ptr = JS_VALUE_GET_PTR(fun_obj);
+        ret_val = JS_EvalFunctionInternal(ctx, fun_obj, this_obj, var_refs, sf);
+        if (unlikely(ctx->snapshot != NULL) && !JS_IsException(ret_val) &&
+            eval_type != JS_EVAL_TYPE_DIRECT &&
+            eval_type != JS_EVAL_TYPE_INDIRECT) {
+            js_snapshot_record_eval(ctx, ptr);
+        }
+    }
+    return ret_val;
+ fail1:
+    /* XXX: should free all the unresolved dependencies */
+    if (m)
+        js_free_module_def(ctx, m);
+    return JS_EXCEPTION;
+}
+
+/* compile the function 'b' created by js_create_lazy_function(). Its
+   closure variables are provided by a direct eval like parent so that
+   they keep the same indexes. */
+static JSFunctionBytecode *js_compile_lazy_function(JSContext *ctx,
+                                                    JSFunctionBytecode *b)
+{
+    JSParseState s1, *s = &s1;
+    JSFunctionBytecodeLazy *lazy = b->lazy;
+    JSFunctionDef *fd, *fd1;
+    JSFunctionBytecode *b1;
+    JSValue func_obj;
+    const char *filename;
+    int i;
+
+    filename = JS_AtomToCString(ctx, b->debug.filename);
+    if (!filename)
+        return NULL;
+    js_parse_init(ctx, s, b->debug.source, b->debug.source_len, filename);
+    s->buf_start_pos = b->debug.source_pos;
+    s->line_num = b->debug.line_num;
+    s->is_module = lazy->u.compile.is_module;
+    s->allow_html_comments = !s->is_module;
+
+    fd = js_new_function_def(ctx, NULL, TRUE, FALSE, filename,
+                             b->debug.line_num);
+    if (!fd)
+        goto fail1;
+    s->cur_func = fd;
+    fd->eval_type = JS_EVAL_TYPE_DIRECT;
+    fd->js_mode = b->js_mode;
+    fd->lazy_compile = TRUE;
+    fd->reload_source = lazy->u.compile.reload_source;
+    fd->func_name = JS_DupAtom(ctx, JS_ATOM__eval_);
+    for(i = 0; i < b->closure_var_count; i++) {
+        JSClosureVar *cv = &b->closure_var[i];
+        if (add_closure_var(ctx, fd, FALSE, cv->is_arg, i, cv->var_name,
+                            cv->is_const, cv->is_lexical, cv->var_kind) < 0)
             goto fail;
-        }
     }
+    push_scope(s); /* body scope */
+    fd->body_scope = fd->scope_level;
 
-    if (fd->has_parameter_expressions) {
-        int idx;
+    fd1 = NULL;
+    if (next_token(s))
+        goto fail;
+    if (js_parse_function_decl2(s, JS_PARSE_FUNC_EXPR, JS_FUNC_NORMAL,
+                                JS_ATOM_NULL, s->token.ptr,
+                                s->token.line_num, JS_PARSE_EXPORT_NONE,
+                                &fd1))
+        goto fail;
+    if (s->token.val != TOK_EOF || fd1->func_name != b->func_name ||
+        fd1->closure_var_count != 0) {
+        JS_ThrowInternalError(ctx, "invalid lazy function");
+        goto fail;
+    }
+    fd1->is_func_expr = lazy->u.compile.is_func_expr;
+    /* reference the closure variables of 'fd' in the same order as
+       in 'b' */
+    for(i = 0; i < b->closure_var_count; i++) {
+        JSClosureVar *cv = &b->closure_var[i];
+        if (add_closure_var(ctx, fd1, FALSE, cv->is_arg, i, cv->var_name,
+                            cv->is_const, cv->is_lexical, cv->var_kind) < 0)
+            goto fail;
+    }
 
-        /* Copy the variables in the argument scope to the variable
-           scope (see FunctionDeclarationInstantiation() in spec). The
-           normal arguments are already present, so no need to copy
-           them. */
-        idx = fd->scopes[fd->scope_level].first;
-        while (idx >= 0) {
-            JSVarDef *vd = &fd->vars[idx];
-            if (vd->scope_level != fd->scope_level)
-                break;
-            if (find_var(ctx, fd, vd->var_name) < 0) {
-                if (add_var(ctx, fd, vd->var_name) < 0)
-                    goto fail;
-                vd = &fd->vars[idx]; /* fd->vars may have been reallocated */
-                emit_op(s, OP_scope_get_var);
-                emit_atom(s, vd->var_name);
-                emit_u16(s, fd->scope_level);
-                emit_op(s, OP_scope_put_var);
-                emit_atom(s, vd->var_name);
-                emit_u16(s, 0);
-            }
-            idx = vd->scope_next;
+    func_obj = js_create_function(ctx, fd1);
+    js_free_function_def(ctx, fd);
+    JS_FreeCString(ctx, filename);
+    if (JS_IsException(func_obj))
+        return NULL;
+    b1 = JS_VALUE_GET_PTR(func_obj);
+    if (b1->closure_var_count != b->closure_var_count) {
+        JS_FreeValue(ctx, func_obj);
+        JS_ThrowInternalError(ctx, "invalid lazy function closure");
+        return NULL;
+    }
+    for(i = 0; i < b->closure_var_count; i++) {
+        b1->closure_var[i].is_local = b->closure_var[i].is_local;
+        b1->closure_var[i].is_arg = b->closure_var[i].is_arg;
+        b1->closure_var[i].var_idx = b->closure_var[i].var_idx;
+    }
+    return b1;
+ fail:
+    free_token(s, &s->token);
+    js_free_function_def(ctx, fd);
+ fail1:
+    JS_FreeCString(ctx, filename);
+    return NULL;
+}
+
+/* return the bytecode to execute for 'b' or NULL if exception. 'b'
+   must be lazy. */
+static JSFunctionBytecode *js_function_bytecode_load(JSFunctionBytecode *b)
+{
+    JSFunctionBytecodeLazy *lazy = b->lazy;
+
+    if (lazy->image) {
+        if (js_function_bytecode_read(b))
+            return NULL;
+        return b;
+    }
+    if (!lazy->u.compile.b) {
+        lazy->u.compile.b = js_compile_lazy_function(b->realm, b);
+        if (lazy->u.compile.b && lazy->u.compile.reload_source) {
+            /* the source is no longer needed to compile 'b' */
+            js_free(b->realm, b->debug.source);
+            b->debug.source = NULL;
         }
-        
-        /* the argument scope has no parent, hence we don't use pop_scope(s) */
-        emit_op(s, OP_leave_scope);
-        emit_u16(s, fd->scope_level);
+    }
+    return lazy->u.compile.b;
+}
 
-        /* set the variable scope as the current scope */
-        fd->scope_level = 0;
-        fd->scope_first = fd->scopes[fd->scope_level].first;
+/* same as js_function_bytecode_load() for the bytecode function
+   object 'p'. The compiled bytecode replaces the lazy one in 'p'. */
+static JSFunctionBytecode *js_function_load_bytecode(JSRuntime *rt,
+                                                     JSObject *p)
+{
+    JSFunctionBytecode *b, *b1;
+
+    b = p->u.func.function_bytecode;
+    b1 = js_function_bytecode_load(b);
+    if (b1 && b1 != b) {
+        b1->header.ref_count++;
+        p->u.func.function_bytecode = b1;
+        JS_FreeValueRT(rt, JS_MKPTR(JS_TAG_FUNCTION_BYTECODE, b));
     }
-    
-    if (next_token(s))
-        goto fail;
+    return b1;
+}
 
-    /* generator function: yield after the parameters are evaluated */
-    if (func_kind == JS_FUNC_GENERATOR ||
-        func_kind == JS_FUNC_ASYNC_GENERATOR)
-        emit_op(s, OP_initial_yield);
+/* the indirection is needed to make 'eval' optional */
+static JSValue JS_EvalInternal(JSContext *ctx, JSValueConst this_obj,
+                               const char *input, size_t input_len,
+                               const char *filename, int flags, int scope_idx)
+{
+    if (unlikely(!ctx->eval_internal)) {
+        return JS_ThrowTypeError(ctx, "eval is not supported");
+    }
+    return ctx->eval_internal(ctx, this_obj, input, input_len, filename,
+                              flags, scope_idx);
+}
 
-    /* in generators, yield expression is forbidden during the parsing
-       of the arguments */
-    fd->in_function_body = TRUE;
-    push_scope(s);  /* enter body scope */
-    fd->body_scope = fd->scope_level;
+static JSValue JS_EvalObject(JSContext *ctx, JSValueConst this_obj,
+                             JSValueConst val, int flags, int scope_idx)
+{
+    JSValue ret;
+    const char *str;
+    size_t len;
 
-    if (s->token.val == TOK_ARROW) {
-        if (next_token(s))
-            goto fail;
+    if (!JS_IsString(val))
+        return JS_DupValue(ctx, val);
+    str = JS_ToCStringLen(ctx, &len, val);
+    if (!str)
+        return JS_EXCEPTION;
+    ret = JS_EvalInternal(ctx, this_obj, str, len, "<input>", flags, scope_idx);
+    JS_FreeCString(ctx, str);
+    return ret;
 
-        if (s->token.val != '{') {
-            if (js_parse_function_check_names(s, fd, func_name))
-                goto fail;
+}
 
-            if (js_parse_assign_expr(s))
-                goto fail;
+JSValue JS_EvalThis(JSContext *ctx, JSValueConst this_obj,
+                    const char *input, size_t input_len,
+                    const char *filename, int eval_flags)
+{
+    int eval_type = eval_flags & JS_EVAL_TYPE_MASK;
+    JSValue ret;
 
-            if (func_kind != JS_FUNC_NORMAL)
-                emit_op(s, OP_return_async);
-            else
-                emit_op(s, OP_return);
+    assert(eval_type == JS_EVAL_TYPE_GLOBAL ||
+           eval_type == JS_EVAL_TYPE_MODULE);
+    ret = JS_EvalInternal(ctx, this_obj, input, input_len, filename,
+                          eval_flags, -1);
+    return ret;
+}
 
-            if (!(fd->js_mode & JS_MODE_STRIP)) {
-                /* save the function source code */
-                /* the end of the function source code is after the last
-                   token of the function source stored into s->last_ptr */
-                fd->source_len = s->last_ptr - ptr;
-                fd->source = js_strndup(ctx, (const char *)ptr, fd->source_len);
-                if (!fd->source)
-                    goto fail;
-            }
-            goto done;
+JSValue JS_Eval(JSContext *ctx, const char *input, size_t input_len,
+                const char *filename, int eval_flags)
+{
+    return JS_EvalThis(ctx, ctx->global_obj, input, input_len, filename,
+                       eval_flags);
+}
+
+int JS_ResolveModule(JSContext *ctx, JSValueConst obj)
+{
+    if (JS_VALUE_GET_TAG(obj) == JS_TAG_MODULE) {
+        JSModuleDef *m = JS_VALUE_GET_PTR(obj);
+        if (js_resolve_module(ctx, m) < 0) {
+            js_free_modules(ctx, JS_FREE_MODULE_NOT_RESOLVED);
+            return -1;
         }
     }
+    return 0;
+}
 
-    if (js_parse_expect(s, '{'))
-        goto fail;
+/* Compute the sorted namespace exports of 'm'. Nothing is done if
+   they depend on C modules or if a name cannot be resolved. */
+static int js_prelink_module_ns(JSContext *ctx, JSModuleDef *m)
+{
+    GetExportNamesState s_s, *s = &s_s;
+    JSModuleNsEntry *tab;
+    JSResolveResultEnum res;
+    JSExportEntry *res_me;
+    JSModuleDef *res_m;
+    BOOL is_static;
+    int i, count;
 
-    if (js_parse_directives(s))
+    if (m->ns_entries)
+        return 0;
+    tab = NULL;
+    count = 0;
+    memset(s, 0, sizeof(*s));
+    if (get_exported_names(ctx, s, m, FALSE))
         goto fail;
-
-    /* in strict_mode, check function and argument names */
-    if (js_parse_function_check_names(s, fd, func_name))
+    for(i = 0; i < s->modules_count; i++) {
+        if (s->modules[i]->init_func)
+            goto done;
+    }
+    tab = js_malloc(ctx, sizeof(tab[0]) * max_int(s->exported_names_count, 1));
+    if (!tab)
         goto fail;
-
-    while (s->token.val != '}') {
-        if (js_parse_source_element(s))
+    for(i = 0; i < s->exported_names_count; i++) {
+        ExportedNameEntry *en = &s->exported_names[i];
+        res = js_resolve_export2(ctx, &res_m, &res_me, m, en->export_name,
+                                 &is_static);
+        if (res == JS_RESOLVE_RES_EXCEPTION)
             goto fail;
+        if (!is_static ||
+            (res != JS_RESOLVE_RES_FOUND && res != JS_RESOLVE_RES_AMBIGUOUS))
+            goto done;
+        /* the ambiguous exports are removed */
+        if (res == JS_RESOLVE_RES_FOUND) {
+            tab[count].export_name = en->export_name;
+            tab[count].module_name = res_m->module_name;
+            tab[count].export_idx = res_me - res_m->export_entries;
+            count++;
+        }
     }
-    if (!(fd->js_mode & JS_MODE_STRIP)) {
-        /* save the function source code */
-        fd->source_len = s->buf_ptr - ptr;
-        fd->source = js_strndup(ctx, (const char *)ptr, fd->source_len);
-        if (!fd->source)
-            goto fail;
+    rqsort(tab, count, sizeof(tab[0]), module_ns_entries_cmp, ctx);
+    for(i = 0; i < count; i++) {
+        JS_DupAtom(ctx, tab[i].export_name);
+        JS_DupAtom(ctx, tab[i].module_name);
     }
+    m->ns_entries = tab;
+    m->ns_entries_count = count;
+    tab = NULL;
+ done:
+    js_free(ctx, tab);
+    js_free(ctx, s->modules);
+    js_free(ctx, s->exported_names);
+    return 0;
+ fail:
+    js_free(ctx, tab);
+    js_free(ctx, s->modules);
+    js_free(ctx, s->exported_names);
+    return -1;
+}
 
-    if (next_token(s)) {
-        /* consume the '}' */
-        goto fail;
+/* Store the result of the resolution of a resolved module so that it
+   is saved with JS_WriteObject() and not recomputed when the module
+   is linked: the requested module names are normalized and the
+   imports, indirect exports and namespace exports are resolved. The
+   resolutions depending on C modules are left to the linker because
+   their exports are only known at run time. */
+int JS_PrelinkModule(JSContext *ctx, JSValueConst obj)
+{
+    JSModuleDef *m, *m1, *res_m;
+    JSExportEntry *res_me;
+    JSResolveResultEnum res;
+    BOOL is_static, exports_ok;
+    int i;
+
+    if (JS_VALUE_GET_TAG(obj) != JS_TAG_MODULE)
+        return 0;
+    m = JS_VALUE_GET_PTR(obj);
+    if (m->init_func || !m->resolved)
+        return 0;
+
+    exports_ok = TRUE;
+    for(i = 0; i < m->export_entries_count; i++) {
+        JSExportEntry *me = &m->export_entries[i];
+        if (me->export_type == JS_EXPORT_TYPE_INDIRECT &&
+            me->local_name != JS_ATOM__star_) {
+            m1 = m->req_module_entries[me->u.req_module_idx].module;
+            res = js_resolve_export2(ctx, &res_m, &res_me, m1,
+                                     me->local_name, &is_static);
+            if (res == JS_RESOLVE_RES_EXCEPTION)
+                return -1;
+            if (res != JS_RESOLVE_RES_FOUND || !is_static)
+                exports_ok = FALSE;
+        }
     }
 
-    /* in case there is no return, add one */
-    if (js_is_live_code(s)) {
-        emit_return(s, FALSE);
+    for(i = 0; i < m->import_entries_count; i++) {
+        JSImportEntry *mi = &m->import_entries[i];
+        if (mi->import_name == JS_ATOM__star_ || mi->res_export_idx >= 0)
+            continue;
+        m1 = m->req_module_entries[mi->req_module_idx].module;
+        res = js_resolve_export2(ctx, &res_m, &res_me, m1,
+                                 mi->import_name, &is_static);
+        if (res == JS_RESOLVE_RES_EXCEPTION)
+            return -1;
+        if (res == JS_RESOLVE_RES_FOUND && is_static) {
+            mi->res_module_name = JS_DupAtom(ctx, res_m->module_name);
+            mi->res_export_idx = res_me - res_m->export_entries;
+        }
     }
-done:
-    s->cur_func = fd->parent;
 
-    /* create the function object */
-    {
-        int idx;
-        JSAtom func_name = fd->func_name;
+    if (js_prelink_module_ns(ctx, m))
+        return -1;
 
-        /* the real object will be set at the end of the compilation */
-        idx = cpool_add(s, JS_NULL);
-        fd->parent_cpool_idx = idx;
+    for(i = 0; i < m->req_module_entries_count; i++) {
+        JSReqModuleEntry *rme = &m->req_module_entries[i];
+        JS_FreeAtom(ctx, rme->module_name);
+        rme->module_name = JS_DupAtom(ctx, rme->module->module_name);
+    }
+    m->prelinked = TRUE;
+    m->prelinked_exports = exports_ok;
+    return 0;
+}
 
-        if (is_expr) {
-            /* for constructors, no code needs to be generated here */
-            if (func_type != JS_PARSE_FUNC_CLASS_CONSTRUCTOR &&
-                func_type != JS_PARSE_FUNC_DERIVED_CLASS_CONSTRUCTOR) {
-                /* OP_fclosure creates the function object from the bytecode
-                   and adds the scope information */
-                emit_op(s, OP_fclosure);
-                emit_u32(s, idx);
-                if (func_name == JS_ATOM_NULL) {
-                    emit_op(s, OP_set_name);
-                    emit_u32(s, JS_ATOM_NULL);
-                }
-            }
-        } else if (func_type == JS_PARSE_FUNC_VAR) {
-            emit_op(s, OP_fclosure);
-            emit_u32(s, idx);
-            if (create_func_var) {
-                if (s->cur_func->is_global_var) {
-                    JSGlobalVar *hf;
-                    /* the global variable must be defined at the start of the
-                       function */
-                    hf = add_global_var(ctx, s->cur_func, func_name);
-                    if (!hf)
-                        goto fail;
-                    /* it is considered as defined at the top level
-                       (needed for annex B.3.3.4 and B.3.3.5
-                       checks) */
-                    hf->scope_level = 0; 
-                    hf->force_init = ((s->cur_func->js_mode & JS_MODE_STRICT) != 0);
-                    /* store directly into global var, bypass lexical scope */
-                    emit_op(s, OP_dup);
-                    emit_op(s, OP_scope_put_var);
-                    emit_atom(s, func_name);
-                    emit_u16(s, 0);
-                } else {
-                    /* do not call define_var to bypass lexical scope check */
-                    func_idx = find_var(ctx, s->cur_func, func_name);
-                    if (func_idx < 0) {
-                        func_idx = add_var(ctx, s->cur_func, func_name);
-                        if (func_idx < 0)
-                            goto fail;
-                    }
-                    /* store directly into local var, bypass lexical catch scope */
-                    emit_op(s, OP_dup);
-                    emit_op(s, OP_scope_put_var);
-                    emit_atom(s, func_name);
-                    emit_u16(s, 0);
-                }
-            }
-            if (lexical_func_idx >= 0) {
-                /* lexical variable will be initialized upon entering scope */
-                s->cur_func->vars[lexical_func_idx].func_pool_idx = idx;
-                emit_op(s, OP_drop);
-            } else {
-                /* store function object into its lexical name */
-                /* XXX: could use OP_put_loc directly */
-                emit_op(s, OP_scope_put_var_init);
-                emit_atom(s, func_name);
-                emit_u16(s, s->cur_func->scope_level);
-            }
-        } else {
-            if (!s->cur_func->is_global_var) {
-                int var_idx = define_var(s, s->cur_func, func_name, JS_VAR_DEF_VAR);
+/* Whole program optimizations used by qjsc */
 
-                if (var_idx < 0)
-                    goto fail;
-                /* the variable will be assigned at the top of the function */
-                if (var_idx & ARGUMENT_VAR_OFFSET) {
-                    s->cur_func->args[var_idx - ARGUMENT_VAR_OFFSET].func_pool_idx = idx;
-                } else {
-                    s->cur_func->vars[var_idx].func_pool_idx = idx;
-                }
-            } else {
-                JSAtom func_var_name;
-                JSGlobalVar *hf;
-                if (func_name == JS_ATOM_NULL)
-                    func_var_name = JS_ATOM__default_; /* export default */
-                else
-                    func_var_name = func_name;
-                /* the variable will be assigned at the top of the function */
-                hf = add_global_var(ctx, s->cur_func, func_var_name);
-                if (!hf)
-                    goto fail;
-                hf->cpool_idx = idx;
-                if (export_flag != JS_PARSE_EXPORT_NONE) {
-                    if (!add_export_entry(s, s->cur_func->module, func_var_name,
-                                          export_flag == JS_PARSE_EXPORT_NAMED ? func_var_name : JS_ATOM_default, JS_EXPORT_TYPE_LOCAL))
-                        goto fail;
-                }
-            }
-        }
+/* return the loaded bytecode of the constant pool entry 'val' or NULL
+   if it is not a function. 'val' must not be an exception */
+static JSFunctionBytecode *js_get_cpool_function(JSContext *ctx,
+                                                 JSValueConst val,
+                                                 BOOL *pexception)
+{
+    JSFunctionBytecode *b;
+
+    *pexception = FALSE;
+    if (JS_VALUE_GET_TAG(val) != JS_TAG_FUNCTION_BYTECODE)
+        return NULL;
+    b = JS_VALUE_GET_PTR(val);
+    if (b->lazy) {
+        b = js_function_bytecode_load(b);
+        if (!b)
+            *pexception = TRUE;
     }
-    return 0;
- fail:
-    s->cur_func = fd->parent;
-    js_free_function_def(ctx, fd);
-    if (pfd)
-        *pfd = NULL;
-    return -1;
+    return b;
 }
 
-static __exception int js_parse_function_decl(JSParseState *s,
-                                              JSParseFunctionEnum func_type,
-                                              JSFunctionKindEnum func_kind,
-                                              JSAtom func_name,
-                                              const uint8_t *ptr,
-                                              int function_line_num)
+static int js_enum_function_atoms(JSContext *ctx, JSFunctionBytecode *b,
+                                  JSBytecodeAtomFunc *func, void *opaque)
 {
-    return js_parse_function_decl2(s, func_type, func_kind, func_name, ptr,
-                                   function_line_num, JS_PARSE_EXPORT_NONE,
-                                   NULL);
+    JSFunctionBytecode *b1;
+    const JSOpCode *oi;
+    JSAtom atom;
+    BOOL is_exception;
+    int pos, op, i;
+
+    if (b->func_kind & JS_FUNC_ASYNC)
+        func(ctx, JS_ATOM_Promise, opaque);
+    for(pos = 0; pos < b->byte_code_len; pos += oi->size) {
+        op = b->byte_code_buf[pos];
+        oi = &short_opcode_info(op);
+        switch(oi->fmt) {
+        case OP_FMT_atom:
+        case OP_FMT_atom_u8:
+        case OP_FMT_atom_u16:
+        case OP_FMT_atom_label_u8:
+        case OP_FMT_atom_label_u16:
+            atom = get_bc_atom(b, b->byte_code_buf + pos + 1);
+            if (!__JS_AtomIsTaggedInt(atom))
+                func(ctx, atom, opaque);
+            break;
+        default:
+            /* the constructors needed by the language constructs */
+            if (op == OP_regexp)
+                func(ctx, JS_ATOM_RegExp, opaque);
+            else if (op == OP_import)
+                func(ctx, JS_ATOM_Promise, opaque);
+            break;
+        }
+    }
+    for(i = 0; i < b->cpool_count; i++) {
+#ifdef CONFIG_BIGNUM
+        if (JS_VALUE_GET_TAG(b->cpool[i]) == JS_TAG_BIG_INT)
+            func(ctx, JS_ATOM_BigInt, opaque);
+#endif
+        b1 = js_get_cpool_function(ctx, b->cpool[i], &is_exception);
+        if (is_exception)
+            return -1;
+        if (b1 && js_enum_function_atoms(ctx, b1, func, opaque))
+            return -1;
+    }
+    return 0;
 }
 
-static __exception int js_parse_program(JSParseState *s)
+/* Call 'func' for each atom referenced by the code of the compiled
+   script or module 'obj'. The constructors implicitly used by the
+   language constructs (e.g. Promise for async functions) are also
+   enumerated. */
+int JS_EnumBytecodeAtoms(JSContext *ctx, JSValueConst obj,
+                         JSBytecodeAtomFunc *func, void *opaque)
 {
-    JSFunctionDef *fd = s->cur_func;
-    int idx;
+    JSFunctionBytecode *b;
+    JSModuleDef *m;
+    BOOL is_exception;
 
-    if (next_token(s))
+    if (JS_VALUE_GET_TAG(obj) == JS_TAG_MODULE) {
+        m = JS_VALUE_GET_PTR(obj);
+        obj = m->func_obj;
+    }
+    b = js_get_cpool_function(ctx, obj, &is_exception);
+    if (is_exception)
         return -1;
+    if (!b)
+        return 0;
+    return js_enum_function_atoms(ctx, b, func, opaque);
+}
 
-    if (js_parse_directives(s))
-        return -1;
+#define JS_SCAN_EVAL   (1 << 0) /* direct eval */
+#define JS_SCAN_IMPORT (1 << 1) /* dynamic module import */
 
-    fd->is_global_var = (fd->eval_type == JS_EVAL_TYPE_GLOBAL) ||
-        (fd->eval_type == JS_EVAL_TYPE_MODULE) ||
-        !(fd->js_mode & JS_MODE_STRICT);
+/* return the JS_SCAN_x flags of the opcodes found in 'b' and in its
+   inner functions or -1 if exception */
+static int js_function_scan_ops(JSContext *ctx, JSFunctionBytecode *b)
+{
+    JSFunctionBytecode *b1;
+    BOOL is_exception;
+    int pos, op, i, ret, flags;
 
-    if (!s->is_module) {
-        /* hidden variable for the return value */
-        fd->eval_ret_idx = idx = add_var(s->ctx, fd, JS_ATOM__ret_);
-        if (idx < 0)
-            return -1;
+    flags = 0;
+    for(pos = 0; pos < b->byte_code_len;
+        pos += short_opcode_info(op).size) {
+        op = b->byte_code_buf[pos];
+        if (op == OP_eval || op == OP_apply_eval)
+            flags |= JS_SCAN_EVAL;
+        else if (op == OP_import)
+            flags |= JS_SCAN_IMPORT;
     }
-
-    while (s->token.val != TOK_EOF) {
-        if (js_parse_source_element(s))
+    for(i = 0; i < b->cpool_count; i++) {
+        b1 = js_get_cpool_function(ctx, b->cpool[i], &is_exception);
+        if (is_exception)
             return -1;
+        if (b1) {
+            ret = js_function_scan_ops(ctx, b1);
+            if (ret < 0)
+                return -1;
+            flags |= ret;
+        }
     }
+    return flags;
+}
 
-    if (!s->is_module) {
-        /* return the value of the hidden variable eval_ret_idx  */
-        emit_op(s, OP_get_loc);
-        emit_u16(s, fd->eval_ret_idx);
+/* Remove the function declarations of 'b' and of its inner functions
+   whose variable is never read. The closure creation and the variable
+   store are replaced by nops. 'm' is the module if 'b' is a module
+   function. Return the number of removed functions or -1 if
+   exception. */
+static int js_strip_unused_functions(JSContext *ctx, JSFunctionBytecode *b,
+                                     JSModuleDef *m)
+{
+    JSFunctionBytecode *b1;
+    const JSOpCode *oi;
+    uint8_t *bc_buf;
+    int *loc_refs, *var_ref_refs, *cpool_refs;
+    int pos, pos1, op, op1, i, idx, cpool_idx, count, n;
+    BOOL is_exception, is_var_ref;
 
-        emit_op(s, OP_return);
-    } else {
-        emit_op(s, OP_return_undef);
+    count = 0;
+    for(i = 0; i < b->cpool_count; i++) {
+        b1 = js_get_cpool_function(ctx, b->cpool[i], &is_exception);
+        if (is_exception)
+            return -1;
+        if (b1) {
+            n = js_strip_unused_functions(ctx, b1, NULL);
+            if (n < 0)
+                return -1;
+            count += n;
+        }
     }
+    if (b->read_only_bytecode || b->atom_map)
+        return count;
 
-    return 0;
-}
-
-static void js_parse_init(JSContext *ctx, JSParseState *s,
-                          const char *input, size_t input_len,
-                          const char *filename)
-{
-    memset(s, 0, sizeof(*s));
-    s->ctx = ctx;
-    s->filename = filename;
-    s->line_num = 1;
-    s->buf_ptr = (const uint8_t *)input;
-    s->buf_end = s->buf_ptr + input_len;
-    s->token.val = ' ';
-    s->token.line_num = 1;
-}
+    loc_refs = js_mallocz(ctx, sizeof(int) * (b->var_count +
+                                             b->closure_var_count +
+                                             b->cpool_count + 1));
+    if (!loc_refs)
+        return -1;
+    var_ref_refs = loc_refs + b->var_count;
+    cpool_refs = var_ref_refs + b->closure_var_count;
 
-static JSValue JS_EvalFunctionInternal(JSContext *ctx, JSValue fun_obj,
-                                       JSValueConst this_obj,
-                                       JSVarRef **var_refs, JSStackFrame *sf)
-{
-    JSValue ret_val;
-    uint32_t tag;
+    /* count the references to the local variables, closure variables
+       and constants */
+    bc_buf = b->byte_code_buf;
+    for(pos = 0; pos < b->byte_code_len; pos += oi->size) {
+        op = bc_buf[pos];
+        oi = &short_opcode_info(op);
+        switch(oi->fmt) {
+#if SHORT_OPCODES
+        case OP_FMT_none_loc:
+            loc_refs[(op - OP_get_loc0) % 4]++;
+            break;
+        case OP_FMT_none_var_ref:
+            var_ref_refs[(op - OP_get_var_ref0) % 4]++;
+            break;
+        case OP_FMT_const8:
+            cpool_refs[get_u8(bc_buf + pos + 1)]++;
+            break;
+#endif
+        case OP_FMT_loc8:
+            loc_refs[get_u8(bc_buf + pos + 1)]++;
+            break;
+        case OP_FMT_loc:
+            loc_refs[get_u16(bc_buf + pos + 1)]++;
+            break;
+        case OP_FMT_var_ref:
+            var_ref_refs[get_u16(bc_buf + pos + 1)]++;
+            break;
+        case OP_FMT_const:
+            cpool_refs[get_u32(bc_buf + pos + 1)]++;
+            break;
+        case OP_FMT_atom_u16:
+            if (op == OP_make_loc_ref)
+                loc_refs[get_u16(bc_buf + pos + 5)]++;
+            else if (op == OP_make_var_ref_ref)
+                var_ref_refs[get_u16(bc_buf + pos + 5)]++;
+            break;
+        default:
+            break;
+        }
+    }
+    for(i = 0; i < b->cpool_count; i++) {
+        if (JS_VALUE_GET_TAG(b->cpool[i]) == JS_TAG_FUNCTION_BYTECODE) {
+            JSFunctionBytecode *b2 = JS_VALUE_GET_PTR(b->cpool[i]);
+            int j;
+            for(j = 0; j < b2->closure_var_count; j++) {
+                JSClosureVar *cv = &b2->closure_var[j];
+                if (!cv->is_local)
+                    var_ref_refs[cv->var_idx]++;
+                else if (!cv->is_arg)
+                    loc_refs[cv->var_idx]++;
+            }
+        }
+    }
+    if (m) {
+        for(i = 0; i < m->export_entries_count; i++) {
+            JSExportEntry *me = &m->export_entries[i];
+            if (me->export_type == JS_EXPORT_TYPE_LOCAL)
+                var_ref_refs[me->u.local.var_idx]++;
+        }
+        for(i = 0; i < m->import_entries_count; i++)
+            var_ref_refs[m->import_entries[i].var_idx]++;
+    }
 
-    tag = JS_VALUE_GET_TAG(fun_obj);
-    if (tag == JS_TAG_FUNCTION_BYTECODE) {
-        fun_obj = js_closure(ctx, fun_obj, var_refs, sf);
-        ret_val = JS_CallFree(ctx, fun_obj, this_obj, 0, NULL);
-    } else if (tag == JS_TAG_MODULE) {
-        JSModuleDef *m;
-        m = JS_VALUE_GET_PTR(fun_obj);
-        /* the module refcount should be >= 2 */
-        JS_FreeValue(ctx, fun_obj);
-        if (js_create_module_function(ctx, m) < 0)
-            goto fail;
-        if (js_link_module(ctx, m) < 0)
-            goto fail;
-        ret_val = js_evaluate_module(ctx, m);
-        if (JS_IsException(ret_val)) {
-        fail:
-            js_free_modules(ctx, JS_FREE_MODULE_NOT_EVALUATED);
-            return JS_EXCEPTION;
+    /* the function declarations are "fclosure; put_loc" or "fclosure;
+       put_var_ref" for the module variables. The store is then the
+       only reference to the variable. */
+    for(pos = 0; pos < b->byte_code_len; pos += oi->size) {
+        op = bc_buf[pos];
+        oi = &short_opcode_info(op);
+        if (op == OP_fclosure)
+            cpool_idx = get_u32(bc_buf + pos + 1);
+#if SHORT_OPCODES
+        else if (op == OP_fclosure8)
+            cpool_idx = get_u8(bc_buf + pos + 1);
+#endif
+        else
+            continue;
+        pos1 = pos + oi->size;
+        if (pos1 >= b->byte_code_len)
+            break;
+        op1 = bc_buf[pos1];
+        is_var_ref = FALSE;
+        if (op1 == OP_put_loc) {
+            idx = get_u16(bc_buf + pos1 + 1);
+        } else if (op1 == OP_put_var_ref) {
+            idx = get_u16(bc_buf + pos1 + 1);
+            is_var_ref = TRUE;
+#if SHORT_OPCODES
+        } else if (op1 >= OP_put_loc0 && op1 <= OP_put_loc3) {
+            idx = op1 - OP_put_loc0;
+        } else if (op1 == OP_put_loc8) {
+            idx = get_u8(bc_buf + pos1 + 1);
+        } else if (op1 >= OP_put_var_ref0 && op1 <= OP_put_var_ref3) {
+            idx = op1 - OP_put_var_ref0;
+            is_var_ref = TRUE;
+#endif
+        } else {
+            continue;
+        }
+        if (is_var_ref) {
+            if (!m || !b->closure_var[idx].is_local || var_ref_refs[idx] != 1)
+                continue;
+        } else {
+            if (loc_refs[idx] != 1)
+                continue;
         }
-    } else {
-        JS_FreeValue(ctx, fun_obj);
-        ret_val = JS_ThrowTypeError(ctx, "bytecode function expected");
+        if (cpool_refs[cpool_idx] != 1)
+            continue;
+        memset(bc_buf + pos, OP_nop,
+               oi->size + short_opcode_info(op1).size);
+        JS_FreeValue(ctx, b->cpool[cpool_idx]);
+        b->cpool[cpool_idx] = JS_UNDEFINED;
+        count++;
     }
-    return ret_val;
+    js_free(ctx, loc_refs);
+    return count;
 }
 
-JSValue JS_EvalFunction(JSContext *ctx, JSValue fun_obj)
+typedef struct JSExportUsage {
+    JSModuleDef *module;
+    BOOL keep : 8; /* all the exports are used */
+    BOOL ns_used : 8; /* the module namespace is used */
+    uint8_t *used; /* for each export entry */
+} JSExportUsage;
+
+static JSExportUsage *js_find_export_usage(JSExportUsage *tab, int count,
+                                           JSModuleDef *m)
 {
-    return JS_EvalFunctionInternal(ctx, fun_obj, ctx->global_obj, NULL, NULL);
+    int i;
+    for(i = 0; i < count; i++) {
+        if (tab[i].module == m)
+            return &tab[i];
+    }
+    return NULL;
 }
 
-static void skip_shebang(JSParseState *s)
+static int js_mark_module_ns_used(JSContext *ctx, JSExportUsage *tab,
+                                  int count, JSModuleDef *m);
+
+/* mark the export entries used to resolve 'export_name' in 'm'. All
+   the visited entries are kept so that the resolution gives the same
+   result once the unused exports are removed. */
+static int js_mark_export_used(JSContext *ctx, JSExportUsage *tab, int count,
+                               JSModuleDef *m, JSAtom export_name)
 {
-    const uint8_t *p = s->buf_ptr;
-    int c;
+    JSResolveState ss, *s = &ss;
+    JSResolveResultEnum res;
+    JSExportEntry *res_me, *me;
+    JSModuleDef *res_m;
+    JSExportUsage *eu;
+    int i, ret;
 
-    if (p[0] == '#' && p[1] == '!') {
-        p += 2;
-        while (p < s->buf_end) {
-            if (*p == '\n' || *p == '\r') {
+    s->array = NULL;
+    s->size = 0;
+    s->count = 0;
+    ret = 0;
+    res = js_resolve_export1(ctx, &res_m, &res_me, m, export_name, s);
+    if (res == JS_RESOLVE_RES_EXCEPTION) {
+        ret = -1;
+        goto done;
+    }
+    for(i = 0; i < s->count; i++) {
+        eu = js_find_export_usage(tab, count, s->array[i].module);
+        if (!eu)
+            continue;
+        me = find_export_entry(ctx, eu->module, s->array[i].name);
+        if (me)
+            eu->used[me - eu->module->export_entries] = TRUE;
+    }
+    if (res == JS_RESOLVE_RES_FOUND && res_me->local_name == JS_ATOM__star_) {
+        ret = js_mark_module_ns_used(ctx, tab, count,
+            res_m->req_module_entries[res_me->u.req_module_idx].module);
+    }
+ done:
+    for(i = 0; i < s->count; i++)
+        JS_FreeAtom(ctx, s->array[i].name);
+    js_free(ctx, s->array);
+    return ret;
+}
+
+static int js_mark_module_ns_used(JSContext *ctx, JSExportUsage *tab,
+                                  int count, JSModuleDef *m)
+{
+    GetExportNamesState s_s, *s = &s_s;
+    JSExportUsage *eu;
+    int i, ret;
+
+    eu = js_find_export_usage(tab, count, m);
+    if (eu) {
+        if (eu->ns_used)
+            return 0;
+        eu->ns_used = TRUE;
+    }
+    memset(s, 0, sizeof(*s));
+    ret = get_exported_names(ctx, s, m, FALSE);
+    if (ret == 0) {
+        /* the ambiguous names depend on all the star exports */
+        for(i = 0; i < s->modules_count; i++) {
+            eu = js_find_export_usage(tab, count, s->modules[i]);
+            if (eu)
+                memset(eu->used, TRUE, eu->module->export_entries_count);
+        }
+        for(i = 0; i < s->exported_names_count; i++) {
+            ret = js_mark_export_used(ctx, tab, count, m,
+                                      s->exported_names[i].export_name);
+            if (ret)
                 break;
-            } else if (*p >= 0x80) {
-                c = unicode_from_utf8(p, UTF8_CHAR_LEN_MAX, &p);
-                if (c == CP_LS || c == CP_PS) {
-                    break;
-                } else if (c == -1) {
-                    p++; /* skip invalid UTF-8 */
-                }
-            } else {
-                p++;
-            }
         }
-        s->buf_ptr = p;
     }
+    js_free(ctx, s->modules);
+    js_free(ctx, s->exported_names);
+    return ret;
 }
 
-/* 'input' must be zero terminated i.e. input[input_len] = '\0'. */
-static JSValue __JS_EvalInternal(JSContext *ctx, JSValueConst this_obj,
-                                 const char *input, size_t input_len,
-                                 const char *filename, int flags, int scope_idx)
+/* remove the local exports of the modules in 'tab' which are not
+   imported by the other modules */
+static int js_strip_unused_exports(JSContext *ctx, JSExportUsage *tab,
+                                   int count)
 {
-    JSParseState s1, *s = &s1;
-    int err, js_mode, eval_type;
-    JSValue fun_obj, ret_val;
-    JSStackFrame *sf;
-    JSVarRef **var_refs;
-    JSFunctionBytecode *b;
-    JSFunctionDef *fd;
-    JSModuleDef *m;
+    JSModuleDef *m, *m1;
+    int i, j, k;
 
-    js_parse_init(ctx, s, input, input_len, filename);
-    skip_shebang(s);
+    for(i = 0; i < count; i++) {
+        m = tab[i].module;
+        if (tab[i].keep)
+            memset(tab[i].used, TRUE, m->export_entries_count);
+        for(j = 0; j < m->import_entries_count; j++) {
+            JSImportEntry *mi = &m->import_entries[j];
+            m1 = m->req_module_entries[mi->req_module_idx].module;
+            if (mi->import_name == JS_ATOM__star_) {
+                if (js_mark_module_ns_used(ctx, tab, count, m1))
+                    return -1;
+            } else {
+                if (js_mark_export_used(ctx, tab, count, m1, mi->import_name))
+                    return -1;
+            }
+        }
+        /* the indirect exports are checked when linking */
+        for(j = 0; j < m->export_entries_count; j++) {
+            JSExportEntry *me = &m->export_entries[j];
+            if (me->export_type == JS_EXPORT_TYPE_INDIRECT &&
+                me->local_name != JS_ATOM__star_) {
+                m1 = m->req_module_entries[me->u.req_module_idx].module;
+                if (js_mark_export_used(ctx, tab, count, m1, me->local_name))
+                    return -1;
+            }
+        }
+    }
 
-    eval_type = flags & JS_EVAL_TYPE_MASK;
-    m = NULL;
-    if (eval_type == JS_EVAL_TYPE_DIRECT) {
-        JSObject *p;
-        sf = ctx->rt->current_stack_frame;
-        assert(sf != NULL);
-        assert(JS_VALUE_GET_TAG(sf->cur_func) == JS_TAG_OBJECT);
-        p = JS_VALUE_GET_OBJ(sf->cur_func);
-        assert(js_class_has_bytecode(p->class_id));
-        b = p->u.func.function_bytecode;
-        var_refs = p->u.func.var_refs;
-        js_mode = b->js_mode;
-    } else {
-        sf = NULL;
-        b = NULL;
-        var_refs = NULL;
-        js_mode = 0;
-        if (flags & JS_EVAL_FLAG_STRICT)
-            js_mode |= JS_MODE_STRICT;
-        if (flags & JS_EVAL_FLAG_STRIP)
-            js_mode |= JS_MODE_STRIP;
-        if (eval_type == JS_EVAL_TYPE_MODULE) {
-            JSAtom module_name = JS_NewAtom(ctx, filename);
-            if (module_name == JS_ATOM_NULL)
-                return JS_EXCEPTION;
-            m = js_new_module_def(ctx, module_name);
-            if (!m)
-                return JS_EXCEPTION;
-            js_mode |= JS_MODE_STRICT;
+    for(i = 0; i < count; i++) {
+        m = tab[i].module;
+        k = 0;
+        for(j = 0; j < m->export_entries_count; j++) {
+            JSExportEntry *me = &m->export_entries[j];
+            if (me->export_type == JS_EXPORT_TYPE_LOCAL && !tab[i].used[j]) {
+                JS_FreeAtom(ctx, me->export_name);
+                JS_FreeAtom(ctx, me->local_name);
+            } else {
+                m->export_entries[k++] = *me;
+            }
         }
+        m->export_entries_count = k;
     }
-    fd = js_new_function_def(ctx, NULL, TRUE, FALSE, filename, 1);
-    if (!fd)
-        goto fail1;
-    s->cur_func = fd;
-    fd->eval_type = eval_type;
-    fd->has_this_binding = (eval_type != JS_EVAL_TYPE_DIRECT);
-    fd->backtrace_barrier = ((flags & JS_EVAL_FLAG_BACKTRACE_BARRIER) != 0);
-    if (eval_type == JS_EVAL_TYPE_DIRECT) {
-        fd->new_target_allowed = b->new_target_allowed;
-        fd->super_call_allowed = b->super_call_allowed;
-        fd->super_allowed = b->super_allowed;
-        fd->arguments_allowed = b->arguments_allowed;
-    } else {
-        fd->new_target_allowed = FALSE;
-        fd->super_call_allowed = FALSE;
-        fd->super_allowed = FALSE;
-        fd->arguments_allowed = TRUE;
+    return 0;
+}
+
+/* Remove the code of the compiled scripts or modules 'objs' which is
+   not reachable: the module exports which are not imported when the
+   modules are not dynamically imported, and then the function
+   declarations which are not referenced. The exports of the modules
+   with 'keep_exports[i]' set are kept. The modules must be
+   resolved. */
+int JS_StripUnusedCode(JSContext *ctx, JSValueConst *objs, int count,
+                       const JS_BOOL *keep_exports)
+{
+    JSFunctionBytecode **funcs;
+    JSModuleDef **modules;
+    JSExportUsage *tab;
+    BOOL is_exception, strip_exports;
+    int i, n, ret, tab_count;
+
+    funcs = js_mallocz(ctx, sizeof(funcs[0]) * max_int(count, 1));
+    modules = js_mallocz(ctx, sizeof(modules[0]) * max_int(count, 1));
+    tab = js_mallocz(ctx, sizeof(tab[0]) * max_int(count, 1));
+    tab_count = 0;
+    ret = -1;
+    if (!funcs || !modules || !tab)
+        goto done;
+    strip_exports = TRUE;
+    for(i = 0; i < count; i++) {
+        JSValueConst obj = objs[i];
+        if (JS_VALUE_GET_TAG(obj) == JS_TAG_MODULE) {
+            modules[i] = JS_VALUE_GET_PTR(obj);
+            if (!modules[i]->resolved || modules[i]->init_func)
+                continue;
+            obj = modules[i]->func_obj;
+        }
+        funcs[i] = js_get_cpool_function(ctx, obj, &is_exception);
+        if (is_exception)
+            goto done;
+        if (!funcs[i])
+            continue;
+        n = js_function_scan_ops(ctx, funcs[i]);
+        if (n < 0)
+            goto done;
+        /* the module namespaces may be observed */
+        if (n & JS_SCAN_IMPORT)
+            strip_exports = FALSE;
+        /* the variables may be accessed by name */
+        if (n & JS_SCAN_EVAL)
+            funcs[i] = NULL;
     }
-    fd->js_mode = js_mode;
-    fd->func_name = JS_DupAtom(ctx, JS_ATOM__eval_);
-    if (b) {
-        if (add_closure_variables(ctx, fd, b, scope_idx))
-            goto fail;
+    for(i = 0; i < count; i++) {
+        if (modules[i] && !modules[i]->init_func && modules[i]->resolved) {
+            JSExportUsage *eu = &tab[tab_count++];
+            eu->module = modules[i];
+            eu->keep = keep_exports[i] || !funcs[i];
+            eu->used = js_mallocz(ctx, max_int(modules[i]->export_entries_count, 1));
+            if (!eu->used)
+                goto done;
+        }
     }
-    fd->module = m;
-    s->is_module = (m != NULL);
-    s->allow_html_comments = !s->is_module;
+    if (strip_exports && js_strip_unused_exports(ctx, tab, tab_count))
+        goto done;
 
-    push_scope(s); /* body scope */
-    fd->body_scope = fd->scope_level;
-    
-    err = js_parse_program(s);
-    if (err) {
-    fail:
-        free_token(s, &s->token);
-        js_free_function_def(ctx, fd);
-        goto fail1;
+    /* removing a function may make other functions unused */
+    do {
+        n = 0;
+        for(i = 0; i < count; i++) {
+            if (funcs[i]) {
+                ret = js_strip_unused_functions(ctx, funcs[i], modules[i]);
+                if (ret < 0)
+                    goto done;
+                n += ret;
+            }
+        }
+    } while (n != 0);
+    ret = 0;
+ done:
+    if (tab) {
+        for(i = 0; i < tab_count; i++)
+            js_free(ctx, tab[i].used);
     }
+    js_free(ctx, tab);
+    js_free(ctx, modules);
+    js_free(ctx, funcs);
+    return ret;
+}
 
-    /* create the function object and all the enclosed functions */
-    fun_obj = js_create_function(ctx, fd);
-    if (JS_IsException(fun_obj))
-        goto fail1;
-    /* Could add a flag to avoid resolution if necessary */
-    if (m) {
-        m->func_obj = fun_obj;
-        if (js_resolve_module(ctx, m) < 0)
-            goto fail1;
-        fun_obj = JS_DupValue(ctx, JS_MKPTR(JS_TAG_MODULE, m));
-    }
-    if (flags & JS_EVAL_FLAG_COMPILE_ONLY) {
-        ret_val = fun_obj;
-    } else {
-        ret_val = JS_EvalFunctionInternal(ctx, fun_obj, this_obj, var_refs, sf);
+/* Context snapshots: when recording is enabled, the scripts and
+   modules compiled and evaluated at the top level of a context are
+   kept in serialized form. JS_WriteSnapshot() outputs them with the
+   order in which they were evaluated so that JS_EvalSnapshot() can
+   reproduce the same initialization in another context without
+   parsing and compiling again. */
+
+#define JS_SNAPSHOT_MAGIC   0x53534a51 /* "QJSS" */
+#define JS_SNAPSHOT_VERSION 1
+
+typedef struct JSSnapshotEntry {
+    void *ptr; /* JSFunctionBytecode or JSModuleDef, only used as a key */
+    uint8_t *buf;
+    size_t len;
+} JSSnapshotEntry;
+
+struct JSSnapshotRecorder {
+    BOOL error; /* TRUE if a write failed */
+    int entry_count;
+    int entry_size;
+    JSSnapshotEntry *entries;
+    int eval_count;
+    int eval_size;
+    uint32_t *eval_list; /* index in 'entries' */
+};
+
+static void js_snapshot_recorder_free(JSContext *ctx, JSSnapshotRecorder *sr)
+{
+    int i;
+    for(i = 0; i < sr->entry_count; i++)
+        js_free(ctx, sr->entries[i].buf);
+    js_free(ctx, sr->entries);
+    js_free(ctx, sr->eval_list);
+    js_free(ctx, sr);
+}
+
+/* 'enable' = FALSE stops the recording and discards the recorded
+   data. Return -1 if not enough memory. */
+int JS_RecordSnapshot(JSContext *ctx, BOOL enable)
+{
+    if (!enable) {
+        if (ctx->snapshot) {
+            js_snapshot_recorder_free(ctx, ctx->snapshot);
+            ctx->snapshot = NULL;
+        }
+    } else if (!ctx->snapshot) {
+        ctx->snapshot = js_mallocz(ctx, sizeof(JSSnapshotRecorder));
+        if (!ctx->snapshot)
+            return -1;
     }
-    return ret_val;
- fail1:
-    /* XXX: should free all the unresolved dependencies */
-    if (m)
-        js_free_module_def(ctx, m);
-    return JS_EXCEPTION;
+    return 0;
 }
 
-/* the indirection is needed to make 'eval' optional */
-static JSValue JS_EvalInternal(JSContext *ctx, JSValueConst this_obj,
-                               const char *input, size_t input_len,
-                               const char *filename, int flags, int scope_idx)
+/* return the entry index or -1 */
+static int js_snapshot_find(JSSnapshotRecorder *sr, void *ptr)
 {
-    if (unlikely(!ctx->eval_internal)) {
-        return JS_ThrowTypeError(ctx, "eval is not supported");
+    int i;
+    /* the most recent entry wins if a pointer was reused */
+    for(i = sr->entry_count - 1; i >= 0; i--) {
+        if (sr->entries[i].ptr == ptr)
+            return i;
     }
-    return ctx->eval_internal(ctx, this_obj, input, input_len, filename,
-                              flags, scope_idx);
+    return -1;
 }
 
-static JSValue JS_EvalObject(JSContext *ctx, JSValueConst this_obj,
-                             JSValueConst val, int flags, int scope_idx)
+/* 'obj' is a compiled script or module */
+static int js_snapshot_record_compile(JSContext *ctx, JSValueConst obj)
 {
-    JSValue ret;
-    const char *str;
+    JSSnapshotRecorder *sr = ctx->snapshot;
+    JSSnapshotEntry *e;
+    uint8_t *buf;
     size_t len;
 
-    if (!JS_IsString(val))
-        return JS_DupValue(ctx, val);
-    str = JS_ToCStringLen(ctx, &len, val);
-    if (!str)
-        return JS_EXCEPTION;
-    ret = JS_EvalInternal(ctx, this_obj, str, len, "<input>", flags, scope_idx);
-    JS_FreeCString(ctx, str);
-    return ret;
+    buf = JS_WriteObject(ctx, &len, obj, JS_WRITE_OBJ_BYTECODE);
+    if (!buf)
+        goto fail;
+    if (js_resize_array(ctx, (void **)&sr->entries, sizeof(sr->entries[0]),
+                        &sr->entry_size, sr->entry_count + 1)) {
+        js_free(ctx, buf);
+        goto fail;
+    }
+    e = &sr->entries[sr->entry_count];
+    e->ptr = JS_VALUE_GET_PTR(obj);
+    e->buf = buf;
+    e->len = len;
+    return sr->entry_count++;
+ fail:
+    /* recording errors are reported by JS_WriteSnapshot() */
+    JS_FreeValue(ctx, JS_GetException(ctx));
+    sr->error = TRUE;
+    return -1;
+}
+
+/* 'ptr' was successfully evaluated */
+static void js_snapshot_record_eval(JSContext *ctx, void *ptr)
+{
+    JSSnapshotRecorder *sr = ctx->snapshot;
+    int idx;
 
+    idx = js_snapshot_find(sr, ptr);
+    if (idx < 0)
+        return;
+    if (js_resize_array(ctx, (void **)&sr->eval_list, sizeof(sr->eval_list[0]),
+                        &sr->eval_size, sr->eval_count + 1)) {
+        JS_FreeValue(ctx, JS_GetException(ctx));
+        sr->error = TRUE;
+        return;
+    }
+    sr->eval_list[sr->eval_count++] = idx;
 }
 
-JSValue JS_EvalThis(JSContext *ctx, JSValueConst this_obj,
-                    const char *input, size_t input_len,
-                    const char *filename, int eval_flags)
+/* Return the snapshot of the recorded initialization of 'ctx' (to be
+   freed with js_free()) or NULL with an exception. */
+uint8_t *JS_WriteSnapshot(JSContext *ctx, size_t *psize)
 {
-    int eval_type = eval_flags & JS_EVAL_TYPE_MASK;
-    JSValue ret;
+    JSSnapshotRecorder *sr = ctx->snapshot;
+    DynBuf dbuf;
+    int i;
 
-    assert(eval_type == JS_EVAL_TYPE_GLOBAL ||
-           eval_type == JS_EVAL_TYPE_MODULE);
-    ret = JS_EvalInternal(ctx, this_obj, input, input_len, filename,
-                          eval_flags, -1);
-    return ret;
+    *psize = 0;
+    if (!sr) {
+        JS_ThrowTypeError(ctx, "snapshot recording is not enabled");
+        return NULL;
+    }
+    if (sr->error) {
+        JS_ThrowInternalError(ctx, "incomplete snapshot recording");
+        return NULL;
+    }
+    js_dbuf_init(ctx, &dbuf);
+    dbuf_put_u32(&dbuf, JS_SNAPSHOT_MAGIC);
+    dbuf_put_u32(&dbuf, JS_SNAPSHOT_VERSION);
+    dbuf_put_u32(&dbuf, sr->entry_count);
+    for(i = 0; i < sr->entry_count; i++) {
+        dbuf_put_u32(&dbuf, sr->entries[i].len);
+        dbuf_put(&dbuf, sr->entries[i].buf, sr->entries[i].len);
+    }
+    dbuf_put_u32(&dbuf, sr->eval_count);
+    for(i = 0; i < sr->eval_count; i++)
+        dbuf_put_u32(&dbuf, sr->eval_list[i]);
+    if (dbuf_error(&dbuf)) {
+        dbuf_free(&dbuf);
+        JS_ThrowOutOfMemory(ctx);
+        return NULL;
+    }
+    *psize = dbuf.size;
+    return dbuf.buf;
 }
 
-JSValue JS_Eval(JSContext *ctx, const char *input, size_t input_len,
-                const char *filename, int eval_flags)
+static int js_snapshot_get_u32(uint32_t *pval, const uint8_t **pp,
+                               const uint8_t *buf_end)
 {
-    return JS_EvalThis(ctx, ctx->global_obj, input, input_len, filename,
-                       eval_flags);
+    if (buf_end - *pp < 4)
+        return -1;
+    *pval = get_u32(*pp);
+    *pp += 4;
+    return 0;
 }
 
-int JS_ResolveModule(JSContext *ctx, JSValueConst obj)
+/* Replay a snapshot produced by JS_WriteSnapshot() in 'ctx'. The
+   native objects and the module loader which were used during the
+   recording must be available. Return -1 with an exception if
+   error. */
+int JS_EvalSnapshot(JSContext *ctx, const uint8_t *buf, size_t buf_len)
 {
-    if (JS_VALUE_GET_TAG(obj) == JS_TAG_MODULE) {
-        JSModuleDef *m = JS_VALUE_GET_PTR(obj);
-        if (js_resolve_module(ctx, m) < 0) {
-            js_free_modules(ctx, JS_FREE_MODULE_NOT_RESOLVED);
-            return -1;
+    const uint8_t *p, *buf_end;
+    uint32_t magic, version, entry_count, eval_count, len, idx, i;
+    JSValue *objs, obj, ret;
+    int res;
+
+    p = buf;
+    buf_end = buf + buf_len;
+    if (js_snapshot_get_u32(&magic, &p, buf_end) ||
+        js_snapshot_get_u32(&version, &p, buf_end) ||
+        magic != JS_SNAPSHOT_MAGIC || version != JS_SNAPSHOT_VERSION) {
+        JS_ThrowSyntaxError(ctx, "invalid snapshot header");
+        return -1;
+    }
+    if (js_snapshot_get_u32(&entry_count, &p, buf_end))
+        goto invalid;
+    if (entry_count > (buf_end - p) / 4)
+        goto invalid;
+    objs = js_mallocz(ctx, sizeof(objs[0]) * max_int(entry_count, 1));
+    if (!objs)
+        return -1;
+    res = -1;
+    for(i = 0; i < entry_count; i++) {
+        if (js_snapshot_get_u32(&len, &p, buf_end) || len > buf_end - p) {
+            JS_ThrowSyntaxError(ctx, "truncated snapshot");
+            goto done;
+        }
+        /* the modules are registered in the context when read */
+        objs[i] = JS_ReadObject(ctx, p, len,
+                                JS_READ_OBJ_BYTECODE | JS_READ_OBJ_LAZY);
+        if (JS_IsException(objs[i]))
+            goto done;
+        p += len;
+    }
+    if (js_snapshot_get_u32(&eval_count, &p, buf_end))
+        goto truncated;
+    for(i = 0; i < eval_count; i++) {
+        if (js_snapshot_get_u32(&idx, &p, buf_end)) {
+        truncated:
+            JS_ThrowSyntaxError(ctx, "truncated snapshot");
+            goto done;
+        }
+        if (idx >= entry_count) {
+            JS_ThrowSyntaxError(ctx, "invalid snapshot entry");
+            goto done;
         }
+        obj = objs[idx];
+        if (JS_ResolveModule(ctx, obj) < 0)
+            goto done;
+        ret = JS_EvalFunction(ctx, JS_DupValue(ctx, obj));
+        if (JS_IsException(ret))
+            goto done;
+        JS_FreeValue(ctx, ret);
     }
-    return 0;
+    res = 0;
+ done:
+    /* the modules are owned by the context */
+    for(i = 0; i < entry_count; i++) {
+        if (JS_VALUE_GET_TAG(objs[i]) != JS_TAG_MODULE)
+            JS_FreeValue(ctx, objs[i]);
+    }
+    js_free(ctx, objs);
+    return res;
+ invalid:
+    JS_ThrowSyntaxError(ctx, "invalid snapshot");
+    return -1;
+}
+
+JSContext *JS_NewContextFromSnapshot(JSRuntime *rt, const uint8_t *buf,
+                                     size_t buf_len)
+{
+    JSContext *ctx;
+
+    ctx = JS_NewContext(rt);
+    if (!ctx)
+        return NULL;
+    if (JS_EvalSnapshot(ctx, buf, buf_len) < 0) {
+        JS_FreeContext(ctx);
+        return NULL;
+    }
+    return ctx;
 }
 
 /*******************************************************************/
@@ -33810,9 +39385,9 @@ typedef enum BCTagEnum {
 } BCTagEnum;
 
 #ifdef CONFIG_BIGNUM
-#define BC_BASE_VERSION 2
+#define BC_BASE_VERSION 7
 #else
-#define BC_BASE_VERSION 1
+#define BC_BASE_VERSION 6
 #endif
 #define BC_BE_VERSION 0x40
 #ifdef WORDS_BIGENDIAN
@@ -33828,6 +39403,7 @@ typedef struct BCWriterState {
     BOOL allow_bytecode : 8;
     BOOL allow_sab : 8;
     BOOL allow_reference : 8;
+    BOOL allow_source : 8;
     uint32_t first_atom;
     uint32_t *atom_to_idx;
     int atom_to_idx_size;
@@ -34026,17 +39602,18 @@ static void bc_byte_swap(uint8_t *bc_buf, int bc_len)
 }
 
 static int JS_WriteFunctionBytecode(BCWriterState *s,
-                                    const uint8_t *bc_buf1, int bc_len)
+                                    const JSFunctionBytecode *b)
 {
-    int pos, len, op;
+    int pos, len, op, bc_len;
     JSAtom atom;
     uint8_t *bc_buf;
     uint32_t val;
 
+    bc_len = b->byte_code_len;
     bc_buf = js_malloc(s->ctx, bc_len);
     if (!bc_buf)
         return -1;
-    memcpy(bc_buf, bc_buf1, bc_len);
+    memcpy(bc_buf, b->byte_code_buf, bc_len);
 
     pos = 0;
     while (pos < bc_len) {
@@ -34048,7 +39625,7 @@ static int JS_WriteFunctionBytecode(BCWriterState *s,
         case OP_FMT_atom_u16:
         case OP_FMT_atom_label_u8:
         case OP_FMT_atom_label_u16:
-            atom = get_u32(bc_buf + pos + 1);
+            atom = get_bc_atom(b, bc_buf + pos + 1);
             if (bc_atom_to_idx(s, &val, atom))
                 goto fail;
             put_u32(bc_buf + pos + 1, val);
@@ -34225,9 +39802,16 @@ static int JS_WriteObjectRec(BCWriterState *s, JSValueConst obj);
 static int JS_WriteFunctionTag(BCWriterState *s, JSValueConst obj)
 {
     JSFunctionBytecode *b = JS_VALUE_GET_PTR(obj);
-    uint32_t flags;
+    uint32_t flags, body_len;
     int idx, i;
-    
+    size_t body_len_pos;
+
+    if (b->lazy) {
+        b = js_function_bytecode_load(b);
+        if (!b)
+            goto fail;
+    }
+
     bc_put_u8(s, BC_TAG_FUNCTION_BYTECODE);
     flags = idx = 0;
     bc_set_flags(&flags, &idx, b->has_prototype, 1);
@@ -34255,19 +39839,6 @@ static int JS_WriteFunctionTag(BCWriterState *s, JSValueConst obj)
     bc_put_leb128(s, b->byte_code_len);
     if (b->vardefs) {
         bc_put_leb128(s, b->arg_count + b->var_count);
-        for(i = 0; i < b->arg_count + b->var_count; i++) {
-            JSVarDef *vd = &b->vardefs[i];
-            bc_put_atom(s, vd->var_name);
-            bc_put_leb128(s, vd->scope_level);
-            bc_put_leb128(s, vd->scope_next + 1);
-            flags = idx = 0;
-            bc_set_flags(&flags, &idx, vd->var_kind, 4);
-            bc_set_flags(&flags, &idx, vd->is_const, 1);
-            bc_set_flags(&flags, &idx, vd->is_lexical, 1);
-            bc_set_flags(&flags, &idx, vd->is_captured, 1);
-            assert(idx <= 8);
-            bc_put_u8(s, flags);
-        }
     } else {
         bc_put_leb128(s, 0);
     }
@@ -34285,8 +39856,29 @@ static int JS_WriteFunctionTag(BCWriterState *s, JSValueConst obj)
         assert(idx <= 8);
         bc_put_u8(s, flags);
     }
+
+    /* the length of the body is stored so that the reader can skip
+       it (JS_READ_OBJ_LAZY) */
+    body_len_pos = s->dbuf.size;
+    bc_put_u32(s, 0);
+
+    if (b->vardefs) {
+        for(i = 0; i < b->arg_count + b->var_count; i++) {
+            JSBytecodeVarDef *vd = &b->vardefs[i];
+            bc_put_atom(s, vd->var_name);
+            bc_put_leb128(s, vd->is_scoped);
+            bc_put_leb128(s, js_var_scope_next(vd) + 1);
+            flags = idx = 0;
+            bc_set_flags(&flags, &idx, vd->var_kind, 4);
+            bc_set_flags(&flags, &idx, vd->is_const, 1);
+            bc_set_flags(&flags, &idx, vd->is_lexical, 1);
+            bc_set_flags(&flags, &idx, vd->is_captured, 1);
+            assert(idx <= 8);
+            bc_put_u8(s, flags);
+        }
+    }
     
-    if (JS_WriteFunctionBytecode(s, b->byte_code_buf, b->byte_code_len))
+    if (JS_WriteFunctionBytecode(s, b))
         goto fail;
     
     if (b->has_debug) {
@@ -34294,12 +39886,41 @@ static int JS_WriteFunctionTag(BCWriterState *s, JSValueConst obj)
         bc_put_leb128(s, b->debug.line_num);
         bc_put_leb128(s, b->debug.pc2line_len);
         dbuf_put(&s->dbuf, b->debug.pc2line_buf, b->debug.pc2line_len);
+        bc_put_leb128(s, b->debug.inline_range_count);
+        for(i = 0; i < b->debug.inline_range_count; i++) {
+            const JSInlineRange *r = &b->debug.inline_ranges[i];
+            bc_put_leb128(s, r->pc_start);
+            bc_put_leb128(s, r->pc_end - r->pc_start);
+            bc_put_leb128(s, r->cpool_idx);
+            bc_put_leb128(s, r->call_line);
+        }
+        /* source: 0 = none, 1 = source text, 2 = position in 'filename' */
+        if (!s->allow_source || b->debug.source_len == 0) {
+            bc_put_u8(s, 0);
+        } else if (b->debug.source) {
+            bc_put_u8(s, 1);
+            bc_put_leb128(s, b->debug.source_len);
+            dbuf_put(&s->dbuf, (const uint8_t *)b->debug.source,
+                     b->debug.source_len);
+        } else {
+            bc_put_u8(s, 2);
+            bc_put_leb128(s, b->debug.source_len);
+            bc_put_leb128(s, b->debug.source_pos);
+            bc_put_u32(s, b->debug.source_hash);
+        }
     }
     
     for(i = 0; i < b->cpool_count; i++) {
         if (JS_WriteObjectRec(s, b->cpool[i]))
             goto fail;
     }
+
+    if (s->dbuf.error)
+        goto fail;
+    body_len = s->dbuf.size - (body_len_pos + 4);
+    if (s->byte_swap)
+        body_len = bswap32(body_len);
+    put_u32(s->dbuf.buf + body_len_pos, body_len);
     return 0;
  fail:
     return -1;
@@ -34345,6 +39966,28 @@ static int JS_WriteModule(BCWriterState *s, JSValueConst obj)
         bc_put_atom(s, mi->import_name);
         bc_put_leb128(s, mi->req_module_idx);
     }
+
+    /* link data computed by JS_PrelinkModule() */
+    bc_put_u8(s, m->prelinked | (m->prelinked_exports << 1));
+    if (m->prelinked) {
+        for(i = 0; i < m->import_entries_count; i++) {
+            JSImportEntry *mi = &m->import_entries[i];
+            bc_put_sleb128(s, mi->res_export_idx);
+            if (mi->res_export_idx >= 0)
+                bc_put_atom(s, mi->res_module_name);
+        }
+        if (m->ns_entries) {
+            bc_put_leb128(s, m->ns_entries_count + 1);
+            for(i = 0; i < m->ns_entries_count; i++) {
+                JSModuleNsEntry *ne = &m->ns_entries[i];
+                bc_put_atom(s, ne->export_name);
+                bc_put_atom(s, ne->module_name);
+                bc_put_leb128(s, ne->export_idx);
+            }
+        } else {
+            bc_put_leb128(s, 0);
+        }
+    }
     
     if (JS_WriteObjectRec(s, m->func_obj))
         goto fail;
@@ -34518,6 +40161,16 @@ static int JS_WriteObjectRec(BCWriterState *s, JSValueConst obj)
             JS_WriteString(s, p);
         }
         break;
+    case JS_TAG_STRING_ROPE:
+        {
+            JSValue str = js_linearize_string_rope(s->ctx, obj);
+            if (JS_IsException(str))
+                goto fail;
+            bc_put_u8(s, BC_TAG_STRING);
+            JS_WriteString(s, JS_VALUE_GET_STRING(str));
+            JS_FreeValue(s->ctx, str);
+        }
+        break;
     case JS_TAG_FUNCTION_BYTECODE:
         if (!s->allow_bytecode)
             goto invalid_tag;
@@ -34668,6 +40321,7 @@ uint8_t *JS_WriteObject2(JSContext *ctx, size_t *psize, JSValueConst obj,
     s->allow_bytecode = ((flags & JS_WRITE_OBJ_BYTECODE) != 0);
     s->allow_sab = ((flags & JS_WRITE_OBJ_SAB) != 0);
     s->allow_reference = ((flags & JS_WRITE_OBJ_REFERENCE) != 0);
+    s->allow_source = ((flags & JS_WRITE_OBJ_SOURCE) != 0);
     /* XXX: could use a different version when bytecode is included */
     if (s->allow_bytecode)
         s->first_atom = JS_ATOM_END;
@@ -34719,6 +40373,11 @@ typedef struct BCReaderState {
     BOOL allow_bytecode : 8;
     BOOL is_rom_data : 8;
     BOOL allow_reference : 8;
+    BOOL rom_buf : 8; /* 'buf' outlives the objects which are read */
+    BOOL lazy : 8; /* read the inner functions as stubs */
+    JSBytecodeImage *image; /* shared by the stubs, created on demand */
+    /* non NULL if the bytecode is used in place with translated atoms */
+    JSAtomMap *atom_map;
     /* object references */
     JSObject **objects;
     int objects_count;
@@ -34973,7 +40632,13 @@ static int JS_ReadFunctionBytecode(BCReaderState *s, JSFunctionBytecode *b,
         case OP_FMT_atom_label_u8:
         case OP_FMT_atom_label_u16:
             idx = get_u32(bc_buf + pos + 1);
-            if (s->is_rom_data) {
+            if (s->atom_map) {
+                /* translated when the bytecode is executed */
+                if (!__JS_AtomIsTaggedInt(idx) && idx >= s->atom_map->count) {
+                    JS_ThrowSyntaxError(s->ctx, "invalid atom index");
+                    return s->error_state = -1;
+                }
+            } else if (s->is_rom_data) {
                 /* just increment the reference count of the atom */
                 JS_DupAtom(s->ctx, (JSAtom)idx);
             } else {
@@ -35149,16 +40814,275 @@ static int BC_add_object_ref(BCReaderState *s, JSValueConst obj)
     return BC_add_object_ref1(s, JS_VALUE_GET_OBJ(obj));
 }
 
-static JSValue JS_ReadFunctionTag(BCReaderState *s)
+static JSBytecodeImage *js_bytecode_image_dup(JSBytecodeImage *img)
+{
+    img->ref_count++;
+    return img;
+}
+
+static JSAtomMap *js_atom_map_dup(JSAtomMap *map)
+{
+    if (map)
+        map->ref_count++;
+    return map;
+}
+
+static void js_atom_map_free(JSRuntime *rt, JSAtomMap *map)
+{
+    uint32_t i;
+
+    if (--map->ref_count > 0)
+        return;
+    for(i = 0; i < map->count; i++)
+        JS_FreeAtomRT(rt, map->atoms[i]);
+    js_free_rt(rt, map);
+}
+
+/* create the atom map of the atoms read in 's'. The atom indexes
+   below 'first_atom' are the predefined atoms. */
+static int bc_create_atom_map(BCReaderState *s)
+{
+    JSAtomMap *map;
+    uint32_t i, count;
+
+    count = s->first_atom + s->idx_to_atom_count;
+    map = js_malloc(s->ctx, sizeof(*map) + count * sizeof(map->atoms[0]));
+    if (!map)
+        return s->error_state = -1;
+    map->ref_count = 1;
+    map->count = count;
+    for(i = 0; i < s->first_atom; i++)
+        map->atoms[i] = i;
+    for(i = 0; i < s->idx_to_atom_count; i++)
+        map->atoms[s->first_atom + i] = JS_DupAtom(s->ctx, s->idx_to_atom[i]);
+    s->atom_map = map;
+    return 0;
+}
+
+static void js_bytecode_image_free(JSRuntime *rt, JSBytecodeImage *img)
+{
+    int i;
+
+    if (--img->ref_count > 0)
+        return;
+    for(i = 0; i < img->idx_to_atom_count; i++)
+        JS_FreeAtomRT(rt, img->idx_to_atom[i]);
+    js_free_rt(rt, img->idx_to_atom);
+    if (img->atom_map)
+        js_atom_map_free(rt, img->atom_map);
+    if (img->free_buf)
+        js_free_rt(rt, (uint8_t *)img->buf);
+    js_free_rt(rt, img);
+}
+
+/* return the image of the buffer being read. It is created when the
+   first function body is skipped. */
+static JSBytecodeImage *bc_get_image(BCReaderState *s)
+{
+    JSContext *ctx = s->ctx;
+    JSBytecodeImage *img;
+    uint8_t *buf;
+    int i;
+
+    if (s->image)
+        return s->image;
+    img = js_mallocz(ctx, sizeof(*img));
+    if (!img)
+        goto fail;
+    img->ref_count = 1;
+    img->is_rom_data = s->is_rom_data;
+    img->atom_map = js_atom_map_dup(s->atom_map);
+    img->first_atom = s->first_atom;
+    img->buf_len = s->buf_end - s->buf_start;
+    if (s->rom_buf) {
+        img->buf = s->buf_start;
+    } else {
+        buf = js_malloc(ctx, max_int(img->buf_len, 1));
+        if (!buf)
+            goto fail;
+        memcpy(buf, s->buf_start, img->buf_len);
+        img->buf = buf;
+        img->free_buf = TRUE;
+    }
+    if (s->idx_to_atom_count != 0) {
+        img->idx_to_atom = js_malloc(ctx, s->idx_to_atom_count *
+                                     sizeof(img->idx_to_atom[0]));
+        if (!img->idx_to_atom)
+            goto fail;
+        for(i = 0; i < s->idx_to_atom_count; i++)
+            img->idx_to_atom[i] = JS_DupAtom(ctx, s->idx_to_atom[i]);
+        img->idx_to_atom_count = s->idx_to_atom_count;
+    }
+    s->image = img;
+    return img;
+ fail:
+    if (img)
+        js_bytecode_image_free(ctx->rt, img);
+    s->error_state = -1;
+    return NULL;
+}
+
+static JSValue JS_ReadFunctionTag1(BCReaderState *s, BOOL is_lazy);
+
+/* read the variable definitions, byte code, debug info and constant
+   pool of 'b'. The layout must match the one of JS_ReadFunctionTag1(). */
+static int JS_ReadFunctionBody(BCReaderState *s, JSFunctionBytecode *b,
+                               int byte_code_len, int cpool_count,
+                               int local_count)
+{
+    JSContext *ctx = s->ctx;
+    uint8_t v8;
+    int idx, i;
+    int function_size, cpool_offset, byte_code_offset;
+    int vardefs_offset;
+
+    if (b->has_debug) {
+        function_size = sizeof(*b);
+    } else {
+        function_size = offsetof(JSFunctionBytecode, debug);
+    }
+    cpool_offset = function_size;
+    function_size += cpool_count * sizeof(*b->cpool);
+    vardefs_offset = function_size;
+    function_size += local_count * sizeof(*b->vardefs);
+    function_size += b->closure_var_count * sizeof(*b->closure_var);
+    byte_code_offset = function_size;
+
+    if (local_count != 0) {
+        bc_read_trace(s, "vars {\n");
+        b->vardefs = (void *)((uint8_t*)b + vardefs_offset);
+        memset(b->vardefs, 0, local_count * sizeof(*b->vardefs));
+        for(i = 0; i < local_count; i++) {
+            JSBytecodeVarDef *vd = &b->vardefs[i];
+            int scope_level, scope_next;
+            if (bc_get_atom(s, &vd->var_name))
+                goto fail;
+            if (bc_get_leb128_int(s, &scope_level))
+                goto fail;
+            if (bc_get_leb128_int(s, &scope_next))
+                goto fail;
+            vd->is_scoped = (scope_level != 0);
+            vd->scope_next = scope_next - 1;
+            if (bc_get_u8(s, &v8))
+                goto fail;
+            idx = 0;
+            vd->var_kind = bc_get_flags(v8, &idx, 4);
+            vd->is_const = bc_get_flags(v8, &idx, 1);
+            vd->is_lexical = bc_get_flags(v8, &idx, 1);
+            vd->is_captured = bc_get_flags(v8, &idx, 1);
+#ifdef DUMP_READ_OBJECT
+            bc_read_trace(s, "name: "); print_atom(s->ctx, vd->var_name); printf("\n");
+#endif
+        }
+        bc_read_trace(s, "}\n");
+    }
+    {
+        bc_read_trace(s, "bytecode {\n");
+        b->byte_code_len = 0;
+        if (JS_ReadFunctionBytecode(s, b, byte_code_offset, byte_code_len))
+            goto fail;
+        b->byte_code_len = byte_code_len;
+        bc_read_trace(s, "}\n");
+    }
+    if (b->has_debug) {
+        /* read optional debug information */
+        bc_read_trace(s, "debug {\n");
+        memset(&b->debug, 0, sizeof(b->debug));
+        if (bc_get_atom(s, &b->debug.filename))
+            goto fail;
+        if (bc_get_leb128_int(s, &b->debug.line_num))
+            goto fail;
+        if (bc_get_leb128_int(s, &b->debug.pc2line_len))
+            goto fail;
+        if (b->debug.pc2line_len) {
+            b->debug.pc2line_buf = js_mallocz(ctx, b->debug.pc2line_len);
+            if (!b->debug.pc2line_buf)
+                goto fail;
+            if (bc_get_buf(s, b->debug.pc2line_buf, b->debug.pc2line_len))
+                goto fail;
+        }
+        if (bc_get_leb128_int(s, &b->debug.inline_range_count))
+            goto fail;
+        if (b->debug.inline_range_count) {
+            b->debug.inline_ranges = js_mallocz(ctx, sizeof(b->debug.inline_ranges[0]) *
+                                                b->debug.inline_range_count);
+            if (!b->debug.inline_ranges)
+                goto fail;
+            for(i = 0; i < b->debug.inline_range_count; i++) {
+                JSInlineRange *r = &b->debug.inline_ranges[i];
+                uint32_t len;
+                if (bc_get_leb128(s, &r->pc_start))
+                    goto fail;
+                if (bc_get_leb128(s, &len))
+                    goto fail;
+                r->pc_end = r->pc_start + len;
+                if (bc_get_leb128_int(s, &r->cpool_idx))
+                    goto fail;
+                if (bc_get_leb128_int(s, &r->call_line))
+                    goto fail;
+            }
+        }
+        if (bc_get_u8(s, &v8))
+            goto fail;
+        if (v8 != 0) {
+            if (bc_get_leb128_int(s, &b->debug.source_len))
+                goto fail;
+            if (v8 == 1) {
+                b->debug.source = js_malloc(ctx, b->debug.source_len + 1);
+                if (!b->debug.source)
+                    goto fail;
+                if (bc_get_buf(s, (uint8_t *)b->debug.source,
+                               b->debug.source_len))
+                    goto fail;
+                b->debug.source[b->debug.source_len] = '\0';
+            } else {
+                if (bc_get_leb128_int(s, &b->debug.source_pos))
+                    goto fail;
+                if (bc_get_u32(s, &b->debug.source_hash))
+                    goto fail;
+            }
+        }
+#ifdef DUMP_READ_OBJECT
+        bc_read_trace(s, "filename: "); print_atom(s->ctx, b->debug.filename); printf("\n");
+#endif
+        bc_read_trace(s, "}\n");
+    }
+    if (cpool_count != 0) {
+        bc_read_trace(s, "cpool {\n");
+        b->cpool = (void *)((uint8_t*)b + cpool_offset);
+        for(i = 0; i < cpool_count; i++) {
+            JSValue val;
+            if (s->lazy && s->ptr < s->buf_end &&
+                *s->ptr == BC_TAG_FUNCTION_BYTECODE) {
+                /* the body of the inner functions is read on first use */
+                s->ptr++;
+                val = JS_ReadFunctionTag1(s, TRUE);
+            } else {
+                val = JS_ReadObjectRec(s);
+            }
+            if (JS_IsException(val))
+                goto fail;
+            b->cpool[b->cpool_count++] = val;
+        }
+        bc_read_trace(s, "}\n");
+    }
+    return 0;
+ fail:
+    return -1;
+}
+
+static JSValue JS_ReadFunctionTag1(BCReaderState *s, BOOL is_lazy)
 {
     JSContext *ctx = s->ctx;
     JSFunctionBytecode bc, *b;
+    JSFunctionBytecodeLazy *lazy;
+    JSBytecodeImage *img;
     JSValue obj = JS_UNDEFINED;
     uint16_t v16;
     uint8_t v8;
+    uint32_t body_len;
     int idx, i, local_count;
-    int function_size, cpool_offset, byte_code_offset;
-    int closure_var_offset, vardefs_offset;
+    int function_size, lazy_offset, closure_var_offset;
 
     memset(&bc, 0, sizeof(bc));
     bc.header.ref_count = 1;
@@ -35206,16 +41130,25 @@ static JSValue JS_ReadFunctionTag(BCReaderState *s)
     } else {
         function_size = offsetof(JSFunctionBytecode, debug);
     }
-    cpool_offset = function_size;
     function_size += bc.cpool_count * sizeof(*bc.cpool);
-    vardefs_offset = function_size;
     function_size += local_count * sizeof(*bc.vardefs);
     closure_var_offset = function_size;
     function_size += bc.closure_var_count * sizeof(*bc.closure_var);
-    byte_code_offset = function_size;
     if (!bc.read_only_bytecode) {
         function_size += bc.byte_code_len;
     }
+    lazy_offset = 0;
+    img = NULL;
+    if (is_lazy) {
+        /* the stub has the size of the loaded function so that it can
+           be loaded in place */
+        img = bc_get_image(s);
+        if (!img)
+            goto fail;
+        function_size = (function_size + 7) & ~7;
+        lazy_offset = function_size;
+        function_size += sizeof(JSFunctionBytecodeLazy);
+    }
 
     b = js_mallocz(ctx, function_size);
     if (!b)
@@ -35223,44 +41156,32 @@ static JSValue JS_ReadFunctionTag(BCReaderState *s)
             
     memcpy(b, &bc, offsetof(JSFunctionBytecode, debug));
     b->header.ref_count = 1;
+    b->atom_map = js_atom_map_dup(s->atom_map);
     add_gc_object(ctx->rt, &b->header, JS_GC_OBJ_TYPE_FUNCTION_BYTECODE);
             
     obj = JS_MKPTR(JS_TAG_FUNCTION_BYTECODE, b);
 
+    /* set when the body is read */
+    b->byte_code_len = 0;
+    b->cpool_count = 0;
+    if (is_lazy) {
+        lazy = (void *)((uint8_t*)b + lazy_offset);
+        lazy->image = js_bytecode_image_dup(img);
+        lazy->u.read.byte_code_len = bc.byte_code_len;
+        lazy->u.read.cpool_count = bc.cpool_count;
+        lazy->u.read.local_count = local_count;
+        b->lazy = lazy;
+    }
+
 #ifdef DUMP_READ_OBJECT
     bc_read_trace(s, "name: "); print_atom(s->ctx, b->func_name); printf("\n");
 #endif
     bc_read_trace(s, "args=%d vars=%d defargs=%d closures=%d cpool=%d\n",
                   b->arg_count, b->var_count, b->defined_arg_count,
-                  b->closure_var_count, b->cpool_count);
+                  b->closure_var_count, bc.cpool_count);
     bc_read_trace(s, "stack=%d bclen=%d locals=%d\n",
-                  b->stack_size, b->byte_code_len, local_count);
+                  b->stack_size, bc.byte_code_len, local_count);
 
-    if (local_count != 0) {
-        bc_read_trace(s, "vars {\n");
-        b->vardefs = (void *)((uint8_t*)b + vardefs_offset);
-        for(i = 0; i < local_count; i++) {
-            JSVarDef *vd = &b->vardefs[i];
-            if (bc_get_atom(s, &vd->var_name))
-                goto fail;
-            if (bc_get_leb128_int(s, &vd->scope_level))
-                goto fail;
-            if (bc_get_leb128_int(s, &vd->scope_next))
-                goto fail;
-            vd->scope_next--;
-            if (bc_get_u8(s, &v8))
-                goto fail;
-            idx = 0;
-            vd->var_kind = bc_get_flags(v8, &idx, 4);
-            vd->is_const = bc_get_flags(v8, &idx, 1);
-            vd->is_lexical = bc_get_flags(v8, &idx, 1);
-            vd->is_captured = bc_get_flags(v8, &idx, 1);
-#ifdef DUMP_READ_OBJECT
-            bc_read_trace(s, "name: "); print_atom(s->ctx, vd->var_name); printf("\n");
-#endif
-        }
-        bc_read_trace(s, "}\n");
-    }
     if (b->closure_var_count != 0) {
         bc_read_trace(s, "closure vars {\n");
         b->closure_var = (void *)((uint8_t*)b + closure_var_offset);
@@ -35286,44 +41207,20 @@ static JSValue JS_ReadFunctionTag(BCReaderState *s)
         }
         bc_read_trace(s, "}\n");
     }
-    {
-        bc_read_trace(s, "bytecode {\n");
-        if (JS_ReadFunctionBytecode(s, b, byte_code_offset, b->byte_code_len))
-            goto fail;
-        bc_read_trace(s, "}\n");
-    }
-    if (b->has_debug) {
-        /* read optional debug information */
-        bc_read_trace(s, "debug {\n");
-        if (bc_get_atom(s, &b->debug.filename))
-            goto fail;
-        if (bc_get_leb128_int(s, &b->debug.line_num))
-            goto fail;
-        if (bc_get_leb128_int(s, &b->debug.pc2line_len))
+    if (bc_get_u32(s, &body_len))
+        goto fail;
+    if (is_lazy) {
+        if (body_len > s->buf_end - s->ptr) {
+            bc_read_error_end(s);
             goto fail;
-        if (b->debug.pc2line_len) {
-            b->debug.pc2line_buf = js_mallocz(ctx, b->debug.pc2line_len);
-            if (!b->debug.pc2line_buf)
-                goto fail;
-            if (bc_get_buf(s, b->debug.pc2line_buf, b->debug.pc2line_len))
-                goto fail;
-        }
-#ifdef DUMP_READ_OBJECT
-        bc_read_trace(s, "filename: "); print_atom(s->ctx, b->debug.filename); printf("\n");
-#endif
-        bc_read_trace(s, "}\n");
-    }
-    if (b->cpool_count != 0) {
-        bc_read_trace(s, "cpool {\n");
-        b->cpool = (void *)((uint8_t*)b + cpool_offset);
-        for(i = 0; i < b->cpool_count; i++) {
-            JSValue val;
-            val = JS_ReadObjectRec(s);
-            if (JS_IsException(val))
-                goto fail;
-            b->cpool[i] = val;
         }
-        bc_read_trace(s, "}\n");
+        b->lazy->u.read.body_pos = s->ptr - s->buf_start;
+        b->lazy->u.read.body_len = body_len;
+        s->ptr += body_len;
+    } else {
+        if (JS_ReadFunctionBody(s, b, bc.byte_code_len, bc.cpool_count,
+                                local_count))
+            goto fail;
     }
     b->realm = JS_DupContext(ctx);
     return obj;
@@ -35332,6 +41229,61 @@ static JSValue JS_ReadFunctionTag(BCReaderState *s)
     return JS_EXCEPTION;
 }
 
+static JSValue JS_ReadFunctionTag(BCReaderState *s)
+{
+    return JS_ReadFunctionTag1(s, FALSE);
+}
+
+/* read the body of a function read with JS_READ_OBJ_LAZY. Its inner
+   functions are in turn read as stubs. */
+static __exception int js_function_bytecode_read(JSFunctionBytecode *b)
+{
+    JSFunctionBytecodeLazy *lazy = b->lazy;
+    JSBytecodeImage *img = lazy->image;
+    JSContext *ctx = b->realm;
+    BCReaderState ss, *s = &ss;
+    int ret;
+
+    memset(s, 0, sizeof(*s));
+    s->ctx = ctx;
+    s->buf_start = img->buf;
+    s->buf_end = img->buf + img->buf_len;
+    s->ptr = img->buf + lazy->u.read.body_pos;
+    s->first_atom = img->first_atom;
+    s->idx_to_atom_count = img->idx_to_atom_count;
+    s->idx_to_atom = img->idx_to_atom;
+    s->allow_bytecode = TRUE;
+    s->is_rom_data = img->is_rom_data;
+    s->atom_map = js_atom_map_dup(img->atom_map);
+    s->lazy = TRUE;
+    s->image = img;
+    ret = JS_ReadFunctionBody(s, b, lazy->u.read.byte_code_len,
+                              lazy->u.read.cpool_count,
+                              lazy->u.read.local_count);
+    if (s->atom_map)
+        js_atom_map_free(ctx->rt, s->atom_map);
+    if (ret == 0 && s->ptr != img->buf + lazy->u.read.body_pos +
+        lazy->u.read.body_len) {
+        JS_ThrowSyntaxError(ctx, "invalid function body");
+        ret = -1;
+    }
+    if (ret) {
+        /* back to the stub state */
+        free_function_bytecode_body(ctx->rt, b);
+        b->byte_code_buf = NULL;
+        b->byte_code_len = 0;
+        b->vardefs = NULL;
+        b->cpool = NULL;
+        b->cpool_count = 0;
+        if (b->has_debug)
+            memset(&b->debug, 0, sizeof(b->debug));
+        return -1;
+    }
+    b->lazy = NULL;
+    js_bytecode_image_free(ctx->rt, img);
+    return 0;
+}
+
 static JSValue JS_ReadModule(BCReaderState *s)
 {
     JSContext *ctx = s->ctx;
@@ -35419,9 +41371,48 @@ static JSValue JS_ReadModule(BCReaderState *s)
                 goto fail;
             if (bc_get_leb128_int(s, &mi->req_module_idx))
                 goto fail;
+            mi->res_export_idx = -1;
         }
     }
 
+    if (bc_get_u8(s, &v8))
+        goto fail;
+    if (v8 & 1) {
+        int ns_count;
+        for(i = 0; i < m->import_entries_count; i++) {
+            JSImportEntry *mi = &m->import_entries[i];
+            if (bc_get_sleb128(s, &mi->res_export_idx))
+                goto fail;
+            if (mi->res_export_idx >= 0) {
+                if (bc_get_atom(s, &mi->res_module_name))
+                    goto fail;
+            } else {
+                mi->res_export_idx = -1;
+            }
+        }
+        if (bc_get_leb128_int(s, &ns_count))
+            goto fail;
+        if (ns_count != 0) {
+            ns_count--;
+            m->ns_entries = js_mallocz(ctx, sizeof(m->ns_entries[0]) *
+                                       max_int(ns_count, 1));
+            if (!m->ns_entries)
+                goto fail;
+            for(i = 0; i < ns_count; i++) {
+                JSModuleNsEntry *ne = &m->ns_entries[i];
+                m->ns_entries_count++;
+                if (bc_get_atom(s, &ne->export_name))
+                    goto fail;
+                if (bc_get_atom(s, &ne->module_name))
+                    goto fail;
+                if (bc_get_leb128_int(s, &ne->export_idx))
+                    goto fail;
+            }
+        }
+        m->prelinked = TRUE;
+        m->prelinked_exports = (v8 >> 1) & 1;
+    }
+
     m->func_obj = JS_ReadObjectRec(s);
     if (JS_IsException(m->func_obj))
         goto fail;
@@ -35625,8 +41616,7 @@ static JSValue JS_ReadDate(BCReaderState *s)
         JS_ThrowTypeError(ctx, "Number tag expected for date");
         goto fail;
     }
-    obj = JS_NewObjectProtoClass(ctx, ctx->class_proto[JS_CLASS_DATE],
-                                 JS_CLASS_DATE);
+    obj = JS_NewObjectClass(ctx, JS_CLASS_DATE);
     if (JS_IsException(obj))
         goto fail;
     if (BC_add_object_ref(s, obj))
@@ -35783,6 +41773,7 @@ static int JS_ReadObjectAtoms(BCReaderState *s)
     JSString *p;
     int i;
     JSAtom atom;
+    BOOL atom_mismatch = FALSE;
 
     if (bc_get_u8(s, &v8))
         return -1;
@@ -35812,9 +41803,16 @@ static int JS_ReadObjectAtoms(BCReaderState *s)
             return s->error_state = -1;
         s->idx_to_atom[i] = atom;
         if (s->is_rom_data && (atom != (i + s->first_atom)))
-            s->is_rom_data = FALSE; /* atoms must be relocated */
+            atom_mismatch = TRUE;
     }
     bc_read_trace(s, "}\n");
+    if (atom_mismatch) {
+        /* the bytecode is kept in place and its atoms are translated
+           when it is executed */
+        if (s->allow_bytecode)
+            return bc_create_atom_map(s);
+        s->is_rom_data = FALSE;
+    }
     return 0;
 }
 
@@ -35828,6 +41826,10 @@ static void bc_reader_free(BCReaderState *s)
         js_free(s->ctx, s->idx_to_atom);
     }
     js_free(s->ctx, s->objects);
+    if (s->image)
+        js_bytecode_image_free(s->ctx->rt, s->image);
+    if (s->atom_map)
+        js_atom_map_free(s->ctx->rt, s->atom_map);
 }
 
 JSValue JS_ReadObject(JSContext *ctx, const uint8_t *buf, size_t buf_len,
@@ -35848,6 +41850,10 @@ JSValue JS_ReadObject(JSContext *ctx, const uint8_t *buf, size_t buf_len,
     s->is_rom_data = ((flags & JS_READ_OBJ_ROM_DATA) != 0);
     s->allow_sab = ((flags & JS_READ_OBJ_SAB) != 0);
     s->allow_reference = ((flags & JS_READ_OBJ_REFERENCE) != 0);
+    s->rom_buf = ((flags & JS_READ_OBJ_ROM_DATA) != 0);
+    /* the stubs cannot reference the objects of the whole buffer */
+    s->lazy = ((flags & JS_READ_OBJ_LAZY) != 0) && s->allow_bytecode &&
+        !s->allow_reference;
     if (s->allow_bytecode)
         s->first_atom = JS_ATOM_END;
     else
@@ -36207,6 +42213,15 @@ static JSValue JS_ToObject(JSContext *ctx, JSValueConst val)
             JS_DefinePropertyValue(ctx, obj, JS_ATOM_length, JS_NewInt32(ctx, p1->len), 0);
         }
         goto set_value;
+    case JS_TAG_STRING_ROPE:
+        {
+            JSValue str = js_linearize_string_rope(ctx, val);
+            if (JS_IsException(str))
+                return JS_EXCEPTION;
+            obj = JS_ToObject(ctx, str);
+            JS_FreeValue(ctx, str);
+            return obj;
+        }
     case JS_TAG_BOOL:
         obj = JS_NewObjectClass(ctx, JS_CLASS_BOOLEAN);
         goto set_value;
@@ -37676,6 +43691,36 @@ JSValue JS_FunctionBind(
 	return js_function_bind(ctx, this_val, argc, argv);
 }
 
+/* return the source of 'b' reloaded from its file or JS_UNDEFINED if
+   it is not available or was modified */
+static JSValue js_function_load_source(JSContext *ctx, JSFunctionBytecode *b)
+{
+    JSRuntime *rt = ctx->rt;
+    const char *filename;
+    uint8_t *buf;
+    size_t buf_len;
+    JSValue ret = JS_UNDEFINED;
+
+    if (!rt->source_loader_func)
+        return JS_UNDEFINED;
+    filename = JS_AtomToCString(ctx, b->debug.filename);
+    if (!filename)
+        return JS_EXCEPTION;
+    buf = rt->source_loader_func(ctx, &buf_len, filename,
+                                 rt->source_loader_opaque);
+    JS_FreeCString(ctx, filename);
+    if (!buf)
+        return JS_UNDEFINED;
+    if (b->debug.source_pos + (size_t)b->debug.source_len <= buf_len &&
+        hash_string8(buf + b->debug.source_pos, b->debug.source_len, 0) ==
+        b->debug.source_hash) {
+        ret = JS_NewStringLen(ctx, (const char *)buf + b->debug.source_pos,
+                              b->debug.source_len);
+    }
+    js_free(ctx, buf);
+    return ret;
+}
+
 static JSValue js_function_toString(JSContext *ctx, JSValueConst this_val,
                                     int argc, JSValueConst *argv)
 {
@@ -37688,9 +43733,20 @@ static JSValue js_function_toString(JSContext *ctx, JSValueConst this_val,
     p = JS_VALUE_GET_OBJ(this_val);
     if (js_class_has_bytecode(p->class_id)) {
         JSFunctionBytecode *b = p->u.func.function_bytecode;
+        if (b->lazy && b->lazy->image) {
+            /* the debug information is read with the function body */
+            b = js_function_load_bytecode(ctx->rt, p);
+            if (!b)
+                return JS_EXCEPTION;
+        }
         if (b->has_debug && b->debug.source) {
             return JS_NewStringLen(ctx, b->debug.source, b->debug.source_len);
         }
+        if (b->has_debug && b->debug.source_len != 0) {
+            JSValue str = js_function_load_source(ctx, b);
+            if (!JS_IsUndefined(str))
+                return str;
+        }
         func_kind = b->func_kind;
     }
     {
@@ -37999,7 +44055,7 @@ static JSValue js_array_from(JSContext *ctx, JSValueConst this_val,
         if (JS_IsException(r))
             goto exception;
         stack[0] = JS_DupValue(ctx, items);
-        if (js_for_of_start(ctx, &stack[1], FALSE))
+        if (js_for_of_start(ctx, &stack[1], FALSE, FALSE))
             goto exception;
         for (k = 0;; k++) {
             v = JS_IteratorNext(ctx, stack[0], stack[1], 0, NULL, &done);
@@ -39366,12 +45422,6 @@ fail:
     return JS_EXCEPTION;
 }
 
-typedef struct JSArrayIteratorData {
-    JSValue obj;
-    JSIteratorKindEnum kind;
-    uint32_t idx;
-} JSArrayIteratorData;
-
 static void js_array_iterator_finalizer(JSRuntime *rt, JSValue val)
 {
     JSObject *p = JS_VALUE_GET_OBJ(val);
@@ -40043,7 +46093,7 @@ static JSValue js_string_constructor(JSContext *ctx, JSValueConst new_target,
 
 static JSValue js_thisStringValue(JSContext *ctx, JSValueConst this_val)
 {
-    if (JS_VALUE_GET_TAG(this_val) == JS_TAG_STRING)
+    if (tag_is_string(JS_VALUE_GET_TAG(this_val)))
         return JS_DupValue(ctx, this_val);
 
     if (JS_VALUE_GET_TAG(this_val) == JS_TAG_OBJECT) {
@@ -40062,6 +46112,13 @@ static JSValue js_string_fromCharCode(JSContext *ctx, JSValueConst this_val,
     int i;
     StringBuffer b_s, *b = &b_s;
 
+    if (argc == 1) {
+        int32_t c;
+        if (JS_ToInt32(ctx, &c, argv[0]))
+            return JS_EXCEPTION;
+        return js_new_string_char(ctx, c & 0xffff);
+    }
+
     string_buffer_init(ctx, b, argc);
 
     for(i = 0; i < argc; i++) {
@@ -40572,7 +46629,8 @@ static JSValue js_string___GetSubstitution(JSContext *ctx, JSValueConst this_val
     namedCaptures = argv[4];
     rep = argv[5];
 
-    if (!JS_IsString(rep) || !JS_IsString(str))
+    if (JS_VALUE_GET_TAG(rep) != JS_TAG_STRING ||
+        JS_VALUE_GET_TAG(str) != JS_TAG_STRING)
         return JS_ThrowTypeError(ctx, "not a string");
 
     sp = JS_VALUE_GET_STRING(str);
@@ -43712,6 +49770,7 @@ static JSValue js_json_check(JSContext *ctx, JSONStringifyContext *jsc,
         if (JS_IsFunction(ctx, val))
             break;
     case JS_TAG_STRING:
+    case JS_TAG_STRING_ROPE:
     case JS_TAG_INT:
     case JS_TAG_FLOAT64:
 #ifdef CONFIG_BIGNUM
@@ -43893,6 +49952,7 @@ static int js_json_to_str(JSContext *ctx, JSONStringifyContext *jsc,
         JS_FreeValue(ctx, prop);
         return 0;
     case JS_TAG_STRING:
+    case JS_TAG_STRING_ROPE:
         val = JS_ToQuotedStringFree(ctx, val);
         if (JS_IsException(val))
             goto exception;
@@ -44022,7 +50082,11 @@ JSValue JS_JSONStringify(JSContext *ctx, JSValueConst obj,
             goto exception;
         jsc->gap = JS_NewStringLen(ctx, "          ", n);
     } else if (JS_IsString(space)) {
-        JSString *p = JS_VALUE_GET_STRING(space);
+        JSString *p;
+        space = js_linearize_string_free(ctx, space);
+        if (JS_IsException(space))
+            goto exception;
+        p = JS_VALUE_GET_STRING(space);
         jsc->gap = js_sub_string(ctx, p, 0, min_int(p->len, 10));
     } else {
         jsc->gap = JS_DupValue(ctx, jsc->empty);
@@ -45187,10 +51251,21 @@ static const JSClassShortDef js_proxy_class_def[] = {
     { JS_ATOM_Object, js_proxy_finalizer, js_proxy_mark }, /* JS_CLASS_PROXY */
 };
 
+static void js_proxy_init(JSContext *ctx)
+{
+    JSValue obj1;
+
+    obj1 = JS_NewCFunction2(ctx, js_proxy_constructor, "Proxy", 2,
+                            JS_CFUNC_constructor, 0);
+    JS_SetConstructorBit(ctx, obj1, TRUE);
+    JS_SetPropertyFunctionList(ctx, obj1, js_proxy_funcs,
+                               countof(js_proxy_funcs));
+    ctx->intrinsic_ctor[JS_INTRINSIC_CTOR_PROXY] = obj1;
+}
+
 void JS_AddIntrinsicProxy(JSContext *ctx)
 {
     JSRuntime *rt = ctx->rt;
-    JSValue obj1;
 
     if (!JS_IsRegisteredClass(rt, JS_CLASS_PROXY)) {
         init_class_range(rt, js_proxy_class_def, JS_CLASS_PROXY,
@@ -45199,13 +51274,10 @@ void JS_AddIntrinsicProxy(JSContext *ctx)
         rt->class_array[JS_CLASS_PROXY].call = js_proxy_call;
     }
 
-    obj1 = JS_NewCFunction2(ctx, js_proxy_constructor, "Proxy", 2,
-                            JS_CFUNC_constructor, 0);
-    JS_SetConstructorBit(ctx, obj1, TRUE);
-    JS_SetPropertyFunctionList(ctx, obj1, js_proxy_funcs,
-                               countof(js_proxy_funcs));
-    JS_DefinePropertyValueStr(ctx, ctx->global_obj, "Proxy",
-                              obj1, JS_PROP_WRITABLE | JS_PROP_CONFIGURABLE);
+    /* Proxy: created on first use */
+    js_defer_intrinsic(ctx, JS_INTRINSIC_PROXY);
+    js_define_intrinsic_ctor(ctx, JS_ATOM_Proxy, JS_INTRINSIC_PROXY,
+                             JS_INTRINSIC_CTOR_PROXY);
 }
 
 /* Symbol */
@@ -45481,6 +51553,23 @@ static uint32_t map_hash_key(JSContext *ctx, JSValueConst key)
     case JS_TAG_STRING:
         h = hash_string(JS_VALUE_GET_STRING(key), 0);
         break;
+    case JS_TAG_STRING_ROPE:
+        {
+            /* same hash as the linearized string */
+            JSStringRopeIter it;
+            JSString *p;
+            uint32_t start, len;
+            h = 0;
+            string_rope_iter_init(&it, key);
+            while ((p = string_rope_iter_next(&it, &start, &len)) != NULL) {
+                if (p->is_wide_char)
+                    h = hash_string16(p->u.str16 + start, len, h);
+                else
+                    h = hash_string8(p->u.str8 + start, len, h);
+            }
+            tag = JS_TAG_STRING;
+        }
+        break;
     case JS_TAG_OBJECT:
     case JS_TAG_SYMBOL:
         h = (uintptr_t)JS_VALUE_GET_PTR(key) * 3163;
@@ -46067,7 +52156,7 @@ static const uint8_t js_map_proto_funcs_count[6] = {
     countof(js_set_iterator_proto_funcs),
 };
 
-void JS_AddIntrinsicMapSet(JSContext *ctx)
+static void js_map_set_init(JSContext *ctx)
 {
     int i;
     JSValue obj1;
@@ -46086,7 +52175,8 @@ void JS_AddIntrinsicMapSet(JSContext *ctx)
             JS_SetPropertyFunctionList(ctx, obj1, js_map_funcs,
                                        countof(js_map_funcs));
         }
-        JS_NewGlobalCConstructor2(ctx, obj1, name, ctx->class_proto[JS_CLASS_MAP + i]);
+        JS_SetConstructor(ctx, obj1, ctx->class_proto[JS_CLASS_MAP + i]);
+        ctx->intrinsic_ctor[JS_INTRINSIC_CTOR_MAP + i] = obj1;
     }
 
     for(i = 0; i < 2; i++) {
@@ -46098,6 +52188,18 @@ void JS_AddIntrinsicMapSet(JSContext *ctx)
     }
 }
 
+void JS_AddIntrinsicMapSet(JSContext *ctx)
+{
+    int i;
+
+    /* Map, Set, WeakMap and WeakSet: created on first use */
+    js_defer_intrinsic(ctx, JS_INTRINSIC_MAP_SET);
+    for(i = 0; i < 4; i++) {
+        js_define_intrinsic_ctor(ctx, JS_ATOM_Map + i, JS_INTRINSIC_MAP_SET,
+                                 JS_INTRINSIC_CTOR_MAP + i);
+    }
+}
+
 /* Generator */
 static const JSCFunctionListEntry js_generator_function_proto_funcs[] = {
     JS_PROP_STRING_DEF("[Symbol.toStringTag]", "GeneratorFunction", JS_PROP_CONFIGURABLE),
@@ -48583,17 +54685,26 @@ static const JSCFunctionListEntry js_date_proto_funcs[] = {
     JS_CFUNC_DEF("toJSON", 1, js_date_toJSON ),
 };
 
-void JS_AddIntrinsicDate(JSContext *ctx)
+static void js_date_init(JSContext *ctx)
 {
-    JSValueConst obj;
+    JSValue obj;
 
-    /* Date */
     ctx->class_proto[JS_CLASS_DATE] = JS_NewObject(ctx);
     JS_SetPropertyFunctionList(ctx, ctx->class_proto[JS_CLASS_DATE], js_date_proto_funcs,
                                countof(js_date_proto_funcs));
-    obj = JS_NewGlobalCConstructor(ctx, "Date", js_date_constructor, 7,
-                                   ctx->class_proto[JS_CLASS_DATE]);
+    obj = JS_NewCFunction2(ctx, js_date_constructor, "Date", 7,
+                           JS_CFUNC_constructor_or_func, 0);
+    JS_SetConstructor(ctx, obj, ctx->class_proto[JS_CLASS_DATE]);
     JS_SetPropertyFunctionList(ctx, obj, js_date_funcs, countof(js_date_funcs));
+    ctx->intrinsic_ctor[JS_INTRINSIC_CTOR_DATE] = obj;
+}
+
+void JS_AddIntrinsicDate(JSContext *ctx)
+{
+    /* Date: created on first use */
+    js_defer_intrinsic(ctx, JS_INTRINSIC_DATE);
+    js_define_intrinsic_ctor(ctx, JS_ATOM_Date, JS_INTRINSIC_DATE,
+                             JS_INTRINSIC_CTOR_DATE);
 }
 
 /* eval */
@@ -48959,6 +55070,7 @@ static JSValue JS_ToBigIntCtorFree(JSContext *ctx, JSValue val)
             break;
         goto redo;
     case JS_TAG_STRING:
+    case JS_TAG_STRING_ROPE:
         val = JS_StringToBigIntErr(ctx, val);
         break;
     case JS_TAG_OBJECT:
@@ -49513,6 +55625,7 @@ static JSValue js_bigfloat_constructor(JSContext *ctx,
                 break;
             goto redo;
         case JS_TAG_STRING:
+        case JS_TAG_STRING_ROPE:
             {
                 const char *str, *p;
                 size_t len;
@@ -50191,6 +56304,7 @@ static JSValue JS_ToBigDecimalFree(JSContext *ctx, JSValue val,
             break;
         goto redo;
     case JS_TAG_STRING:
+    case JS_TAG_STRING_ROPE:
         {
             const char *str, *p;
             size_t len;
@@ -50635,6 +56749,8 @@ void JS_AddIntrinsicBigDecimal(JSContext *ctx)
 void JS_EnableBignumExt(JSContext *ctx, BOOL enable)
 {
     ctx->bignum_ext = enable;
+    /* the parsing depends on it */
+    js_eval_cache_free(ctx);
 }
 
 #endif /* CONFIG_BIGNUM */
@@ -50645,6 +56761,194 @@ static const char * const native_error_name[JS_NATIVE_ERROR_COUNT] = {
     "InternalError", "AggregateError",
 };
 
+/* freeze 'val' and the objects reachable from it through its
+   prototype and its properties. The objects which are already not
+   extensible are considered as already visited. */
+static int js_freeze_intrinsic(JSContext *ctx, JSValueConst val)
+{
+    JSObject *p;
+    JSShape *sh;
+    JSShapeProperty *prs;
+    JSValue res;
+    int i;
+
+    if (JS_VALUE_GET_TAG(val) != JS_TAG_OBJECT)
+        return 0;
+    p = JS_VALUE_GET_OBJ(val);
+    if (!p->extensible || p->class_id == JS_CLASS_PROXY)
+        return 0;
+    if (js_check_stack_overflow(ctx->rt, 0)) {
+        JS_ThrowStackOverflow(ctx);
+        return -1;
+    }
+    /* also instantiates the autoinit properties */
+    res = js_object_seal(ctx, JS_UNDEFINED, 1, &val, 1);
+    if (JS_IsException(res))
+        return -1;
+    JS_FreeValue(ctx, res);
+
+    if (p->shape->proto &&
+        js_freeze_intrinsic(ctx, JS_MKPTR(JS_TAG_OBJECT, p->shape->proto)))
+        return -1;
+    /* the shape is not modified by the freezing of the other objects */
+    sh = p->shape;
+    for(i = 0, prs = get_shape_prop(sh); i < sh->prop_count; i++, prs++) {
+        JSProperty *pr = &p->prop[i];
+        if (prs->atom == JS_ATOM_NULL)
+            continue;
+        if ((prs->flags & JS_PROP_TMASK) == JS_PROP_GETSET) {
+            if (pr->u.getset.getter &&
+                js_freeze_intrinsic(ctx, JS_MKPTR(JS_TAG_OBJECT, pr->u.getset.getter)))
+                return -1;
+            if (pr->u.getset.setter &&
+                js_freeze_intrinsic(ctx, JS_MKPTR(JS_TAG_OBJECT, pr->u.getset.setter)))
+                return -1;
+        } else if ((prs->flags & JS_PROP_TMASK) == JS_PROP_NORMAL) {
+            if (js_freeze_intrinsic(ctx, pr->u.value))
+                return -1;
+        }
+    }
+    return 0;
+}
+
+/* instantiate and freeze all the intrinsics of 'ctx' so that they
+   can be shared with other contexts */
+static int js_share_intrinsics(JSContext *ctx)
+{
+    JSRuntime *rt = ctx->rt;
+    JSPropertyEnum *props;
+    uint32_t len, i;
+    JSValue val;
+    int id, ret;
+
+    for(id = 0; id < JS_INTRINSIC_COUNT; id++)
+        js_instantiate_intrinsic(ctx, id);
+
+    /* the global object itself is not shared */
+    if (JS_GetOwnPropertyNamesInternal(ctx, &props, &len,
+                                       JS_VALUE_GET_OBJ(ctx->global_obj),
+                                       JS_GPN_STRING_MASK | JS_GPN_SYMBOL_MASK))
+        return -1;
+    ret = 0;
+    for(i = 0; i < len && ret == 0; i++) {
+        val = JS_GetProperty(ctx, ctx->global_obj, props[i].atom);
+        if (JS_IsException(val)) {
+            ret = -1;
+        } else {
+            if (!js_same_value(ctx, val, ctx->global_obj))
+                ret = js_freeze_intrinsic(ctx, val);
+            JS_FreeValue(ctx, val);
+        }
+    }
+    js_free_prop_enum(ctx, props, len);
+    if (ret)
+        return -1;
+
+    /* the intrinsics which are not reachable from the global object */
+    for(i = 0; i < rt->class_count; i++) {
+        if (js_freeze_intrinsic(ctx, ctx->class_proto[i]))
+            return -1;
+    }
+    for(i = 0; i < JS_NATIVE_ERROR_COUNT; i++) {
+        if (js_freeze_intrinsic(ctx, ctx->native_error_proto[i]))
+            return -1;
+    }
+    if (js_freeze_intrinsic(ctx, ctx->function_proto) ||
+        js_freeze_intrinsic(ctx, ctx->iterator_proto) ||
+        js_freeze_intrinsic(ctx, ctx->async_iterator_proto) ||
+        js_freeze_intrinsic(ctx, ctx->throw_type_error) ||
+        js_freeze_intrinsic(ctx, ctx->eval_obj))
+        return -1;
+    ctx->shared_intrinsics = TRUE;
+    return 0;
+}
+
+/* Create a context sharing the intrinsic objects of 'tmpl'. The first
+   call freezes the intrinsics of 'tmpl'. The new context has its own
+   global object containing a copy of the global properties of
+   'tmpl'. */
+JSContext *JS_NewContextShared(JSContext *tmpl)
+{
+    JSRuntime *rt = tmpl->rt;
+    JSContext *ctx;
+    JSPropertyEnum *props;
+    JSPropertyDescriptor desc;
+    uint32_t len, i;
+    int res;
+
+    if (!tmpl->shared_intrinsics) {
+        if (js_share_intrinsics(tmpl))
+            return NULL;
+    }
+
+    ctx = js_new_context(rt);
+    if (!ctx)
+        return NULL;
+    for(i = 0; i < rt->class_count; i++)
+        ctx->class_proto[i] = JS_DupValue(ctx, tmpl->class_proto[i]);
+    for(i = 0; i < JS_NATIVE_ERROR_COUNT; i++)
+        ctx->native_error_proto[i] = JS_DupValue(ctx, tmpl->native_error_proto[i]);
+    for(i = 0; i < JS_INTRINSIC_CTOR_COUNT; i++)
+        ctx->intrinsic_ctor[i] = JS_DupValue(ctx, tmpl->intrinsic_ctor[i]);
+    ctx->function_proto = JS_DupValue(ctx, tmpl->function_proto);
+    ctx->function_ctor = JS_DupValue(ctx, tmpl->function_ctor);
+    ctx->array_ctor = JS_DupValue(ctx, tmpl->array_ctor);
+    ctx->regexp_ctor = JS_DupValue(ctx, tmpl->regexp_ctor);
+    ctx->promise_ctor = JS_DupValue(ctx, tmpl->promise_ctor);
+    ctx->iterator_proto = JS_DupValue(ctx, tmpl->iterator_proto);
+    ctx->async_iterator_proto = JS_DupValue(ctx, tmpl->async_iterator_proto);
+    ctx->array_proto_values = JS_DupValue(ctx, tmpl->array_proto_values);
+    ctx->throw_type_error = JS_DupValue(ctx, tmpl->throw_type_error);
+    ctx->eval_obj = JS_DupValue(ctx, tmpl->eval_obj);
+    ctx->array_shape = js_dup_shape(tmpl->array_shape);
+    ctx->compile_regexp = tmpl->compile_regexp;
+    ctx->eval_internal = tmpl->eval_internal;
+    ctx->is_error_property_enabled = tmpl->is_error_property_enabled;
+#ifdef CONFIG_BIGNUM
+    ctx->fp_env = tmpl->fp_env;
+    ctx->bignum_ext = tmpl->bignum_ext;
+    ctx->allow_operator_overloading = tmpl->allow_operator_overloading;
+#endif
+    js_random_init(ctx);
+
+    ctx->global_obj = JS_NewObject(ctx);
+    ctx->global_var_obj = JS_NewObjectProto(ctx, JS_NULL);
+    if (JS_IsException(ctx->global_obj) || JS_IsException(ctx->global_var_obj))
+        goto fail;
+    if (JS_GetOwnPropertyNamesInternal(ctx, &props, &len,
+                                       JS_VALUE_GET_OBJ(tmpl->global_obj),
+                                       JS_GPN_STRING_MASK | JS_GPN_SYMBOL_MASK))
+        goto fail;
+    res = 0;
+    for(i = 0; i < len && res >= 0; i++) {
+        res = JS_GetOwnPropertyInternal(ctx, &desc,
+                                        JS_VALUE_GET_OBJ(tmpl->global_obj),
+                                        props[i].atom);
+        if (res <= 0)
+            continue;
+        if (js_same_value(ctx, desc.value, tmpl->global_obj)) {
+            /* globalThis */
+            JS_FreeValue(ctx, desc.value);
+            desc.value = JS_DupValue(ctx, ctx->global_obj);
+        }
+        res = JS_DefineProperty(ctx, ctx->global_obj, props[i].atom,
+                                desc.value, desc.getter, desc.setter,
+                                desc.flags | JS_PROP_HAS_CONFIGURABLE |
+                                JS_PROP_HAS_WRITABLE | JS_PROP_HAS_ENUMERABLE |
+                                ((desc.flags & JS_PROP_GETSET) ?
+                                 (JS_PROP_HAS_GET | JS_PROP_HAS_SET) :
+                                 JS_PROP_HAS_VALUE));
+        js_free_desc(ctx, &desc);
+    }
+    js_free_prop_enum(ctx, props, len);
+    if (res < 0)
+        goto fail;
+    return ctx;
+ fail:
+    JS_FreeContext(ctx);
+    return NULL;
+}
+
 /* Minimum amount of objects to be able to compile code and display
    error messages. No JSAtom should be allocated by this function. */
 static void JS_AddIntrinsicBasicObjects(JSContext *ctx)
@@ -51621,7 +57925,7 @@ static JSValue js_typed_array_from(JSContext *ctx, JSValueConst this_val,
         if (JS_IsException(arr))
             goto exception;
         stack[0] = JS_DupValue(ctx, items);
-        if (js_for_of_start(ctx, &stack[1], FALSE))
+        if (js_for_of_start(ctx, &stack[1], FALSE, FALSE))
             goto exception;
         for (k = 0;; k++) {
             v = JS_IteratorNext(ctx, stack[0], stack[1], 0, NULL, &done);
@@ -53752,10 +60056,9 @@ void JS_AddIntrinsicAtomics(JSContext *ctx)
 
 #endif /* CONFIG_ATOMICS */
 
-void JS_AddIntrinsicTypedArrays(JSContext *ctx)
+static void js_typed_arrays_init(JSContext *ctx)
 {
-    JSValue typed_array_base_proto, typed_array_base_func;
-    JSValueConst array_buffer_func, shared_array_buffer_func;
+    JSValue typed_array_base_proto, typed_array_base_func, obj;
     int i;
 
     ctx->class_proto[JS_CLASS_ARRAY_BUFFER] = JS_NewObject(ctx);
@@ -53763,24 +60066,26 @@ void JS_AddIntrinsicTypedArrays(JSContext *ctx)
                                js_array_buffer_proto_funcs,
                                countof(js_array_buffer_proto_funcs));
 
-    array_buffer_func = JS_NewGlobalCConstructorOnly(ctx, "ArrayBuffer",
-                                                 js_array_buffer_constructor, 1,
-                                                 ctx->class_proto[JS_CLASS_ARRAY_BUFFER]);
-    JS_SetPropertyFunctionList(ctx, array_buffer_func,
+    obj = JS_NewCFunction2(ctx, js_array_buffer_constructor, "ArrayBuffer", 1,
+                           JS_CFUNC_constructor, 0);
+    JS_SetConstructor(ctx, obj, ctx->class_proto[JS_CLASS_ARRAY_BUFFER]);
+    JS_SetPropertyFunctionList(ctx, obj,
                                js_array_buffer_funcs,
                                countof(js_array_buffer_funcs));
+    ctx->intrinsic_ctor[JS_INTRINSIC_CTOR_ARRAY_BUFFER] = obj;
 
     ctx->class_proto[JS_CLASS_SHARED_ARRAY_BUFFER] = JS_NewObject(ctx);
     JS_SetPropertyFunctionList(ctx, ctx->class_proto[JS_CLASS_SHARED_ARRAY_BUFFER],
                                js_shared_array_buffer_proto_funcs,
                                countof(js_shared_array_buffer_proto_funcs));
 
-    shared_array_buffer_func = JS_NewGlobalCConstructorOnly(ctx, "SharedArrayBuffer",
-                                                 js_shared_array_buffer_constructor, 1,
-                                                 ctx->class_proto[JS_CLASS_SHARED_ARRAY_BUFFER]);
-    JS_SetPropertyFunctionList(ctx, shared_array_buffer_func,
+    obj = JS_NewCFunction2(ctx, js_shared_array_buffer_constructor,
+                           "SharedArrayBuffer", 1, JS_CFUNC_constructor, 0);
+    JS_SetConstructor(ctx, obj, ctx->class_proto[JS_CLASS_SHARED_ARRAY_BUFFER]);
+    JS_SetPropertyFunctionList(ctx, obj,
                                js_shared_array_buffer_funcs,
                                countof(js_shared_array_buffer_funcs));
+    ctx->intrinsic_ctor[JS_INTRINSIC_CTOR_SHARED_ARRAY_BUFFER] = obj;
 
     typed_array_base_proto = JS_NewObject(ctx);
     JS_SetPropertyFunctionList(ctx, typed_array_base_proto,
@@ -53788,7 +60093,7 @@ void JS_AddIntrinsicTypedArrays(JSContext *ctx)
                                countof(js_typed_array_base_proto_funcs));
 
     /* TypedArray.prototype.toString must be the same object as Array.prototype.toString */
-    JSValue obj = JS_GetProperty(ctx, ctx->class_proto[JS_CLASS_ARRAY], JS_ATOM_toString);
+    obj = JS_GetProperty(ctx, ctx->class_proto[JS_CLASS_ARRAY], JS_ATOM_toString);
     /* XXX: should use alias method in JSCFunctionListEntry */ //@@@
     JS_DefinePropertyValue(ctx, typed_array_base_proto, JS_ATOM_toString, obj,
                            JS_PROP_WRITABLE | JS_PROP_CONFIGURABLE);
@@ -53815,11 +60120,12 @@ void JS_AddIntrinsicTypedArrays(JSContext *ctx)
         func_obj = JS_NewCFunction3(ctx, (JSCFunction *)js_typed_array_constructor,
                                     name, 3, JS_CFUNC_constructor_magic, i,
                                     typed_array_base_func);
-        JS_NewGlobalCConstructor2(ctx, func_obj, name, ctx->class_proto[i]);
+        JS_SetConstructor(ctx, func_obj, ctx->class_proto[i]);
         JS_DefinePropertyValueStr(ctx, func_obj,
                                   "BYTES_PER_ELEMENT",
                                   JS_NewInt32(ctx, 1 << typed_array_size_log2(i)),
                                   0);
+        ctx->intrinsic_ctor[JS_INTRINSIC_CTOR_TYPED_ARRAY + i - JS_CLASS_UINT8C_ARRAY] = func_obj;
     }
     JS_FreeValue(ctx, typed_array_base_proto);
     JS_FreeValue(ctx, typed_array_base_func);
@@ -53829,9 +60135,30 @@ void JS_AddIntrinsicTypedArrays(JSContext *ctx)
     JS_SetPropertyFunctionList(ctx, ctx->class_proto[JS_CLASS_DATAVIEW],
                                js_dataview_proto_funcs,
                                countof(js_dataview_proto_funcs));
-    JS_NewGlobalCConstructorOnly(ctx, "DataView",
-                                 js_dataview_constructor, 1,
-                                 ctx->class_proto[JS_CLASS_DATAVIEW]);
+    obj = JS_NewCFunction2(ctx, js_dataview_constructor, "DataView", 1,
+                           JS_CFUNC_constructor, 0);
+    JS_SetConstructor(ctx, obj, ctx->class_proto[JS_CLASS_DATAVIEW]);
+    ctx->intrinsic_ctor[JS_INTRINSIC_CTOR_DATAVIEW] = obj;
+}
+
+void JS_AddIntrinsicTypedArrays(JSContext *ctx)
+{
+    int i;
+
+    /* ArrayBuffer, SharedArrayBuffer, the typed arrays and DataView:
+       created on first use */
+    js_defer_intrinsic(ctx, JS_INTRINSIC_TYPED_ARRAYS);
+    js_define_intrinsic_ctor(ctx, JS_ATOM_ArrayBuffer, JS_INTRINSIC_TYPED_ARRAYS,
+                             JS_INTRINSIC_CTOR_ARRAY_BUFFER);
+    js_define_intrinsic_ctor(ctx, JS_ATOM_SharedArrayBuffer, JS_INTRINSIC_TYPED_ARRAYS,
+                             JS_INTRINSIC_CTOR_SHARED_ARRAY_BUFFER);
+    for(i = 0; i < JS_TYPED_ARRAY_COUNT; i++) {
+        js_define_intrinsic_ctor(ctx, JS_ATOM_Uint8ClampedArray + i,
+                                 JS_INTRINSIC_TYPED_ARRAYS,
+                                 JS_INTRINSIC_CTOR_TYPED_ARRAY + i);
+    }
+    js_define_intrinsic_ctor(ctx, JS_ATOM_DataView, JS_INTRINSIC_TYPED_ARRAYS,
+                             JS_INTRINSIC_CTOR_DATAVIEW);
     /* Atomics */
 #ifdef CONFIG_ATOMICS
     JS_AddIntrinsicAtomics(ctx);
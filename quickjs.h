@@ -66,6 +66,7 @@ enum {
     JS_TAG_BIG_FLOAT   = -9,
     JS_TAG_SYMBOL      = -8,
     JS_TAG_STRING      = -7,
+    JS_TAG_STRING_ROPE = -6, /* used internally */
     JS_TAG_MODULE      = -3, /* used internally */
     JS_TAG_FUNCTION_BYTECODE = -2, /* used internally */
     JS_TAG_OBJECT      = -1,
@@ -305,6 +306,10 @@ static inline JS_BOOL JS_VALUE_IS_NAN(JSValue v)
 #define JS_EVAL_FLAG_COMPILE_ONLY (1 << 5)
 /* don't include the stack frames before this eval in the Error() backtraces */
 #define JS_EVAL_FLAG_BACKTRACE_BARRIER (1 << 6)
+/* the input is the content of the file 'filename'. If a source
+   loader is defined, the source code of the functions is not kept in
+   memory (see JS_SetSourceLoaderFunc()) */
+#define JS_EVAL_FLAG_RELOAD_SOURCE (1 << 7)
 
 typedef JSValue JSCFunction(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv);
 typedef JSValue JSCFunctionMagic(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv, int magic);
@@ -342,6 +347,9 @@ void JS_RunGC(JSRuntime *rt);
 JS_BOOL JS_IsLiveObject(JSRuntime *rt, JSValueConst obj);
 
 JSContext *JS_NewContext(JSRuntime *rt);
+/* create a context sharing the intrinsic objects of 'tmpl'. The
+   intrinsics of 'tmpl' are frozen on the first call. */
+JSContext *JS_NewContextShared(JSContext *tmpl);
 void JS_FreeContext(JSContext *s);
 JSContext *JS_DupContext(JSContext *ctx);
 void *JS_GetContextOpaque(JSContext *ctx);
@@ -353,6 +361,9 @@ JSValue JS_GetClassProto(JSContext *ctx, JSClassID class_id);
 /* the following functions are used to select the intrinsic object to
    save memory */
 JSContext *JS_NewContextRaw(JSRuntime *rt);
+/* allocate the memory of a short lived context from an arena of
+   'size' bytes which is released at once when the context is freed */
+int JS_SetContextArena(JSContext *ctx, size_t size);
 void JS_AddIntrinsicBaseObjects(JSContext *ctx);
 void JS_AddIntrinsicDate(JSContext *ctx);
 void JS_AddIntrinsicEval(JSContext *ctx);
@@ -371,6 +382,9 @@ void JS_AddIntrinsicBigDecimal(JSContext *ctx);
 void JS_AddIntrinsicOperators(JSContext *ctx);
 /* enable "use math" */
 void JS_EnableBignumExt(JSContext *ctx, JS_BOOL enable);
+/* set the maximum number of compiled scripts, eval() and Function()
+   sources kept to avoid parsing them again (0 = no cache) */
+void JS_SetEvalCacheSize(JSContext *ctx, int max_size);
 
 JSValue js_string_codePointRange(JSContext *ctx, JSValueConst this_val,
                                  int argc, JSValueConst *argv);
@@ -409,6 +423,12 @@ typedef struct JSMemoryUsage {
 void JS_ComputeMemoryUsage(JSRuntime *rt, JSMemoryUsage *s);
 void JS_DumpMemoryUsage(FILE *fp, const JSMemoryUsage *s, JSRuntime *rt);
 
+/* allocation sampling profiler: the JS stack is recorded for one
+   allocation every 'sample_interval' bytes on average (0 = disable) */
+int JS_SetAllocSampling(JSRuntime *rt, size_t sample_interval);
+/* output the sampled allocations in the folded stack format */
+void JS_DumpAllocProfile(JSRuntime *rt, FILE *fp, JS_BOOL live_only);
+
 /* atom support */
 #define JS_ATOM_NULL 0
 
@@ -608,7 +628,8 @@ static inline JS_BOOL JS_IsUninitialized(JSValueConst v)
 
 static inline JS_BOOL JS_IsString(JSValueConst v)
 {
-    return JS_VALUE_GET_TAG(v) == JS_TAG_STRING;
+    return JS_VALUE_GET_TAG(v) == JS_TAG_STRING ||
+        JS_VALUE_GET_TAG(v) == JS_TAG_STRING_ROPE;
 }
 
 static inline JS_BOOL JS_IsSymbol(JSValueConst v)
@@ -782,6 +803,15 @@ JSValue JS_Eval(JSContext *ctx, const char *input, size_t input_len,
 JSValue JS_EvalThis(JSContext *ctx, JSValueConst this_obj,
                     const char *input, size_t input_len,
                     const char *filename, int eval_flags);
+/* return the content of the file 'filename' allocated with js_malloc()
+   or NULL if it is not available */
+typedef uint8_t *JSSourceLoaderFunc(JSContext *ctx, size_t *plen,
+                                    const char *filename, void *opaque);
+/* the source of the functions evaluated with
+   JS_EVAL_FLAG_RELOAD_SOURCE is reloaded with 'source_loader' when
+   Function.prototype.toString() needs it */
+void JS_SetSourceLoaderFunc(JSRuntime *rt, JSSourceLoaderFunc *source_loader,
+                            void *opaque);
 JSValue JS_GetGlobalObject(JSContext *ctx);
 int JS_IsInstanceOf(JSContext *ctx, JSValueConst val, JSValueConst obj);
 int JS_DefineProperty(JSContext *ctx, JSValueConst this_obj,
@@ -879,23 +909,53 @@ int JS_ExecutePendingJob(JSRuntime *rt, JSContext **pctx);
 #define JS_WRITE_OBJ_REFERENCE (1 << 3) /* allow object references to
                                            encode arbitrary object
                                            graph */
+/* also write the function sources, or their position in the source
+   file if they are reloaded with the source loader */
+#define JS_WRITE_OBJ_SOURCE    (1 << 4)
 uint8_t *JS_WriteObject(JSContext *ctx, size_t *psize, JSValueConst obj,
                         int flags);
 uint8_t *JS_WriteObject2(JSContext *ctx, size_t *psize, JSValueConst obj,
                          int flags, uint8_t ***psab_tab, size_t *psab_tab_len);
 
 #define JS_READ_OBJ_BYTECODE  (1 << 0) /* allow function/module */
-#define JS_READ_OBJ_ROM_DATA  (1 << 1) /* avoid duplicating 'buf' data */
+/* avoid duplicating 'buf' data. The bytecode is executed in place and
+   is never modified, so the same buffer can be read by several
+   runtimes, possibly in different threads. 'buf' must be kept until
+   the runtimes are freed. */
+#define JS_READ_OBJ_ROM_DATA  (1 << 1)
 #define JS_READ_OBJ_SAB       (1 << 2) /* allow SharedArrayBuffer */
 #define JS_READ_OBJ_REFERENCE (1 << 3) /* allow object references */
+/* read the body of the inner functions when they are first called. With
+   JS_READ_OBJ_ROM_DATA, 'buf' must be kept until the runtime is freed
+   (e.g. a memory mapped file), otherwise it is copied. Ignored with
+   JS_READ_OBJ_REFERENCE. */
+#define JS_READ_OBJ_LAZY      (1 << 4)
 JSValue JS_ReadObject(JSContext *ctx, const uint8_t *buf, size_t buf_len,
                       int flags);
 /* instantiate and evaluate a bytecode function. Only used when
    reading a script or module with JS_ReadObject() */
 JSValue JS_EvalFunction(JSContext *ctx, JSValue fun_obj);
+/* context snapshots: record the scripts and modules evaluated in a
+   context so that the same initialization can be replayed in another
+   context without parsing them */
+int JS_RecordSnapshot(JSContext *ctx, JS_BOOL enable);
+uint8_t *JS_WriteSnapshot(JSContext *ctx, size_t *psize);
+int JS_EvalSnapshot(JSContext *ctx, const uint8_t *buf, size_t buf_len);
+JSContext *JS_NewContextFromSnapshot(JSRuntime *rt, const uint8_t *buf,
+                                     size_t buf_len);
 /* load the dependencies of the module 'obj'. Useful when JS_ReadObject()
    returns a module. */
 int JS_ResolveModule(JSContext *ctx, JSValueConst obj);
+/* store the resolved imports and exports of the resolved module 'obj'
+   so that JS_WriteObject() saves them. The module must be loaded with
+   the same dependencies. */
+int JS_PrelinkModule(JSContext *ctx, JSValueConst obj);
+/* whole program optimizations (used by qjsc) */
+typedef void JSBytecodeAtomFunc(JSContext *ctx, JSAtom atom, void *opaque);
+int JS_EnumBytecodeAtoms(JSContext *ctx, JSValueConst obj,
+                         JSBytecodeAtomFunc *func, void *opaque);
+int JS_StripUnusedCode(JSContext *ctx, JSValueConst *objs, int count,
+                       const JS_BOOL *keep_exports);
 
 /* only exported for os.Worker() */
 JSAtom JS_GetScriptOrModuleName(JSContext *ctx, int n_stack_levels);
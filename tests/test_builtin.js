@@ -302,6 +302,101 @@ function test_string()
     assert(eval('"\0"'), "\0");
 
     assert("abc".padStart(Infinity, ""), "abc");
+
+    /* one character strings are shared */
+    a = "abc"[1];
+    assert(a, "b");
+    a += "c";
+    assert(a, "bc");
+    assert("abc"[1], "b");
+    assert(String.fromCharCode(98), "abc".charAt(1));
+    assert(Symbol("abc"[0]).description, "a");
+    assert("abc"[0], "a");
+}
+
+function test_string_concat()
+{
+    var s, p, r, i, m, o;
+
+    /* long concatenations are represented as ropes */
+    s = "";
+    for(i = 0; i < 10000; i++)
+        s += "ab" + i;
+    r = [];
+    for(i = 0; i < 10000; i++)
+        r.push("ab" + i);
+    r = r.join("");
+    assert(s.length, r.length);
+    assert(s === r, true);
+    assert(s, r);
+    assert(s[2], "0");
+    assert(s.charAt(s.length - 1), "9");
+    assert(typeof s, "string");
+    assert(s.slice(-6), "ab9999");
+    assert(s.indexOf("ab5000") > 0, true);
+
+    p = "";
+    for(i = 0; i < 2000; i++)
+        p = "x" + p + "y";
+    assert(p, "x".repeat(2000) + "y".repeat(2000));
+    assert(p < "x".repeat(2000) + "z", true);
+    assert(p > "x".repeat(2000), true);
+    assert(p == new String(p), true);
+
+    s = "\u20ac".repeat(300) + "a".repeat(300);
+    assert(s.length, 600);
+    assert(s.charCodeAt(299), 0x20ac);
+    assert(s.charCodeAt(300), 0x61);
+
+    m = new Map();
+    m.set("z".repeat(1000), 1);
+    assert(m.get("z".repeat(500) + "z".repeat(500)), 1);
+    o = {};
+    o["z".repeat(500) + "z".repeat(500)] = 2;
+    assert(o["z".repeat(1000)], 2);
+    assert(JSON.parse(JSON.stringify([p]))[0], p);
+    assert(+("1".repeat(300) + "1".repeat(300)), Infinity);
+
+    /* in place appends must not modify the other references */
+    s = "";
+    for(i = 0; i < 1000; i++) {
+        s += "a";
+        if (i == 99)
+            p = s;
+        s = s + "b";
+    }
+    assert(s, "ab".repeat(1000));
+    assert(p, "ab".repeat(99) + "a");
+    s = "xy";
+    s = s + s;
+    s += s;
+    assert(s, "xyxyxyxy");
+    s = "abc";
+    try {
+        s += Symbol();
+    } catch(e) {
+    }
+    assert(s, "abc");
+
+    /* long substrings share the storage of their parent */
+    r = "";
+    for(i = 0; i < 1000; i++)
+        r += String.fromCharCode(97 + (i % 26));
+    s = r.slice(100, 900);
+    assert(s.length, 800);
+    assert(s[0], "w");
+    assert(s[800], undefined);
+    assert(s, r.substring(100, 900));
+    assert(s.slice(400, 700), r.substr(500, 300));
+    assert(s + r.slice(900), r.slice(100));
+    assert([s, s].join(""), s.repeat(2));
+    p = (r + "\u20ac").slice(300);
+    assert(p.length, 701);
+    assert(p.charCodeAt(700), 0x20ac);
+    assert(p.slice(0, 500), r.slice(300, 800));
+    m = new Map();
+    m.set(r.slice(0, 500), 1);
+    assert(m.get(r.substring(0, 500)), 1);
 }
 
 function test_math()
@@ -360,6 +455,33 @@ function test_eval2()
     assert(g_call_count, 2);
 }
 
+/* the compiled code of the evaluated sources may be reused */
+function test_eval3()
+{
+    var i, a, fa, r;
+
+    fa = [];
+    for(i = 0; i < 3; i++) {
+        a = i;
+        assert(eval("a * 2"), i * 2);
+        assert(eval("(function() { return a; })")(), i);
+        fa.push(new Function("return 1;"));
+    }
+    assert(fa[0] !== fa[1], true);
+    fa[0].x = 1;
+    assert(fa[1].x, undefined);
+
+    fa = [];
+    for(i = 0; i < 3; i++)
+        fa.push((0, eval)("(function() { return [1]; })"));
+    assert(fa[0] !== fa[1] && fa[0]() !== fa[1](), true);
+
+    r = [];
+    for(i = 0; i < 2; i++)
+        r.push(eval("[1]"));
+    assert(r[0] !== r[1], true);
+}
+
 function test_eval()
 {
     function f(b) {
@@ -395,6 +517,7 @@ function test_eval()
     assert(a, 3);
 
     test_eval2();
+    test_eval3();
 }
 
 function test_typed_array()
@@ -667,6 +790,7 @@ test_function();
 test_enum();
 test_array();
 test_string();
+test_string_concat();
 test_math();
 test_number();
 test_eval();
@@ -212,6 +212,60 @@ function test_eval_const()
     assert(success);
 }
 
+/* the functions of the global code are compiled when first called */
+var lazy_count = 0;
+{
+    let lazy_var = 1;
+    function lazy_block() { return lazy_var++; }
+}
+
+function test_lazy_function()
+{
+    var f, g;
+
+    assert(lazy_block(), 1);
+    assert(lazy_block(), 2);
+    f = lazy_block;
+    assert(f.name, "lazy_block");
+    assert(f.length, 0);
+
+    g = function lazy_expr(n) { return n ? lazy_expr(n - 1) + 1 : 0; };
+    assert(g(3), 3);
+    assert(g.name, "lazy_expr");
+
+    function lazy_inc() { return ++lazy_count; }
+    assert(lazy_inc() + lazy_inc(), 3);
+}
+
+function test_closure_var_refs()
+{
+    var tab, i;
+
+    /* closures sharing some variables of the same frame */
+    function f(a, b) {
+        var c = a + b, d = 0;
+        var g1 = function () { return a + c; };
+        var g2 = function () { d++; return c + d; };
+        var g3 = function () { return [a, b, c, d]; };
+        return [g1, g2, g3];
+    }
+    tab = f(1, 2);
+    assert(tab[0](), 4);
+    assert(tab[1](), 4);
+    assert(tab[2]().toString(), "1,2,3,1");
+    tab.length = 2;
+    assert(tab[1](), 5);
+
+    /* new variables at each iteration */
+    tab = [];
+    for(let j = 0; j < 3; j++) {
+        let k = j * 2;
+        tab.push(() => j + k + i);
+    }
+    i = 1;
+    assert(tab.map((g) => g()).toString(), "1,4,7");
+}
+
 test_closure1();
 test_closure2();
 test_closure3();
@@ -219,3 +273,5 @@ test_arrow_function();
 test_with();
 test_eval_closure();
 test_eval_const();
+test_lazy_function();
+test_closure_var_refs();
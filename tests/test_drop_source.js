@@ -0,0 +1,61 @@
+/* must be run with qjs --drop-source */
+import * as std from "std";
+import * as os from "os";
+
+function assert(actual, expected, message) {
+    if (arguments.length == 1)
+        expected = true;
+
+    if (actual === expected)
+        return;
+
+    throw Error("assertion failed: got |" + actual + "|" +
+                ", expected |" + expected + "|" +
+                (message ? " (" + message + ")" : ""));
+}
+
+function write_file(filename, str)
+{
+    var f = std.open(filename, "w");
+    f.puts(str);
+    f.close();
+}
+
+function test_reload()
+{
+    function f(a, b) { return a + b; }
+    var g = (x) => x * 2;
+    class C { m() { return 1; } }
+
+    assert(f(1, 2), 3);
+    assert(f.toString(), "function f(a, b) { return a + b; }");
+    assert(g.toString(), "(x) => x * 2");
+    assert(C.prototype.m.toString(), "m() { return 1; }");
+}
+
+function test_reload_script()
+{
+    var fname = "/tmp/qjs_drop_source_" + Date.now() + ".js";
+    var src = "function g1(a) { return a; }\n" +
+        "function g2(a) { return -a; }\n" +
+        "function g3(a) { return a * a; }\n";
+
+    write_file(fname, src);
+    std.loadScript(fname);
+    assert(g1.toString(), "function g1(a) { return a; }");
+
+    /* the source is not used if the file changed */
+    write_file(fname, src.replace("-a", "+a"));
+    assert(g2.toString(), "function g2() {\n    [native code]\n}");
+    assert(g2(1), -1);
+    write_file(fname, "\n" + src);
+    assert(g3.toString(), "function g3() {\n    [native code]\n}");
+    write_file(fname, src);
+    assert(g3.toString(), "function g3(a) { return a * a; }");
+
+    os.remove(fname);
+    assert(g1.toString(), "function g1() {\n    [native code]\n}");
+}
+
+test_reload();
+test_reload_script();
@@ -266,6 +266,58 @@ function test_arguments()
         assert(arguments[1], 3, "arguments");
     }
     f2(1, 3);
+
+    /* uses which do not need the arguments object */
+    function sum() {
+        var s = 0;
+        for(var i = 0; i < arguments.length; i++)
+            s += arguments[i];
+        return s;
+    }
+    function fwd(a) {
+        return sum.apply(null, arguments);
+    }
+    function mapped(a) {
+        a = 10;
+        return arguments[0] + ":" + arguments[1];
+    }
+    function unmapped(a) {
+        "use strict";
+        a = 10;
+        return arguments[0] + ":" + arguments.length;
+    }
+    function prop(a) {
+        return typeof arguments["callee"] + ":" + arguments[-1] + ":" +
+            arguments[3];
+    }
+    function call(o) {
+        return o.m(1, arguments);
+    }
+    var saved_apply;
+
+    assert(sum(), 0);
+    assert(sum(1, 2, 3), 6);
+    assert(fwd(1, 2, 3), 6);
+    assert(fwd(), 0);
+    assert(Reflect.apply(fwd, null, [1, 2, 3]), 6);
+    assert(mapped(1, 2), "10:2");
+    assert(mapped(), "undefined:undefined");
+    assert(unmapped(1), "1:1");
+    Object.prototype[3] = "p";
+    assert(prop(1), "function:undefined:p");
+    delete Object.prototype[3];
+    assert(call({ m(x, a) { return x + a.length + a[1]; } }, 2), 5);
+    saved_apply = Function.prototype.apply;
+    Function.prototype.apply = function (t, a) { return a.length; };
+    assert(fwd(1, 2), 2);
+    Function.prototype.apply = saved_apply;
+
+    /* the apply call is kept in the backtraces */
+    try {
+        fwd(1, Symbol());
+    } catch(e) {
+        assert(/\n    at apply \(native\)\n    at fwd /.test(e.stack), true);
+    }
 }
 
 function test_class()
@@ -385,6 +437,66 @@ function test_destructuring()
     function * g () { return 0; };
     var [x] = g();
     assert(x, void 0);
+
+    var a, b, c, r, arr, log, proto, next;
+    [a, , b = 5, ...r] = [1, 2, undefined, 4, 5];
+    assert(a, 1);
+    assert(b, 5);
+    assert(r.toString(), "4,5");
+    ({ a, b: [b, c = a] } = { a: 3, b: [4] });
+    assert(a + b + c, 10);
+    [a, b] = [b, a];
+    assert(a, 4);
+    assert(b, 3);
+
+    /* closure and global variables */
+    (function () { [a, b] = [7, 8]; })();
+    assert(a + b, 15);
+    [globalThis.test_destr_x, test_destr_y] = [1, 2];
+    assert(test_destr_x + test_destr_y, 3);
+    try {
+        (function () { "use strict"; [test_destr_z] = [1]; })();
+    } catch(e) {
+        r = e;
+    }
+    assert(r instanceof ReferenceError);
+
+    /* the arrays may be modified during the iteration */
+    arr = [1, 2];
+    r = [];
+    for (x of arr) {
+        r.push(x);
+        if (arr.length < 4)
+            arr.push(x + 10);
+    }
+    assert(r.toString(), "1,2,11,12");
+    Array.prototype[1] = "p";
+    r = [];
+    for (x of [1, , 3])
+        r.push(x);
+    delete Array.prototype[1];
+    assert(r.toString(), "1,p,3");
+
+    /* the iteration protocol remains observable */
+    log = [];
+    Object.prototype.return = function () { log.push("return"); return {}; };
+    [a] = [1, 2];
+    for (x of [1, 2])
+        break;
+    delete Object.prototype.return;
+    assert(log.join(), "return,return");
+
+    proto = Object.getPrototypeOf([][Symbol.iterator]());
+    next = proto.next;
+    proto.next = function () {
+        var r = next.call(this);
+        if (!r.done)
+            r.value *= 2;
+        return r;
+    };
+    [a, b] = [1, 2];
+    proto.next = next;
+    assert(a + b, 6);
 }
 
 function test_spread()
@@ -526,6 +638,268 @@ function test_function_expr_name()
     assert_throws(TypeError, f);
 }
 
+/* the checks of the lexical variables must be kept when they may be
+   accessed before their initialization */
+function test_tdz()
+{
+    var i, r, f;
+
+    f = function (n) {
+        switch (n) {
+        case 0:
+            let a = 1;
+        case 1:
+            return a;
+        }
+    };
+    assert(f(0), 1);
+    assert_throws(ReferenceError, () => f(1));
+
+    f = function (n) {
+        for(i = 0; i < 2; i++) {
+            if (i == n)
+                continue;
+            let b = i;
+        }
+        { let c; }
+        return x;
+        let x;
+    };
+    assert_throws(ReferenceError, () => f(0));
+
+    f = function (n) {
+        try {
+            if (n)
+                throw 1;
+            var t = 1;
+            let d = 1;
+        } catch(e) {
+        }
+        l: {
+            if (n)
+                break l;
+            e = 2;
+        }
+        let e = 1;
+        return e;
+    };
+    assert(f(1), 1);
+    assert_throws(ReferenceError, () => f(0));
+
+    f = function () {
+        let g = () => h;
+        r = g;
+        let h = 1;
+        return g();
+    };
+    assert(f(), 1);
+
+    class A { constructor() { this.v = 1; } }
+    class B extends A {
+        constructor(n) {
+            if (n)
+                this.w = 1;
+            super();
+            this.w = 2;
+        }
+    }
+    assert(new B(0).w, 2);
+    assert_throws(ReferenceError, () => new B(1));
+
+    r = 0;
+    for(let j = 0; j < 10; j++) {
+        const k = j * 2;
+        r += k;
+    }
+    assert(r, 90);
+}
+
+function test_block_slots()
+{
+    var r, f, g;
+
+    f = function (n) {
+        var s = 0;
+        { let a = n; s += a; }
+        { let b = n * 2; s += b; }
+        for(let i = 0; i < n; i++) {
+            const c = i;
+            s += c;
+        }
+        for(let j = 0; j < n; j++) {
+            let d = j;
+            { let e = d + 1; s += e; }
+        }
+        return s;
+    };
+    assert(f(3), 3 + 6 + 3 + 6);
+
+    /* captured variables keep their own slot */
+    f = function () {
+        var fs = [];
+        { let a = 1; fs.push(() => a); }
+        { let b = 2; s = b; }
+        { let c = 3; fs.push(() => c); }
+        var s;
+        return fs[0]() + fs[1]() + s;
+    };
+    assert(f(), 6);
+
+    g = function* () {
+        { let a = 1; yield a; }
+        { let b = 2; yield b; }
+    };
+    r = [];
+    for(var v of g())
+        r.push(v);
+    assert(r.join(), "1,2");
+
+    f = function (n) {
+        { let a = 1; if (n) return a; }
+        { let b; return b; }
+    };
+    assert(f(0), undefined);
+    assert(f(1), 1);
+}
+
+function test_const_fold()
+{
+    assert("a" + "b" + 1, "ab1");
+    assert(1 + 2 + "c", "3c");
+    assert("c" + 1 + 2, "c12");
+    assert(1 << 10, 1024);
+    assert(-1 >>> 0, 4294967295);
+    assert(-(2 ** 31), -2147483648);
+    assert(Object.is(-0, -0), true);
+    assert(Object.is(0 * -1, -0), true);
+    assert(Object.is(-7 % 7, -0), true);
+    assert(1 / 0, Infinity);
+    assert(0.1 + 0.2, 0.30000000000000004);
+    assert("3" * "4", 12);
+    assert(~5, -6);
+    assert(!"", true);
+    assert("a" < "b", true);
+    assert(null == undefined, true);
+    assert(null === undefined, false);
+    assert(`x${1 + 2}y${null}z${true}`, "x3ynullztrue");
+    assert(`${"a"}`, "a");
+    assert(typeof (1 + 2), "number");
+}
+
+function test_inline()
+{
+    var r, log, i;
+
+    function sq(x) { return x * x; }
+    function opt(x) { var t; if (x) t = x; return t; }
+    function first(a, b) { return a; }
+    function thrower(x) { if (x) throw Error("inline"); return 1; }
+    function get_this() { return typeof this; }
+    const add = (a, b) => a + b;
+    const sign = (x) => { let s = 0; if (x > 0) s = 1; else if (x < 0) s = -1; return s; };
+    function reassigned(x) { return 1; }
+    reassigned = function (x) { return 2; };
+
+    assert(sq(3), 9);
+    assert(add(1, 2), 3);
+    assert(isNaN(add(1)), true);
+    assert(add(sq(2), add(1, sq(3))), 14);
+    assert(opt(2), 2);
+    assert(opt(0), undefined);
+    assert(sign(-5), -1);
+    assert(sign(0), 0);
+    assert(reassigned(0), 2);
+    assert(get_this(), "object");
+
+    /* argument evaluation order and extra arguments */
+    log = [];
+    r = first((log.push(1), 1), (log.push(2), 2), (log.push(3), 3));
+    assert(r, 1);
+    assert(log.join(), "1,2,3");
+
+    r = 0;
+    for(i = 0; i < 3; i++) {
+        try {
+            r += thrower(i == 1);
+        } catch(e) {
+            r += 10;
+        }
+    }
+    assert(r, 12);
+
+    /* the inlined calls are kept in the backtraces */
+    const get_x = (o) => o.x;
+    try {
+        get_x(null);
+    } catch(e) {
+        assert(/^    at get_x \(.*\)\n    at test_inline \(/.test(e.stack), true);
+    }
+    try {
+        thrower(true);
+    } catch(e) {
+        assert(/^    at thrower \(.*\)\n    at test_inline \(/.test(e.stack), true);
+    }
+}
+
+function test_dead_store()
+{
+    "use strip";
+    var r, i, t, log;
+
+    function f(a) {
+        var t = a * 2;
+        var u = t + 1;
+        u = 5;
+        let r = u + a;
+        return r;
+    }
+    assert(f(1), 6);
+
+    /* stores with side effects are kept */
+    log = [];
+    t = { valueOf() { log.push("v"); return 1; } };
+    r = (function (x) { var y = x + 1; return 0; })(t);
+    assert(r, 0);
+    assert(log.join(), "v");
+
+    /* the variables are live in the exception handlers */
+    r = 0;
+    t = 1;
+    try {
+        t = 2;
+        null.x;
+        t = 3;
+    } catch(e) {
+        r = t;
+    }
+    assert(r, 2);
+
+    t = 1;
+    try {
+        t = 4;
+    } finally {
+        r = t;
+    }
+    assert(r, 4);
+
+    /* loop carried variables */
+    r = 0;
+    t = 0;
+    for(i = 0; i < 10; i++) {
+        r += t;
+        t = i;
+    }
+    assert(r, 36);
+
+    /* captured variables */
+    t = 1;
+    f = () => t;
+    t = 2;
+    assert(f(), 2);
+
+    assert({ ["k"]: 1 }.k, 1);
+}
+
 test_op1();
 test_cvt();
 test_eq();
@@ -545,3 +919,8 @@ test_spread();
 test_function_length();
 test_argument_scope();
 test_function_expr_name();
+test_tdz();
+test_block_slots();
+test_const_fold();
+test_inline();
+test_dead_store();
@@ -0,0 +1,59 @@
+/* must be run with a memory limit (qjs --memory-limit 8000000) */
+function assert(actual, expected, message) {
+    if (arguments.length == 1)
+        expected = true;
+
+    if (actual === expected)
+        return;
+
+    throw Error("assertion failed: got |" + actual + "|" +
+                ", expected |" + expected + "|" +
+                (message ? " (" + message + ")" : ""));
+}
+
+/*----------------*/
+
+function test_string_append_oom()
+{
+    var s, t, len, err;
+
+    /* 's += t' in place */
+    s = "a".repeat(1000);
+    s = s + "";
+    t = "b".repeat(300000);
+    len = 0;
+    err = null;
+    try {
+        for(;;) {
+            s += t;
+            len = s.length;
+        }
+    } catch(e) {
+        err = e;
+    }
+    assert(err instanceof InternalError, true, "out of memory");
+    assert(typeof s, "string");
+    assert(s.length, len);
+    assert(s[len - 1], "b");
+    s = null;
+
+    /* 's = s + t' in place */
+    s = "a".repeat(1000);
+    s = s + "";
+    len = 0;
+    err = null;
+    try {
+        for(;;) {
+            s = s + t;
+            len = s.length;
+        }
+    } catch(e) {
+        err = e;
+    }
+    assert(err instanceof InternalError, true, "out of memory");
+    assert(typeof s, "string");
+    assert(s.length, len);
+    assert(s[len - 1], "b");
+}
+
+test_string_append_oom();